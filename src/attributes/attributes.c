@@ -241,121 +241,314 @@ int attributes_output(
 }
 
 /**
- * Output all attributes belonging to an object.
+ * Name of an attribute type, for output.
+ */
+static const char *attributes_name(CK_ATTRIBUTE_TYPE type) {
+    size_t i = (size_t)0;
+
+    for (i = (size_t)0; i < attributes_types_len; i++) {
+        if (attributes_types[i].type == type)
+            return attributes_types[i].name;
+    }
+    return "";
+}
+
+/**
+ * Whether a C_GetAttributeValue result concerns single attributes, which are
+ *   then marked unavailable, rather than the whole object or session.
+ */
+static CK_BBOOL attributes_per_attribute_rv(CK_RV rv) {
+    return CKR_OK == rv
+           || CKR_ATTRIBUTE_SENSITIVE == rv
+           || CKR_ATTRIBUTE_TYPE_INVALID == rv;
+}
+
+/**
+ * Point the arrays of a table at their place in its arena.
+ */
+static void attributes_table_layout(struct attributes_table *table) {
+    CK_ULONG cells = table->object_count * table->type_count;
+
+    table->objects = (CK_OBJECT_HANDLE_PTR)(table + 1);
+    table->types = (CK_ATTRIBUTE_TYPE *)(table->objects + table->object_count);
+    table->lengths = (CK_ULONG_PTR)(table->types + table->type_count);
+    table->offsets = (CK_ULONG_PTR)(table->lengths + cells);
+    table->object_rv = (CK_RV *)(table->offsets + cells);
+    table->data = (uint8_t *)(table->object_rv + table->object_count);
+}
+
+/**
+ * Get many attributes of many objects.
+ *
+ * Each object takes one C_GetAttributeValue call to size every requested
+ *   attribute, and one to fetch them all. The results live in a single
+ *   allocation, laid out by column: the values of one attribute type for all
+ *   objects are contiguous.
  *
- * Iterates through all possible attributes of an object, finds the ones that
- *   are valid using attributes_get(), and outputs them using
- *   attributes_output().
+ * Attributes an object does not have, or will not reveal, are unavailable
+ *   in the table. Objects which could not be read are marked with their
+ *   error in object_rv and have no available attributes.
  *
  * @returns CK_RV Value returned by the PKCS#11 library. This will indicate
  *   success or failure.
  */
-CK_RV attributes_output_all(
+CK_RV attributes_get_bulk(
         /** [in] Valid PKCS11 session. */
         CK_SESSION_HANDLE session,
-        /** [in] The object handle. */
-        CK_OBJECT_HANDLE object,
-        /** [in] The output file handle. */
-        FILE *f ) {
-
-    uint8_t* attr_avail = calloc(attributes_types_len, sizeof(uint8_t));
-    if (NULL == attr_avail) {
-        fprintf(f, "ERROR: failed to allocate memory\n");
-        return CKR_HOST_MEMORY;
-    }
-
-    size_t i = (size_t)0;
+        /** [in] The object handles. */
+        CK_OBJECT_HANDLE_PTR objects,
+        /** [in] The number of objects. */
+        CK_ULONG object_count,
+        /** [in] The attribute types to get. */
+        CK_ATTRIBUTE_TYPE *types,
+        /** [in] The number of attribute types. */
+        CK_ULONG type_count,
+        /** [out] The results. Free with attributes_table_free(). */
+        struct attributes_table **table_out ) {
+    struct attributes_table *table = NULL;
+    struct attributes_table *grown = NULL;
+    CK_ATTRIBUTE_PTR template = NULL;
+    CK_ULONG cells = object_count * type_count;
+    size_t header_len = (size_t)0;
+    size_t data_len = (size_t)0;
+    CK_ULONG o = (CK_ULONG)0;
+    CK_ULONG t = (CK_ULONG)0;
     CK_RV rv = CKR_OK;
 
     if (CK_INVALID_HANDLE == session)
         return CKR_ARGUMENTS_BAD;
 
-    if (CK_INVALID_HANDLE == object)
+    if ((NULL == objects && object_count) || (NULL == types && type_count) || NULL == table_out)
         return CKR_ARGUMENTS_BAD;
 
-    if (NULL == f)
-        return CKR_ARGUMENTS_BAD;
+    header_len = sizeof(struct attributes_table)
+                 + (object_count + type_count + 2 * cells + object_count) * sizeof(CK_ULONG);
+    table = (struct attributes_table *)calloc(header_len, (size_t)1);
+    template = (CK_ATTRIBUTE_PTR)calloc(type_count ? type_count : 1, sizeof(CK_ATTRIBUTE));
+    if (NULL == table || NULL == template) {
+        rv = CKR_HOST_MEMORY;
+        goto attributes_get_bulk_1;
+    }
 
-    for (i = (size_t)0; i < attributes_types_len; i++) {
-        CK_ATTRIBUTE attr[] = {
-                { attributes_types[i].type, NULL_PTR, (CK_ULONG)0 } };
-        CK_RV rv_local = CKR_OK;
+    table->object_count = object_count;
+    table->type_count = type_count;
+    attributes_table_layout(table);
+    memcpy(table->objects, objects, object_count * sizeof(CK_OBJECT_HANDLE));
+    memcpy(table->types, types, type_count * sizeof(CK_ATTRIBUTE_TYPE));
+
+    /* Size every attribute of an object in one call. */
+    for (o = (CK_ULONG)0; o < object_count; o++) {
+        for (t = (CK_ULONG)0; t < type_count; t++) {
+            template[t].type = types[t];
+            template[t].pValue = NULL_PTR;
+            template[t].ulValueLen = (CK_ULONG)0;
+        }
 
-        rv_local = funcs->C_GetAttributeValue(
-            session,
-            object,
-            (CK_ATTRIBUTE_PTR)&attr[0].type,
-            (CK_ULONG)1 );
-        if (CKR_OK == rv_local) {
-            attr_avail[i] = UINT8_C(1);
+        rv = funcs->C_GetAttributeValue(session, objects[o], template, type_count);
+        if (CKR_OBJECT_HANDLE_INVALID == rv) {
+            table->object_rv[o] = rv;
+        } else if (!attributes_per_attribute_rv(rv)) {
+            goto attributes_get_bulk_1;
         }
 
-        if (CKR_OBJECT_HANDLE_INVALID == rv_local) {
-            fprintf(f, "ERROR: object [%lu] is not valid\n", object);
-            rv = CKR_HOST_MEMORY;
-            goto attributes_output_all_1;
+        for (t = (CK_ULONG)0; t < type_count; t++) {
+            CK_ULONG cell = t * object_count + o;
+            table->lengths[cell] = CKR_OK == table->object_rv[o]
+                                   ? template[t].ulValueLen : CK_UNAVAILABLE_INFORMATION;
+        }
+    }
+    rv = CKR_OK;
+
+    /* Lay out values by column, aligned for attributes holding CK_ULONGs. */
+    for (t = (CK_ULONG)0; t < type_count; t++) {
+        for (o = (CK_ULONG)0; o < object_count; o++) {
+            CK_ULONG cell = t * object_count + o;
+            table->offsets[cell] = (CK_ULONG)data_len;
+            if (CK_UNAVAILABLE_INFORMATION != table->lengths[cell]) {
+                data_len += (table->lengths[cell] + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+            }
         }
     }
 
-    fprintf(f, "Attributes for object %lu:\n", object);
-
-    for (i = (size_t)0; i < attributes_types_len; i++) {
-        uint8_t *buf = NULL;
-        CK_ULONG buf_len = (CK_ULONG)0;
-        CK_RV rv_local = CKR_OK;
-
-        if( UINT8_C(0) == attr_avail[i] )
+    grown = (struct attributes_table *)realloc(table, header_len + data_len);
+    if (NULL == grown) {
+        rv = CKR_HOST_MEMORY;
+        goto attributes_get_bulk_1;
+    }
+    table = grown;
+    attributes_table_layout(table);
+    table->data_len = data_len;
+    /* Array attributes are read into nested templates, which must start out empty. */
+    memset(table->data, 0, data_len);
+
+    /* Fetch every available attribute of an object in one call. */
+    for (o = (CK_ULONG)0; o < object_count; o++) {
+        CK_ULONG requested = (CK_ULONG)0;
+
+        for (t = (CK_ULONG)0; t < type_count; t++) {
+            CK_ULONG cell = t * object_count + o;
+            if (CK_UNAVAILABLE_INFORMATION == table->lengths[cell])
+                continue;
+            template[requested].type = types[t];
+            template[requested].pValue = table->data + table->offsets[cell];
+            template[requested].ulValueLen = table->lengths[cell];
+            requested++;
+        }
+        if ((CK_ULONG)0 == requested)
             continue;
 
-        rv_local = attributes_get(
-                session, object, attributes_types[i].type, NULL, &buf_len );
-        switch (rv_local)
-        {
-            case CKR_HOST_MEMORY:
-                fprintf(f, "ERROR: failed to allocate memory\n");
-                rv = rv_local;
-                goto attributes_output_all_1;
-                break;
-            case CKR_OK:
-                break;
-            default:
-                goto attributes_output_all_1;
-                break;
+        rv = funcs->C_GetAttributeValue(session, objects[o], template, requested);
+        if (CKR_OBJECT_HANDLE_INVALID == rv || CKR_BUFFER_TOO_SMALL == rv) {
+            /* The object was destroyed or changed since it was sized. */
+            table->object_rv[o] = rv;
+        } else if (!attributes_per_attribute_rv(rv)) {
+            goto attributes_get_bulk_1;
         }
 
-        buf = (uint8_t *)calloc(buf_len, (size_t)1);
-        if (NULL == buf) {
-            fprintf(f, "ERROR: failed to allocate memory\n");
-            rv = CKR_HOST_MEMORY;
-            break;
+        requested = (CK_ULONG)0;
+        for (t = (CK_ULONG)0; t < type_count; t++) {
+            CK_ULONG cell = t * object_count + o;
+            if (CK_UNAVAILABLE_INFORMATION == table->lengths[cell])
+                continue;
+            table->lengths[cell] = CKR_OK == table->object_rv[o]
+                                   ? template[requested].ulValueLen : CK_UNAVAILABLE_INFORMATION;
+            requested++;
+        }
+    }
+    rv = CKR_OK;
+
+    attributes_get_bulk_1:
+
+    free(template);
+    if (CKR_OK != rv) {
+        free(table);
+        table = NULL;
+    }
+    *table_out = table;
+    return rv;
+}
+
+/**
+ * Get one value from a table filled by attributes_get_bulk().
+ *
+ * @returns The value, or NULL if the attribute is unavailable.
+ */
+const uint8_t *attributes_table_value(
+        /** [in] The table. */
+        const struct attributes_table *table,
+        /** [in] Index of the object in the handles passed to attributes_get_bulk(). */
+        CK_ULONG object_index,
+        /** [in] Index of the attribute in the types passed to attributes_get_bulk(). */
+        CK_ULONG type_index,
+        /** [out] The length of the value. */
+        CK_ULONG_PTR length ) {
+    CK_ULONG cell = (CK_ULONG)0;
+
+    if (NULL == table || object_index >= table->object_count || type_index >= table->type_count)
+        return NULL;
+
+    cell = type_index * table->object_count + object_index;
+    if (CK_UNAVAILABLE_INFORMATION == table->lengths[cell])
+        return NULL;
+
+    if (length)
+        *length = table->lengths[cell];
+    return table->data + table->offsets[cell];
+}
+
+/**
+ * Free a table filled by attributes_get_bulk().
+ */
+void attributes_table_free(
+        /** [in] The table. */
+        struct attributes_table *table ) {
+    free(table);
+}
+
+/**
+ * Output every available attribute in a table, object by object.
+ *
+ * @returns 0 on success, EXIT_FAILURE otherwise.
+ */
+int attributes_output_table(
+        /** [in] The table. */
+        const struct attributes_table *table,
+        /** [in] The output file handle. */
+        FILE *f ) {
+    CK_ULONG o = (CK_ULONG)0;
+    CK_ULONG t = (CK_ULONG)0;
+
+    if (NULL == table)
+        return EXIT_FAILURE;
+
+    if (NULL == f)
+        return EXIT_FAILURE;
+
+    for (o = (CK_ULONG)0; o < table->object_count; o++) {
+        if (CKR_OK != table->object_rv[o]) {
+            fprintf(f, "ERROR: object [%lu] is not valid\n", table->objects[o]);
+            continue;
         }
 
-        rv_local = attributes_get(
-                session, object, attributes_types[i].type, buf, &buf_len );
-        switch (rv_local)
-        {
-            case CKR_HOST_MEMORY:
-                fprintf(f, "ERROR: failed to allocate memory\n");
-                rv = rv_local;
-                break;
-            case CKR_OK:
-                fprintf(f,  "INFO : Attribute [0x%010lu] %30s:\n  0x ",
-                       attributes_types[i].type, attributes_types[i].name );
-                attributes_output(buf, buf_len, f);
-                break;
-            default:
-                break;
+        fprintf(f, "Attributes for object %lu:\n", table->objects[o]);
+        for (t = (CK_ULONG)0; t < table->type_count; t++) {
+            CK_ULONG length = (CK_ULONG)0;
+            const uint8_t *value = attributes_table_value(table, o, t, &length);
+            if (NULL == value)
+                continue;
+
+            fprintf(f,  "INFO : Attribute [0x%010lu] %30s:\n  0x ",
+                    table->types[t], attributes_name(table->types[t]) );
+            attributes_output((uint8_t *)value, length, f);
         }
+        fprintf(f, "\n");
+    }
+    return 0;
+}
+
+/**
+ * Output all attributes belonging to an object.
+ *
+ * Asks for every known attribute type with attributes_get_bulk(), and
+ *   outputs the ones the object has using attributes_output().
+ *
+ * @returns CK_RV Value returned by the PKCS#11 library. This will indicate
+ *   success or failure.
+ */
+CK_RV attributes_output_all(
+        /** [in] Valid PKCS11 session. */
+        CK_SESSION_HANDLE session,
+        /** [in] The object handle. */
+        CK_OBJECT_HANDLE object,
+        /** [in] The output file handle. */
+        FILE *f ) {
+    CK_ATTRIBUTE_TYPE types[sizeof(attributes_types)/sizeof(attributes_types[0])];
+    struct attributes_table *table = NULL;
+    size_t i = (size_t)0;
+    CK_RV rv = CKR_OK;
 
-        free(buf);
+    if (CK_INVALID_HANDLE == session)
+        return CKR_ARGUMENTS_BAD;
 
-        if (CKR_OK != rv_local)
-            break;
+    if (CK_INVALID_HANDLE == object)
+        return CKR_ARGUMENTS_BAD;
+
+    if (NULL == f)
+        return CKR_ARGUMENTS_BAD;
+
+    for (i = (size_t)0; i < attributes_types_len; i++) {
+        types[i] = attributes_types[i].type;
     }
 
-    attributes_output_all_1:
+    rv = attributes_get_bulk(session, &object, (CK_ULONG)1, types, (CK_ULONG)attributes_types_len, &table);
+    if (CKR_HOST_MEMORY == rv) {
+        fprintf(f, "ERROR: failed to allocate memory\n");
+    }
+    if (CKR_OK != rv)
+        return rv;
 
-    fprintf(f, "\n");
-    free(attr_avail);
+    rv = table->object_rv[0];
+    attributes_output_table(table, f);
+    attributes_table_free(table);
     return rv;
 }
@@ -45,6 +45,47 @@ int attributes_output(
         size_t buf_len,
         FILE *f);
 
+/**
+ * Attribute values of many objects, in one allocation.
+ *
+ * The cell of object o and attribute type t is t * object_count + o. Its
+ *   value is data + offsets[cell], lengths[cell] bytes long, or unavailable
+ *   when lengths[cell] is CK_UNAVAILABLE_INFORMATION.
+ */
+struct attributes_table {
+    CK_ULONG object_count;
+    CK_ULONG type_count;
+    CK_OBJECT_HANDLE_PTR objects;
+    CK_ATTRIBUTE_TYPE *types;
+    CK_ULONG_PTR lengths;
+    CK_ULONG_PTR offsets;
+    /** CKR_OK, or the error which kept an object from being read. */
+    CK_RV *object_rv;
+    uint8_t *data;
+    size_t data_len;
+};
+
+CK_RV attributes_get_bulk(
+        CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE_PTR objects,
+        CK_ULONG object_count,
+        CK_ATTRIBUTE_TYPE *types,
+        CK_ULONG type_count,
+        struct attributes_table **table_out );
+
+const uint8_t *attributes_table_value(
+        const struct attributes_table *table,
+        CK_ULONG object_index,
+        CK_ULONG type_index,
+        CK_ULONG_PTR length );
+
+void attributes_table_free(
+        struct attributes_table *table );
+
+int attributes_output_table(
+        const struct attributes_table *table,
+        FILE *f );
+
 CK_RV attributes_output_all(
         CK_SESSION_HANDLE session,
         CK_OBJECT_HANDLE object,
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "common.h"
+#include "attributes.h"
+
+#define KEY_COUNT 200
+
+/**
+ * Generate session AES keys with numbered labels.
+ * @param session
+ * @param keys Receives KEY_COUNT key handles
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+static CK_RV generate_aes_keys(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR keys) {
+    CK_MECHANISM mech = {CKM_AES_KEY_GEN, NULL, 0};
+    CK_ULONG key_length_bytes = 32;
+    char label[32];
+
+    for (CK_ULONG i = 0; i < KEY_COUNT; i++) {
+        snprintf(label, sizeof(label), "audit key %lu", i);
+        CK_ATTRIBUTE template[] = {
+                {CKA_TOKEN,     &false_val,        sizeof(CK_BBOOL)},
+                {CKA_SENSITIVE, &true_val,         sizeof(CK_BBOOL)},
+                {CKA_LABEL,     label,             (CK_ULONG) strlen(label)},
+                {CKA_VALUE_LEN, &key_length_bytes, sizeof(CK_ULONG)}
+        };
+
+        CK_RV rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), &keys[i]);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to generate an AES key: %lu\n", rv);
+            return rv;
+        }
+    }
+    return CKR_OK;
+}
+
+/**
+ * Read the label, key type, length and value of many keys with
+ * attributes_get_bulk. The value of a sensitive key is unavailable, which
+ * does not keep the other attributes from being read.
+ * @param session
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+CK_RV attributes_bulk_example(CK_SESSION_HANDLE session) {
+    CK_OBJECT_HANDLE keys[KEY_COUNT];
+    CK_ATTRIBUTE_TYPE types[] = { CKA_LABEL, CKA_KEY_TYPE, CKA_VALUE_LEN, CKA_VALUE };
+    struct attributes_table *table = NULL;
+    char label[32];
+    CK_RV rv;
+
+    rv = generate_aes_keys(session, keys);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = attributes_get_bulk(session, keys, KEY_COUNT, types, sizeof(types) / sizeof(types[0]), &table);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to get the attributes: %lu\n", rv);
+        return rv;
+    }
+
+    for (CK_ULONG i = 0; i < KEY_COUNT && CKR_OK == rv; i++) {
+        CK_ULONG length = 0;
+        const uint8_t *value = attributes_table_value(table, i, 0, &length);
+
+        snprintf(label, sizeof(label), "audit key %lu", i);
+        if (NULL == value || length != strlen(label) || 0 != memcmp(value, label, length)) {
+            fprintf(stderr, "Wrong label for key %lu\n", keys[i]);
+            rv = CKR_GENERAL_ERROR;
+        }
+
+        value = attributes_table_value(table, i, 1, &length);
+        if (NULL == value || length != sizeof(CK_KEY_TYPE) || CKK_AES != *(const CK_KEY_TYPE *) value) {
+            fprintf(stderr, "Wrong key type for key %lu\n", keys[i]);
+            rv = CKR_GENERAL_ERROR;
+        }
+
+        if (NULL != attributes_table_value(table, i, 3, &length)) {
+            fprintf(stderr, "The value of sensitive key %lu is available\n", keys[i]);
+            rv = CKR_GENERAL_ERROR;
+        }
+    }
+
+    if (CKR_OK == rv) {
+        printf("Read %lu attributes of %d keys into %zu bytes\n",
+               (CK_ULONG) (sizeof(types) / sizeof(types[0])), KEY_COUNT, table->data_len);
+    }
+
+    attributes_table_free(table);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    // attributes_output_all reads every known attribute type the same way.
+    return attributes_output_all(session, keys[0], stdout);
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    rv = attributes_bulk_example(session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,808 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "common.h"
+#include "gopt.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+#include "pkcs11_trace.h"
+#include "sign.h"
+#include "digest.h"
+#include "aes.h"
+#include "aes_wrapping_common.h"
+
+#define DEFAULT_DURATION_SECONDS 10
+#define MIN_OUTPUT_CAPACITY 512
+
+/*
+ * Mechanisms are grouped by the kind of key and operation they need.
+ * Sign and verify share a family, as do encrypt and decrypt.
+ */
+enum bench_family {
+    BENCH_FAMILY_DIGEST,
+    BENCH_FAMILY_SIGN,
+    BENCH_FAMILY_CIPHER,
+    BENCH_FAMILY_WRAP,
+    BENCH_FAMILY_DERIVE,
+    BENCH_FAMILY_RANDOM,
+};
+
+struct bench_mechanism {
+    const char *name;
+    CK_MECHANISM_TYPE type;
+    enum bench_family family;
+    CK_KEY_TYPE key_type;
+};
+
+static const struct bench_mechanism bench_mechanisms[] = {
+        { "CKM_SHA_1",                           CKM_SHA_1,                           BENCH_FAMILY_DIGEST, 0 },
+        { "CKM_SHA224",                          CKM_SHA224,                          BENCH_FAMILY_DIGEST, 0 },
+        { "CKM_SHA256",                          CKM_SHA256,                          BENCH_FAMILY_DIGEST, 0 },
+        { "CKM_SHA384",                          CKM_SHA384,                          BENCH_FAMILY_DIGEST, 0 },
+        { "CKM_SHA512",                          CKM_SHA512,                          BENCH_FAMILY_DIGEST, 0 },
+        { "CKM_SHA1_RSA_PKCS",                   CKM_SHA1_RSA_PKCS,                   BENCH_FAMILY_SIGN,   CKK_RSA },
+        { "CKM_SHA224_RSA_PKCS",                 CKM_SHA224_RSA_PKCS,                 BENCH_FAMILY_SIGN,   CKK_RSA },
+        { "CKM_SHA256_RSA_PKCS",                 CKM_SHA256_RSA_PKCS,                 BENCH_FAMILY_SIGN,   CKK_RSA },
+        { "CKM_SHA384_RSA_PKCS",                 CKM_SHA384_RSA_PKCS,                 BENCH_FAMILY_SIGN,   CKK_RSA },
+        { "CKM_SHA512_RSA_PKCS",                 CKM_SHA512_RSA_PKCS,                 BENCH_FAMILY_SIGN,   CKK_RSA },
+        { "CKM_ECDSA_SHA1",                      CKM_ECDSA_SHA1,                      BENCH_FAMILY_SIGN,   CKK_EC },
+        { "CKM_ECDSA_SHA224",                    CKM_ECDSA_SHA224,                    BENCH_FAMILY_SIGN,   CKK_EC },
+        { "CKM_ECDSA_SHA256",                    CKM_ECDSA_SHA256,                    BENCH_FAMILY_SIGN,   CKK_EC },
+        { "CKM_ECDSA_SHA384",                    CKM_ECDSA_SHA384,                    BENCH_FAMILY_SIGN,   CKK_EC },
+        { "CKM_ECDSA_SHA512",                    CKM_ECDSA_SHA512,                    BENCH_FAMILY_SIGN,   CKK_EC },
+        { "CKM_AES_ECB",                         CKM_AES_ECB,                         BENCH_FAMILY_CIPHER, CKK_AES },
+        { "CKM_AES_CBC",                         CKM_AES_CBC,                         BENCH_FAMILY_CIPHER, CKK_AES },
+        { "CKM_AES_CBC_PAD",                     CKM_AES_CBC_PAD,                     BENCH_FAMILY_CIPHER, CKK_AES },
+        { "CKM_AES_CTR",                         CKM_AES_CTR,                         BENCH_FAMILY_CIPHER, CKK_AES },
+        { "CKM_AES_GCM",                         CKM_AES_GCM,                         BENCH_FAMILY_CIPHER, CKK_AES },
+        { "CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD", CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD, BENCH_FAMILY_WRAP,   CKK_AES },
+        { "CKM_CLOUDHSM_AES_KEY_WRAP_NO_PAD",    CKM_CLOUDHSM_AES_KEY_WRAP_NO_PAD,    BENCH_FAMILY_WRAP,   CKK_AES },
+        { "CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD",  CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD,  BENCH_FAMILY_WRAP,   CKK_AES },
+        { "CKM_AES_GCM",                         CKM_AES_GCM,                         BENCH_FAMILY_WRAP,   CKK_AES },
+        { "CKM_ECDH1_DERIVE",                    CKM_ECDH1_DERIVE,                    BENCH_FAMILY_DERIVE, CKK_EC },
+};
+
+static const size_t bench_mechanisms_len =
+        (sizeof(bench_mechanisms)/sizeof(bench_mechanisms[0]));
+
+/**
+ * State shared by every worker. It is written during setup, before any
+ * worker starts, and only read afterwards.
+ */
+struct bench_context {
+    const struct bench_op *op;
+    const struct bench_mechanism *mechanism;
+    CK_BYTE_PTR payload;
+    CK_ULONG payload_size;
+
+    // The AES key, signing key, wrapping key or ECDH base key.
+    CK_OBJECT_HANDLE key;
+    // The verification key, or the key being wrapped.
+    CK_OBJECT_HANDLE other_key;
+    CK_BBOOL key_is_token;
+    // Sign hashes the payload on the client and sends only the digest.
+    CK_BBOOL hash_locally;
+
+    // Signature consumed by verify, or ciphertext consumed by decrypt.
+    CK_BYTE_PTR reference;
+    CK_ULONG reference_length;
+    CK_BYTE iv[16];
+
+    CK_BYTE ec_point[133];
+    CK_ULONG ec_point_length;
+
+    atomic_int stop;
+};
+
+struct bench_worker {
+    pthread_t thread;
+    struct bench_context *ctx;
+    CK_SESSION_HANDLE session;
+    CK_BYTE_PTR output;
+    CK_ULONG output_capacity;
+    CK_BYTE iv[16];
+    // Object created by the last operation, destroyed outside of the timed section.
+    CK_OBJECT_HANDLE created_object;
+    struct latency_histogram histogram;
+    unsigned long errors;
+    CK_RV last_error;
+};
+
+struct bench_op {
+    const char *name;
+    enum bench_family family;
+    CK_MECHANISM_TYPE default_mechanism;
+    CK_ULONG default_payload_size;
+    CK_RV (*setup)(struct bench_context *ctx, CK_SESSION_HANDLE session);
+    CK_RV (*run)(struct bench_context *ctx, struct bench_worker *worker);
+};
+
+/**
+ * Curve OIDs generated using OpenSSL on the command line.
+ * openssl ecparam -name prime256v1 -outform DER | hexdump -C
+ */
+static CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+/**
+ * Build the mechanism for an AES encrypt or decrypt. The parameter structures
+ * are owned by the caller so concurrent workers never share them.
+ */
+static void bench_cipher_mechanism(CK_MECHANISM_TYPE type,
+                                   CK_BYTE_PTR iv,
+                                   CK_MECHANISM_PTR mech,
+                                   CK_AES_CTR_PARAMS *ctr_params,
+                                   CK_GCM_PARAMS *gcm_params) {
+    mech->mechanism = type;
+    mech->pParameter = NULL;
+    mech->ulParameterLen = 0;
+
+    switch (type) {
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD:
+            mech->pParameter = iv;
+            mech->ulParameterLen = 16;
+            break;
+        case CKM_AES_CTR:
+            ctr_params->ulCounterBits = 32;
+            memcpy(ctr_params->cb, iv, sizeof(ctr_params->cb));
+            mech->pParameter = ctr_params;
+            mech->ulParameterLen = sizeof(*ctr_params);
+            break;
+        case CKM_AES_GCM:
+            // The HSM generates the IV and writes it to pIv.
+            memset(gcm_params, 0, sizeof(*gcm_params));
+            gcm_params->pIv = iv;
+            gcm_params->ulIvLen = AES_GCM_IV_SIZE;
+            gcm_params->ulTagBits = AES_GCM_TAG_SIZE * 8;
+            mech->pParameter = gcm_params;
+            mech->ulParameterLen = sizeof(*gcm_params);
+            break;
+    }
+}
+
+static CK_RV bench_run_digest(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_BYTE_PTR digest = NULL;
+    CK_ULONG digest_length = 0;
+
+    CK_RV rv = generateDigest(worker->session, ctx->mechanism->type,
+                              ctx->payload, ctx->payload_size, &digest, &digest_length);
+    free(digest);
+    return rv;
+}
+
+static CK_RV bench_setup_sign(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    CK_RV rv;
+
+    if (CKK_RSA == ctx->mechanism->key_type) {
+        rv = generate_rsa_keypair(session, 2048, &public_key, &private_key);
+    } else {
+        rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &public_key, &private_key);
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Signing key generation failed: %lu\n", rv);
+        return rv;
+    }
+
+    ctx->key = private_key;
+    ctx->other_key = public_key;
+    return CKR_OK;
+}
+
+static CK_RV bench_run_sign(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_ULONG signature_length = worker->output_capacity;
+
+    return generate_signature(worker->session, ctx->key, ctx->mechanism->type,
+                              ctx->payload, ctx->payload_size, worker->output, &signature_length,
+                              ctx->hash_locally);
+}
+
+static CK_RV bench_setup_verify(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    CK_RV rv = bench_setup_sign(ctx, session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    ctx->reference = malloc(MAX_SIGNATURE_LENGTH);
+    if (NULL == ctx->reference) {
+        return CKR_HOST_MEMORY;
+    }
+    ctx->reference_length = MAX_SIGNATURE_LENGTH;
+
+    rv = generate_signature(session, ctx->key, ctx->mechanism->type,
+                            ctx->payload, ctx->payload_size, ctx->reference, &ctx->reference_length,
+                            CK_FALSE);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Signature generation failed: %lu\n", rv);
+    }
+    return rv;
+}
+
+static CK_RV bench_run_verify(struct bench_context *ctx, struct bench_worker *worker) {
+    return verify_signature(worker->session, ctx->other_key, ctx->mechanism->type,
+                            ctx->payload, ctx->payload_size, ctx->reference, ctx->reference_length);
+}
+
+static CK_RV bench_setup_encrypt(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    CK_MECHANISM_TYPE type = ctx->mechanism->type;
+
+    if ((CKM_AES_ECB == type || CKM_AES_CBC == type) && 0 != ctx->payload_size % 16) {
+        fprintf(stderr, "Payload size must be a multiple of 16 bytes without padding\n");
+        return CKR_DATA_LEN_RANGE;
+    }
+
+    memset(ctx->iv, 0x01, sizeof(ctx->iv));
+
+    CK_RV rv = generate_aes_key(session, 32, &ctx->key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "AES key generation failed: %lu\n", rv);
+    }
+    return rv;
+}
+
+static CK_RV bench_run_encrypt(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_MECHANISM mech;
+    CK_AES_CTR_PARAMS ctr_params;
+    CK_GCM_PARAMS gcm_params;
+    CK_ULONG ciphertext_length = 0;
+
+    bench_cipher_mechanism(ctx->mechanism->type, worker->iv, &mech, &ctr_params, &gcm_params);
+
+    CK_RV rv = funcs->C_EncryptInit(worker->session, &mech, ctx->key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    return pkcs11_single_part(funcs->C_Encrypt, worker->session, ctx->payload, ctx->payload_size,
+                              &worker->output, &worker->output_capacity, &ciphertext_length);
+}
+
+static CK_RV bench_setup_decrypt(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    CK_MECHANISM mech;
+    CK_AES_CTR_PARAMS ctr_params;
+    CK_GCM_PARAMS gcm_params;
+    CK_ULONG reference_capacity;
+
+    CK_RV rv = bench_setup_encrypt(ctx, session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    // Every worker decrypts the same ciphertext, so GCM reuses the IV generated here.
+    bench_cipher_mechanism(ctx->mechanism->type, ctx->iv, &mech, &ctr_params, &gcm_params);
+    reference_capacity = pkcs11_max_output_length(PKCS11_OPERATION_ENCRYPT, &mech, 0, ctx->payload_size);
+    rv = funcs->C_EncryptInit(session, &mech, ctx->key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Encryption Init failed: %lu\n", rv);
+        return rv;
+    }
+
+    rv = pkcs11_single_part(funcs->C_Encrypt, session, ctx->payload, ctx->payload_size,
+                            &ctx->reference, &reference_capacity, &ctx->reference_length);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Encryption failed: %lu\n", rv);
+    }
+    return rv;
+}
+
+static CK_RV bench_run_decrypt(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_MECHANISM mech;
+    CK_AES_CTR_PARAMS ctr_params;
+    CK_GCM_PARAMS gcm_params;
+    CK_ULONG plaintext_length = 0;
+
+    bench_cipher_mechanism(ctx->mechanism->type, ctx->iv, &mech, &ctr_params, &gcm_params);
+
+    CK_RV rv = funcs->C_DecryptInit(worker->session, &mech, ctx->key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    return pkcs11_single_part(funcs->C_Decrypt, worker->session, ctx->reference, ctx->reference_length,
+                              &worker->output, &worker->output_capacity, &plaintext_length);
+}
+
+static CK_RV bench_setup_wrap(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    if (16 != ctx->payload_size && 24 != ctx->payload_size && 32 != ctx->payload_size) {
+        fprintf(stderr, "Payload size is the length of the wrapped AES key: 16, 24 or 32\n");
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    CK_RV rv = generate_aes_token_key_for_wrapping(session, 32, &ctx->key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Wrapping key generation failed: %lu\n", rv);
+        return rv;
+    }
+    ctx->key_is_token = CK_TRUE;
+
+    rv = generate_aes_session_key(session, ctx->payload_size, &ctx->other_key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "AES key generation failed: %lu\n", rv);
+    }
+    return rv;
+}
+
+static CK_RV bench_run_wrap(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_MECHANISM mech = { ctx->mechanism->type, NULL, 0 };
+    CK_GCM_PARAMS gcm_params = { worker->iv, AES_GCM_IV_SIZE, 0, NULL, 0, AES_GCM_TAG_SIZE * 8 };
+    CK_ULONG wrapped_length = 0;
+
+    if (CKM_AES_GCM == mech.mechanism) {
+        mech.pParameter = &gcm_params;
+        mech.ulParameterLen = sizeof(gcm_params);
+    }
+
+    return aes_wrap_key(worker->session, &mech, ctx->key, ctx->other_key,
+                        &worker->output, &worker->output_capacity, &wrapped_length);
+}
+
+static CK_RV bench_setup_derive(struct bench_context *ctx, CK_SESSION_HANDLE session) {
+    CK_MECHANISM mech = {CKM_EC_KEY_PAIR_GEN, NULL, 0};
+    CK_RV rv;
+
+    CK_ATTRIBUTE public_key_template[] = {
+            {CKA_VERIFY,    &true_val,  sizeof(CK_BBOOL)},
+            {CKA_EC_PARAMS, prime256v1, sizeof(prime256v1)},
+            {CKA_TOKEN,     &false_val, sizeof(CK_BBOOL)},
+    };
+
+    CK_ATTRIBUTE private_key_template[] = {
+            {CKA_TOKEN,  &false_val, sizeof(CK_BBOOL)},
+            {CKA_DERIVE, &true_val,  sizeof(CK_BBOOL)},
+    };
+
+    rv = funcs->C_GenerateKeyPair(session,
+                                  &mech,
+                                  public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
+                                  private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
+                                  &ctx->other_key,
+                                  &ctx->key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "EC key generation failed: %lu\n", rv);
+        return rv;
+    }
+
+    CK_ATTRIBUTE point_template[] = {
+            {CKA_EC_POINT, ctx->ec_point, sizeof(ctx->ec_point)},
+    };
+    rv = funcs->C_GetAttributeValue(session, ctx->other_key, point_template, 1);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed getting attribute value: %lu\n", rv);
+        return rv;
+    }
+    ctx->ec_point_length = point_template[0].ulValueLen;
+
+    return CKR_OK;
+}
+
+static CK_RV bench_run_derive(struct bench_context *ctx, struct bench_worker *worker) {
+    CK_KEY_TYPE key_type = CKK_AES;
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_ULONG key_length = 32;
+
+    // derivation/ecdh.c builds its helper into a sample with its own main(), so
+    // this issues C_DeriveKey directly with the same template.
+    // Derive against our own public point; skip the DER OCTET STRING header.
+    CK_ECDH1_DERIVE_PARAMS params = { CKD_NULL, 0, NULL, ctx->ec_point_length - 2, &ctx->ec_point[2] };
+    CK_MECHANISM mech = { CKM_ECDH1_DERIVE, &params, sizeof(params) };
+
+    CK_ATTRIBUTE template[] = {
+            { CKA_CLASS,     &key_class,  sizeof(key_class) },
+            { CKA_KEY_TYPE,  &key_type,   sizeof(key_type) },
+            { CKA_ENCRYPT,   &true_val,   sizeof(CK_BBOOL) },
+            { CKA_DECRYPT,   &true_val,   sizeof(CK_BBOOL) },
+            { CKA_VALUE_LEN, &key_length, sizeof(key_length) },
+            { CKA_TOKEN,     &false_val,  sizeof(CK_BBOOL) },
+    };
+
+    return funcs->C_DeriveKey(worker->session, &mech, ctx->key,
+                              template, sizeof(template) / sizeof(CK_ATTRIBUTE),
+                              &worker->created_object);
+}
+
+static CK_RV bench_run_random(struct bench_context *ctx, struct bench_worker *worker) {
+    return funcs->C_GenerateRandom(worker->session, worker->output, ctx->payload_size);
+}
+
+static const struct bench_op bench_ops[] = {
+        { "digest",  BENCH_FAMILY_DIGEST, CKM_SHA256,                          1024, NULL,                bench_run_digest },
+        { "sign",    BENCH_FAMILY_SIGN,   CKM_SHA256_RSA_PKCS,                 1024, bench_setup_sign,    bench_run_sign },
+        { "verify",  BENCH_FAMILY_SIGN,   CKM_SHA256_RSA_PKCS,                 1024, bench_setup_verify,  bench_run_verify },
+        { "encrypt", BENCH_FAMILY_CIPHER, CKM_AES_CBC_PAD,                     1024, bench_setup_encrypt, bench_run_encrypt },
+        { "decrypt", BENCH_FAMILY_CIPHER, CKM_AES_CBC_PAD,                     1024, bench_setup_decrypt, bench_run_decrypt },
+        { "wrap",    BENCH_FAMILY_WRAP,   CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD, 32,   bench_setup_wrap,    bench_run_wrap },
+        { "derive",  BENCH_FAMILY_DERIVE, CKM_ECDH1_DERIVE,                    0,    bench_setup_derive,  bench_run_derive },
+        { "random",  BENCH_FAMILY_RANDOM, 0,                                   1024, NULL,                bench_run_random },
+};
+
+static const size_t bench_ops_len = (sizeof(bench_ops)/sizeof(bench_ops[0]));
+
+struct bench_arguments {
+    char *pin;
+    char *library;
+    const struct bench_op *op;
+    const struct bench_mechanism *mechanism;
+    unsigned long threads;
+    CK_ULONG payload_size;
+    unsigned long duration;
+    int trace;
+    int hash_locally;
+};
+
+static void show_help(void) {
+    printf("\n\t--pin <user:password>\n\t[--library <path/to/pkcs11>]\n");
+    printf("\t--op <operation>\n\t[--mechanism <CKM_ name>]\n");
+    printf("\t[--threads <count>]\n\t[--payload-size <bytes>]\n\t[--duration <seconds>]\n\t[--trace]\n");
+    printf("\t[--hash-locally] Hash on the client and sign only the digest\n\n");
+
+    printf("Operations and mechanisms:\n");
+    for (size_t i = 0; i < bench_ops_len; i++) {
+        printf("\t%s:", bench_ops[i].name);
+        for (size_t j = 0; j < bench_mechanisms_len; j++) {
+            if (bench_mechanisms[j].family == bench_ops[i].family) {
+                printf(" %s", bench_mechanisms[j].name);
+            }
+        }
+        printf("\n");
+    }
+}
+
+static const struct bench_mechanism *find_mechanism(enum bench_family family, const char *name) {
+    for (size_t i = 0; i < bench_mechanisms_len; i++) {
+        if (bench_mechanisms[i].family != family) {
+            continue;
+        }
+        if (NULL == name || 0 == strcmp(name, bench_mechanisms[i].name)) {
+            return &bench_mechanisms[i];
+        }
+    }
+    return NULL;
+}
+
+static int get_bench_args(int argc, char **argv, struct bench_arguments *args) {
+    if (!args || !argv || argc == 0) {
+        return -1;
+    }
+
+    struct option options[10];
+
+    options[0].long_name  = "pin";
+    options[0].short_name = 0;
+    options[0].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[1].long_name  = "library";
+    options[1].short_name = 0;
+    options[1].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[2].long_name  = "op";
+    options[2].short_name = 0;
+    options[2].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[3].long_name  = "mechanism";
+    options[3].short_name = 0;
+    options[3].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[4].long_name  = "threads";
+    options[4].short_name = 0;
+    options[4].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[5].long_name  = "payload-size";
+    options[5].short_name = 0;
+    options[5].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[6].long_name  = "duration";
+    options[6].short_name = 0;
+    options[6].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[7].long_name  = "trace";
+    options[7].short_name = 0;
+    options[7].flags      = GOPT_ARGUMENT_FORBIDDEN;
+
+    options[8].long_name  = "hash-locally";
+    options[8].short_name = 0;
+    options[8].flags      = GOPT_ARGUMENT_FORBIDDEN;
+
+    options[9].flags      = GOPT_LAST;
+
+    gopt (argv, options);
+
+    if (options[0].count != 1 || options[2].count != 1) {
+        show_help();
+        return -1;
+    }
+
+    args->pin = options[0].argument;
+    args->library = options[1].argument;
+    if (!args->library) {
+        args->library = DEFAULT_PKCS11_LIBRARY_PATH;
+    }
+
+    args->op = NULL;
+    for (size_t i = 0; i < bench_ops_len; i++) {
+        if (0 == strcmp(options[2].argument, bench_ops[i].name)) {
+            args->op = &bench_ops[i];
+        }
+    }
+    if (!args->op) {
+        fprintf(stderr, "Unknown operation: %s\n", options[2].argument);
+        show_help();
+        return -1;
+    }
+
+    args->mechanism = NULL;
+    if (BENCH_FAMILY_RANDOM != args->op->family) {
+        args->mechanism = find_mechanism(args->op->family, options[3].argument);
+        if (!args->mechanism) {
+            fprintf(stderr, "Mechanism %s can not be used for %s\n", options[3].argument, args->op->name);
+            show_help();
+            return -1;
+        }
+        if (!options[3].argument) {
+            for (size_t i = 0; i < bench_mechanisms_len; i++) {
+                if (bench_mechanisms[i].family == args->op->family
+                    && bench_mechanisms[i].type == args->op->default_mechanism) {
+                    args->mechanism = &bench_mechanisms[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    args->threads = 1;
+    if (options[4].argument) {
+        args->threads = strtoul(options[4].argument, NULL, 0);
+    }
+
+    args->payload_size = args->op->default_payload_size;
+    if (options[5].argument) {
+        args->payload_size = strtoul(options[5].argument, NULL, 0);
+    }
+
+    args->duration = DEFAULT_DURATION_SECONDS;
+    if (options[6].argument) {
+        args->duration = strtoul(options[6].argument, NULL, 0);
+    }
+
+    args->trace = options[7].count > 0;
+    args->hash_locally = options[8].count > 0;
+
+    if (0 == args->threads || 0 == args->duration) {
+        show_help();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *bench_worker_run(void *arg) {
+    struct bench_worker *worker = arg;
+    struct bench_context *ctx = worker->ctx;
+
+    while (!atomic_load_explicit(&ctx->stop, memory_order_relaxed)) {
+        uint64_t start = latency_now_ns();
+        CK_RV rv = ctx->op->run(ctx, worker);
+        uint64_t end = latency_now_ns();
+
+        if (CKR_OK == rv) {
+            latency_histogram_record(&worker->histogram, end - start);
+        } else {
+            worker->errors++;
+            worker->last_error = rv;
+        }
+
+        if (CK_INVALID_HANDLE != worker->created_object) {
+            funcs->C_DestroyObject(worker->session, worker->created_object);
+            worker->created_object = CK_INVALID_HANDLE;
+        }
+    }
+
+    return NULL;
+}
+
+static void bench_report(struct bench_arguments *args, struct bench_worker *workers, uint64_t elapsed_ns) {
+    struct latency_histogram *total = malloc(sizeof(struct latency_histogram));
+    unsigned long errors = 0;
+    CK_RV last_error = CKR_OK;
+    double seconds = (double) elapsed_ns / 1e9;
+
+    if (NULL == total) {
+        fprintf(stderr, "Could not allocate memory for the report\n");
+        return;
+    }
+
+    latency_histogram_init(total);
+    for (unsigned long i = 0; i < args->threads; i++) {
+        latency_histogram_merge(total, &workers[i].histogram);
+        errors += workers[i].errors;
+        if (CKR_OK != workers[i].last_error) {
+            last_error = workers[i].last_error;
+        }
+    }
+
+    printf("Operation:    %s\n", args->op->name);
+    if (args->mechanism) {
+        printf("Mechanism:    %s (0x%08lx)\n", args->mechanism->name, args->mechanism->type);
+    }
+    printf("Threads:      %lu\n", args->threads);
+    printf("Payload size: %lu bytes\n", args->payload_size);
+    printf("Duration:     %.2f s\n", seconds);
+    printf("Operations:   %llu\n", (unsigned long long) total->count);
+    printf("Errors:       %lu", errors);
+    if (errors > 0) {
+        printf(" (last error: %lu)", last_error);
+    }
+    printf("\n");
+    printf("Throughput:   %.1f ops/sec\n", (double) total->count / seconds);
+
+    if (total->count > 0) {
+        printf("Latency (us): min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               total->min_ns / 1e3,
+               (double) total->sum_ns / (double) total->count / 1e3,
+               latency_histogram_percentile(total, 50.0) / 1e3,
+               latency_histogram_percentile(total, 90.0) / 1e3,
+               latency_histogram_percentile(total, 99.0) / 1e3,
+               latency_histogram_percentile(total, 99.9) / 1e3,
+               total->max_ns / 1e3);
+    }
+
+    free(total);
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct bench_arguments args = {0};
+    struct bench_context ctx;
+    struct session_pool *pool = NULL;
+    struct bench_worker *workers = NULL;
+    unsigned long started = 0;
+    int rc = EXIT_FAILURE;
+
+    if (get_bench_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.op = args.op;
+    ctx.mechanism = args.mechanism;
+    ctx.payload_size = args.payload_size;
+    ctx.hash_locally = args.hash_locally ? CK_TRUE : CK_FALSE;
+    atomic_init(&ctx.stop, 0);
+
+    ctx.payload = malloc(ctx.payload_size + 1);
+    if (NULL == ctx.payload) {
+        fprintf(stderr, "Could not allocate memory for the payload\n");
+        return rc;
+    }
+    for (CK_ULONG i = 0; i < ctx.payload_size; i++) {
+        ctx.payload[i] = (CK_BYTE) rand();
+    }
+
+    // Tracing shows how much of each operation's latency every C_ call accounts for.
+    if (args.trace && CKR_OK != pkcs11_trace_enable()) {
+        fprintf(stderr, "Could not enable tracing\n");
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        free(ctx.payload);
+        return rc;
+    }
+
+    // One session per thread, so workers never wait on each other.
+    rv = session_pool_create(args.pin, args.threads, args.threads, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to open %lu sessions: %lu\n", args.threads, rv);
+        goto done;
+    }
+
+    workers = calloc(args.threads, sizeof(struct bench_worker));
+    if (NULL == workers) {
+        fprintf(stderr, "Could not allocate memory for workers\n");
+        goto done;
+    }
+
+    for (unsigned long i = 0; i < args.threads; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].output_capacity = ctx.payload_size + 2 * 16;
+        if (workers[i].output_capacity < MIN_OUTPUT_CAPACITY) {
+            workers[i].output_capacity = MIN_OUTPUT_CAPACITY;
+        }
+        workers[i].output = malloc(workers[i].output_capacity);
+        if (NULL == workers[i].output) {
+            fprintf(stderr, "Could not allocate memory for worker output\n");
+            goto done;
+        }
+        latency_histogram_init(&workers[i].histogram);
+
+        rv = session_pool_acquire(pool, &workers[i].session);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+            goto done;
+        }
+    }
+
+    // Keys are session objects on the first worker's session, visible to every session.
+    if (ctx.op->setup) {
+        rv = ctx.op->setup(&ctx, workers[0].session);
+        if (CKR_OK != rv) {
+            goto done;
+        }
+    }
+
+    uint64_t start = latency_now_ns();
+    for (; started < args.threads; started++) {
+        if (0 != pthread_create(&workers[started].thread, NULL, bench_worker_run, &workers[started])) {
+            fprintf(stderr, "Failed to start worker %lu\n", started);
+            break;
+        }
+    }
+
+    if (started == args.threads) {
+        struct timespec remaining = { (time_t) args.duration, 0 };
+        while (0 != nanosleep(&remaining, &remaining)) {
+        }
+    }
+    atomic_store(&ctx.stop, 1);
+
+    for (unsigned long i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t elapsed = latency_now_ns() - start;
+
+    if (started == args.threads) {
+        bench_report(&args, workers, elapsed);
+        rc = EXIT_SUCCESS;
+    }
+
+done:
+    if (ctx.key_is_token && CK_INVALID_HANDLE != ctx.key) {
+        // The wrapping key is a token key, so we have to clean it up.
+        rv = funcs->C_DestroyObject(workers[0].session, ctx.key);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to delete wrapping key with rv: %lu\n", rv);
+        }
+    }
+
+    if (NULL != workers) {
+        for (unsigned long i = 0; i < args.threads; i++) {
+            session_pool_release(pool, workers[i].session);
+            free(workers[i].output);
+        }
+        free(workers);
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    if (pkcs11_trace_enabled()) {
+        pkcs11_trace_dump(stderr);
+    }
+
+    free(ctx.reference);
+    free(ctx.payload);
+
+    return rc;
+}
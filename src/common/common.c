@@ -21,12 +21,6 @@
 #include "gopt.h"
 #include "common.h"
 
-#ifdef _WIN32
-#define DEFAULT_PKCS11_LIBRARY_PATH "C:\\Program Files\\Amazon\\CloudHSM\\lib\\cloudhsm_pkcs11.dll"
-#else
-#define DEFAULT_PKCS11_LIBRARY_PATH "/opt/cloudhsm/lib/libcloudhsm_pkcs11.so"
-#endif
-
 CK_BBOOL true_val = TRUE;
 CK_BBOOL false_val = FALSE;
 
@@ -23,6 +23,14 @@
 
 #define MAX_SIGNATURE_LENGTH 256
 
+#ifndef DEFAULT_PKCS11_LIBRARY_PATH
+#ifdef _WIN32
+#define DEFAULT_PKCS11_LIBRARY_PATH "C:\\Program Files\\Amazon\\CloudHSM\\lib\\cloudhsm_pkcs11.dll"
+#else
+#define DEFAULT_PKCS11_LIBRARY_PATH "/opt/cloudhsm/lib/libcloudhsm_pkcs11.so"
+#endif
+#endif
+
 extern CK_FUNCTION_LIST *funcs;
 extern CK_BBOOL true_val;
 extern CK_BBOOL false_val;
@@ -34,6 +42,21 @@ CK_RV pkcs11_get_slot(CK_SLOT_ID *slot_id);
 
 void pkcs11_finalize_session(CK_SESSION_HANDLE session);
 
+CK_RV pkcs11_generate_key(CK_SESSION_HANDLE session,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_ATTRIBUTE_PTR template,
+                          CK_ULONG attribute_count,
+                          CK_OBJECT_HANDLE_PTR key);
+
+CK_RV pkcs11_generate_key_pair(CK_SESSION_HANDLE session,
+                               CK_MECHANISM_PTR mechanism,
+                               CK_ATTRIBUTE_PTR public_template,
+                               CK_ULONG public_attribute_count,
+                               CK_ATTRIBUTE_PTR private_template,
+                               CK_ULONG private_attribute_count,
+                               CK_OBJECT_HANDLE_PTR public_key,
+                               CK_OBJECT_HANDLE_PTR private_key);
+
 struct pkcs_arguments {
     char *pin;
     char *library;
@@ -0,0 +1,439 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "key_pool.h"
+
+// How long the refill thread waits before retrying after a failed generation.
+#define KEY_POOL_RETRY_SECONDS 1
+
+/**
+ * A template copied into one allocation, so it outlives the caller's.
+ */
+struct key_template {
+    CK_ATTRIBUTE_PTR attributes;
+    CK_ULONG count;
+};
+
+struct key_pool {
+    pthread_mutex_t lock;
+    // Signalled when the pool drops below the low watermark, or is being destroyed.
+    pthread_cond_t refill;
+    // Signalled when the pool reaches the high watermark, or the refill fails.
+    pthread_cond_t filled;
+    pthread_t thread;
+
+    struct session_pool *sessions;
+    CK_SESSION_HANDLE session;
+
+    CK_MECHANISM mechanism;
+    CK_BBOOL key_pair;
+    struct key_template public_template;
+    struct key_template template;
+
+    // Ring of generated keys, handed out oldest first.
+    CK_OBJECT_HANDLE_PTR keys;
+    CK_OBJECT_HANDLE_PTR public_keys;
+    CK_ULONG head;
+    CK_ULONG count;
+    CK_ULONG low_watermark;
+    CK_ULONG high_watermark;
+
+    CK_ULONG generated;
+    CK_ULONG taken;
+    CK_ULONG misses;
+    CK_RV last_error;
+    // Fill up to the high watermark even though the low watermark is not reached.
+    CK_BBOOL refill_requested;
+    CK_BBOOL stopping;
+};
+
+/**
+ * Round a value length up so the next value starts at a CK_ULONG boundary;
+ * the module reads values such as CKA_VALUE_LEN as CK_ULONG.
+ */
+static size_t key_template_aligned(size_t length) {
+    return (length + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+}
+
+/**
+ * Copy a template, making sure it describes a session object.
+ * The values are packed after the attribute array, each one aligned for CK_ULONG.
+ * @return CKR_TEMPLATE_INCONSISTENT if the template asks for a token object
+ */
+static CK_RV key_template_copy(CK_ATTRIBUTE_PTR template, CK_ULONG count, struct key_template *copy) {
+    CK_BBOOL has_token = CK_FALSE;
+    size_t size;
+    CK_BYTE_PTR values;
+
+    if (!template && count > 0) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    size = (count + 1) * sizeof(CK_ATTRIBUTE) + sizeof(CK_BBOOL);
+    for (CK_ULONG i = 0; i < count; i++) {
+        if (NULL == template[i].pValue && template[i].ulValueLen > 0) {
+            return CKR_ARGUMENTS_BAD;
+        }
+        if (CKA_TOKEN == template[i].type) {
+            if (sizeof(CK_BBOOL) != template[i].ulValueLen || CK_FALSE != *(CK_BBOOL *) template[i].pValue) {
+                return CKR_TEMPLATE_INCONSISTENT;
+            }
+            has_token = CK_TRUE;
+        }
+        size += key_template_aligned(template[i].ulValueLen);
+    }
+
+    copy->attributes = malloc(size);
+    if (NULL == copy->attributes) {
+        return CKR_HOST_MEMORY;
+    }
+
+    values = (CK_BYTE_PTR) &copy->attributes[count + 1];
+    for (CK_ULONG i = 0; i < count; i++) {
+        copy->attributes[i].type = template[i].type;
+        copy->attributes[i].pValue = values;
+        copy->attributes[i].ulValueLen = template[i].ulValueLen;
+        if (template[i].ulValueLen > 0) {
+            memcpy(values, template[i].pValue, template[i].ulValueLen);
+        }
+        values += key_template_aligned(template[i].ulValueLen);
+    }
+    copy->count = count;
+
+    if (!has_token) {
+        *values = CK_FALSE;
+        copy->attributes[count].type = CKA_TOKEN;
+        copy->attributes[count].pValue = values;
+        copy->attributes[count].ulValueLen = sizeof(CK_BBOOL);
+        copy->count++;
+    }
+    return CKR_OK;
+}
+
+static CK_RV key_pool_generate(struct key_pool *pool, CK_SESSION_HANDLE session,
+                               CK_OBJECT_HANDLE_PTR key, CK_OBJECT_HANDLE_PTR public_key) {
+    if (pool->key_pair) {
+        CK_OBJECT_HANDLE unused = CK_INVALID_HANDLE;
+        return pkcs11_generate_key_pair(session, &pool->mechanism,
+                                        pool->public_template.attributes, pool->public_template.count,
+                                        pool->template.attributes, pool->template.count,
+                                        public_key ? public_key : &unused, key);
+    }
+    return pkcs11_generate_key(session, &pool->mechanism, pool->template.attributes, pool->template.count, key);
+}
+
+/**
+ * Background refill: sleep until the pool drops below the low watermark,
+ * then generate keys until it reaches the high watermark.
+ */
+static void *key_pool_refill_run(void *arg) {
+    struct key_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        if (pool->count >= pool->low_watermark && !pool->refill_requested) {
+            pthread_cond_wait(&pool->refill, &pool->lock);
+            continue;
+        }
+        pool->refill_requested = CK_FALSE;
+
+        while (!pool->stopping && pool->count < pool->high_watermark) {
+            CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+            CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+
+            pthread_mutex_unlock(&pool->lock);
+            CK_RV rv = key_pool_generate(pool, pool->session, &key, &public_key);
+            pthread_mutex_lock(&pool->lock);
+
+            pool->last_error = rv;
+            if (CKR_OK != rv) {
+                break;
+            }
+
+            CK_ULONG tail = (pool->head + pool->count) % pool->high_watermark;
+            pool->keys[tail] = key;
+            pool->public_keys[tail] = public_key;
+            pool->count++;
+            pool->generated++;
+        }
+        pthread_cond_broadcast(&pool->filled);
+
+        if (CKR_OK != pool->last_error && !pool->stopping) {
+            struct timespec retry;
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += KEY_POOL_RETRY_SECONDS;
+            pthread_cond_timedwait(&pool->refill, &pool->lock, &retry);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void key_pool_free(struct key_pool *pool) {
+    free(pool->mechanism.pParameter);
+    free(pool->public_template.attributes);
+    free(pool->template.attributes);
+    free(pool->keys);
+    free(pool->public_keys);
+    free(pool);
+}
+
+static CK_RV key_pool_start(struct session_pool *sessions,
+                            CK_MECHANISM_PTR mechanism,
+                            CK_ATTRIBUTE_PTR public_template,
+                            CK_ULONG public_attribute_count,
+                            CK_ATTRIBUTE_PTR template,
+                            CK_ULONG attribute_count,
+                            CK_BBOOL key_pair,
+                            CK_ULONG low_watermark,
+                            CK_ULONG high_watermark,
+                            struct key_pool **pool) {
+    struct key_pool *created;
+    CK_RV rv;
+
+    if (!sessions || !mechanism || !pool || 0 == high_watermark || low_watermark > high_watermark) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    created = calloc(1, sizeof(struct key_pool));
+    if (NULL == created) {
+        return CKR_HOST_MEMORY;
+    }
+
+    created->sessions = sessions;
+    created->key_pair = key_pair;
+    created->low_watermark = low_watermark;
+    created->high_watermark = high_watermark;
+    created->refill_requested = CK_TRUE;
+    created->mechanism.mechanism = mechanism->mechanism;
+    if (mechanism->ulParameterLen > 0) {
+        created->mechanism.pParameter = malloc(mechanism->ulParameterLen);
+        if (NULL == created->mechanism.pParameter) {
+            key_pool_free(created);
+            return CKR_HOST_MEMORY;
+        }
+        memcpy(created->mechanism.pParameter, mechanism->pParameter, mechanism->ulParameterLen);
+        created->mechanism.ulParameterLen = mechanism->ulParameterLen;
+    }
+
+    rv = key_template_copy(template, attribute_count, &created->template);
+    if (CKR_OK == rv && key_pair) {
+        rv = key_template_copy(public_template, public_attribute_count, &created->public_template);
+    }
+    if (CKR_OK != rv) {
+        key_pool_free(created);
+        return rv;
+    }
+
+    created->keys = malloc(high_watermark * sizeof(CK_OBJECT_HANDLE));
+    created->public_keys = malloc(high_watermark * sizeof(CK_OBJECT_HANDLE));
+    if (NULL == created->keys || NULL == created->public_keys) {
+        key_pool_free(created);
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = session_pool_acquire(sessions, &created->session);
+    if (CKR_OK != rv) {
+        key_pool_free(created);
+        return rv;
+    }
+
+    pthread_mutex_init(&created->lock, NULL);
+    pthread_cond_init(&created->refill, NULL);
+    pthread_cond_init(&created->filled, NULL);
+
+    if (0 != pthread_create(&created->thread, NULL, key_pool_refill_run, created)) {
+        session_pool_release(sessions, created->session);
+        pthread_cond_destroy(&created->filled);
+        pthread_cond_destroy(&created->refill);
+        pthread_mutex_destroy(&created->lock);
+        key_pool_free(created);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    *pool = created;
+    return CKR_OK;
+}
+
+/**
+ * Create a pool of secret keys, which starts filling in the background.
+ * @param sessions Session pool to take the generating session from
+ * @param mechanism Key generation mechanism, such as CKM_AES_KEY_GEN
+ * @param template
+ * @param attribute_count
+ * @param low_watermark Refill when fewer keys are left
+ * @param high_watermark Number of keys a refill generates up to
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV key_pool_create(struct session_pool *sessions,
+                      CK_MECHANISM_PTR mechanism,
+                      CK_ATTRIBUTE_PTR template,
+                      CK_ULONG attribute_count,
+                      CK_ULONG low_watermark,
+                      CK_ULONG high_watermark,
+                      struct key_pool **pool) {
+    return key_pool_start(sessions, mechanism, NULL, 0, template, attribute_count, CK_FALSE,
+                          low_watermark, high_watermark, pool);
+}
+
+/**
+ * Create a pool of key pairs, such as EC keys for ECDH, which starts filling in the background.
+ * @param sessions Session pool to take the generating session from
+ * @param mechanism Key pair generation mechanism, such as CKM_EC_KEY_PAIR_GEN
+ * @param public_template
+ * @param public_attribute_count
+ * @param private_template
+ * @param private_attribute_count
+ * @param low_watermark Refill when fewer key pairs are left
+ * @param high_watermark Number of key pairs a refill generates up to
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV key_pool_create_key_pair(struct session_pool *sessions,
+                               CK_MECHANISM_PTR mechanism,
+                               CK_ATTRIBUTE_PTR public_template,
+                               CK_ULONG public_attribute_count,
+                               CK_ATTRIBUTE_PTR private_template,
+                               CK_ULONG private_attribute_count,
+                               CK_ULONG low_watermark,
+                               CK_ULONG high_watermark,
+                               struct key_pool **pool) {
+    return key_pool_start(sessions, mechanism, public_template, public_attribute_count,
+                          private_template, private_attribute_count, CK_TRUE,
+                          low_watermark, high_watermark, pool);
+}
+
+/**
+ * Take a key from the pool. If the pool is empty, the key is generated on
+ * the caller's session, and lives as long as that session.
+ * @param pool
+ * @param session Session to generate the key on when the pool is empty
+ * @param key Receives the secret key, or the private key of a pair
+ * @param public_key Receives the public key of a pair; may be NULL for secret keys
+ * @return CK_RV
+ */
+CK_RV key_pool_take(struct key_pool *pool,
+                    CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE_PTR key,
+                    CK_OBJECT_HANDLE_PTR public_key) {
+    if (!pool || !key || (pool->key_pair && !public_key)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count > 0) {
+        *key = pool->keys[pool->head];
+        if (public_key) {
+            *public_key = pool->public_keys[pool->head];
+        }
+        pool->head = (pool->head + 1) % pool->high_watermark;
+        pool->count--;
+        pool->taken++;
+        if (pool->count < pool->low_watermark) {
+            pthread_cond_signal(&pool->refill);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_OK;
+    }
+
+    pool->misses++;
+    pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->lock);
+
+    return key_pool_generate(pool, session, key, public_key);
+}
+
+/**
+ * Wait until the pool holds high_watermark keys, for instance before
+ * serving requests.
+ * @param pool
+ * @return CK_RV The error which stopped the refill, if any
+ */
+CK_RV key_pool_wait_full(struct key_pool *pool) {
+    CK_RV rv;
+
+    if (!pool) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < pool->high_watermark) {
+        pool->refill_requested = CK_TRUE;
+        pool->last_error = CKR_OK;
+        pthread_cond_signal(&pool->refill);
+    }
+    while (pool->count < pool->high_watermark && CKR_OK == pool->last_error) {
+        pthread_cond_wait(&pool->filled, &pool->lock);
+    }
+    rv = pool->last_error;
+    pthread_mutex_unlock(&pool->lock);
+    return rv;
+}
+
+void key_pool_stats(struct key_pool *pool, struct key_pool_stats *stats) {
+    if (!pool || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    stats->available = pool->count;
+    stats->generated = pool->generated;
+    stats->taken = pool->taken;
+    stats->misses = pool->misses;
+    stats->last_error = pool->last_error;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stop the refill thread, destroy the keys left in the pool and return the
+ * generating session to the session pool.
+ * @param pool
+ */
+void key_pool_destroy(struct key_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = CK_TRUE;
+    pthread_cond_signal(&pool->refill);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+
+    for (CK_ULONG i = 0; i < pool->count; i++) {
+        CK_ULONG index = (pool->head + i) % pool->high_watermark;
+        funcs->C_DestroyObject(pool->session, pool->keys[index]);
+        if (pool->key_pair) {
+            funcs->C_DestroyObject(pool->session, pool->public_keys[index]);
+        }
+    }
+
+    session_pool_release(pool->sessions, pool->session);
+    pthread_cond_destroy(&pool->filled);
+    pthread_cond_destroy(&pool->refill);
+    pthread_mutex_destroy(&pool->lock);
+    key_pool_free(pool);
+}
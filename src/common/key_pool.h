@@ -0,0 +1,79 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KEY_POOL_H__
+#define __KEY_POOL_H__
+
+#include "common.h"
+#include "session_pool.h"
+
+/*
+ * Pre-generated session keys for one key template.
+ *
+ * A background thread keeps between low_watermark and high_watermark keys
+ * generated, so key_pool_take only pops a handle. When the pool runs dry,
+ * take generates the key on the caller's session instead of waiting.
+ *
+ * Session objects are destroyed with the session that created them, so the
+ * pool holds one session from the session pool for its whole lifetime and
+ * generates every key on it. The keys are visible to every other session of
+ * the application. Keys handed out belong to the caller, who destroys them
+ * after use; keys left in the pool are destroyed by key_pool_destroy.
+ *
+ * Templates must not set CKA_TOKEN to true; CKA_TOKEN false is added if the
+ * template does not set it.
+ */
+struct key_pool;
+
+struct key_pool_stats {
+    CK_ULONG available;
+    // Keys generated by the background thread.
+    CK_ULONG generated;
+    // Keys handed out from the pool.
+    CK_ULONG taken;
+    // Keys generated by key_pool_take because the pool was empty.
+    CK_ULONG misses;
+    CK_RV last_error;
+};
+
+CK_RV key_pool_create(struct session_pool *sessions,
+                      CK_MECHANISM_PTR mechanism,
+                      CK_ATTRIBUTE_PTR template,
+                      CK_ULONG attribute_count,
+                      CK_ULONG low_watermark,
+                      CK_ULONG high_watermark,
+                      struct key_pool **pool);
+CK_RV key_pool_create_key_pair(struct session_pool *sessions,
+                               CK_MECHANISM_PTR mechanism,
+                               CK_ATTRIBUTE_PTR public_template,
+                               CK_ULONG public_attribute_count,
+                               CK_ATTRIBUTE_PTR private_template,
+                               CK_ULONG private_attribute_count,
+                               CK_ULONG low_watermark,
+                               CK_ULONG high_watermark,
+                               struct key_pool **pool);
+
+CK_RV key_pool_take(struct key_pool *pool,
+                    CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE_PTR key,
+                    CK_OBJECT_HANDLE_PTR public_key);
+CK_RV key_pool_wait_full(struct key_pool *pool);
+
+void key_pool_stats(struct key_pool *pool, struct key_pool_stats *stats);
+
+void key_pool_destroy(struct key_pool *pool);
+
+#endif
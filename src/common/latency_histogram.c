@@ -0,0 +1,134 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+
+#include "latency_histogram.h"
+
+/**
+ * Read the monotonic clock.
+ * @return Nanoseconds since an arbitrary point in the past.
+ */
+uint64_t latency_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static unsigned int latency_histogram_index(uint64_t value_ns) {
+    unsigned int msb = 0;
+    unsigned int shift;
+
+    if (value_ns < 2 * LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return (unsigned int) value_ns;
+    }
+
+    for (uint64_t v = value_ns; v > 1; v >>= 1) {
+        msb++;
+    }
+
+    // Keep the top LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1 bits of the value.
+    shift = msb - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+    return shift * LATENCY_HISTOGRAM_SUB_BUCKETS + (unsigned int) (value_ns >> shift);
+}
+
+static uint64_t latency_histogram_value(unsigned int index) {
+    unsigned int shift;
+    uint64_t mantissa;
+
+    if (index < 2 * LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+    mantissa = index % LATENCY_HISTOGRAM_SUB_BUCKETS + LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+    // Report the middle of the bucket.
+    return (mantissa << shift) + ((1ull << shift) >> 1);
+}
+
+void latency_histogram_init(struct latency_histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min_ns = UINT64_MAX;
+}
+
+void latency_histogram_record(struct latency_histogram *histogram, uint64_t value_ns) {
+    histogram->counts[latency_histogram_index(value_ns)]++;
+    histogram->count++;
+    histogram->sum_ns += value_ns;
+    if (value_ns < histogram->min_ns) {
+        histogram->min_ns = value_ns;
+    }
+    if (value_ns > histogram->max_ns) {
+        histogram->max_ns = value_ns;
+    }
+}
+
+void latency_histogram_merge(struct latency_histogram *destination, const struct latency_histogram *source) {
+    for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        destination->counts[i] += source->counts[i];
+    }
+    destination->count += source->count;
+    destination->sum_ns += source->sum_ns;
+    if (source->min_ns < destination->min_ns) {
+        destination->min_ns = source->min_ns;
+    }
+    if (source->max_ns > destination->max_ns) {
+        destination->max_ns = source->max_ns;
+    }
+}
+
+/**
+ * Find the latency below which the given percentage of samples fall.
+ * @param histogram
+ * @param percentile Between 0 and 100, for example 99.9
+ * @return Latency in nanoseconds, or 0 if the histogram is empty.
+ */
+uint64_t latency_histogram_percentile(const struct latency_histogram *histogram, double percentile) {
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    if (0 == histogram->count) {
+        return 0;
+    }
+
+    rank = (uint64_t) (percentile / 100.0 * (double) histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > histogram->count) {
+        rank = histogram->count;
+    }
+
+    for (unsigned int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = latency_histogram_value(i);
+            if (value > histogram->max_ns) {
+                value = histogram->max_ns;
+            }
+            if (value < histogram->min_ns) {
+                value = histogram->min_ns;
+            }
+            return value;
+        }
+    }
+
+    return histogram->max_ns;
+}
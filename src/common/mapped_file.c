@@ -0,0 +1,90 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+// MADV_SEQUENTIAL and MAP_FAILED are BSD additions on some libcs.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapped_file.h"
+
+/**
+ * Call a function on successive windows of a file, in order.
+ * @param path File to read
+ * @param window_size Largest window, or 0 for MAPPED_FILE_DEFAULT_WINDOW
+ * @param callback Called once per window. An error from it stops the walk.
+ * @param context Passed to the callback
+ * @return CKR_FUNCTION_FAILED if the file cannot be opened or mapped, with
+ * errno set, otherwise the first error from the callback, or CKR_OK.
+ */
+CK_RV mapped_file_each_window(const char *path,
+                              CK_ULONG window_size,
+                              mapped_file_callback callback,
+                              void *context) {
+    struct stat info;
+    CK_RV rv = CKR_OK;
+    int fd;
+
+    if (!path || !callback) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (0 == window_size) {
+        window_size = MAPPED_FILE_DEFAULT_WINDOW;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return CKR_FUNCTION_FAILED;
+    }
+    if (0 != fstat(fd, &info)) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return CKR_FUNCTION_FAILED;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // MAPPED_FILE_SPAN is a multiple of the page size, as mmap offsets must be.
+    for (off_t offset = 0; offset < info.st_size && CKR_OK == rv; offset += MAPPED_FILE_SPAN) {
+        size_t span = (size_t) (info.st_size - offset < MAPPED_FILE_SPAN ? info.st_size - offset : MAPPED_FILE_SPAN);
+
+        CK_BYTE_PTR data = mmap(NULL, span, PROT_READ, MAP_PRIVATE, fd, offset);
+        if (MAP_FAILED == data) {
+            rv = CKR_FUNCTION_FAILED;
+            break;
+        }
+        madvise(data, span, MADV_SEQUENTIAL);
+
+        for (size_t position = 0; position < span && CKR_OK == rv; position += window_size) {
+            CK_ULONG length = span - position < window_size ? (CK_ULONG) (span - position) : window_size;
+            rv = callback(context, data + position, length);
+        }
+
+        munmap(data, span);
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return rv;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include "common.h"
+
+/*
+ * Feed a file to multi-part operations without reading it into the heap.
+ *
+ * The file is mapped MAPPED_FILE_SPAN bytes at a time with MADV_SEQUENTIAL,
+ * so the kernel reads ahead of the caller, and each span is unmapped once
+ * it has been consumed. Resident memory stays at about one span however
+ * large the file is, and large files also work with a 32 bit address space.
+ *
+ * Each span is handed out in windows of at most window_size bytes, one per
+ * C_DigestUpdate, C_SignUpdate or similar call. The default window is 16 KiB,
+ * the most data CloudHSM takes in a single request, so every update is one
+ * round trip and the library never has to split it.
+ *
+ * The file must not be truncated while it is mapped, or reading the missing
+ * pages raises SIGBUS.
+ */
+#define MAPPED_FILE_DEFAULT_WINDOW 16384
+#define MAPPED_FILE_SPAN (8 * 1024 * 1024)
+
+typedef CK_RV (*mapped_file_callback)(void *context, CK_BYTE_PTR window, CK_ULONG window_length);
+
+CK_RV mapped_file_each_window(const char *path,
+                              CK_ULONG window_size,
+                              mapped_file_callback callback,
+                              void *context);
+
+#endif
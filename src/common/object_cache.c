@@ -0,0 +1,529 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "object_cache.h"
+#include "latency_histogram.h"
+
+#define OBJECT_CACHE_MAX_ENTRIES 1024
+#define OBJECT_CACHE_READER_SLOTS 128
+#define CACHE_LINE_SIZE 64
+
+// Cacheable templates hold each of these attributes at most once.
+static const CK_ATTRIBUTE_TYPE cacheable_types[] = { CKA_CLASS, CKA_KEY_TYPE, CKA_ID, CKA_LABEL };
+#define CACHEABLE_TYPE_COUNT (sizeof(cacheable_types) / sizeof(cacheable_types[0]))
+
+struct cache_entry {
+    uint64_t hash;
+    uint64_t expires_ns;
+    // Canonical template: (type, length, value) for each attribute, ordered by type.
+    CK_BYTE_PTR key;
+    CK_ULONG key_length;
+    CK_OBJECT_HANDLE_PTR handles;
+    CK_ULONG handle_count;
+};
+
+/*
+ * An immutable set of entries, allocated as one block and sorted by hash.
+ * Snapshots are replaced as a whole, never modified in place.
+ */
+struct cache_snapshot {
+    CK_ULONG count;
+    struct cache_entry entries[];
+};
+
+struct retired_snapshot {
+    struct cache_snapshot *snapshot;
+    unsigned long epoch;
+    struct retired_snapshot *next;
+};
+
+/*
+ * A reader publishes the epoch it entered in, or 0 while outside the cache.
+ * A snapshot retired in epoch t can be freed once no reader is in an epoch <= t.
+ */
+struct reader_slot {
+    atomic_ulong epoch;
+    atomic_int in_use;
+    char padding[CACHE_LINE_SIZE - sizeof(atomic_ulong) - sizeof(atomic_int)];
+};
+
+static struct cache_snapshot *_Atomic current_snapshot;
+static atomic_ulong global_epoch = 1;
+static atomic_ulong cache_ttl_ms = OBJECT_CACHE_DEFAULT_TTL_MS;
+static struct reader_slot reader_slots[OBJECT_CACHE_READER_SLOTS];
+
+// Serializes writers, and readers which could not get a slot.
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct retired_snapshot *retired;
+
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+static void reader_slot_release(void *value) {
+    struct reader_slot *slot = value;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->in_use, 0);
+}
+
+static void reader_slot_key_create(void) {
+    pthread_key_create(&slot_key, reader_slot_release);
+}
+
+/**
+ * The calling thread's reader slot, claimed on first use and released when the thread exits.
+ * @return NULL if every slot is taken.
+ */
+static struct reader_slot *reader_slot_get(void) {
+    struct reader_slot *slot;
+
+    pthread_once(&slot_key_once, reader_slot_key_create);
+    slot = pthread_getspecific(slot_key);
+    if (slot) {
+        return slot;
+    }
+
+    for (size_t i = 0; i < OBJECT_CACHE_READER_SLOTS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&reader_slots[i].in_use, &expected, 1)) {
+            if (0 != pthread_setspecific(slot_key, &reader_slots[i])) {
+                atomic_store(&reader_slots[i].in_use, 0);
+                return NULL;
+            }
+            return &reader_slots[i];
+        }
+    }
+    return NULL;
+}
+
+static uint64_t cache_hash(CK_BYTE_PTR data, CK_ULONG length) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (CK_ULONG i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+ * Serialize a template into its canonical form, so templates with the same
+ * attributes in a different order share an entry.
+ * @param key Receives a buffer the caller must free
+ * @return CK_FALSE if the template can not be cached
+ */
+static CK_BBOOL cache_key(CK_ATTRIBUTE_PTR template, CK_ULONG attribute_count,
+                          CK_BYTE_PTR *key, CK_ULONG_PTR key_length) {
+    CK_ATTRIBUTE_PTR ordered[CACHEABLE_TYPE_COUNT] = { NULL };
+    CK_ULONG length = 0;
+    CK_BYTE_PTR out;
+
+    if (!template || 0 == attribute_count || attribute_count > CACHEABLE_TYPE_COUNT) {
+        return CK_FALSE;
+    }
+
+    for (CK_ULONG i = 0; i < attribute_count; i++) {
+        size_t t;
+        for (t = 0; t < CACHEABLE_TYPE_COUNT && cacheable_types[t] != template[i].type; t++) {
+        }
+        if (t == CACHEABLE_TYPE_COUNT || ordered[t] || (!template[i].pValue && template[i].ulValueLen > 0)) {
+            return CK_FALSE;
+        }
+        ordered[t] = &template[i];
+        length += 2 * sizeof(CK_ULONG) + template[i].ulValueLen;
+    }
+
+    out = malloc(length);
+    if (NULL == out) {
+        return CK_FALSE;
+    }
+
+    *key = out;
+    *key_length = length;
+    for (size_t t = 0; t < CACHEABLE_TYPE_COUNT; t++) {
+        if (!ordered[t]) {
+            continue;
+        }
+        memcpy(out, &ordered[t]->type, sizeof(CK_ULONG));
+        memcpy(out + sizeof(CK_ULONG), &ordered[t]->ulValueLen, sizeof(CK_ULONG));
+        if (ordered[t]->ulValueLen > 0) {
+            memcpy(out + 2 * sizeof(CK_ULONG), ordered[t]->pValue, ordered[t]->ulValueLen);
+        }
+        out += 2 * sizeof(CK_ULONG) + ordered[t]->ulValueLen;
+    }
+    return CK_TRUE;
+}
+
+static const struct cache_entry *snapshot_find(const struct cache_snapshot *snapshot, uint64_t hash,
+                                               CK_BYTE_PTR key, CK_ULONG key_length) {
+    CK_ULONG low = 0;
+    CK_ULONG high;
+
+    if (!snapshot) {
+        return NULL;
+    }
+
+    // Find the first entry with the hash, then compare keys among equal hashes.
+    high = snapshot->count;
+    while (low < high) {
+        CK_ULONG middle = low + (high - low) / 2;
+        if (snapshot->entries[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (; low < snapshot->count && snapshot->entries[low].hash == hash; low++) {
+        const struct cache_entry *entry = &snapshot->entries[low];
+        if (entry->key_length == key_length && 0 == memcmp(entry->key, key, key_length)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static int entry_compare(const void *a, const void *b) {
+    const struct cache_entry *left = a;
+    const struct cache_entry *right = b;
+    return (left->hash > right->hash) - (left->hash < right->hash);
+}
+
+static size_t entry_data_size(const struct cache_entry *entry) {
+    size_t size = entry->handle_count * sizeof(CK_OBJECT_HANDLE) + entry->key_length;
+    return (size + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+}
+
+/**
+ * Copy entries into a new snapshot block.
+ * @return NULL if there are no entries or memory is short.
+ */
+static struct cache_snapshot *snapshot_build(const struct cache_entry **entries, CK_ULONG count) {
+    struct cache_snapshot *snapshot;
+    size_t size = sizeof(struct cache_snapshot) + count * sizeof(struct cache_entry);
+    CK_BYTE_PTR data;
+
+    if (0 == count) {
+        return NULL;
+    }
+    for (CK_ULONG i = 0; i < count; i++) {
+        size += entry_data_size(entries[i]);
+    }
+
+    snapshot = malloc(size);
+    if (NULL == snapshot) {
+        return NULL;
+    }
+
+    snapshot->count = count;
+    data = (CK_BYTE_PTR) &snapshot->entries[count];
+    for (CK_ULONG i = 0; i < count; i++) {
+        struct cache_entry *entry = &snapshot->entries[i];
+
+        *entry = *entries[i];
+        entry->handles = (CK_OBJECT_HANDLE_PTR) data;
+        memcpy(entry->handles, entries[i]->handles, entry->handle_count * sizeof(CK_OBJECT_HANDLE));
+        entry->key = data + entry->handle_count * sizeof(CK_OBJECT_HANDLE);
+        memcpy(entry->key, entries[i]->key, entry->key_length);
+        data += entry_data_size(entry);
+    }
+
+    qsort(snapshot->entries, count, sizeof(struct cache_entry), entry_compare);
+    return snapshot;
+}
+
+/**
+ * Free retired snapshots no reader can still hold. Called with the writer lock held.
+ */
+static void snapshot_reclaim(void) {
+    unsigned long oldest = ~0ul;
+    struct retired_snapshot **link = &retired;
+
+    for (size_t i = 0; i < OBJECT_CACHE_READER_SLOTS; i++) {
+        unsigned long epoch = atomic_load(&reader_slots[i].epoch);
+        if (0 != epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    while (*link) {
+        struct retired_snapshot *entry = *link;
+        if (entry->epoch < oldest) {
+            *link = entry->next;
+            free(entry->snapshot);
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+/**
+ * Replace the current snapshot. Called with the writer lock held.
+ */
+static void snapshot_publish(struct cache_snapshot *snapshot) {
+    struct cache_snapshot *old = atomic_exchange(&current_snapshot, snapshot);
+
+    // Readers entering from now on see the new snapshot, and a later epoch.
+    unsigned long epoch = atomic_fetch_add(&global_epoch, 1);
+
+    if (old) {
+        struct retired_snapshot *entry = malloc(sizeof(struct retired_snapshot));
+        if (NULL == entry) {
+            // Leaking is safer than freeing a snapshot a reader may hold.
+            return;
+        }
+        entry->snapshot = old;
+        entry->epoch = epoch;
+        entry->next = retired;
+        retired = entry;
+    }
+    snapshot_reclaim();
+}
+
+typedef CK_BBOOL (*entry_filter)(const struct cache_entry *entry, const void *context);
+
+/**
+ * Publish a snapshot without the expired entries and the entries the filter
+ * rejects, plus an optional new entry. Called with the writer lock held.
+ */
+static void snapshot_rewrite(entry_filter keep, const void *context, const struct cache_entry *added) {
+    struct cache_snapshot *snapshot = atomic_load(&current_snapshot);
+    CK_ULONG old_count = snapshot ? snapshot->count : 0;
+    const struct cache_entry **entries;
+    CK_ULONG count = 0;
+    uint64_t now = latency_now_ns();
+
+    entries = malloc((old_count + 1) * sizeof(struct cache_entry *));
+    if (NULL == entries) {
+        return;
+    }
+
+    for (CK_ULONG i = 0; i < old_count; i++) {
+        const struct cache_entry *entry = &snapshot->entries[i];
+        if (entry->expires_ns <= now || (keep && !keep(entry, context))) {
+            continue;
+        }
+        entries[count++] = entry;
+    }
+
+    if (added) {
+        // Evict the entry closest to expiry when the cache is full.
+        if (count >= OBJECT_CACHE_MAX_ENTRIES) {
+            CK_ULONG oldest = 0;
+            for (CK_ULONG i = 1; i < count; i++) {
+                if (entries[i]->expires_ns < entries[oldest]->expires_ns) {
+                    oldest = i;
+                }
+            }
+            entries[oldest] = entries[--count];
+        }
+        entries[count++] = added;
+    }
+
+    // On allocation failure the new snapshot is empty, which only costs lookups.
+    snapshot_publish(snapshot_build(entries, count));
+    free(entries);
+}
+
+/**
+ * Look up the handles a search template found earlier.
+ * @param template
+ * @param attribute_count
+ * @param handles Receives a copy of the handles, which the caller must free
+ * @param handle_count
+ * @return CK_TRUE on a hit
+ */
+CK_BBOOL object_cache_get(CK_ATTRIBUTE_PTR template,
+                          CK_ULONG attribute_count,
+                          CK_OBJECT_HANDLE_PTR *handles,
+                          CK_ULONG_PTR handle_count) {
+    CK_BYTE_PTR key = NULL;
+    CK_ULONG key_length = 0;
+    CK_BBOOL hit = CK_FALSE;
+    struct reader_slot *slot;
+
+    if (!handles || !handle_count || 0 == atomic_load(&cache_ttl_ms)) {
+        return CK_FALSE;
+    }
+    if (!cache_key(template, attribute_count, &key, &key_length)) {
+        return CK_FALSE;
+    }
+    uint64_t hash = cache_hash(key, key_length);
+    uint64_t now = latency_now_ns();
+
+    slot = reader_slot_get();
+    if (slot) {
+        atomic_store(&slot->epoch, atomic_load(&global_epoch));
+    } else {
+        pthread_mutex_lock(&writer_lock);
+    }
+
+    const struct cache_entry *entry = snapshot_find(atomic_load(&current_snapshot), hash, key, key_length);
+    if (entry && entry->expires_ns > now) {
+        *handles = malloc(entry->handle_count * sizeof(CK_OBJECT_HANDLE));
+        if (*handles) {
+            memcpy(*handles, entry->handles, entry->handle_count * sizeof(CK_OBJECT_HANDLE));
+            *handle_count = entry->handle_count;
+            hit = CK_TRUE;
+        }
+    }
+
+    if (slot) {
+        atomic_store(&slot->epoch, 0);
+    } else {
+        pthread_mutex_unlock(&writer_lock);
+    }
+
+    free(key);
+    return hit;
+}
+
+static CK_BBOOL entry_key_differs(const struct cache_entry *entry, const void *context) {
+    const struct cache_entry *added = context;
+    return entry->key_length != added->key_length || 0 != memcmp(entry->key, added->key, added->key_length);
+}
+
+/**
+ * Remember the handles a search template found. Empty results are not
+ * cached, so a key created later is found by the next search.
+ * @param template
+ * @param attribute_count
+ * @param handles
+ * @param handle_count
+ */
+void object_cache_put(CK_ATTRIBUTE_PTR template,
+                      CK_ULONG attribute_count,
+                      CK_OBJECT_HANDLE_PTR handles,
+                      CK_ULONG handle_count) {
+    struct cache_entry added;
+    unsigned long ttl_ms = atomic_load(&cache_ttl_ms);
+
+    if (!handles || 0 == handle_count || 0 == ttl_ms) {
+        return;
+    }
+    if (!cache_key(template, attribute_count, &added.key, &added.key_length)) {
+        return;
+    }
+    added.hash = cache_hash(added.key, added.key_length);
+    added.expires_ns = latency_now_ns() + (uint64_t) ttl_ms * 1000000ull;
+    added.handles = handles;
+    added.handle_count = handle_count;
+
+    pthread_mutex_lock(&writer_lock);
+    snapshot_rewrite(entry_key_differs, &added, &added);
+    pthread_mutex_unlock(&writer_lock);
+
+    free(added.key);
+}
+
+/**
+ * Change how long entries stay valid. Entries already cached keep their expiry.
+ * @param ttl_ms 0 turns the cache off
+ */
+void object_cache_set_ttl(CK_ULONG ttl_ms) {
+    atomic_store(&cache_ttl_ms, ttl_ms);
+    if (0 == ttl_ms) {
+        object_cache_clear();
+    }
+}
+
+static CK_BBOOL entry_lacks_handle(const struct cache_entry *entry, const void *context) {
+    CK_OBJECT_HANDLE handle = *(const CK_OBJECT_HANDLE *) context;
+    for (CK_ULONG i = 0; i < entry->handle_count; i++) {
+        if (entry->handles[i] == handle) {
+            return CK_FALSE;
+        }
+    }
+    return CK_TRUE;
+}
+
+/**
+ * Drop every entry which found the handle. Call this when the object is destroyed.
+ * @param handle
+ */
+void object_cache_invalidate_handle(CK_OBJECT_HANDLE handle) {
+    pthread_mutex_lock(&writer_lock);
+    if (atomic_load(&current_snapshot)) {
+        snapshot_rewrite(entry_lacks_handle, &handle, NULL);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+struct attribute_list {
+    CK_ATTRIBUTE_PTR attributes;
+    CK_ULONG count;
+};
+
+/**
+ * Keep an entry only if some attribute of its template has a different
+ * value on the new object, so the search could not match it. Attributes the
+ * new object does not list are assumed to match.
+ */
+static CK_BBOOL entry_excludes_object(const struct cache_entry *entry, const void *context) {
+    const struct attribute_list *object = context;
+    CK_BYTE_PTR position = entry->key;
+    CK_BYTE_PTR end = entry->key + entry->key_length;
+
+    while (position < end) {
+        CK_ATTRIBUTE_TYPE type;
+        CK_ULONG length;
+
+        memcpy(&type, position, sizeof(CK_ULONG));
+        memcpy(&length, position + sizeof(CK_ULONG), sizeof(CK_ULONG));
+        position += 2 * sizeof(CK_ULONG);
+
+        for (CK_ULONG i = 0; i < object->count; i++) {
+            CK_ATTRIBUTE_PTR attribute = &object->attributes[i];
+            if (attribute->type == type
+                && (attribute->ulValueLen != length || 0 != memcmp(attribute->pValue, position, length))) {
+                return CK_TRUE;
+            }
+        }
+        position += length;
+    }
+    return CK_FALSE;
+}
+
+/**
+ * Drop every entry whose search could match a new object. Call this after
+ * generating, importing or unwrapping a key, with the attributes of its template.
+ * @param attributes
+ * @param attribute_count
+ */
+void object_cache_invalidate_matching(CK_ATTRIBUTE_PTR attributes, CK_ULONG attribute_count) {
+    struct attribute_list object = { attributes, attributes ? attribute_count : 0 };
+
+    pthread_mutex_lock(&writer_lock);
+    if (atomic_load(&current_snapshot)) {
+        snapshot_rewrite(entry_excludes_object, &object, NULL);
+    }
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Drop every entry. Handles are only valid within one C_Initialize, so this
+ * runs when the library is finalized.
+ */
+void object_cache_clear(void) {
+    pthread_mutex_lock(&writer_lock);
+    snapshot_publish(NULL);
+    pthread_mutex_unlock(&writer_lock);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __OBJECT_CACHE_H__
+#define __OBJECT_CACHE_H__
+
+#include "common.h"
+
+/*
+ * Process-wide cache of object searches.
+ *
+ * Resolving a key by label takes a C_FindObjectsInit, C_FindObjects and
+ * C_FindObjectsFinal round trip each. The cache remembers the handles a
+ * search template found, for templates made only of CKA_LABEL, CKA_CLASS,
+ * CKA_KEY_TYPE and CKA_ID. Entries expire after a TTL, which bounds how long
+ * changes made by other processes go unnoticed. Changes made through this
+ * process are reported with the invalidation functions.
+ *
+ * The cache is read-mostly. Lookups read an immutable snapshot without
+ * taking a lock; updates copy the snapshot and publish the copy, and old
+ * snapshots are freed once no reader can still be using them.
+ */
+#define OBJECT_CACHE_DEFAULT_TTL_MS 60000
+
+CK_BBOOL object_cache_get(CK_ATTRIBUTE_PTR template,
+                          CK_ULONG attribute_count,
+                          CK_OBJECT_HANDLE_PTR *handles,
+                          CK_ULONG_PTR handle_count);
+void object_cache_put(CK_ATTRIBUTE_PTR template,
+                      CK_ULONG attribute_count,
+                      CK_OBJECT_HANDLE_PTR handles,
+                      CK_ULONG handle_count);
+
+void object_cache_set_ttl(CK_ULONG ttl_ms);
+
+void object_cache_invalidate_handle(CK_OBJECT_HANDLE handle);
+void object_cache_invalidate_matching(CK_ATTRIBUTE_PTR attributes, CK_ULONG attribute_count);
+void object_cache_clear(void);
+
+#endif
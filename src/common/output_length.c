@@ -0,0 +1,293 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+
+#include "output_length.h"
+
+#define AES_BLOCK_BYTES 16
+#define DES_BLOCK_BYTES 8
+#define AES_KEY_WRAP_BLOCK_BYTES 8
+#define DEFAULT_TAG_BYTES 16
+
+static CK_ULONG round_up(CK_ULONG length, CK_ULONG block) {
+    return (length + block - 1) / block * block;
+}
+
+static CK_ULONG digest_length(CK_MECHANISM_TYPE mechanism) {
+    switch (mechanism) {
+        case CKM_MD5:
+        case CKM_MD5_HMAC:
+            return 16;
+        case CKM_SHA_1:
+        case CKM_SHA_1_HMAC:
+            return 20;
+        case CKM_SHA224:
+        case CKM_SHA224_HMAC:
+            return 28;
+        case CKM_SHA256:
+        case CKM_SHA256_HMAC:
+            return 32;
+        case CKM_SHA384:
+        case CKM_SHA384_HMAC:
+            return 48;
+        case CKM_SHA512:
+        case CKM_SHA512_HMAC:
+            return 64;
+        default:
+            return 0;
+    }
+}
+
+static CK_ULONG rsa_length(CK_ULONG key_length) {
+    return key_length ? key_length : PKCS11_MAX_RSA_MODULUS_BYTES;
+}
+
+static CK_ULONG gcm_tag_length(CK_MECHANISM_PTR mechanism) {
+    if (mechanism->pParameter && mechanism->ulParameterLen == sizeof(CK_GCM_PARAMS)) {
+        return ((CK_GCM_PARAMS_PTR) mechanism->pParameter)->ulTagBits / 8;
+    }
+    return DEFAULT_TAG_BYTES;
+}
+
+static CK_ULONG encrypt_length(CK_MECHANISM_PTR mechanism, CK_ULONG key_length, CK_ULONG input_length) {
+    switch (mechanism->mechanism) {
+        case CKM_AES_ECB:
+        case CKM_AES_CBC:
+        case CKM_AES_CTR:
+        case CKM_DES3_ECB:
+        case CKM_DES3_CBC:
+            return input_length;
+        case CKM_AES_CBC_PAD:
+            return round_up(input_length + 1, AES_BLOCK_BYTES);
+        case CKM_DES3_CBC_PAD:
+            return round_up(input_length + 1, DES_BLOCK_BYTES);
+        case CKM_AES_GCM:
+            return input_length + gcm_tag_length(mechanism);
+        case CKM_RSA_PKCS:
+        case CKM_RSA_PKCS_OAEP:
+        case CKM_RSA_X_509:
+            return rsa_length(key_length);
+        default:
+            return 0;
+    }
+}
+
+static CK_ULONG sign_length(CK_MECHANISM_PTR mechanism, CK_ULONG key_length) {
+    switch (mechanism->mechanism) {
+        case CKM_SHA_1_HMAC_GENERAL:
+        case CKM_SHA224_HMAC_GENERAL:
+        case CKM_SHA256_HMAC_GENERAL:
+        case CKM_SHA384_HMAC_GENERAL:
+        case CKM_SHA512_HMAC_GENERAL:
+        case CKM_AES_CMAC_GENERAL:
+            if (mechanism->pParameter && mechanism->ulParameterLen == sizeof(CK_MAC_GENERAL_PARAMS)) {
+                return *(CK_MAC_GENERAL_PARAMS_PTR) mechanism->pParameter;
+            }
+            return 0;
+        case CKM_AES_CMAC:
+            return AES_BLOCK_BYTES;
+        case CKM_RSA_PKCS:
+        case CKM_RSA_X_509:
+        case CKM_RSA_PKCS_PSS:
+        case CKM_SHA1_RSA_PKCS:
+        case CKM_SHA224_RSA_PKCS:
+        case CKM_SHA256_RSA_PKCS:
+        case CKM_SHA384_RSA_PKCS:
+        case CKM_SHA512_RSA_PKCS:
+        case CKM_SHA1_RSA_PKCS_PSS:
+        case CKM_SHA224_RSA_PKCS_PSS:
+        case CKM_SHA256_RSA_PKCS_PSS:
+        case CKM_SHA384_RSA_PKCS_PSS:
+        case CKM_SHA512_RSA_PKCS_PSS:
+            return rsa_length(key_length);
+        case CKM_ECDSA:
+        case CKM_ECDSA_SHA1:
+        case CKM_ECDSA_SHA224:
+        case CKM_ECDSA_SHA256:
+        case CKM_ECDSA_SHA384:
+        case CKM_ECDSA_SHA512:
+            // The signature is r || s, each as long as the curve's field.
+            return 2 * (key_length ? key_length : PKCS11_MAX_EC_FIELD_BYTES);
+        default:
+            return digest_length(mechanism->mechanism);
+    }
+}
+
+static CK_ULONG wrap_length(CK_MECHANISM_PTR mechanism, CK_ULONG key_length, CK_ULONG input_length) {
+    CK_ULONG material = input_length ? input_length : PKCS11_MAX_KEY_MATERIAL_BYTES;
+
+    switch (mechanism->mechanism) {
+        case CKM_AES_KEY_WRAP:
+        case CKM_AES_KEY_WRAP_PAD:
+        case CKM_CLOUDHSM_AES_KEY_WRAP_NO_PAD:
+        case CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD:
+        case CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD:
+            // Padding adds up to one block, and RFC 3394 adds its integrity block.
+            return round_up(material + 1, AES_KEY_WRAP_BLOCK_BYTES) + AES_KEY_WRAP_BLOCK_BYTES;
+        case CKM_AES_GCM:
+            return material + gcm_tag_length(mechanism);
+        case CKM_RSA_PKCS:
+        case CKM_RSA_PKCS_OAEP:
+            return rsa_length(key_length);
+        case CKM_RSA_AES_KEY_WRAP:
+            return rsa_length(key_length)
+                   + round_up(material + 1, AES_KEY_WRAP_BLOCK_BYTES) + AES_KEY_WRAP_BLOCK_BYTES;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Compute an upper bound on the output of a single-part operation.
+ * @param operation
+ * @param mechanism Mechanism passed to the Init call, with its parameters
+ * @param key_length Modulus length in bytes for RSA, field length in bytes for EC.
+ * 0 if unknown, in which case the largest supported key is assumed.
+ * @param input_length Length of the data. When wrapping, the length of the key
+ * material, or 0 if unknown.
+ * @return The bound in bytes, or 0 if the mechanism is not known.
+ */
+CK_ULONG pkcs11_max_output_length(enum pkcs11_operation operation,
+                                  CK_MECHANISM_PTR mechanism,
+                                  CK_ULONG key_length,
+                                  CK_ULONG input_length) {
+    if (!mechanism) {
+        return 0;
+    }
+
+    switch (operation) {
+        case PKCS11_OPERATION_ENCRYPT:
+            return encrypt_length(mechanism, key_length, input_length);
+        case PKCS11_OPERATION_DECRYPT:
+            // No supported mechanism's plaintext is longer than its ciphertext.
+            return input_length;
+        case PKCS11_OPERATION_DIGEST:
+            return digest_length(mechanism->mechanism);
+        case PKCS11_OPERATION_SIGN:
+            return sign_length(mechanism, key_length);
+        case PKCS11_OPERATION_WRAP:
+            return wrap_length(mechanism, key_length, input_length);
+        default:
+            return 0;
+    }
+}
+
+static CK_RV reserve(CK_BYTE_PTR *output, CK_ULONG_PTR output_capacity, CK_ULONG length) {
+    CK_BYTE_PTR larger;
+
+    if (*output && length <= *output_capacity) {
+        return CKR_OK;
+    }
+
+    // Some mechanisms have empty output; keep the buffer pointer valid anyway.
+    larger = realloc(*output, length ? length : 1);
+    if (NULL == larger) {
+        return CKR_HOST_MEMORY;
+    }
+    *output = larger;
+    *output_capacity = length;
+    return CKR_OK;
+}
+
+/**
+ * Finish an initialized single-part operation with one call.
+ * Works with C_Encrypt, C_Decrypt, C_Digest and C_Sign, which share a signature.
+ * If the buffer turns out too small, it is grown to the length the library
+ * reports and the call is repeated; the operation stays active in between.
+ * @param function One of funcs->C_Encrypt, C_Decrypt, C_Digest or C_Sign
+ * @param session Session with the matching operation initialized
+ * @param input
+ * @param input_length
+ * @param output Buffer from malloc, or NULL to allocate *output_capacity bytes.
+ * The caller frees it, and may reuse it for the next call.
+ * @param output_capacity Size of *output, usually from pkcs11_max_output_length.
+ * Updated when the buffer grows.
+ * @param output_length Receives the length of the output
+ * @return CK_RV
+ */
+CK_RV pkcs11_single_part(CK_C_Encrypt function,
+                         CK_SESSION_HANDLE session,
+                         CK_BYTE_PTR input,
+                         CK_ULONG input_length,
+                         CK_BYTE_PTR *output,
+                         CK_ULONG_PTR output_capacity,
+                         CK_ULONG_PTR output_length) {
+    CK_RV rv;
+
+    if (!function || !output || !output_capacity || !output_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    rv = reserve(output, output_capacity, *output_capacity);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    *output_length = *output_capacity;
+    rv = function(session, input, input_length, *output, output_length);
+    if (CKR_BUFFER_TOO_SMALL != rv) {
+        return rv;
+    }
+
+    rv = reserve(output, output_capacity, *output_length);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return function(session, input, input_length, *output, output_length);
+}
+
+/**
+ * Wrap a key with one call, the same way pkcs11_single_part finishes an operation.
+ * @param session
+ * @param mechanism
+ * @param wrapping_key
+ * @param key
+ * @param output Buffer from malloc, or NULL to allocate *output_capacity bytes
+ * @param output_capacity Size of *output, usually from pkcs11_max_output_length
+ * @param output_length Receives the length of the wrapped key
+ * @return CK_RV
+ */
+CK_RV pkcs11_wrap_key(CK_SESSION_HANDLE session,
+                      CK_MECHANISM_PTR mechanism,
+                      CK_OBJECT_HANDLE wrapping_key,
+                      CK_OBJECT_HANDLE key,
+                      CK_BYTE_PTR *output,
+                      CK_ULONG_PTR output_capacity,
+                      CK_ULONG_PTR output_length) {
+    CK_RV rv;
+
+    if (!output || !output_capacity || !output_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    rv = reserve(output, output_capacity, *output_capacity);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    *output_length = *output_capacity;
+    rv = funcs->C_WrapKey(session, mechanism, wrapping_key, key, *output, output_length);
+    if (CKR_BUFFER_TOO_SMALL != rv) {
+        return rv;
+    }
+
+    rv = reserve(output, output_capacity, *output_length);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return funcs->C_WrapKey(session, mechanism, wrapping_key, key, *output, output_length);
+}
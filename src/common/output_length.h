@@ -0,0 +1,68 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __OUTPUT_LENGTH_H__
+#define __OUTPUT_LENGTH_H__
+
+#include "common.h"
+
+/*
+ * Output buffer sizing without a round trip.
+ *
+ * Calling C_Encrypt, C_Sign, C_WrapKey and friends with a NULL buffer to
+ * learn the output length costs a full round trip to the HSM. The length
+ * can almost always be bounded locally from the mechanism, the key size and
+ * the input length, so these helpers size the buffer up front and make a
+ * single call. They only fall back to the library's length when it returns
+ * CKR_BUFFER_TOO_SMALL.
+ */
+
+/* Bounds used when the caller does not know the key size. */
+#define PKCS11_MAX_RSA_MODULUS_BYTES 512
+#define PKCS11_MAX_EC_FIELD_BYTES 66
+/* Large enough for the PKCS#8 encoding of a 4096 bit RSA private key. */
+#define PKCS11_MAX_KEY_MATERIAL_BYTES 2560
+
+enum pkcs11_operation {
+    PKCS11_OPERATION_ENCRYPT,
+    PKCS11_OPERATION_DECRYPT,
+    PKCS11_OPERATION_DIGEST,
+    PKCS11_OPERATION_SIGN,
+    PKCS11_OPERATION_WRAP,
+};
+
+CK_ULONG pkcs11_max_output_length(enum pkcs11_operation operation,
+                                  CK_MECHANISM_PTR mechanism,
+                                  CK_ULONG key_length,
+                                  CK_ULONG input_length);
+
+CK_RV pkcs11_single_part(CK_C_Encrypt function,
+                         CK_SESSION_HANDLE session,
+                         CK_BYTE_PTR input,
+                         CK_ULONG input_length,
+                         CK_BYTE_PTR *output,
+                         CK_ULONG_PTR output_capacity,
+                         CK_ULONG_PTR output_length);
+
+CK_RV pkcs11_wrap_key(CK_SESSION_HANDLE session,
+                      CK_MECHANISM_PTR mechanism,
+                      CK_OBJECT_HANDLE wrapping_key,
+                      CK_OBJECT_HANDLE key,
+                      CK_BYTE_PTR *output,
+                      CK_ULONG_PTR output_capacity,
+                      CK_ULONG_PTR output_length);
+
+#endif
@@ -25,6 +25,10 @@
 #endif
 
 #include "common.h"
+#ifndef _WIN32
+#include "object_cache.h"
+#include "pkcs11_trace.h"
+#endif
 
 CK_FUNCTION_LIST *funcs;
 
@@ -83,6 +87,8 @@ CK_RV pkcs11_load_functions(char *library_path) {
         return rv;
     }
 
+    pkcs11_trace_attach();
+
     return CKR_OK;
 }
 #endif
@@ -176,10 +182,80 @@ CK_RV pkcs11_open_session(const CK_UTF8CHAR_PTR pin, CK_SESSION_HANDLE_PTR sessi
 
 /**
  * Logout and finalize the PKCS#11 session.
+ * When tracing is enabled, the statistics are written to stderr afterwards.
+ * Cached object handles are dropped, as they do not outlive the library.
  * @param session
  */
 void pkcs11_finalize_session(CK_SESSION_HANDLE session) {
     funcs->C_Logout(session);
     funcs->C_CloseSession(session);
     funcs->C_Finalize(NULL);
-}
\ No newline at end of file
+
+#ifndef _WIN32
+    object_cache_clear();
+    if (pkcs11_trace_enabled()) {
+        pkcs11_trace_dump(stderr);
+    }
+#endif
+}
+
+/**
+ * Generate a secret key with C_GenerateKey.
+ * Cached searches made before the key existed could now match it, so they
+ * are dropped from the object cache.
+ * @param session
+ * @param mechanism
+ * @param template
+ * @param attribute_count
+ * @param key Receives the new key handle
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+CK_RV pkcs11_generate_key(CK_SESSION_HANDLE session,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_ATTRIBUTE_PTR template,
+                          CK_ULONG attribute_count,
+                          CK_OBJECT_HANDLE_PTR key) {
+    CK_RV rv = funcs->C_GenerateKey(session, mechanism, template, attribute_count, key);
+
+#ifndef _WIN32
+    if (CKR_OK == rv) {
+        object_cache_invalidate_matching(template, attribute_count);
+    }
+#endif
+    return rv;
+}
+
+/**
+ * Generate a key pair with C_GenerateKeyPair, and drop cached searches
+ * that either new key could match.
+ * @param session
+ * @param mechanism
+ * @param public_template
+ * @param public_attribute_count
+ * @param private_template
+ * @param private_attribute_count
+ * @param public_key Receives the public key handle
+ * @param private_key Receives the private key handle
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+CK_RV pkcs11_generate_key_pair(CK_SESSION_HANDLE session,
+                               CK_MECHANISM_PTR mechanism,
+                               CK_ATTRIBUTE_PTR public_template,
+                               CK_ULONG public_attribute_count,
+                               CK_ATTRIBUTE_PTR private_template,
+                               CK_ULONG private_attribute_count,
+                               CK_OBJECT_HANDLE_PTR public_key,
+                               CK_OBJECT_HANDLE_PTR private_key) {
+    CK_RV rv = funcs->C_GenerateKeyPair(session, mechanism,
+                                        public_template, public_attribute_count,
+                                        private_template, private_attribute_count,
+                                        public_key, private_key);
+
+#ifndef _WIN32
+    if (CKR_OK == rv) {
+        object_cache_invalidate_matching(public_template, public_attribute_count);
+        object_cache_invalidate_matching(private_template, private_attribute_count);
+    }
+#endif
+    return rv;
+}
@@ -0,0 +1,537 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pkcs11_async.h"
+
+struct pkcs11_async_request {
+    struct pkcs11_async_request *next;
+    pkcs11_async_operation operation;
+    void *arg;
+    pkcs11_async_callback callback;
+    struct pkcs11_async_future *future;
+    CK_RV rv;
+};
+
+struct pkcs11_async_future {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    CK_BBOOL done;
+    CK_RV rv;
+};
+
+struct pkcs11_async_worker {
+    pthread_t thread;
+    struct pkcs11_async *async;
+    CK_SESSION_HANDLE session;
+};
+
+struct pkcs11_async {
+    struct session_pool *pool;
+
+    // Submitted requests, oldest first. Submitting only takes this lock for
+    // a pointer swap, so it does not block behind HSM round trips.
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct pkcs11_async_request *head;
+    struct pkcs11_async_request *tail;
+    CK_BBOOL stopping;
+
+    // Completed requests which had neither a callback nor a future.
+    pthread_mutex_t completion_lock;
+    struct pkcs11_async_request *completed_head;
+    struct pkcs11_async_request *completed_tail;
+    CK_ULONG unreaped;
+
+    // Readable while completions are queued. Both ends are the same
+    // eventfd on Linux, and a pipe elsewhere.
+    int read_fd;
+    int write_fd;
+
+    struct pkcs11_async_worker *workers;
+    CK_ULONG worker_count;
+
+    atomic_ulong submitted;
+    atomic_ulong started;
+    atomic_ulong completed;
+    atomic_ulong failed;
+};
+
+static int pkcs11_async_open_fd(struct pkcs11_async *async) {
+#ifdef __linux__
+    async->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    async->write_fd = async->read_fd;
+    return async->read_fd < 0 ? -1 : 0;
+#else
+    int fds[2];
+
+    if (0 != pipe(fds)) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    async->read_fd = fds[0];
+    async->write_fd = fds[1];
+    return 0;
+#endif
+}
+
+static void pkcs11_async_signal(struct pkcs11_async *async) {
+    uint64_t one = 1;
+    size_t length = async->read_fd == async->write_fd ? sizeof(one) : 1;
+
+    // A full pipe is already readable, so a failed write loses nothing.
+    if (write(async->write_fd, &one, length) < 0) {
+        return;
+    }
+}
+
+static void pkcs11_async_drain(struct pkcs11_async *async) {
+    uint64_t buffer[8];
+
+    // One read returns and clears an eventfd's counter; a pipe is read until empty.
+    while (read(async->read_fd, buffer, sizeof(buffer)) > 0 && async->read_fd != async->write_fd) {
+    }
+}
+
+static void pkcs11_async_complete(struct pkcs11_async *async, struct pkcs11_async_request *request) {
+    CK_BBOOL signal = CK_FALSE;
+
+    if (CKR_OK != request->rv) {
+        atomic_fetch_add(&async->failed, 1);
+    }
+    atomic_fetch_add(&async->completed, 1);
+
+    if (request->callback) {
+        request->callback(request->arg, request->rv);
+        free(request);
+    } else if (request->future) {
+        struct pkcs11_async_future *future = request->future;
+
+        pthread_mutex_lock(&future->lock);
+        future->rv = request->rv;
+        future->done = CK_TRUE;
+        pthread_cond_broadcast(&future->done_cond);
+        pthread_mutex_unlock(&future->lock);
+        free(request);
+    } else {
+        request->next = NULL;
+        pthread_mutex_lock(&async->completion_lock);
+        if (async->completed_tail) {
+            async->completed_tail->next = request;
+        } else {
+            async->completed_head = request;
+            signal = CK_TRUE;
+        }
+        async->completed_tail = request;
+        async->unreaped++;
+        pthread_mutex_unlock(&async->completion_lock);
+
+        // Only the first completion in an empty queue needs to wake the
+        // event loop; pkcs11_async_reap signals again if it leaves any behind.
+        if (signal) {
+            pkcs11_async_signal(async);
+        }
+    }
+}
+
+static void *pkcs11_async_worker_run(void *arg) {
+    struct pkcs11_async_worker *worker = arg;
+    struct pkcs11_async *async = worker->async;
+
+    for (;;) {
+        struct pkcs11_async_request *request;
+
+        pthread_mutex_lock(&async->lock);
+        while (NULL == async->head && !async->stopping) {
+            pthread_cond_wait(&async->queued, &async->lock);
+        }
+        request = async->head;
+        if (NULL == request) {
+            pthread_mutex_unlock(&async->lock);
+            break;
+        }
+        async->head = request->next;
+        if (NULL == async->head) {
+            async->tail = NULL;
+        }
+        pthread_mutex_unlock(&async->lock);
+
+        atomic_fetch_add(&async->started, 1);
+        request->rv = request->operation(worker->session, request->arg);
+
+        // A worker whose session was lost swaps it for another, rather than
+        // failing every later operation.
+        if (session_pool_is_lost(request->rv)) {
+            session_pool_discard(async->pool, worker->session);
+            if (CKR_OK != session_pool_acquire(async->pool, &worker->session)) {
+                worker->session = CK_INVALID_HANDLE;
+            }
+        }
+        pkcs11_async_complete(async, request);
+    }
+
+    return NULL;
+}
+
+static CK_RV pkcs11_async_enqueue(struct pkcs11_async *async,
+                                  pkcs11_async_operation operation,
+                                  void *arg,
+                                  pkcs11_async_callback callback,
+                                  struct pkcs11_async_future *future) {
+    struct pkcs11_async_request *request = calloc(1, sizeof(struct pkcs11_async_request));
+
+    if (NULL == request) {
+        return CKR_HOST_MEMORY;
+    }
+    request->operation = operation;
+    request->arg = arg;
+    request->callback = callback;
+    request->future = future;
+
+    atomic_fetch_add(&async->submitted, 1);
+    pthread_mutex_lock(&async->lock);
+    if (async->tail) {
+        async->tail->next = request;
+    } else {
+        async->head = request;
+    }
+    async->tail = request;
+    pthread_cond_signal(&async->queued);
+    pthread_mutex_unlock(&async->lock);
+    return CKR_OK;
+}
+
+/**
+ * Start an executor with the given number of workers.
+ * Each worker checks a session out of the pool for the lifetime of the executor.
+ * @param pool Session pool with room for at least workers sessions
+ * @param workers Number of worker threads and sessions
+ * @param async Location where the new executor will be written
+ * @return CK_RV
+ */
+CK_RV pkcs11_async_create(struct session_pool *pool, CK_ULONG workers, struct pkcs11_async **async) {
+    CK_RV rv = CKR_OK;
+    struct pkcs11_async *new_async;
+
+    if (!pool || !async || 0 == workers) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_async = calloc(1, sizeof(struct pkcs11_async));
+    if (NULL == new_async) {
+        return CKR_HOST_MEMORY;
+    }
+    new_async->workers = calloc(workers, sizeof(struct pkcs11_async_worker));
+    if (NULL == new_async->workers) {
+        free(new_async);
+        return CKR_HOST_MEMORY;
+    }
+    if (0 != pkcs11_async_open_fd(new_async)) {
+        perror("eventfd");
+        free(new_async->workers);
+        free(new_async);
+        return CKR_GENERAL_ERROR;
+    }
+
+    new_async->pool = pool;
+    pthread_mutex_init(&new_async->lock, NULL);
+    pthread_cond_init(&new_async->queued, NULL);
+    pthread_mutex_init(&new_async->completion_lock, NULL);
+    atomic_init(&new_async->submitted, 0);
+    atomic_init(&new_async->started, 0);
+    atomic_init(&new_async->completed, 0);
+    atomic_init(&new_async->failed, 0);
+
+    for (CK_ULONG i = 0; i < workers; i++) {
+        struct pkcs11_async_worker *worker = &new_async->workers[i];
+
+        worker->async = new_async;
+        rv = session_pool_acquire(pool, &worker->session);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to acquire a session for async worker %lu: %lu\n", i, rv);
+            break;
+        }
+        if (0 != pthread_create(&worker->thread, NULL, pkcs11_async_worker_run, worker)) {
+            session_pool_release(pool, worker->session);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+        new_async->worker_count++;
+    }
+
+    if (CKR_OK != rv) {
+        pkcs11_async_destroy(new_async);
+        return rv;
+    }
+
+    *async = new_async;
+    return CKR_OK;
+}
+
+/**
+ * Queue an operation without waiting.
+ * The argument must stay valid until the operation completes.
+ * @param async
+ * @param operation Runs on a worker thread with the worker's session
+ * @param arg Passed to the operation, and to the callback or in the completion
+ * @param callback Called on the worker thread with the result. If NULL, the
+ * result is queued for pkcs11_async_reap instead.
+ * @return CK_RV
+ */
+CK_RV pkcs11_async_submit(struct pkcs11_async *async,
+                          pkcs11_async_operation operation,
+                          void *arg,
+                          pkcs11_async_callback callback) {
+    if (!async || !operation) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    return pkcs11_async_enqueue(async, operation, arg, callback, NULL);
+}
+
+/**
+ * Queue an operation without waiting, and return a future for its result.
+ * @param async
+ * @param operation
+ * @param arg Passed to the operation, and must stay valid until the future completes
+ * @param future Receives a future which must be freed with pkcs11_async_future_free
+ * @return CK_RV
+ */
+CK_RV pkcs11_async_submit_future(struct pkcs11_async *async,
+                                 pkcs11_async_operation operation,
+                                 void *arg,
+                                 struct pkcs11_async_future **future) {
+    CK_RV rv;
+    struct pkcs11_async_future *new_future;
+
+    if (!async || !operation || !future) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_future = calloc(1, sizeof(struct pkcs11_async_future));
+    if (NULL == new_future) {
+        return CKR_HOST_MEMORY;
+    }
+    pthread_mutex_init(&new_future->lock, NULL);
+    pthread_cond_init(&new_future->done_cond, NULL);
+
+    rv = pkcs11_async_enqueue(async, operation, arg, NULL, new_future);
+    if (CKR_OK != rv) {
+        pthread_cond_destroy(&new_future->done_cond);
+        pthread_mutex_destroy(&new_future->lock);
+        free(new_future);
+        return rv;
+    }
+
+    *future = new_future;
+    return CKR_OK;
+}
+
+/**
+ * Descriptor which is readable while completions are waiting for
+ * pkcs11_async_reap. Add it to poll or epoll; do not read or close it.
+ * @param async
+ * @return File descriptor, or -1 if async is NULL
+ */
+int pkcs11_async_fd(struct pkcs11_async *async) {
+    return async ? async->read_fd : -1;
+}
+
+/**
+ * Take completed operations from the completion queue, oldest first,
+ * without waiting. The descriptor may wake the caller once more than there
+ * are completions, in which case nothing is returned.
+ * @param async
+ * @param completions Receives the argument and result of each operation
+ * @param max_completions
+ * @return Number of completions written
+ */
+CK_ULONG pkcs11_async_reap(struct pkcs11_async *async,
+                           struct pkcs11_async_completion *completions,
+                           CK_ULONG max_completions) {
+    CK_ULONG count = 0;
+    CK_BBOOL remaining;
+
+    if (!async || !completions) {
+        return 0;
+    }
+
+    // Clear the descriptor before emptying the queue, so a completion which
+    // arrives in between leaves it readable.
+    pkcs11_async_drain(async);
+
+    pthread_mutex_lock(&async->completion_lock);
+    while (count < max_completions && async->completed_head) {
+        struct pkcs11_async_request *request = async->completed_head;
+
+        async->completed_head = request->next;
+        completions[count].arg = request->arg;
+        completions[count].rv = request->rv;
+        count++;
+        free(request);
+    }
+    if (NULL == async->completed_head) {
+        async->completed_tail = NULL;
+    }
+    async->unreaped -= count;
+    remaining = NULL != async->completed_head;
+    pthread_mutex_unlock(&async->completion_lock);
+
+    if (remaining) {
+        pkcs11_async_signal(async);
+    }
+    return count;
+}
+
+/**
+ * Check whether a future has completed, without waiting.
+ * @param future
+ * @return CK_TRUE once pkcs11_async_future_wait would return immediately
+ */
+CK_BBOOL pkcs11_async_future_done(struct pkcs11_async_future *future) {
+    CK_BBOOL done;
+
+    if (!future) {
+        return CK_FALSE;
+    }
+
+    pthread_mutex_lock(&future->lock);
+    done = future->done;
+    pthread_mutex_unlock(&future->lock);
+    return done;
+}
+
+/**
+ * Wait for a future to complete.
+ * @param future
+ * @return Result of the operation
+ */
+CK_RV pkcs11_async_future_wait(struct pkcs11_async_future *future) {
+    CK_RV rv;
+
+    if (!future) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        pthread_cond_wait(&future->done_cond, &future->lock);
+    }
+    rv = future->rv;
+    pthread_mutex_unlock(&future->lock);
+    return rv;
+}
+
+/**
+ * Free a future. Waits for it to complete first, since the worker still
+ * holds a pointer to it until then.
+ * @param future
+ */
+void pkcs11_async_future_free(struct pkcs11_async_future *future) {
+    if (!future) {
+        return;
+    }
+
+    pkcs11_async_future_wait(future);
+    pthread_cond_destroy(&future->done_cond);
+    pthread_mutex_destroy(&future->lock);
+    free(future);
+}
+
+/**
+ * Read the executor's counters. The values are read one at a time while the
+ * workers run, so they are a close snapshot rather than an exact one.
+ * @param async
+ * @param stats
+ */
+void pkcs11_async_stats(struct pkcs11_async *async, struct pkcs11_async_stats *stats) {
+    CK_ULONG submitted;
+    CK_ULONG started;
+    CK_ULONG completed;
+
+    if (!async || !stats) {
+        return;
+    }
+
+    // Read in the order the counters are updated, so no difference is negative.
+    completed = atomic_load(&async->completed);
+    started = atomic_load(&async->started);
+    submitted = atomic_load(&async->submitted);
+
+    stats->queue_depth = submitted - started;
+    stats->in_flight = started - completed;
+    stats->completed = completed;
+    stats->failed = atomic_load(&async->failed);
+
+    pthread_mutex_lock(&async->completion_lock);
+    stats->unreaped = async->unreaped;
+    pthread_mutex_unlock(&async->completion_lock);
+}
+
+/**
+ * Run every queued operation, stop the workers and return their sessions to
+ * the pool. Completions which were never reaped are discarded.
+ * Futures stay valid until they are freed.
+ * @param async
+ */
+void pkcs11_async_destroy(struct pkcs11_async *async) {
+    if (!async) {
+        return;
+    }
+
+    pthread_mutex_lock(&async->lock);
+    async->stopping = CK_TRUE;
+    pthread_cond_broadcast(&async->queued);
+    pthread_mutex_unlock(&async->lock);
+
+    for (CK_ULONG i = 0; i < async->worker_count; i++) {
+        pthread_join(async->workers[i].thread, NULL);
+        session_pool_release(async->pool, async->workers[i].session);
+    }
+
+    while (async->completed_head) {
+        struct pkcs11_async_request *request = async->completed_head;
+
+        async->completed_head = request->next;
+        free(request);
+    }
+
+    if (async->write_fd != async->read_fd) {
+        close(async->write_fd);
+    }
+    close(async->read_fd);
+    pthread_mutex_destroy(&async->completion_lock);
+    pthread_cond_destroy(&async->queued);
+    pthread_mutex_destroy(&async->lock);
+    free(async->workers);
+    free(async);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __PKCS11_ASYNC_H__
+#define __PKCS11_ASYNC_H__
+
+#include "common.h"
+#include "session_pool.h"
+
+/*
+ * Non-blocking execution of PKCS#11 operations.
+ *
+ * Any blocking helper, such as generate_signature or aes_wrap_key, becomes
+ * asynchronous by wrapping it in a pkcs11_async_operation, which receives a
+ * session and an argument. pkcs11_async_submit queues the operation and
+ * returns at once; it never waits for a worker, so it is safe to call from
+ * an event loop thread. A fixed set of worker threads runs the operations,
+ * each on its own session from a session pool. A worker whose operation
+ * fails because its session was lost takes a new session from the pool.
+ *
+ * An operation completes in one of three ways:
+ *  - through a callback, which runs on the worker thread;
+ *  - through a future, which the caller polls or waits on;
+ *  - through the completion queue, when neither is given. Completions are
+ *    read with pkcs11_async_reap, and pkcs11_async_fd returns a descriptor
+ *    which is readable while completions are queued, for poll or epoll.
+ */
+struct pkcs11_async;
+struct pkcs11_async_future;
+
+/**
+ * Runs on a worker thread, with a logged in session which no other thread uses.
+ */
+typedef CK_RV (*pkcs11_async_operation)(CK_SESSION_HANDLE session, void *arg);
+
+/**
+ * Called on a worker thread when an operation completes.
+ */
+typedef void (*pkcs11_async_callback)(void *arg, CK_RV rv);
+
+struct pkcs11_async_completion {
+    void *arg;
+    CK_RV rv;
+};
+
+struct pkcs11_async_stats {
+    CK_ULONG queue_depth;   // Submitted and not yet picked up by a worker
+    CK_ULONG in_flight;     // Picked up by a worker and not yet completed
+    CK_ULONG completed;
+    CK_ULONG failed;
+    CK_ULONG unreaped;      // Waiting in the completion queue
+};
+
+CK_RV pkcs11_async_create(struct session_pool *pool, CK_ULONG workers, struct pkcs11_async **async);
+
+CK_RV pkcs11_async_submit(struct pkcs11_async *async,
+                          pkcs11_async_operation operation,
+                          void *arg,
+                          pkcs11_async_callback callback);
+CK_RV pkcs11_async_submit_future(struct pkcs11_async *async,
+                                 pkcs11_async_operation operation,
+                                 void *arg,
+                                 struct pkcs11_async_future **future);
+
+int pkcs11_async_fd(struct pkcs11_async *async);
+CK_ULONG pkcs11_async_reap(struct pkcs11_async *async,
+                           struct pkcs11_async_completion *completions,
+                           CK_ULONG max_completions);
+
+CK_BBOOL pkcs11_async_future_done(struct pkcs11_async_future *future);
+CK_RV pkcs11_async_future_wait(struct pkcs11_async_future *future);
+void pkcs11_async_future_free(struct pkcs11_async_future *future);
+
+void pkcs11_async_stats(struct pkcs11_async *async, struct pkcs11_async_stats *stats);
+
+void pkcs11_async_destroy(struct pkcs11_async *async);
+
+#endif
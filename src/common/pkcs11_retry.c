@@ -0,0 +1,798 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pkcs11_retry.h"
+#include "output_length.h"
+#include "latency_histogram.h"
+
+#define PKCS11_RETRY_DEFAULT_ATTEMPTS 4
+#define PKCS11_RETRY_DEFAULT_INITIAL_BACKOFF_NS (5 * 1000000ULL)
+#define PKCS11_RETRY_DEFAULT_MAX_BACKOFF_NS (500 * 1000000ULL)
+#define PKCS11_RETRY_DEFAULT_HEDGE_PERCENTILE 95.0
+#define PKCS11_RETRY_DEFAULT_HEDGE_DELAY_NS (20 * 1000000ULL)
+#define PKCS11_RETRY_DEFAULT_MIN_HEDGE_DELAY_NS (100 * 1000ULL)
+
+// The hedge delay is recomputed every PKCS11_RETRY_DELAY_SAMPLES successful
+// attempts, from at most the last PKCS11_RETRY_WINDOW_SAMPLES, so it follows
+// the cluster's current latency.
+#define PKCS11_RETRY_DELAY_SAMPLES 32
+#define PKCS11_RETRY_WINDOW_SAMPLES 1024
+
+enum retry_kind {
+    RETRY_SIGN,
+    RETRY_VERIFY,
+    RETRY_DIGEST,
+    RETRY_RANDOM,
+};
+
+struct retry_request {
+    enum retry_kind kind;
+    CK_OBJECT_HANDLE key;
+    CK_MECHANISM mechanism;
+    CK_BYTE_PTR input;
+    CK_ULONG input_length;
+    // Signature to verify.
+    CK_BYTE_PTR signature;
+    CK_ULONG signature_length;
+    // Output buffer size each attempt starts with.
+    CK_ULONG output_capacity;
+};
+
+/*
+ * One call to a helper, shared by its attempts. Hedged calls own copies of
+ * the request's buffers, and the last of the caller and the attempts to
+ * let go of the call frees it.
+ */
+struct retry_call {
+    struct pkcs11_retry *retry;
+    struct retry_request request;
+    CK_BBOOL owns_request;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    CK_ULONG references;
+    CK_ULONG outstanding;
+    CK_BBOOL succeeded;
+    CK_BBOOL hedge_won;
+    CK_RV rv;
+    CK_BYTE_PTR output;
+    CK_ULONG output_length;
+};
+
+struct retry_attempt {
+    struct retry_call *call;
+    CK_BBOOL hedge;
+    uint64_t start_ns;
+    CK_BYTE_PTR output;
+    CK_ULONG output_capacity;
+    CK_ULONG output_length;
+};
+
+struct pkcs11_retry {
+    struct session_pool *pool;
+    struct pkcs11_retry_policy policy;
+    struct pkcs11_async *async;
+
+    pthread_mutex_t lock;
+    struct latency_histogram latency;
+    uint64_t hedge_delay_ns;
+
+    atomic_ullong jitter_state;
+    atomic_ulong calls;
+    atomic_ulong attempts;
+    atomic_ulong retries;
+    atomic_ulong hedges;
+    atomic_ulong hedge_wins;
+    atomic_ulong fatal;
+    atomic_ulong exhausted;
+};
+
+/**
+ * Fill a policy with the defaults: 4 attempts, backoff from 5 ms up to
+ * 500 ms, and no hedging. Hedging, when enabled, starts at the p95 latency.
+ * @param policy
+ */
+void pkcs11_retry_policy_default(struct pkcs11_retry_policy *policy) {
+    if (!policy) {
+        return;
+    }
+
+    policy->max_attempts = PKCS11_RETRY_DEFAULT_ATTEMPTS;
+    policy->initial_backoff_ns = PKCS11_RETRY_DEFAULT_INITIAL_BACKOFF_NS;
+    policy->max_backoff_ns = PKCS11_RETRY_DEFAULT_MAX_BACKOFF_NS;
+    policy->hedge_workers = 0;
+    policy->hedge_percentile = PKCS11_RETRY_DEFAULT_HEDGE_PERCENTILE;
+    policy->initial_hedge_delay_ns = PKCS11_RETRY_DEFAULT_HEDGE_DELAY_NS;
+    policy->min_hedge_delay_ns = PKCS11_RETRY_DEFAULT_MIN_HEDGE_DELAY_NS;
+}
+
+/**
+ * Whether an attempt which failed with rv may succeed if it is repeated,
+ * on another session if the session was lost. Errors caused by the request
+ * itself, such as CKR_KEY_HANDLE_INVALID or CKR_SIGNATURE_INVALID, are not.
+ * @param rv
+ * @return CK_TRUE if the attempt should be retried
+ */
+CK_BBOOL pkcs11_retry_is_retryable(CK_RV rv) {
+    if (session_pool_is_lost(rv)) {
+        return CK_TRUE;
+    }
+
+    switch (rv) {
+        case CKR_DEVICE_MEMORY:
+        case CKR_SESSION_COUNT:
+        // The cluster drops the login during failover, until the session pool logs in again.
+        case CKR_USER_NOT_LOGGED_IN:
+            return CK_TRUE;
+        default:
+            return CK_FALSE;
+    }
+}
+
+/**
+ * Backoff before the given retry, with full jitter: a uniform delay between
+ * zero and the exponential bound, so callers which failed together spread out.
+ */
+static uint64_t retry_backoff_ns(struct pkcs11_retry *retry, CK_ULONG retry_number) {
+    uint64_t bound = retry->policy.initial_backoff_ns;
+
+    for (CK_ULONG i = 1; i < retry_number && bound < retry->policy.max_backoff_ns; i++) {
+        bound *= 2;
+    }
+    if (bound > retry->policy.max_backoff_ns) {
+        bound = retry->policy.max_backoff_ns;
+    }
+
+    // splitmix64 over a shared counter, which needs no lock.
+    uint64_t z = atomic_fetch_add(&retry->jitter_state, 0x9e3779b97f4a7c15ULL) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+
+    return bound ? z % (bound + 1) : 0;
+}
+
+static void retry_sleep_ns(uint64_t delay_ns) {
+    struct timespec delay = { (time_t) (delay_ns / 1000000000ULL), (long) (delay_ns % 1000000000ULL) };
+
+    while (0 != nanosleep(&delay, &delay) && EINTR == errno) {
+    }
+}
+
+static void retry_record_latency(struct pkcs11_retry *retry, uint64_t latency_ns) {
+    pthread_mutex_lock(&retry->lock);
+    latency_histogram_record(&retry->latency, latency_ns);
+    if (0 == retry->latency.count % PKCS11_RETRY_DELAY_SAMPLES) {
+        uint64_t delay_ns = latency_histogram_percentile(&retry->latency, retry->policy.hedge_percentile);
+
+        retry->hedge_delay_ns = delay_ns < retry->policy.min_hedge_delay_ns ? retry->policy.min_hedge_delay_ns
+                                                                            : delay_ns;
+        if (retry->latency.count >= PKCS11_RETRY_WINDOW_SAMPLES) {
+            latency_histogram_init(&retry->latency);
+        }
+    }
+    pthread_mutex_unlock(&retry->lock);
+}
+
+static uint64_t retry_hedge_delay_ns(struct pkcs11_retry *retry) {
+    pthread_mutex_lock(&retry->lock);
+    uint64_t delay_ns = retry->hedge_delay_ns;
+    pthread_mutex_unlock(&retry->lock);
+    return delay_ns;
+}
+
+/**
+ * Create a retry layer over a session pool.
+ * @param pool Session pool. Hedging keeps hedge_workers of its sessions checked out.
+ * @param policy Policy, or NULL for pkcs11_retry_policy_default
+ * @param retry Location where the new retry layer will be written
+ * @return CK_RV
+ */
+CK_RV pkcs11_retry_create(struct session_pool *pool,
+                          const struct pkcs11_retry_policy *policy,
+                          struct pkcs11_retry **retry) {
+    struct pkcs11_retry *new_retry;
+    CK_RV rv;
+
+    if (!pool || !retry || (policy && 0 == policy->max_attempts)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_retry = calloc(1, sizeof(struct pkcs11_retry));
+    if (NULL == new_retry) {
+        return CKR_HOST_MEMORY;
+    }
+
+    new_retry->pool = pool;
+    if (policy) {
+        new_retry->policy = *policy;
+    } else {
+        pkcs11_retry_policy_default(&new_retry->policy);
+    }
+    pthread_mutex_init(&new_retry->lock, NULL);
+    latency_histogram_init(&new_retry->latency);
+    new_retry->hedge_delay_ns = new_retry->policy.initial_hedge_delay_ns;
+    atomic_init(&new_retry->jitter_state, latency_now_ns());
+    atomic_init(&new_retry->calls, 0);
+    atomic_init(&new_retry->attempts, 0);
+    atomic_init(&new_retry->retries, 0);
+    atomic_init(&new_retry->hedges, 0);
+    atomic_init(&new_retry->hedge_wins, 0);
+    atomic_init(&new_retry->fatal, 0);
+    atomic_init(&new_retry->exhausted, 0);
+
+    if (new_retry->policy.hedge_workers > 0) {
+        rv = pkcs11_async_create(pool, new_retry->policy.hedge_workers, &new_retry->async);
+        if (CKR_OK != rv) {
+            pthread_mutex_destroy(&new_retry->lock);
+            free(new_retry);
+            return rv;
+        }
+    }
+
+    *retry = new_retry;
+    return CKR_OK;
+}
+
+/**
+ * Count the end of a call which failed, as fatal or out of attempts.
+ */
+static CK_RV retry_finish(struct pkcs11_retry *retry, CK_RV rv, CK_ULONG attempts) {
+    if (CKR_OK != rv) {
+        if (pkcs11_retry_is_retryable(rv) && attempts >= retry->policy.max_attempts) {
+            atomic_fetch_add(&retry->exhausted, 1);
+        } else {
+            atomic_fetch_add(&retry->fatal, 1);
+        }
+    }
+    return rv;
+}
+
+/**
+ * Run an operation on a pooled session, retrying it with backoff while it
+ * fails with a retryable error. The operation is repeated from the start,
+ * so it must be safe to run more than once. Runs on the caller's thread and
+ * never hedges.
+ * @param retry
+ * @param operation Receives a session from the pool
+ * @param arg Passed to the operation
+ * @return Result of the last attempt
+ */
+CK_RV pkcs11_retry_run(struct pkcs11_retry *retry, pkcs11_async_operation operation, void *arg) {
+    CK_ULONG attempts = 0;
+    CK_RV rv;
+
+    if (!retry || !operation) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    atomic_fetch_add(&retry->calls, 1);
+    for (;;) {
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+        if (attempts > 0) {
+            atomic_fetch_add(&retry->retries, 1);
+            retry_sleep_ns(retry_backoff_ns(retry, attempts));
+        }
+        attempts++;
+        atomic_fetch_add(&retry->attempts, 1);
+
+        rv = session_pool_acquire(retry->pool, &session);
+        if (CKR_OK == rv) {
+            uint64_t start_ns = latency_now_ns();
+
+            rv = operation(session, arg);
+            if (session_pool_is_lost(rv)) {
+                session_pool_discard(retry->pool, session);
+            } else {
+                session_pool_release(retry->pool, session);
+            }
+            if (CKR_OK == rv) {
+                retry_record_latency(retry, latency_now_ns() - start_ns);
+            }
+        }
+
+        if (CKR_OK == rv || !pkcs11_retry_is_retryable(rv) || attempts >= retry->policy.max_attempts) {
+            return retry_finish(retry, rv, attempts);
+        }
+    }
+}
+
+/**
+ * One attempt at a request, with output in a buffer of the attempt's own.
+ */
+static CK_RV retry_perform(CK_SESSION_HANDLE session, struct retry_request *request,
+                           CK_BYTE_PTR *output, CK_ULONG_PTR output_capacity, CK_ULONG_PTR output_length) {
+    CK_RV rv;
+
+    switch (request->kind) {
+        case RETRY_SIGN:
+            rv = funcs->C_SignInit(session, &request->mechanism, request->key);
+            if (CKR_OK != rv) {
+                return rv;
+            }
+            return pkcs11_single_part(funcs->C_Sign, session, request->input, request->input_length,
+                                      output, output_capacity, output_length);
+        case RETRY_VERIFY:
+            rv = funcs->C_VerifyInit(session, &request->mechanism, request->key);
+            if (CKR_OK != rv) {
+                return rv;
+            }
+            *output_length = 0;
+            return funcs->C_Verify(session, request->input, request->input_length,
+                                   request->signature, request->signature_length);
+        case RETRY_DIGEST:
+            rv = funcs->C_DigestInit(session, &request->mechanism);
+            if (CKR_OK != rv) {
+                return rv;
+            }
+            return pkcs11_single_part(funcs->C_Digest, session, request->input, request->input_length,
+                                      output, output_capacity, output_length);
+        case RETRY_RANDOM:
+            if (NULL == *output) {
+                *output = malloc(*output_capacity ? *output_capacity : 1);
+                if (NULL == *output) {
+                    return CKR_HOST_MEMORY;
+                }
+            }
+            *output_length = *output_capacity;
+            return funcs->C_GenerateRandom(session, *output, *output_length);
+        default:
+            return CKR_ARGUMENTS_BAD;
+    }
+}
+
+static CK_RV retry_attempt_run(CK_SESSION_HANDLE session, void *arg) {
+    struct retry_attempt *attempt = arg;
+
+    // Measured from here, so time spent queued for a worker does not raise the hedge delay.
+    attempt->start_ns = latency_now_ns();
+    return retry_perform(session, &attempt->call->request, &attempt->output,
+                         &attempt->output_capacity, &attempt->output_length);
+}
+
+static void retry_call_release(struct retry_call *call) {
+    pthread_mutex_lock(&call->lock);
+    CK_ULONG references = --call->references;
+    pthread_mutex_unlock(&call->lock);
+    if (references > 0) {
+        return;
+    }
+
+    if (call->owns_request) {
+        free(call->request.input);
+        free(call->request.signature);
+        free(call->request.mechanism.pParameter);
+    }
+    pthread_cond_destroy(&call->done_cond);
+    pthread_mutex_destroy(&call->lock);
+    free(call->output);
+    free(call);
+}
+
+/**
+ * Completion of a hedged attempt, on a worker thread. The first attempt to
+ * succeed hands its output to the call.
+ */
+static void retry_attempt_complete(void *arg, CK_RV rv) {
+    struct retry_attempt *attempt = arg;
+    struct retry_call *call = attempt->call;
+
+    if (CKR_OK == rv) {
+        retry_record_latency(call->retry, latency_now_ns() - attempt->start_ns);
+    }
+
+    pthread_mutex_lock(&call->lock);
+    if (CKR_OK == rv && !call->succeeded) {
+        call->succeeded = CK_TRUE;
+        call->hedge_won = attempt->hedge;
+        call->rv = CKR_OK;
+        call->output = attempt->output;
+        call->output_length = attempt->output_length;
+        attempt->output = NULL;
+    } else if (!call->succeeded) {
+        call->rv = rv;
+    }
+    call->outstanding--;
+    pthread_cond_broadcast(&call->done_cond);
+    pthread_mutex_unlock(&call->lock);
+
+    retry_call_release(call);
+    free(attempt->output);
+    free(attempt);
+}
+
+static CK_RV retry_submit_attempt(struct retry_call *call, CK_BBOOL hedge) {
+    struct retry_attempt *attempt = calloc(1, sizeof(struct retry_attempt));
+    CK_RV rv;
+
+    if (NULL == attempt) {
+        return CKR_HOST_MEMORY;
+    }
+    attempt->call = call;
+    attempt->hedge = hedge;
+    attempt->output_capacity = call->request.output_capacity;
+
+    pthread_mutex_lock(&call->lock);
+    call->references++;
+    call->outstanding++;
+    pthread_mutex_unlock(&call->lock);
+
+    rv = pkcs11_async_submit(call->retry->async, retry_attempt_run, attempt, retry_attempt_complete);
+    if (CKR_OK != rv) {
+        pthread_mutex_lock(&call->lock);
+        call->references--;
+        call->outstanding--;
+        pthread_mutex_unlock(&call->lock);
+        free(attempt);
+    }
+    return rv;
+}
+
+/**
+ * Wait until the call succeeds, every attempt has failed, or the deadline
+ * passes. A deadline of zero waits without limit.
+ */
+static void retry_call_wait(struct retry_call *call, uint64_t deadline_ns) {
+    struct timespec deadline;
+
+    if (deadline_ns) {
+        // Condition variables time out on CLOCK_REALTIME.
+        uint64_t remaining_ns = deadline_ns > latency_now_ns() ? deadline_ns - latency_now_ns() : 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t) (remaining_ns / 1000000000ULL);
+        deadline.tv_nsec += (long) (remaining_ns % 1000000000ULL);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&call->lock);
+    while (!call->succeeded && call->outstanding > 0) {
+        if (!deadline_ns) {
+            pthread_cond_wait(&call->done_cond, &call->lock);
+        } else if (0 != pthread_cond_timedwait(&call->done_cond, &call->lock, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&call->lock);
+}
+
+/**
+ * Copy the request's buffers, so attempts can outlive the caller's call.
+ */
+static CK_RV retry_copy_request(struct retry_request *copy, const struct retry_request *request) {
+    *copy = *request;
+    copy->input = NULL;
+    copy->signature = NULL;
+    copy->mechanism.pParameter = NULL;
+
+    if (request->input_length) {
+        copy->input = malloc(request->input_length);
+    }
+    if (request->signature_length) {
+        copy->signature = malloc(request->signature_length);
+    }
+    if (request->mechanism.ulParameterLen) {
+        copy->mechanism.pParameter = malloc(request->mechanism.ulParameterLen);
+    }
+    if ((request->input_length && !copy->input) || (request->signature_length && !copy->signature)
+        || (request->mechanism.ulParameterLen && !copy->mechanism.pParameter)) {
+        free(copy->input);
+        free(copy->signature);
+        free(copy->mechanism.pParameter);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (request->input_length) {
+        memcpy(copy->input, request->input, request->input_length);
+    }
+    if (request->signature_length) {
+        memcpy(copy->signature, request->signature, request->signature_length);
+    }
+    if (request->mechanism.ulParameterLen) {
+        memcpy(copy->mechanism.pParameter, request->mechanism.pParameter, request->mechanism.ulParameterLen);
+    }
+    return CKR_OK;
+}
+
+/**
+ * Run a request on the caller's thread, with retries.
+ */
+static CK_RV retry_call_direct(struct pkcs11_retry *retry, struct retry_call *call) {
+    struct retry_attempt attempt = { call, CK_FALSE, 0, NULL, call->request.output_capacity, 0 };
+
+    call->rv = pkcs11_retry_run(retry, retry_attempt_run, &attempt);
+    call->output = attempt.output;
+    call->output_length = attempt.output_length;
+    return call->rv;
+}
+
+/**
+ * Run a request on the hedging workers: start an attempt, hedge it if it is
+ * slower than the hedge delay, and retry with backoff when every attempt
+ * failed with a retryable error. The primary attempt runs on a worker too,
+ * so the caller can return as soon as the hedge wins.
+ */
+static CK_RV retry_call_hedged(struct pkcs11_retry *retry, struct retry_call *call) {
+    CK_ULONG attempts = 0;
+    CK_RV rv;
+
+    atomic_fetch_add(&retry->calls, 1);
+    for (;;) {
+        if (attempts > 0) {
+            atomic_fetch_add(&retry->retries, 1);
+            retry_sleep_ns(retry_backoff_ns(retry, attempts));
+        }
+
+        rv = retry_submit_attempt(call, CK_FALSE);
+        if (CKR_OK != rv) {
+            return retry_finish(retry, rv, attempts);
+        }
+        attempts++;
+        atomic_fetch_add(&retry->attempts, 1);
+
+        retry_call_wait(call, latency_now_ns() + retry_hedge_delay_ns(retry));
+
+        pthread_mutex_lock(&call->lock);
+        CK_BBOOL pending = !call->succeeded && call->outstanding > 0;
+        pthread_mutex_unlock(&call->lock);
+
+        if (pending && attempts < retry->policy.max_attempts) {
+            struct pkcs11_async_stats stats;
+
+            // A hedge which would wait for a worker only adds load.
+            pkcs11_async_stats(retry->async, &stats);
+            if (stats.in_flight + stats.queue_depth < retry->policy.hedge_workers
+                && CKR_OK == retry_submit_attempt(call, CK_TRUE)) {
+                attempts++;
+                atomic_fetch_add(&retry->attempts, 1);
+                atomic_fetch_add(&retry->hedges, 1);
+            }
+        }
+        retry_call_wait(call, 0);
+
+        pthread_mutex_lock(&call->lock);
+        rv = call->rv;
+        CK_BBOOL succeeded = call->succeeded;
+        CK_BBOOL hedge_won = call->hedge_won;
+        pthread_mutex_unlock(&call->lock);
+
+        if (succeeded) {
+            if (hedge_won) {
+                atomic_fetch_add(&retry->hedge_wins, 1);
+            }
+            return CKR_OK;
+        }
+        if (!pkcs11_retry_is_retryable(rv) || attempts >= retry->policy.max_attempts) {
+            return retry_finish(retry, rv, attempts);
+        }
+    }
+}
+
+/**
+ * Run a request, hedged if hedging is enabled, and copy its output out.
+ * @param output Caller's buffer, or NULL to only learn the output length
+ * @param output_length In: size of output. Out: length of the output.
+ */
+static CK_RV retry_call(struct pkcs11_retry *retry, const struct retry_request *request,
+                        CK_BYTE_PTR output, CK_ULONG_PTR output_length) {
+    struct retry_call *call;
+    CK_RV rv;
+
+    call = calloc(1, sizeof(struct retry_call));
+    if (NULL == call) {
+        return CKR_HOST_MEMORY;
+    }
+    call->retry = retry;
+    call->references = 1;
+    pthread_mutex_init(&call->lock, NULL);
+    pthread_cond_init(&call->done_cond, NULL);
+
+    if (retry->async) {
+        rv = retry_copy_request(&call->request, request);
+        if (CKR_OK != rv) {
+            retry_call_release(call);
+            return rv;
+        }
+        call->owns_request = CK_TRUE;
+        rv = retry_call_hedged(retry, call);
+    } else {
+        call->request = *request;
+        rv = retry_call_direct(retry, call);
+    }
+
+    if (CKR_OK == rv && output_length) {
+        if (NULL == output) {
+            *output_length = call->output_length;
+        } else if (*output_length < call->output_length) {
+            *output_length = call->output_length;
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(output, call->output, call->output_length);
+            *output_length = call->output_length;
+        }
+    }
+
+    retry_call_release(call);
+    return rv;
+}
+
+/**
+ * Sign data with retries, and hedging if it is enabled.
+ * @param retry
+ * @param key
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param signature Buffer for the signature, or NULL to learn its length
+ * @param signature_length In: size of signature. Out: length of the signature.
+ * @return CK_RV
+ */
+CK_RV pkcs11_retry_sign(struct pkcs11_retry *retry,
+                        CK_OBJECT_HANDLE key,
+                        CK_MECHANISM_PTR mechanism,
+                        CK_BYTE_PTR data,
+                        CK_ULONG data_length,
+                        CK_BYTE_PTR signature,
+                        CK_ULONG_PTR signature_length) {
+    struct retry_request request = { RETRY_SIGN };
+
+    if (!retry || !mechanism || (!data && data_length) || !signature_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    request.key = key;
+    request.mechanism = *mechanism;
+    request.input = data;
+    request.input_length = data_length;
+    request.output_capacity = pkcs11_max_output_length(PKCS11_OPERATION_SIGN, mechanism, 0, data_length);
+    if (0 == request.output_capacity) {
+        request.output_capacity = PKCS11_MAX_RSA_MODULUS_BYTES;
+    }
+    return retry_call(retry, &request, signature, signature_length);
+}
+
+/**
+ * Verify a signature with retries, and hedging if it is enabled.
+ * @param retry
+ * @param key
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param signature
+ * @param signature_length
+ * @return CKR_SIGNATURE_INVALID, which is not retried, if the signature does not match, otherwise CK_RV
+ */
+CK_RV pkcs11_retry_verify(struct pkcs11_retry *retry,
+                          CK_OBJECT_HANDLE key,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_BYTE_PTR data,
+                          CK_ULONG data_length,
+                          CK_BYTE_PTR signature,
+                          CK_ULONG signature_length) {
+    struct retry_request request = { RETRY_VERIFY };
+
+    if (!retry || !mechanism || (!data && data_length) || !signature) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    request.key = key;
+    request.mechanism = *mechanism;
+    request.input = data;
+    request.input_length = data_length;
+    request.signature = signature;
+    request.signature_length = signature_length;
+    return retry_call(retry, &request, NULL, NULL);
+}
+
+/**
+ * Digest data with retries, and hedging if it is enabled.
+ * @param retry
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param digest Buffer for the digest, or NULL to learn its length
+ * @param digest_length In: size of digest. Out: length of the digest.
+ * @return CK_RV
+ */
+CK_RV pkcs11_retry_digest(struct pkcs11_retry *retry,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_BYTE_PTR data,
+                          CK_ULONG data_length,
+                          CK_BYTE_PTR digest,
+                          CK_ULONG_PTR digest_length) {
+    struct retry_request request = { RETRY_DIGEST };
+
+    if (!retry || !mechanism || (!data && data_length) || !digest_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    request.mechanism = *mechanism;
+    request.input = data;
+    request.input_length = data_length;
+    request.output_capacity = pkcs11_max_output_length(PKCS11_OPERATION_DIGEST, mechanism, 0, data_length);
+    if (0 == request.output_capacity) {
+        request.output_capacity = PKCS11_MAX_EC_FIELD_BYTES;
+    }
+    return retry_call(retry, &request, digest, digest_length);
+}
+
+/**
+ * Generate random data with retries, and hedging if it is enabled.
+ * @param retry
+ * @param output
+ * @param output_length
+ * @return CK_RV
+ */
+CK_RV pkcs11_retry_generate_random(struct pkcs11_retry *retry, CK_BYTE_PTR output, CK_ULONG output_length) {
+    struct retry_request request = { RETRY_RANDOM };
+
+    if (!retry || (!output && output_length)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    request.output_capacity = output_length;
+    return retry_call(retry, &request, output, &output_length);
+}
+
+/**
+ * Read the retry layer's counters and its current hedge delay.
+ * @param retry
+ * @param stats
+ */
+void pkcs11_retry_stats(struct pkcs11_retry *retry, struct pkcs11_retry_stats *stats) {
+    if (!retry || !stats) {
+        return;
+    }
+
+    stats->calls = atomic_load(&retry->calls);
+    stats->attempts = atomic_load(&retry->attempts);
+    stats->retries = atomic_load(&retry->retries);
+    stats->hedges = atomic_load(&retry->hedges);
+    stats->hedge_wins = atomic_load(&retry->hedge_wins);
+    stats->fatal = atomic_load(&retry->fatal);
+    stats->exhausted = atomic_load(&retry->exhausted);
+    stats->hedge_delay_ns = retry->async ? retry_hedge_delay_ns(retry) : 0;
+}
+
+/**
+ * Wait for attempts still running, such as the slower attempts of hedged
+ * calls, and return the hedging workers' sessions to the pool.
+ * @param retry
+ */
+void pkcs11_retry_destroy(struct pkcs11_retry *retry) {
+    if (!retry) {
+        return;
+    }
+
+    pkcs11_async_destroy(retry->async);
+    pthread_mutex_destroy(&retry->lock);
+    free(retry);
+}
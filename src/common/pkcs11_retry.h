@@ -0,0 +1,113 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __PKCS11_RETRY_H__
+#define __PKCS11_RETRY_H__
+
+#include <stdint.h>
+
+#include "common.h"
+#include "session_pool.h"
+#include "pkcs11_async.h"
+
+/*
+ * Retries with backoff, and hedged requests, for calls on pooled sessions.
+ *
+ * Each attempt runs on a session from the pool. An attempt which fails with
+ * an error for which pkcs11_retry_is_retryable is true, such as a lost
+ * session or a device error during failover, is retried after a jittered
+ * exponential backoff, up to max_attempts. Other errors are returned at once.
+ *
+ * Signing, verifying, digesting and generating random data can be repeated
+ * safely, so their helpers can also hedge: when an attempt has not completed
+ * within the hedge_percentile latency of recent attempts, a second attempt
+ * is started on another session, and the first to succeed answers the call.
+ * Hedged attempts run on hedge_workers threads of an async executor, and
+ * work on copies of the caller's input, so the call can return while the
+ * slower attempt is still running. Hedges are only sent while a worker is
+ * free, so they do not add queueing under load.
+ *
+ * With hedging enabled, the primary attempt of every helper call runs on
+ * those workers as well, so at most hedge_workers attempts run at once
+ * across all callers, and further calls queue for a worker. Size
+ * hedge_workers for the expected number of concurrent callers plus room
+ * for hedges. pkcs11_retry_run always runs on the caller's thread.
+ */
+struct pkcs11_retry;
+
+struct pkcs11_retry_policy {
+    // Attempts per call, including the first and any hedge. 1 disables retries.
+    CK_ULONG max_attempts;
+    uint64_t initial_backoff_ns;
+    uint64_t max_backoff_ns;
+    // Worker threads for hedged calls, which also caps their concurrency. 0 disables hedging.
+    CK_ULONG hedge_workers;
+    double hedge_percentile;
+    // Hedge delay until enough attempts have been measured, and its lower bound.
+    uint64_t initial_hedge_delay_ns;
+    uint64_t min_hedge_delay_ns;
+};
+
+struct pkcs11_retry_stats {
+    CK_ULONG calls;
+    CK_ULONG attempts;
+    // Attempts started after a retryable failure.
+    CK_ULONG retries;
+    // Hedged attempts started, and calls which the hedge answered first.
+    CK_ULONG hedges;
+    CK_ULONG hedge_wins;
+    // Calls which failed with an error which is not retried, or ran out of attempts.
+    CK_ULONG fatal;
+    CK_ULONG exhausted;
+    uint64_t hedge_delay_ns;
+};
+
+void pkcs11_retry_policy_default(struct pkcs11_retry_policy *policy);
+CK_BBOOL pkcs11_retry_is_retryable(CK_RV rv);
+
+CK_RV pkcs11_retry_create(struct session_pool *pool,
+                          const struct pkcs11_retry_policy *policy,
+                          struct pkcs11_retry **retry);
+
+CK_RV pkcs11_retry_run(struct pkcs11_retry *retry, pkcs11_async_operation operation, void *arg);
+
+CK_RV pkcs11_retry_sign(struct pkcs11_retry *retry,
+                        CK_OBJECT_HANDLE key,
+                        CK_MECHANISM_PTR mechanism,
+                        CK_BYTE_PTR data,
+                        CK_ULONG data_length,
+                        CK_BYTE_PTR signature,
+                        CK_ULONG_PTR signature_length);
+CK_RV pkcs11_retry_verify(struct pkcs11_retry *retry,
+                          CK_OBJECT_HANDLE key,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_BYTE_PTR data,
+                          CK_ULONG data_length,
+                          CK_BYTE_PTR signature,
+                          CK_ULONG signature_length);
+CK_RV pkcs11_retry_digest(struct pkcs11_retry *retry,
+                          CK_MECHANISM_PTR mechanism,
+                          CK_BYTE_PTR data,
+                          CK_ULONG data_length,
+                          CK_BYTE_PTR digest,
+                          CK_ULONG_PTR digest_length);
+CK_RV pkcs11_retry_generate_random(struct pkcs11_retry *retry, CK_BYTE_PTR output, CK_ULONG output_length);
+
+void pkcs11_retry_stats(struct pkcs11_retry *retry, struct pkcs11_retry_stats *stats);
+
+void pkcs11_retry_destroy(struct pkcs11_retry *retry);
+
+#endif
@@ -0,0 +1,757 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "latency_histogram.h"
+#include "pkcs11_trace.h"
+
+#undef CK_NEED_ARG_LIST
+#define CK_PKCS11_FUNCTION_INFO(name) #name,
+
+static const char *trace_function_names[] = {
+#include "pkcs11f.h"
+};
+
+#undef CK_PKCS11_FUNCTION_INFO
+
+#define TRACE_FUNCTIONS (sizeof(trace_function_names) / sizeof(trace_function_names[0]))
+
+/* Position of a function in CK_FUNCTION_LIST, which is also its position in pkcs11f.h. */
+#define TRACE_INDEX(name) \
+    ((offsetof(CK_FUNCTION_LIST, name) - offsetof(CK_FUNCTION_LIST, C_Initialize)) / sizeof(CK_C_Initialize))
+
+/* Distinct return codes remembered per function; the rest are counted together. */
+#define TRACE_ERROR_CODES 4
+
+/* A reader gives up waiting for a consistent copy after this many attempts. */
+#define TRACE_SNAPSHOT_ATTEMPTS 16
+
+struct trace_function {
+    struct latency_histogram latency;
+    CK_RV error_codes[TRACE_ERROR_CODES];
+    uint64_t error_counts[TRACE_ERROR_CODES];
+    uint64_t other_errors;
+};
+
+/*
+ * Statistics of one thread. Only the owning thread writes them. The sequence
+ * is odd while a call is being recorded, so a reader can tell a torn copy
+ * from a consistent one without the writer ever taking a lock.
+ * The buffers are never freed; the buffer of an exited thread is handed to
+ * the next new thread, which keeps memory bounded by the peak thread count.
+ */
+struct trace_thread {
+    atomic_uint_fast64_t sequence;
+    atomic_int in_use;
+    _Atomic(struct trace_function *) functions[TRACE_FUNCTIONS];
+    struct trace_thread *next;
+};
+
+static _Atomic(struct trace_thread *) trace_threads;
+static atomic_int trace_on;
+static CK_FUNCTION_LIST *trace_target;
+static CK_FUNCTION_LIST trace_function_list;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_signal_pipe[2] = { -1, -1 };
+
+static void trace_thread_release(void *value) {
+    struct trace_thread *thread = value;
+    atomic_store(&thread->in_use, 0);
+}
+
+static struct trace_thread *trace_thread_get(void) {
+    struct trace_thread *thread = pthread_getspecific(trace_key);
+    if (thread) {
+        return thread;
+    }
+
+    for (thread = atomic_load(&trace_threads); thread; thread = thread->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&thread->in_use, &expected, 1)) {
+            break;
+        }
+    }
+
+    if (!thread) {
+        thread = calloc(1, sizeof(*thread));
+        if (!thread) {
+            return NULL;
+        }
+        atomic_store(&thread->in_use, 1);
+        thread->next = atomic_load(&trace_threads);
+        while (!atomic_compare_exchange_weak(&trace_threads, &thread->next, thread)) {
+        }
+    }
+
+    pthread_setspecific(trace_key, thread);
+    return thread;
+}
+
+static void trace_add_error(struct trace_function *stats, CK_RV rv, uint64_t count) {
+    for (unsigned int i = 0; i < TRACE_ERROR_CODES; i++) {
+        if (0 == stats->error_counts[i]) {
+            stats->error_codes[i] = rv;
+        }
+        if (stats->error_codes[i] == rv) {
+            stats->error_counts[i] += count;
+            return;
+        }
+    }
+    stats->other_errors += count;
+}
+
+static void trace_record(size_t function, CK_RV rv, uint64_t elapsed_ns) {
+    struct trace_thread *thread = trace_thread_get();
+    struct trace_function *stats;
+    uint_fast64_t sequence;
+
+    if (!thread) {
+        return;
+    }
+
+    stats = atomic_load_explicit(&thread->functions[function], memory_order_relaxed);
+    if (!stats) {
+        stats = calloc(1, sizeof(*stats));
+        if (!stats) {
+            return;
+        }
+        latency_histogram_init(&stats->latency);
+        atomic_store_explicit(&thread->functions[function], stats, memory_order_release);
+    }
+
+    sequence = atomic_load_explicit(&thread->sequence, memory_order_relaxed);
+    atomic_store_explicit(&thread->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    latency_histogram_record(&stats->latency, elapsed_ns);
+    if (CKR_OK != rv) {
+        trace_add_error(stats, rv, 1);
+    }
+
+    atomic_store_explicit(&thread->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Copy the statistics one thread holds for one function.
+ * If the thread keeps recording, the last copy is used anyway; it can be
+ * off by at most the call which was being recorded.
+ * @param thread
+ * @param function
+ * @param copy
+ * @return 1 if the thread called the function, 0 otherwise.
+ */
+static int trace_snapshot(struct trace_thread *thread, size_t function, struct trace_function *copy) {
+    struct trace_function *stats = atomic_load_explicit(&thread->functions[function], memory_order_acquire);
+
+    if (!stats) {
+        return 0;
+    }
+
+    for (unsigned int attempt = 0; attempt < TRACE_SNAPSHOT_ATTEMPTS; attempt++) {
+        uint_fast64_t before = atomic_load_explicit(&thread->sequence, memory_order_acquire);
+        uint_fast64_t after;
+
+        memcpy(copy, stats, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&thread->sequence, memory_order_relaxed);
+        if (before == after && 0 == (before & 1)) {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Every shim has the signature of the function it wraps, so the application
+ * can not tell the traced list from the library's own.
+ */
+#define TRACE_FUNCTION(name, parameters, arguments) \
+    static CK_RV trace_##name parameters { \
+        uint64_t start = latency_now_ns(); \
+        CK_RV rv = trace_target->name arguments; \
+        trace_record(TRACE_INDEX(name), rv, latency_now_ns() - start); \
+        return rv; \
+    }
+
+TRACE_FUNCTION(C_Initialize,
+               (CK_VOID_PTR pInitArgs),
+               (pInitArgs))
+
+TRACE_FUNCTION(C_Finalize,
+               (CK_VOID_PTR pReserved),
+               (pReserved))
+
+TRACE_FUNCTION(C_GetInfo,
+               (CK_INFO_PTR pInfo),
+               (pInfo))
+
+TRACE_FUNCTION(C_GetSlotList,
+               (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount),
+               (tokenPresent, pSlotList, pulCount))
+
+TRACE_FUNCTION(C_GetSlotInfo,
+               (CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo),
+               (slotID, pInfo))
+
+TRACE_FUNCTION(C_GetTokenInfo,
+               (CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo),
+               (slotID, pInfo))
+
+TRACE_FUNCTION(C_GetMechanismList,
+               (CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount),
+               (slotID, pMechanismList, pulCount))
+
+TRACE_FUNCTION(C_GetMechanismInfo,
+               (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo),
+               (slotID, type, pInfo))
+
+TRACE_FUNCTION(C_InitToken,
+               (CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel),
+               (slotID, pPin, ulPinLen, pLabel))
+
+TRACE_FUNCTION(C_InitPIN,
+               (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen),
+               (hSession, pPin, ulPinLen))
+
+TRACE_FUNCTION(C_SetPIN,
+               (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen,
+                CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen),
+               (hSession, pOldPin, ulOldLen, pNewPin, ulNewLen))
+
+TRACE_FUNCTION(C_OpenSession,
+               (CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY Notify,
+                CK_SESSION_HANDLE_PTR phSession),
+               (slotID, flags, pApplication, Notify, phSession))
+
+TRACE_FUNCTION(C_CloseSession,
+               (CK_SESSION_HANDLE hSession),
+               (hSession))
+
+TRACE_FUNCTION(C_CloseAllSessions,
+               (CK_SLOT_ID slotID),
+               (slotID))
+
+TRACE_FUNCTION(C_GetSessionInfo,
+               (CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
+               (hSession, pInfo))
+
+TRACE_FUNCTION(C_GetOperationState,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+                CK_ULONG_PTR pulOperationStateLen),
+               (hSession, pOperationState, pulOperationStateLen))
+
+TRACE_FUNCTION(C_SetOperationState,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+                CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey,
+                CK_OBJECT_HANDLE hAuthenticationKey),
+               (hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey))
+
+TRACE_FUNCTION(C_Login,
+               (CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin,
+                CK_ULONG ulPinLen),
+               (hSession, userType, pPin, ulPinLen))
+
+TRACE_FUNCTION(C_Logout,
+               (CK_SESSION_HANDLE hSession),
+               (hSession))
+
+TRACE_FUNCTION(C_CreateObject,
+               (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+                CK_OBJECT_HANDLE_PTR phObject),
+               (hSession, pTemplate, ulCount, phObject))
+
+TRACE_FUNCTION(C_CopyObject,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+                CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject),
+               (hSession, hObject, pTemplate, ulCount, phNewObject))
+
+TRACE_FUNCTION(C_DestroyObject,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+               (hSession, hObject))
+
+TRACE_FUNCTION(C_GetObjectSize,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize),
+               (hSession, hObject, pulSize))
+
+TRACE_FUNCTION(C_GetAttributeValue,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+                CK_ULONG ulCount),
+               (hSession, hObject, pTemplate, ulCount))
+
+TRACE_FUNCTION(C_SetAttributeValue,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate,
+                CK_ULONG ulCount),
+               (hSession, hObject, pTemplate, ulCount))
+
+TRACE_FUNCTION(C_FindObjectsInit,
+               (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount),
+               (hSession, pTemplate, ulCount))
+
+TRACE_FUNCTION(C_FindObjects,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+                CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount),
+               (hSession, phObject, ulMaxObjectCount, pulObjectCount))
+
+TRACE_FUNCTION(C_FindObjectsFinal,
+               (CK_SESSION_HANDLE hSession),
+               (hSession))
+
+TRACE_FUNCTION(C_EncryptInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_Encrypt,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen),
+               (hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen))
+
+TRACE_FUNCTION(C_EncryptUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+               (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+
+TRACE_FUNCTION(C_EncryptFinal,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart,
+                CK_ULONG_PTR pulLastEncryptedPartLen),
+               (hSession, pLastEncryptedPart, pulLastEncryptedPartLen))
+
+TRACE_FUNCTION(C_DecryptInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_Decrypt,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData,
+                CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+               (hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen))
+
+TRACE_FUNCTION(C_DecryptUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+                CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+               (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+
+TRACE_FUNCTION(C_DecryptFinal,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen),
+               (hSession, pLastPart, pulLastPartLen))
+
+TRACE_FUNCTION(C_DigestInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism),
+               (hSession, pMechanism))
+
+TRACE_FUNCTION(C_Digest,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+               (hSession, pData, ulDataLen, pDigest, pulDigestLen))
+
+TRACE_FUNCTION(C_DigestUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+               (hSession, pPart, ulPartLen))
+
+TRACE_FUNCTION(C_DigestKey,
+               (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey),
+               (hSession, hKey))
+
+TRACE_FUNCTION(C_DigestFinal,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+               (hSession, pDigest, pulDigestLen))
+
+TRACE_FUNCTION(C_SignInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_Sign,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+               (hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+
+TRACE_FUNCTION(C_SignUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+               (hSession, pPart, ulPartLen))
+
+TRACE_FUNCTION(C_SignFinal,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+               (hSession, pSignature, pulSignatureLen))
+
+TRACE_FUNCTION(C_SignRecoverInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_SignRecover,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen),
+               (hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+
+TRACE_FUNCTION(C_VerifyInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_Verify,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+               (hSession, pData, ulDataLen, pSignature, ulSignatureLen))
+
+TRACE_FUNCTION(C_VerifyUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+               (hSession, pPart, ulPartLen))
+
+TRACE_FUNCTION(C_VerifyFinal,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen),
+               (hSession, pSignature, ulSignatureLen))
+
+TRACE_FUNCTION(C_VerifyRecoverInit,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey),
+               (hSession, pMechanism, hKey))
+
+TRACE_FUNCTION(C_VerifyRecover,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+                CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen),
+               (hSession, pSignature, ulSignatureLen, pData, pulDataLen))
+
+TRACE_FUNCTION(C_DigestEncryptUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+               (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+
+TRACE_FUNCTION(C_DecryptDigestUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+                CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+               (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+
+TRACE_FUNCTION(C_SignEncryptUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen),
+               (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen))
+
+TRACE_FUNCTION(C_DecryptVerifyUpdate,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart,
+                CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen),
+               (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen))
+
+TRACE_FUNCTION(C_GenerateKey,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey),
+               (hSession, pMechanism, pTemplate, ulCount, phKey))
+
+TRACE_FUNCTION(C_GenerateKeyPair,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+                CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+                CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey),
+               (hSession, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey))
+
+TRACE_FUNCTION(C_WrapKey,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, CK_BYTE_PTR pWrappedKey,
+                CK_ULONG_PTR pulWrappedKeyLen),
+               (hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen))
+
+TRACE_FUNCTION(C_UnwrapKey,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen,
+                CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+               (hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulAttributeCount, phKey))
+
+TRACE_FUNCTION(C_DeriveKey,
+               (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey,
+                CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey),
+               (hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey))
+
+TRACE_FUNCTION(C_SeedRandom,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen),
+               (hSession, pSeed, ulSeedLen))
+
+TRACE_FUNCTION(C_GenerateRandom,
+               (CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen),
+               (hSession, RandomData, ulRandomLen))
+
+TRACE_FUNCTION(C_GetFunctionStatus,
+               (CK_SESSION_HANDLE hSession),
+               (hSession))
+
+TRACE_FUNCTION(C_CancelFunction,
+               (CK_SESSION_HANDLE hSession),
+               (hSession))
+
+TRACE_FUNCTION(C_WaitForSlotEvent,
+               (CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pRserved),
+               (flags, pSlot, pRserved))
+
+static CK_RV trace_C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+    if (!ppFunctionList) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *ppFunctionList = &trace_function_list;
+    return CKR_OK;
+}
+
+#undef CK_NEED_ARG_LIST
+#define CK_PKCS11_FUNCTION_INFO(name) trace_##name,
+
+static CK_FUNCTION_LIST trace_function_list = {
+        { CRYPTOKI_VERSION_MAJOR, CRYPTOKI_VERSION_MINOR },
+#include "pkcs11f.h"
+};
+
+#undef CK_PKCS11_FUNCTION_INFO
+
+/*
+ * Dumping is not async-signal-safe, so the SIGUSR1 handler only wakes a
+ * thread which writes the statistics.
+ */
+static void trace_signal_handler(int signal_number) {
+    int saved_errno = errno;
+    char wake = 0;
+    ssize_t written;
+
+    (void) signal_number;
+    written = write(trace_signal_pipe[1], &wake, 1);
+    (void) written;
+    errno = saved_errno;
+}
+
+static void *trace_signal_thread(void *unused) {
+    char wake;
+
+    (void) unused;
+    for (;;) {
+        ssize_t count = read(trace_signal_pipe[0], &wake, 1);
+        if (count > 0) {
+            pkcs11_trace_dump(stderr);
+        } else if (count < 0 && EINTR == errno) {
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void trace_install_signal_handler(void) {
+    struct sigaction action;
+    struct sigaction previous;
+    pthread_t thread;
+
+    // Leave SIGUSR1 alone if the application already handles it.
+    if (0 != sigaction(SIGUSR1, NULL, &previous)) {
+        return;
+    }
+    if ((previous.sa_flags & SA_SIGINFO) || SIG_DFL != previous.sa_handler) {
+        return;
+    }
+
+    if (0 != pipe(trace_signal_pipe)) {
+        return;
+    }
+
+    if (0 != pthread_create(&thread, NULL, trace_signal_thread, NULL)) {
+        close(trace_signal_pipe[0]);
+        close(trace_signal_pipe[1]);
+        return;
+    }
+    pthread_detach(thread);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_signal_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+static CK_RV trace_setup_rv = CKR_OK;
+
+static void trace_setup(void) {
+    if (0 != pthread_key_create(&trace_key, trace_thread_release)) {
+        trace_setup_rv = CKR_HOST_MEMORY;
+        return;
+    }
+
+    trace_install_signal_handler();
+}
+
+static void trace_interpose(void) {
+    if (!funcs || &trace_function_list == funcs) {
+        return;
+    }
+
+    trace_target = funcs;
+    trace_function_list.version = funcs->version;
+    funcs = &trace_function_list;
+}
+
+/**
+ * Turn tracing on. If the library is already loaded, funcs is switched to
+ * the traced function list immediately; otherwise pkcs11_load_functions
+ * switches it when the library is loaded.
+ * @return CKR_OK, or CKR_HOST_MEMORY if the per-thread buffers can not be set up.
+ */
+CK_RV pkcs11_trace_enable(void) {
+    pthread_once(&trace_once, trace_setup);
+    if (CKR_OK != trace_setup_rv) {
+        return trace_setup_rv;
+    }
+
+    atomic_store(&trace_on, 1);
+    trace_interpose();
+    return CKR_OK;
+}
+
+CK_BBOOL pkcs11_trace_enabled(void) {
+    return atomic_load(&trace_on) ? CK_TRUE : CK_FALSE;
+}
+
+/**
+ * Called by pkcs11_load_functions once funcs points at the library.
+ * Enables tracing if PKCS11_TRACE is set to anything but 0.
+ */
+void pkcs11_trace_attach(void) {
+    const char *setting;
+
+    if (atomic_load(&trace_on)) {
+        trace_interpose();
+        return;
+    }
+
+    setting = getenv(PKCS11_TRACE_ENV);
+    if (!setting || '\0' == *setting || 0 == strcmp(setting, "0")) {
+        return;
+    }
+
+    if (CKR_OK != pkcs11_trace_enable()) {
+        fprintf(stderr, "PKCS#11 tracing could not be enabled\n");
+    }
+}
+
+static void trace_print_function(FILE *out, const char *name, const struct trace_function *stats, uint64_t total_ns) {
+    const struct latency_histogram *latency = &stats->latency;
+    uint64_t errors = stats->other_errors;
+
+    for (unsigned int i = 0; i < TRACE_ERROR_CODES; i++) {
+        errors += stats->error_counts[i];
+    }
+
+    fprintf(out, "%-22s %10llu %8llu %12.3f %5.1f%% %10.1f %10.1f %10.1f %10.1f\n",
+            name,
+            (unsigned long long) latency->count,
+            (unsigned long long) errors,
+            latency->sum_ns / 1e6,
+            total_ns ? 100.0 * (double) latency->sum_ns / (double) total_ns : 0.0,
+            (double) latency->sum_ns / (double) latency->count / 1e3,
+            latency_histogram_percentile(latency, 50.0) / 1e3,
+            latency_histogram_percentile(latency, 99.0) / 1e3,
+            latency->max_ns / 1e3);
+
+    for (unsigned int i = 0; i < TRACE_ERROR_CODES; i++) {
+        if (stats->error_counts[i] > 0) {
+            fprintf(out, "%22s rv 0x%08lx: %llu\n", "", stats->error_codes[i],
+                    (unsigned long long) stats->error_counts[i]);
+        }
+    }
+    if (stats->other_errors > 0) {
+        fprintf(out, "%22s other errors: %llu\n", "", (unsigned long long) stats->other_errors);
+    }
+}
+
+/**
+ * Write the statistics of every thread, merged per function, with the
+ * functions which took the most time in total first.
+ * @param out
+ */
+void pkcs11_trace_dump(FILE *out) {
+    struct trace_function *totals;
+    struct trace_function *copy;
+    size_t order[TRACE_FUNCTIONS];
+    size_t used = 0;
+    uint64_t calls = 0;
+    uint64_t total_ns = 0;
+
+    // One extra entry is the scratch copy of a single thread's statistics.
+    totals = calloc(TRACE_FUNCTIONS + 1, sizeof(*totals));
+    if (!totals) {
+        fprintf(out, "PKCS#11 trace: out of memory\n");
+        return;
+    }
+    copy = &totals[TRACE_FUNCTIONS];
+
+    pthread_mutex_lock(&trace_dump_lock);
+
+    for (size_t f = 0; f < TRACE_FUNCTIONS; f++) {
+        latency_histogram_init(&totals[f].latency);
+    }
+
+    for (struct trace_thread *thread = atomic_load(&trace_threads); thread; thread = thread->next) {
+        for (size_t f = 0; f < TRACE_FUNCTIONS; f++) {
+            if (!trace_snapshot(thread, f, copy)) {
+                continue;
+            }
+            latency_histogram_merge(&totals[f].latency, &copy->latency);
+            for (unsigned int i = 0; i < TRACE_ERROR_CODES; i++) {
+                if (copy->error_counts[i] > 0) {
+                    trace_add_error(&totals[f], copy->error_codes[i], copy->error_counts[i]);
+                }
+            }
+            totals[f].other_errors += copy->other_errors;
+        }
+    }
+
+    for (size_t f = 0; f < TRACE_FUNCTIONS; f++) {
+        size_t position;
+
+        if (0 == totals[f].latency.count) {
+            continue;
+        }
+        calls += totals[f].latency.count;
+        total_ns += totals[f].latency.sum_ns;
+
+        for (position = used; position > 0; position--) {
+            if (totals[order[position - 1]].latency.sum_ns >= totals[f].latency.sum_ns) {
+                break;
+            }
+            order[position] = order[position - 1];
+        }
+        order[position] = f;
+        used++;
+    }
+
+    fprintf(out, "PKCS#11 trace: %llu calls, %.3f ms in the library\n",
+            (unsigned long long) calls, total_ns / 1e6);
+    if (used > 0) {
+        fprintf(out, "%-22s %10s %8s %12s %6s %10s %10s %10s %10s\n",
+                "Function", "Calls", "Errors", "Total ms", "Share", "Mean us", "p50 us", "p99 us", "Max us");
+        for (size_t i = 0; i < used; i++) {
+            trace_print_function(out, trace_function_names[order[i]], &totals[order[i]], total_ns);
+        }
+    }
+    fflush(out);
+
+    pthread_mutex_unlock(&trace_dump_lock);
+    free(totals);
+}
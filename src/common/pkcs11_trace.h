@@ -0,0 +1,45 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __PKCS11_TRACE_H__
+#define __PKCS11_TRACE_H__
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+ * Tracing interposer for the global function list.
+ *
+ * When tracing is enabled, funcs points at a copy of the library's function
+ * list whose entries time each call before returning the library's result.
+ * Every thread records call counts, return codes and a latency histogram per
+ * C_ function in its own buffer, so tracing adds no locking to the calls.
+ *
+ * Tracing is enabled by setting PKCS11_TRACE=1 in the environment or by
+ * calling pkcs11_trace_enable before starting threads which use funcs.
+ * The statistics are written to stderr by pkcs11_finalize_session and
+ * whenever the process receives SIGUSR1.
+ */
+#define PKCS11_TRACE_ENV "PKCS11_TRACE"
+
+CK_RV pkcs11_trace_enable(void);
+CK_BBOOL pkcs11_trace_enabled(void);
+
+void pkcs11_trace_attach(void);
+void pkcs11_trace_dump(FILE *out);
+
+#endif
@@ -0,0 +1,695 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "session_pool.h"
+#include "latency_histogram.h"
+
+struct session_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+    CK_SLOT_ID slot_id;
+
+    // Stack of sessions which are open and not checked out by any thread.
+    CK_SESSION_HANDLE *idle;
+    CK_ULONG idle_count;
+    CK_ULONG capacity;
+
+    // Sessions owned by the pool, including checked out sessions and
+    // sessions which are currently being opened.
+    CK_ULONG open_count;
+    CK_ULONG min_sessions;
+    CK_ULONG max_sessions;
+
+    // Kept to log in again after the cluster drops the login.
+    CK_UTF8CHAR_PTR pin;
+    struct session_pool_health health;
+
+    // Background thread which runs session_pool_check every interval_ms.
+    pthread_t monitor;
+    CK_BBOOL monitoring;
+    CK_BBOOL stop_monitor;
+    pthread_cond_t monitor_wake;
+    CK_ULONG interval_ms;
+};
+
+static CK_RV session_pool_login(struct session_pool *pool, CK_SESSION_HANDLE session) {
+    CK_RV rv = funcs->C_Login(session, CKU_USER, pool->pin, (CK_ULONG) strlen(pool->pin));
+    return CKR_USER_ALREADY_LOGGED_IN == rv ? CKR_OK : rv;
+}
+
+/**
+ * Open a session and make sure it is logged in. Login is shared by the slot,
+ * so this usually finds the user already logged in; it matters when every
+ * session was lost and the slot was logged out with them.
+ */
+static CK_RV session_pool_open_one(struct session_pool *pool, CK_SESSION_HANDLE_PTR session) {
+    CK_RV rv = funcs->C_OpenSession(pool->slot_id, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+                                    NULL, NULL, session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = session_pool_login(pool, *session);
+    if (CKR_OK != rv) {
+        funcs->C_CloseSession(*session);
+        *session = CK_INVALID_HANDLE;
+    }
+    return rv;
+}
+
+/**
+ * Remove idle sessions until at most target sessions are left open, then close them.
+ * Sessions which are checked out are closed later by session_pool_release().
+ * @param pool
+ * @param target
+ * @return Number of sessions closed.
+ */
+static CK_ULONG session_pool_shrink(struct session_pool *pool, CK_ULONG target) {
+    CK_SESSION_HANDLE *closing = NULL;
+    CK_ULONG count = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->open_count > target && pool->idle_count > 0) {
+        count = pool->open_count - target;
+        if (count > pool->idle_count) {
+            count = pool->idle_count;
+        }
+
+        closing = malloc(count * sizeof(CK_SESSION_HANDLE));
+        if (NULL == closing) {
+            count = 0;
+        } else {
+            pool->idle_count -= count;
+            pool->open_count -= count;
+            memcpy(closing, &pool->idle[pool->idle_count], count * sizeof(CK_SESSION_HANDLE));
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (CK_ULONG i = 0; i < count; i++) {
+        funcs->C_CloseSession(closing[i]);
+    }
+    free(closing);
+
+    return count;
+}
+
+/**
+ * Open sessions until at least target sessions are owned by the pool.
+ * @param pool
+ * @param target
+ * @return CK_RV
+ */
+static CK_RV session_pool_grow(struct session_pool *pool, CK_ULONG target) {
+    CK_RV rv = CKR_OK;
+
+    while (CKR_OK == rv) {
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+        pthread_mutex_lock(&pool->lock);
+        if (pool->open_count >= target || pool->open_count >= pool->max_sessions) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->open_count++;
+        pthread_mutex_unlock(&pool->lock);
+
+        rv = session_pool_open_one(pool, &session);
+
+        pthread_mutex_lock(&pool->lock);
+        if (CKR_OK == rv) {
+            pool->idle[pool->idle_count++] = session;
+        } else {
+            pool->open_count--;
+        }
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return rv;
+}
+
+static void session_pool_free_pin(struct session_pool *pool) {
+    volatile CK_BYTE *pin = pool->pin;
+
+    // Clear the pin through a volatile pointer so the stores are not elided.
+    for (size_t i = 0; pin && pin[i]; i++) {
+        pin[i] = 0;
+    }
+    free(pool->pin);
+    pool->pin = NULL;
+}
+
+/**
+ * Create a pool of sessions logged in with the given pin.
+ * min_sessions are opened immediately. More sessions are opened on demand when
+ * every session is checked out, up to max_sessions.
+ * @param pin Copied, so the pool can log in again when the cluster drops the login.
+ * @param min_sessions Must be at least one, so the slot stays logged in.
+ * @param max_sessions
+ * @param pool Location where the new pool will be written
+ * @return CK_RV
+ */
+CK_RV session_pool_create(const CK_UTF8CHAR_PTR pin,
+                          CK_ULONG min_sessions,
+                          CK_ULONG max_sessions,
+                          struct session_pool **pool) {
+    CK_RV rv;
+    struct session_pool *new_pool = NULL;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+    if (!pin || !pool || min_sessions < 1 || max_sessions < min_sessions) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_pool = calloc(1, sizeof(struct session_pool));
+    if (NULL == new_pool) {
+        return CKR_HOST_MEMORY;
+    }
+
+    new_pool->idle = calloc(max_sessions, sizeof(CK_SESSION_HANDLE));
+    if (NULL == new_pool->idle) {
+        free(new_pool);
+        return CKR_HOST_MEMORY;
+    }
+    new_pool->pin = (CK_UTF8CHAR_PTR) strdup((const char *) pin);
+    if (NULL == new_pool->pin) {
+        free(new_pool->idle);
+        free(new_pool);
+        return CKR_HOST_MEMORY;
+    }
+    new_pool->capacity = max_sessions;
+    new_pool->min_sessions = min_sessions;
+    new_pool->max_sessions = max_sessions;
+    pthread_mutex_init(&new_pool->lock, NULL);
+    pthread_cond_init(&new_pool->available, NULL);
+    pthread_cond_init(&new_pool->monitor_wake, NULL);
+
+    rv = pkcs11_get_slot(&new_pool->slot_id);
+    if (CKR_OK != rv) {
+        goto fail;
+    }
+
+    rv = session_pool_open_one(new_pool, &session);
+    if (CKR_OK != rv) {
+        goto fail;
+    }
+
+    new_pool->idle[new_pool->idle_count++] = session;
+    new_pool->open_count = 1;
+
+    rv = session_pool_grow(new_pool, min_sessions);
+    if (CKR_OK != rv) {
+        session_pool_destroy(new_pool);
+        return rv;
+    }
+
+    *pool = new_pool;
+    return CKR_OK;
+
+fail:
+    pthread_cond_destroy(&new_pool->monitor_wake);
+    pthread_cond_destroy(&new_pool->available);
+    pthread_mutex_destroy(&new_pool->lock);
+    session_pool_free_pin(new_pool);
+    free(new_pool->idle);
+    free(new_pool);
+    return rv;
+}
+
+/**
+ * Check a session out of the pool, waiting for one to be released if the pool
+ * has already opened max_sessions.
+ * @param pool
+ * @param session
+ * @return CK_RV
+ */
+CK_RV session_pool_acquire(struct session_pool *pool, CK_SESSION_HANDLE_PTR session) {
+    CK_RV rv;
+
+    if (!pool || !session) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (0 == pool->idle_count && pool->open_count >= pool->max_sessions) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+
+    if (pool->idle_count > 0) {
+        *session = pool->idle[--pool->idle_count];
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_OK;
+    }
+
+    // Every session is busy but the pool may still grow.
+    pool->open_count++;
+    pthread_mutex_unlock(&pool->lock);
+
+    rv = session_pool_open_one(pool, session);
+    if (CKR_OK != rv) {
+        pthread_mutex_lock(&pool->lock);
+        pool->open_count--;
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return rv;
+}
+
+/**
+ * Check a session out of the pool without waiting.
+ * @param pool
+ * @param session
+ * @return CKR_SESSION_COUNT if every session is checked out and the pool can not grow.
+ */
+CK_RV session_pool_try_acquire(struct session_pool *pool, CK_SESSION_HANDLE_PTR session) {
+    CK_RV rv;
+
+    if (!pool || !session) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count > 0) {
+        *session = pool->idle[--pool->idle_count];
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_OK;
+    }
+
+    if (pool->open_count >= pool->max_sessions) {
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_SESSION_COUNT;
+    }
+
+    pool->open_count++;
+    pthread_mutex_unlock(&pool->lock);
+
+    rv = session_pool_open_one(pool, session);
+    if (CKR_OK != rv) {
+        pthread_mutex_lock(&pool->lock);
+        pool->open_count--;
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return rv;
+}
+
+/**
+ * Return a session to the pool. If the pool has been shrunk below the number
+ * of open sessions, the session is closed instead.
+ * @param pool
+ * @param session
+ */
+void session_pool_release(struct session_pool *pool, CK_SESSION_HANDLE session) {
+    if (!pool || CK_INVALID_HANDLE == session) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->open_count > pool->max_sessions) {
+        pool->open_count--;
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+        funcs->C_CloseSession(session);
+        return;
+    }
+
+    pool->idle[pool->idle_count++] = session;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Hand back a session which failed with an error for which
+ * session_pool_is_lost is true. The session is closed instead of being
+ * reused, and the next session_pool_check opens a replacement if the pool
+ * has fallen below min_sessions.
+ * @param pool
+ * @param session
+ */
+void session_pool_discard(struct session_pool *pool, CK_SESSION_HANDLE session) {
+    if (!pool || CK_INVALID_HANDLE == session) {
+        return;
+    }
+
+    // The session is most likely gone already, so the result does not matter.
+    funcs->C_CloseSession(session);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->open_count--;
+    pool->health.lost++;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Whether an error means the session can not be used again, because it was
+ * closed or the HSM it was connected to failed.
+ * @param rv
+ * @return CK_TRUE if the session should be discarded
+ */
+CK_BBOOL session_pool_is_lost(CK_RV rv) {
+    switch (rv) {
+        case CKR_SESSION_HANDLE_INVALID:
+        case CKR_SESSION_CLOSED:
+        case CKR_DEVICE_ERROR:
+        case CKR_DEVICE_REMOVED:
+        case CKR_TOKEN_NOT_PRESENT:
+            return CK_TRUE;
+        default:
+            return CK_FALSE;
+    }
+}
+
+/**
+ * Replace a lost session with a new logged in one, and return it to the pool.
+ * If no session can be opened, the pool gives up the lost session's place.
+ */
+static CK_RV session_pool_reconnect(struct session_pool *pool, CK_SESSION_HANDLE lost, uint64_t lost_at) {
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_RV rv;
+
+    funcs->C_CloseSession(lost);
+
+    rv = session_pool_open_one(pool, &session);
+    if (CKR_OK != rv) {
+        pthread_mutex_lock(&pool->lock);
+        pool->open_count--;
+        pool->health.reconnect_failures++;
+        pool->health.last_error = rv;
+        pthread_cond_signal(&pool->available);
+        pthread_mutex_unlock(&pool->lock);
+        return rv;
+    }
+
+    uint64_t recovery_ns = latency_now_ns() - lost_at;
+    pthread_mutex_lock(&pool->lock);
+    pool->health.reconnects++;
+    pool->health.last_recovery_ns = recovery_ns;
+    if (recovery_ns > pool->health.max_recovery_ns) {
+        pool->health.max_recovery_ns = recovery_ns;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    session_pool_release(pool, session);
+    return CKR_OK;
+}
+
+/**
+ * Probe every idle session with C_GetSessionInfo. Sessions which were logged
+ * out are logged in again, and lost sessions are closed and replaced. Then
+ * sessions are opened up to min_sessions, replacing discarded sessions.
+ * Each session is checked out only while it is probed: the sessions idle
+ * longest are taken one at a time from the bottom of the stack, while
+ * acquirers keep taking recently released ones from the top.
+ * @param pool
+ * @return CKR_OK if every idle session is usable, otherwise the last error
+ */
+CK_RV session_pool_check(struct session_pool *pool) {
+    CK_ULONG count;
+    CK_ULONG min_sessions;
+    CK_RV result = CKR_OK;
+
+    if (!pool) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    count = pool->idle_count;
+    min_sessions = pool->min_sessions;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (CK_ULONG i = 0; i < count; i++) {
+        CK_SESSION_HANDLE session;
+        CK_SESSION_INFO info;
+        CK_BBOOL relogin = CK_FALSE;
+        CK_RV rv;
+
+        pthread_mutex_lock(&pool->lock);
+        if (0 == pool->idle_count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        session = pool->idle[0];
+        pool->idle_count--;
+        memmove(&pool->idle[0], &pool->idle[1], pool->idle_count * sizeof(CK_SESSION_HANDLE));
+        pthread_mutex_unlock(&pool->lock);
+
+        rv = funcs->C_GetSessionInfo(session, &info);
+        if (CKR_OK == rv && (CKS_RW_PUBLIC_SESSION == info.state || CKS_RO_PUBLIC_SESSION == info.state)) {
+            relogin = CK_TRUE;
+            rv = session_pool_login(pool, session);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->health.probes++;
+        if (CKR_OK == rv && relogin) {
+            pool->health.relogins++;
+        } else if (CKR_OK != rv) {
+            pool->health.lost++;
+            pool->health.last_error = rv;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (CKR_OK == rv) {
+            session_pool_release(pool, session);
+        } else {
+            // A session which can not be logged in is replaced the same way as a lost one.
+            rv = session_pool_reconnect(pool, session, latency_now_ns());
+            if (CKR_OK != rv) {
+                result = rv;
+            }
+        }
+    }
+
+    CK_RV rv = session_pool_grow(pool, min_sessions);
+    return CKR_OK != rv ? rv : result;
+}
+
+static void *session_pool_monitor_run(void *arg) {
+    struct session_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop_monitor) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pool->interval_ms / 1000;
+        deadline.tv_nsec += (long) (pool->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!pool->stop_monitor
+               && 0 == pthread_cond_timedwait(&pool->monitor_wake, &pool->lock, &deadline)) {
+        }
+        if (pool->stop_monitor) {
+            break;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        session_pool_check(pool);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Start a background thread which runs session_pool_check every interval_ms.
+ * @param pool
+ * @param interval_ms
+ * @return CKR_FUNCTION_FAILED if the monitor is already running, otherwise CK_RV
+ */
+CK_RV session_pool_monitor_start(struct session_pool *pool, CK_ULONG interval_ms) {
+    if (!pool || 0 == interval_ms) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->monitoring) {
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_FUNCTION_FAILED;
+    }
+    pool->interval_ms = interval_ms;
+    pool->stop_monitor = CK_FALSE;
+    if (0 != pthread_create(&pool->monitor, NULL, session_pool_monitor_run, pool)) {
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_GENERAL_ERROR;
+    }
+    pool->monitoring = CK_TRUE;
+    pthread_mutex_unlock(&pool->lock);
+
+    return CKR_OK;
+}
+
+/**
+ * Stop the monitor thread, waiting for a check in progress to finish.
+ * @param pool
+ */
+void session_pool_monitor_stop(struct session_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->monitoring) {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pool->stop_monitor = CK_TRUE;
+    pthread_cond_signal(&pool->monitor_wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(pool->monitor, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->monitoring = CK_FALSE;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Read the pool's health counters.
+ * @param pool
+ * @param health
+ */
+void session_pool_health(struct session_pool *pool, struct session_pool_health *health) {
+    if (!pool || !health) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *health = pool->health;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Change the bounds of the pool. Sessions are opened to reach the new minimum,
+ * and idle sessions are closed to reach the new maximum. Checked out sessions
+ * above the new maximum are closed as they are released.
+ * @param pool
+ * @param min_sessions
+ * @param max_sessions
+ * @return CK_RV
+ */
+CK_RV session_pool_resize(struct session_pool *pool, CK_ULONG min_sessions, CK_ULONG max_sessions) {
+    if (!pool || min_sessions < 1 || max_sessions < min_sessions) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (max_sessions > pool->capacity) {
+        CK_SESSION_HANDLE *idle = realloc(pool->idle, max_sessions * sizeof(CK_SESSION_HANDLE));
+        if (NULL == idle) {
+            pthread_mutex_unlock(&pool->lock);
+            return CKR_HOST_MEMORY;
+        }
+        pool->idle = idle;
+        pool->capacity = max_sessions;
+    }
+    pool->min_sessions = min_sessions;
+    pool->max_sessions = max_sessions;
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+
+    session_pool_shrink(pool, max_sessions);
+    return session_pool_grow(pool, min_sessions);
+}
+
+/**
+ * Close idle sessions above min_sessions. Call this when load drops to give
+ * sessions back to the cluster.
+ * @param pool
+ * @return Number of sessions closed.
+ */
+CK_ULONG session_pool_trim(struct session_pool *pool) {
+    CK_ULONG min_sessions;
+
+    if (!pool) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    min_sessions = pool->min_sessions;
+    pthread_mutex_unlock(&pool->lock);
+
+    return session_pool_shrink(pool, min_sessions);
+}
+
+/**
+ * Read the number of sessions owned by the pool, and how many of them are idle.
+ * @param pool
+ * @param open_sessions
+ * @param idle_sessions
+ */
+void session_pool_stats(struct session_pool *pool, CK_ULONG *open_sessions, CK_ULONG *idle_sessions) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (open_sessions) {
+        *open_sessions = pool->open_count;
+    }
+    if (idle_sessions) {
+        *idle_sessions = pool->idle_count;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stop the monitor, then logout and close every session in the pool.
+ * All sessions must have been released before the pool is destroyed.
+ * @param pool
+ */
+void session_pool_destroy(struct session_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    session_pool_monitor_stop(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->idle_count < pool->open_count) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pool->idle_count > 0) {
+        funcs->C_Logout(pool->idle[0]);
+    }
+    for (CK_ULONG i = 0; i < pool->idle_count; i++) {
+        funcs->C_CloseSession(pool->idle[i]);
+    }
+
+    pthread_cond_destroy(&pool->monitor_wake);
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->lock);
+    session_pool_free_pin(pool);
+    free(pool->idle);
+    free(pool);
+}
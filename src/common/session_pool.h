@@ -0,0 +1,82 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SESSION_POOL_H__
+#define __SESSION_POOL_H__
+
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * A pool of opened and logged in sessions on the CloudHSM slot.
+ *
+ * Login state in PKCS#11 is shared by every session on a slot, so the pool
+ * keeps at least one session open for its whole lifetime. Sessions are
+ * opened on demand up to max_sessions, each one logged in unless the slot
+ * already is, and handed to one thread at a time.
+ *
+ * Sessions die when the HSM they are connected to fails over or restarts,
+ * and the cluster may log the application out with them. The pool keeps the
+ * pin so it can replace such sessions itself: session_pool_check probes each
+ * idle session with C_GetSessionInfo, logs in again if the slot was logged
+ * out, and reopens sessions which are gone. session_pool_monitor_start runs
+ * the check on a background thread, so failed sessions are replaced before
+ * a request picks them up. Callers which see a session fail with an error
+ * for which session_pool_is_lost is true hand it back with
+ * session_pool_discard rather than session_pool_release.
+ */
+struct session_pool;
+
+struct session_pool_health {
+    CK_ULONG probes;
+    // Sessions found closed or on a failed device, and discarded sessions.
+    CK_ULONG lost;
+    // Sessions found logged out and logged in again.
+    CK_ULONG relogins;
+    // Lost sessions replaced with a new logged in session.
+    CK_ULONG reconnects;
+    CK_ULONG reconnect_failures;
+    CK_RV last_error;
+    // Time from finding a session lost to its replacement being idle in the pool.
+    uint64_t last_recovery_ns;
+    uint64_t max_recovery_ns;
+};
+
+CK_RV session_pool_create(const CK_UTF8CHAR_PTR pin,
+                          CK_ULONG min_sessions,
+                          CK_ULONG max_sessions,
+                          struct session_pool **pool);
+
+CK_RV session_pool_acquire(struct session_pool *pool, CK_SESSION_HANDLE_PTR session);
+CK_RV session_pool_try_acquire(struct session_pool *pool, CK_SESSION_HANDLE_PTR session);
+void session_pool_release(struct session_pool *pool, CK_SESSION_HANDLE session);
+void session_pool_discard(struct session_pool *pool, CK_SESSION_HANDLE session);
+
+CK_BBOOL session_pool_is_lost(CK_RV rv);
+CK_RV session_pool_check(struct session_pool *pool);
+CK_RV session_pool_monitor_start(struct session_pool *pool, CK_ULONG interval_ms);
+void session_pool_monitor_stop(struct session_pool *pool);
+void session_pool_health(struct session_pool *pool, struct session_pool_health *health);
+
+CK_RV session_pool_resize(struct session_pool *pool, CK_ULONG min_sessions, CK_ULONG max_sessions);
+CK_ULONG session_pool_trim(struct session_pool *pool);
+
+void session_pool_stats(struct session_pool *pool, CK_ULONG *open_sessions, CK_ULONG *idle_sessions);
+
+void session_pool_destroy(struct session_pool *pool);
+
+#endif
@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <common.h>
+#include <output_length.h>
 
 #define AES_GCM_IV_SIZE 12
 #define AES_GCM_TAG_SIZE 16
@@ -177,37 +178,28 @@ CK_RV aes_gcm_sample(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR aes_key) {
         goto done;
     }
 
-    // Determine how much memory is required to store the ciphertext.
-    rv = funcs->C_Encrypt(session, plaintext, plaintext_length, NULL, &ciphertext_length);
-
-    // The ciphertext will be prepended with the HSM generated IV
-    // so the length must include the IV
-    ciphertext_length += AES_GCM_IV_SIZE;
-    if (CKR_OK != rv) {
-        fprintf(stderr, "Failed to find GCM ciphertext length\n");
-        goto done;
-    }
-
-    // Allocate memory to store the ciphertext.
-    ciphertext = malloc(ciphertext_length);
+    // Encrypt the data. The ciphertext and tag fit in a buffer sized from the mechanism,
+    // so a single C_Encrypt call is enough. The ciphertext will be prepended with the
+    // HSM generated IV, so the buffer also has room for the IV.
+    CK_ULONG ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_ENCRYPT, &mech, 0, plaintext_length);
+    ciphertext = malloc(AES_GCM_IV_SIZE + ciphertext_capacity);
     if (NULL == ciphertext) {
-        rv = 1;
+        rv = CKR_HOST_MEMORY;
         fprintf(stderr, "Failed to allocate ciphertext memory\n");
         goto done;
     }
-    memset(ciphertext, 0, ciphertext_length);
 
-    // Encrypt the data.
+    ciphertext_length = ciphertext_capacity;
     rv = funcs->C_Encrypt(session, plaintext, plaintext_length, ciphertext + AES_GCM_IV_SIZE, &ciphertext_length);
-
-    // Prepend HSM generated IV to ciphertext buffer
-    memcpy(ciphertext, iv, AES_GCM_IV_SIZE);
-    ciphertext_length += AES_GCM_IV_SIZE;
     if (CKR_OK != rv) {
         fprintf(stderr, "Encryption failed: %lu\n", rv);
         goto done;
     }
 
+    // Prepend HSM generated IV to ciphertext buffer
+    memcpy(ciphertext, iv, AES_GCM_IV_SIZE);
+    ciphertext_length += AES_GCM_IV_SIZE;
+
     // Ciphertext buffer = IV || ciphertext || TAG
     // Print the HSM generated IV
     printf("IV: ");
@@ -230,8 +222,6 @@ CK_RV aes_gcm_sample(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR aes_key) {
 
     // Use the IV that was prepended -- The first AES_GCM_IV_SIZE bytes of the ciphertext.
     params.pIv = ciphertext;
-    mech.ulParameterLen = sizeof(params);
-    mech.pParameter = &params;
 
     rv = funcs->C_DecryptInit(session, &mech, *aes_key);
     if (CKR_OK != rv) {
@@ -239,32 +229,18 @@ CK_RV aes_gcm_sample(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR aes_key) {
         goto done;
     }
 
-    // Determine the length of decrypted ciphertext.
+    // Decrypt the ciphertext. The plaintext is never longer than the ciphertext.
     CK_ULONG decrypted_ciphertext_length = 0;
-    rv = funcs->C_Decrypt(session, ciphertext + AES_GCM_IV_SIZE, ciphertext_length - AES_GCM_IV_SIZE,
-                          NULL, &decrypted_ciphertext_length);
-
+    CK_ULONG decrypted_ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_DECRYPT, &mech, 0,
+                                                                      ciphertext_length - AES_GCM_IV_SIZE);
+    rv = pkcs11_single_part(funcs->C_Decrypt, session, ciphertext + AES_GCM_IV_SIZE, ciphertext_length - AES_GCM_IV_SIZE,
+                            &decrypted_ciphertext, &decrypted_ciphertext_capacity, &decrypted_ciphertext_length);
     if (CKR_OK != rv) {
         fprintf(stderr, "Decryption failed: %lu\n", rv);
         goto done;
     }
 
-    // Allocate memory for the decrypted cipher text.
-    decrypted_ciphertext = malloc(decrypted_ciphertext_length);
-    if (NULL == decrypted_ciphertext) {
-        rv = 1;
-        fprintf(stderr, "Could not allocate memory for decrypted ciphertext\n");
-        goto done;
-    }
-
-    // Decrypt the ciphertext.
-    rv = funcs->C_Decrypt(session, ciphertext + AES_GCM_IV_SIZE, ciphertext_length - AES_GCM_IV_SIZE,
-                          decrypted_ciphertext, &decrypted_ciphertext_length);
-    if (CKR_OK != rv) {
-        fprintf(stderr, "Decryption failed: %lu\n", rv);
-        goto done;
-    }
-    printf("Decrypted ciphertext: %.*s\n", (int)decrypted_ciphertext_length, decrypted_ciphertext);
+    printf("Decrypted ciphertext: %.*s\n", (int) decrypted_ciphertext_length, decrypted_ciphertext);
     printf("Decrypted ciphertext length: %lu\n", decrypted_ciphertext_length);
 
 done:
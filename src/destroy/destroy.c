@@ -23,6 +23,9 @@
 
 #include "common.h"
 #include "destroy.h"
+#ifndef _WIN32
+#include "object_cache.h"
+#endif
 
 /**
  * Destroy object.
@@ -47,5 +50,11 @@ CK_RV destroy_object(
             session,
             object );
 
+#ifndef _WIN32
+    if (CKR_OK == rv) {
+        object_cache_invalidate_handle(object);
+    }
+#endif
+
     return rv;
 }
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <errno.h>
+
+#include "digest.h"
+
+/**
+ * Generate a digest of a given message. This function will allocate the required memory to store the digest.
+ * Available mechanisms are documented at https://docs.aws.amazon.com/cloudhsm/latest/userguide/pkcs11-mechanisms.html
+ * @param session
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param digest
+ * @param digest_length
+ * @return CK_RV
+ */
+CK_RV generateDigest(CK_SESSION_HANDLE session,
+                     CK_MECHANISM_TYPE mechanism,
+                     CK_BYTE_PTR data,
+                     CK_ULONG data_length,
+                     CK_BYTE **digest,
+                     CK_ULONG_PTR digest_length) {
+    CK_RV rv;
+    CK_MECHANISM mech;
+
+    mech.mechanism = mechanism;
+    mech.ulParameterLen = 0;
+    mech.pParameter = NULL;
+
+    rv = funcs->C_DigestInit(session, &mech);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    // The digest length is known from the mechanism, so a single C_Digest call is enough.
+    CK_ULONG capacity = pkcs11_max_output_length(PKCS11_OPERATION_DIGEST, &mech, 0, data_length);
+    *digest = NULL;
+    rv = pkcs11_single_part(funcs->C_Digest, session, data, data_length, digest, &capacity, digest_length);
+    return rv;
+}
+
+/**
+ * Generate a digest of a given message in multiple parts. This function will allocate the required memory to store the digest.
+ * Available mechanisms are documented at https://docs.aws.amazon.com/cloudhsm/latest/userguide/pkcs11-mechanisms.html
+ * @param session       PKCS11 session
+ * @param mechanism     Mechanism type
+ * @param data          Data to generate digest for
+ * @param data_length   Length of the previous arg 'data'
+ * @param digest        Pointer to where the generated digest will be stored
+ * @param digest_length Length of the generated digest
+ * @return CK_RV        PKCS11 return code
+ */
+CK_RV generate_multi_part_digest(CK_SESSION_HANDLE session,
+                     CK_MECHANISM_TYPE mechanism,
+                     CK_BYTE_PTR data,
+                     CK_ULONG data_length,
+                     CK_BYTE **digest,
+                     CK_ULONG_PTR digest_length) {
+    CK_RV rv;
+    CK_MECHANISM mech;
+
+    mech.mechanism = mechanism;
+    mech.ulParameterLen = 0;
+    mech.pParameter = NULL;
+
+    rv = funcs->C_DigestInit(session, &mech);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = funcs->C_DigestUpdate(session, data, data_length);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    // The digest length is known from the mechanism, so only query it if the mechanism is unknown.
+    // C_DigestFinal won't terminate the session if we just determine digest length.
+    *digest_length = pkcs11_max_output_length(PKCS11_OPERATION_DIGEST, &mech, 0, data_length);
+    if (0 == *digest_length) {
+        rv = funcs->C_DigestFinal(session, NULL, digest_length);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+    }
+
+    *digest = malloc(*digest_length);
+    if (NULL == *digest) {
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = funcs->C_DigestFinal(session, *digest, digest_length);
+    return rv;
+}
+
+#ifndef _WIN32
+static CK_RV digest_window(void *context, CK_BYTE_PTR window, CK_ULONG window_length) {
+    return funcs->C_DigestUpdate(*(CK_SESSION_HANDLE *) context, window, window_length);
+}
+
+/**
+ * Generate a digest of a file without reading it into memory. The file is
+ * mapped a span at a time and sent in windows of window_size bytes, one
+ * C_DigestUpdate each. This function will allocate the required memory to store the digest.
+ * @param session       PKCS11 session
+ * @param mechanism     Mechanism type
+ * @param path          File to digest
+ * @param window_size   Bytes per C_DigestUpdate, or 0 for MAPPED_FILE_DEFAULT_WINDOW
+ * @param digest        Pointer to where the generated digest will be stored
+ * @param digest_length Length of the generated digest
+ * @return CK_RV        PKCS11 return code, or CKR_FUNCTION_FAILED with errno set
+ *                      if the file could not be read
+ */
+CK_RV generate_file_digest(CK_SESSION_HANDLE session,
+                           CK_MECHANISM_TYPE mechanism,
+                           const char *path,
+                           CK_ULONG window_size,
+                           CK_BYTE **digest,
+                           CK_ULONG_PTR digest_length) {
+    CK_RV rv;
+    CK_MECHANISM mech = {mechanism, NULL, 0};
+    CK_BYTE discard[64];
+
+    *digest = NULL;
+    rv = funcs->C_DigestInit(session, &mech);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = mapped_file_each_window(path, window_size, digest_window, &session);
+    if (CKR_OK != rv) {
+        // Finish the operation if the file, rather than the HSM, failed.
+        int saved_errno = errno;
+        *digest_length = sizeof(discard);
+        funcs->C_DigestFinal(session, discard, digest_length);
+        errno = saved_errno;
+        return rv;
+    }
+
+    *digest_length = pkcs11_max_output_length(PKCS11_OPERATION_DIGEST, &mech, 0, 0);
+    if (0 == *digest_length) {
+        rv = funcs->C_DigestFinal(session, NULL, digest_length);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+    }
+
+    *digest = malloc(*digest_length);
+    if (NULL == *digest) {
+        return CKR_HOST_MEMORY;
+    }
+
+    return funcs->C_DigestFinal(session, *digest, digest_length);
+}
+#endif
@@ -18,51 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "common.h"
-
-/**
- * Generate a digest of a given message. This function will allocate the required memory to store the digest.
- * Available mechanisms are documented at https://docs.aws.amazon.com/cloudhsm/latest/userguide/pkcs11-mechanisms.html
- * @param session
- * @param mechanism
- * @param data
- * @param data_length
- * @param digest
- * @param digest_length
- * @return CK_RV
- */
-CK_RV generateDigest(CK_SESSION_HANDLE session,
-                     CK_MECHANISM_TYPE mechanism,
-                     CK_BYTE_PTR data,
-                     CK_ULONG data_length,
-                     CK_BYTE **digest,
-                     CK_ULONG_PTR digest_length) {
-    CK_RV rv;
-    CK_MECHANISM mech;
-
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
-
-    rv = funcs->C_DigestInit(session, &mech);
-    if (rv != CKR_OK) {
-        return rv;
-    }
-
-    // C_Digest won't terminate the session if we just determine digest length.
-    rv = funcs->C_Digest(session, data, data_length, NULL, digest_length);
-    if (CKR_OK != rv) {
-        return rv;
-    }
-
-    *digest = malloc(*digest_length);
-    if (NULL == *digest) {
-        return CKR_HOST_MEMORY;
-    }
-
-    rv = funcs->C_Digest(session, data, data_length, *digest, digest_length);
-    return rv;
-}
+#include "digest.h"
 
 int main(int argc, char **argv) {
     CK_RV rv;
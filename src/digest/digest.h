@@ -0,0 +1,48 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_DIGEST_H
+#define AWS_CLOUDHSM_PKCS11_DIGEST_H
+
+#include <stdio.h>
+#include <memory.h>
+#include <stdlib.h>
+#include "common.h"
+#include "output_length.h"
+#include "mapped_file.h"
+
+CK_RV generateDigest(CK_SESSION_HANDLE session,
+                     CK_MECHANISM_TYPE mechanism,
+                     CK_BYTE_PTR data,
+                     CK_ULONG data_length,
+                     CK_BYTE **digest,
+                     CK_ULONG_PTR digest_length);
+CK_RV generate_multi_part_digest(CK_SESSION_HANDLE session,
+                                 CK_MECHANISM_TYPE mechanism,
+                                 CK_BYTE_PTR data,
+                                 CK_ULONG data_length,
+                                 CK_BYTE **digest,
+                                 CK_ULONG_PTR digest_length);
+#ifndef _WIN32
+CK_RV generate_file_digest(CK_SESSION_HANDLE session,
+                           CK_MECHANISM_TYPE mechanism,
+                           const char *path,
+                           CK_ULONG window_size,
+                           CK_BYTE **digest,
+                           CK_ULONG_PTR digest_length);
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "digest.h"
+
+#define SAMPLE_FILE_SIZE (128 * 1024 * 1024)
+#define SAMPLE_WRITE_SIZE (1024 * 1024)
+
+/**
+ * Write SAMPLE_FILE_SIZE bytes to a new temporary file.
+ * @param path Template for mkstemp, replaced with the file's name
+ * @return CK_RV
+ */
+static CK_RV write_sample_file(char *path) {
+    CK_BYTE_PTR block = malloc(SAMPLE_WRITE_SIZE);
+    CK_RV rv = CKR_OK;
+    int fd;
+
+    if (NULL == block) {
+        return CKR_HOST_MEMORY;
+    }
+    for (size_t i = 0; i < SAMPLE_WRITE_SIZE; i++) {
+        block[i] = (CK_BYTE) (i * 131 + 17);
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        free(block);
+        return CKR_FUNCTION_FAILED;
+    }
+    for (size_t written = 0; written < SAMPLE_FILE_SIZE && CKR_OK == rv; written += SAMPLE_WRITE_SIZE) {
+        if (SAMPLE_WRITE_SIZE != write(fd, block, SAMPLE_WRITE_SIZE)) {
+            perror("write");
+            rv = CKR_FUNCTION_FAILED;
+        }
+    }
+
+    close(fd);
+    free(block);
+    return rv;
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * Digest a large file from a mapping, then from a heap buffer, and compare
+ * how far each raises the peak resident set.
+ * @param session Active PKCS#11 session
+ * @return CK_RV
+ */
+CK_RV digest_file_sample(CK_SESSION_HANDLE session) {
+    char path[] = "/tmp/hsm_digest_XXXXXX";
+    CK_BYTE_PTR mapped_digest = NULL;
+    CK_BYTE_PTR heap_digest = NULL;
+    CK_BYTE_PTR data = NULL;
+    CK_ULONG mapped_digest_length = 0;
+    CK_ULONG heap_digest_length = 0;
+    CK_RV rv;
+
+    rv = write_sample_file(path);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    long before = peak_rss_kb();
+    rv = generate_file_digest(session, CKM_SHA256, path, 0, &mapped_digest, &mapped_digest_length);
+    if (CKR_OK != rv) {
+        printf("Digest of the mapped file failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Mapped file: peak RSS grew by %ld KiB\n", peak_rss_kb() - before);
+
+    // The same digest the way generate_multi_part_digest is usually fed: the whole file in memory.
+    FILE *file = fopen(path, "rb");
+    data = malloc(SAMPLE_FILE_SIZE);
+    before = peak_rss_kb();
+    if (NULL == file || NULL == data || 1 != fread(data, SAMPLE_FILE_SIZE, 1, file)) {
+        printf("Failed to read the file into memory\n");
+        rv = CKR_FUNCTION_FAILED;
+    }
+    if (NULL != file) {
+        fclose(file);
+    }
+    if (CKR_OK == rv) {
+        rv = generate_multi_part_digest(session, CKM_SHA256, data, SAMPLE_FILE_SIZE, &heap_digest, &heap_digest_length);
+    }
+    if (CKR_OK != rv) {
+        printf("Digest of the buffered file failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Heap buffer: peak RSS grew by %ld KiB\n", peak_rss_kb() - before);
+
+    printf("Digest: ");
+    print_bytes_as_hex(mapped_digest, mapped_digest_length);
+    if (mapped_digest_length != heap_digest_length || 0 != memcmp(mapped_digest, heap_digest, heap_digest_length)) {
+        printf("The digests differ\n");
+        rv = CKR_GENERAL_ERROR;
+    }
+
+done:
+    unlink(path);
+    free(data);
+    free(mapped_digest);
+    free(heap_digest);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    printf("\nDigest a %d MiB file\n", SAMPLE_FILE_SIZE / (1024 * 1024));
+    if (CKR_OK == digest_file_sample(session)) {
+        rc = EXIT_SUCCESS;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return rc;
+}
@@ -18,57 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "common.h"
-
-/**
- * Generate a digest of a given message in multiple parts. This function will allocate the required memory to store the digest.
- * Available mechanisms are documented at https://docs.aws.amazon.com/cloudhsm/latest/userguide/pkcs11-mechanisms.html
- * @param session       PKCS11 session
- * @param mechanism     Mechanism type
- * @param data          Data to generate digest for
- * @param data_length   Length of the previous arg 'data'
- * @param digest        Pointer to where the generated digest will be stored
- * @param digest_length Length of the generated digest
- * @return CK_RV        PKCS11 return code
- */
-CK_RV generate_multi_part_digest(CK_SESSION_HANDLE session,
-                     CK_MECHANISM_TYPE mechanism,
-                     CK_BYTE_PTR data,
-                     CK_ULONG data_length,
-                     CK_BYTE **digest,
-                     CK_ULONG_PTR digest_length) {
-    CK_RV rv;
-    CK_MECHANISM mech;
-
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
-
-    rv = funcs->C_DigestInit(session, &mech);
-    if (CKR_OK != rv) {
-        return rv;
-    }
-
-    rv = funcs->C_DigestUpdate(session, data, data_length);
-    if (CKR_OK != rv) {
-        return rv;
-    }
-
-    // First determine the digest length by passing in a NULL buffer
-    // C_DigestFinal won't terminate the session if we just determine digest length.
-    rv = funcs->C_DigestFinal(session, NULL, digest_length);
-    if (CKR_OK != rv) {
-        return rv;
-    }
-
-    *digest = malloc(*digest_length);
-    if (NULL == *digest) {
-        return CKR_HOST_MEMORY;
-    }
-
-    rv = funcs->C_DigestFinal(session, *digest, digest_length);
-    return rv;
-}
+#include "digest.h"
 
 int main(int argc, char **argv) {
     CK_RV rv;
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "tree_hash.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_THREADS 8
+#define SAMPLE_DATA_SIZE (64 * 1024 * 1024)
+#define REFERENCE_DATA_SIZE 150001
+#define REFERENCE_LEAF_SIZE 4096
+
+/**
+ * Digest a buffer as one C_DigestUpdate stream on one session, the way
+ * generate_multi_part_digest does, in windows the HSM takes in one request.
+ */
+static CK_RV stream_digest(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG length,
+                           CK_BYTE_PTR digest, CK_ULONG_PTR digest_length) {
+    CK_MECHANISM mech = {CKM_SHA256, NULL, 0};
+    CK_RV rv = funcs->C_DigestInit(session, &mech);
+
+    for (CK_ULONG offset = 0; offset < length && CKR_OK == rv; offset += MAPPED_FILE_DEFAULT_WINDOW) {
+        CK_ULONG window = length - offset < MAPPED_FILE_DEFAULT_WINDOW ? length - offset : MAPPED_FILE_DEFAULT_WINDOW;
+        rv = funcs->C_DigestUpdate(session, data + offset, window);
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return funcs->C_DigestFinal(session, digest, digest_length);
+}
+
+/**
+ * RFC 6962 MTH written out recursively, one single-part digest per node, to
+ * check the layout tree_hash builds bottom up.
+ */
+static CK_RV reference_tree_hash(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG leaf_count,
+                                 CK_ULONG data_length, CK_BYTE_PTR root) {
+    CK_BYTE input[1 + REFERENCE_LEAF_SIZE];
+    CK_BYTE_PTR digest = NULL;
+    CK_ULONG digest_length = 0;
+    CK_RV rv;
+
+    if (1 == leaf_count) {
+        input[0] = 0x00;
+        memcpy(input + 1, data, data_length);
+        rv = generateDigest(session, CKM_SHA256, input, 1 + data_length, &digest, &digest_length);
+    } else {
+        CK_ULONG split = 1;
+        while (2 * split < leaf_count) {
+            split *= 2;
+        }
+
+        input[0] = 0x01;
+        rv = reference_tree_hash(session, data, split, split * REFERENCE_LEAF_SIZE, input + 1);
+        if (CKR_OK == rv) {
+            rv = reference_tree_hash(session, data + split * REFERENCE_LEAF_SIZE, leaf_count - split,
+                                     data_length - split * REFERENCE_LEAF_SIZE, input + 33);
+        }
+        if (CKR_OK == rv) {
+            rv = generateDigest(session, CKM_SHA256, input, 65, &digest, &digest_length);
+        }
+    }
+
+    if (CKR_OK == rv) {
+        memcpy(root, digest, 32);
+    }
+    free(digest);
+    return rv;
+}
+
+/**
+ * Check tree_hash against the recursive definition on a small input with
+ * short leaves, the last one partial.
+ */
+static CK_RV check_layout(struct session_pool *pool) {
+    CK_BYTE_PTR data = malloc(REFERENCE_DATA_SIZE);
+    CK_BYTE expected[32];
+    CK_BYTE root[TREE_HASH_MAX_DIGEST_LENGTH];
+    CK_ULONG root_length = 0;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    if (NULL == data) {
+        return CKR_HOST_MEMORY;
+    }
+    for (CK_ULONG i = 0; i < REFERENCE_DATA_SIZE; i++) {
+        data[i] = (CK_BYTE) (i * 7 + 3);
+    }
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK == rv) {
+        rv = reference_tree_hash(session, data, (REFERENCE_DATA_SIZE + REFERENCE_LEAF_SIZE - 1) / REFERENCE_LEAF_SIZE,
+                                 REFERENCE_DATA_SIZE, expected);
+        session_pool_release(pool, session);
+    }
+    if (CKR_OK == rv) {
+        rv = tree_hash(pool, CKM_SHA256, data, REFERENCE_DATA_SIZE, REFERENCE_LEAF_SIZE, SAMPLE_THREADS,
+                       root, &root_length);
+    }
+    if (CKR_OK == rv && (32 != root_length || 0 != memcmp(root, expected, 32))) {
+        printf("The tree hash does not match RFC 6962\n");
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    free(data);
+    return rv;
+}
+
+/**
+ * Digest a large buffer as one stream, then as a tree on one and on
+ * SAMPLE_THREADS sessions.
+ * @param pool Session pool with SAMPLE_THREADS sessions
+ * @return CK_RV
+ */
+CK_RV tree_digest_sample(struct session_pool *pool) {
+    CK_BYTE_PTR data = malloc(SAMPLE_DATA_SIZE);
+    CK_BYTE digest[TREE_HASH_MAX_DIGEST_LENGTH];
+    CK_BYTE one_thread_root[TREE_HASH_MAX_DIGEST_LENGTH];
+    CK_BYTE root[TREE_HASH_MAX_DIGEST_LENGTH];
+    CK_ULONG digest_length = sizeof(digest);
+    CK_ULONG one_thread_root_length = 0;
+    CK_ULONG root_length = 0;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    if (NULL == data) {
+        return CKR_HOST_MEMORY;
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_DATA_SIZE; i++) {
+        data[i] = (CK_BYTE) (i * 131 + 17);
+    }
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        free(data);
+        return rv;
+    }
+    uint64_t start = latency_now_ns();
+    rv = stream_digest(session, data, SAMPLE_DATA_SIZE, digest, &digest_length);
+    uint64_t elapsed = latency_now_ns() - start;
+    session_pool_release(pool, session);
+    if (CKR_OK != rv) {
+        printf("Stream digest failed: %lu\n", rv);
+        goto done;
+    }
+    printf("One stream: %.0f MiB/s\n", SAMPLE_DATA_SIZE / 1048576.0 / (elapsed / 1e9));
+
+    start = latency_now_ns();
+    rv = tree_hash(pool, CKM_SHA256, data, SAMPLE_DATA_SIZE, 0, 1, one_thread_root, &one_thread_root_length);
+    elapsed = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        printf("Tree hash on one session failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Tree hash, 1 session: %.0f MiB/s\n", SAMPLE_DATA_SIZE / 1048576.0 / (elapsed / 1e9));
+
+    start = latency_now_ns();
+    rv = tree_hash(pool, CKM_SHA256, data, SAMPLE_DATA_SIZE, 0, SAMPLE_THREADS, root, &root_length);
+    elapsed = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        printf("Tree hash on %d sessions failed: %lu\n", SAMPLE_THREADS, rv);
+        goto done;
+    }
+    printf("Tree hash, %d sessions: %.0f MiB/s\n", SAMPLE_THREADS, SAMPLE_DATA_SIZE / 1048576.0 / (elapsed / 1e9));
+
+    printf("Root: ");
+    print_bytes_as_hex(root, root_length);
+    if (root_length != one_thread_root_length || 0 != memcmp(root, one_thread_root, root_length)) {
+        printf("The roots differ\n");
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+
+    rv = check_layout(pool);
+
+done:
+    free(data);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 1, SAMPLE_THREADS, &pool);
+    if (CKR_OK != rv) {
+        printf("Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nTree hash of %d MiB over %d KiB leaves\n", SAMPLE_DATA_SIZE / (1024 * 1024),
+           TREE_HASH_DEFAULT_LEAF_SIZE / 1024);
+    if (CKR_OK == tree_digest_sample(pool)) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
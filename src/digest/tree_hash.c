@@ -0,0 +1,292 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tree_hash.h"
+
+#define TREE_HASH_LEAF_PREFIX 0x00
+#define TREE_HASH_NODE_PREFIX 0x01
+
+/*
+ * One level of the tree. Leaves are digested from the input; every other
+ * level digests pairs of nodes from the level below.
+ */
+struct tree_level {
+    struct session_pool *pool;
+    CK_MECHANISM mechanism;
+    CK_ULONG digest_length;
+    CK_BBOOL leaves;
+    CK_BYTE_PTR data;
+    CK_ULONG data_length;
+    CK_ULONG leaf_size;
+    CK_BYTE_PTR below;
+    CK_ULONG below_count;
+    CK_BYTE_PTR nodes;
+    CK_ULONG node_count;
+    atomic_ulong next_node;
+    atomic_int failed;
+};
+
+struct tree_worker {
+    pthread_t thread;
+    struct tree_level *level;
+    CK_RV rv;
+};
+
+static CK_RV tree_hash_leaf(CK_SESSION_HANDLE session, struct tree_level *level, CK_ULONG leaf) {
+    CK_BYTE prefix = TREE_HASH_LEAF_PREFIX;
+    CK_ULONG offset = leaf * level->leaf_size;
+    CK_ULONG end = level->data_length - offset < level->leaf_size ? level->data_length : offset + level->leaf_size;
+    CK_ULONG digest_length = level->digest_length;
+    CK_RV rv;
+
+    rv = funcs->C_DigestInit(session, &level->mechanism);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = funcs->C_DigestUpdate(session, &prefix, 1);
+    for (; offset < end && CKR_OK == rv; offset += MAPPED_FILE_DEFAULT_WINDOW) {
+        CK_ULONG length = end - offset < MAPPED_FILE_DEFAULT_WINDOW ? end - offset : MAPPED_FILE_DEFAULT_WINDOW;
+        rv = funcs->C_DigestUpdate(session, level->data + offset, length);
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return funcs->C_DigestFinal(session, level->nodes + leaf * level->digest_length, &digest_length);
+}
+
+static CK_RV tree_hash_node(CK_SESSION_HANDLE session, struct tree_level *level, CK_ULONG node) {
+    CK_BYTE input[1 + 2 * TREE_HASH_MAX_DIGEST_LENGTH];
+    CK_ULONG digest_length = level->digest_length;
+    CK_RV rv;
+
+    // An odd node at the end of a level moves up unchanged.
+    if (2 * node + 1 == level->below_count) {
+        memcpy(level->nodes + node * digest_length, level->below + 2 * node * digest_length, digest_length);
+        return CKR_OK;
+    }
+
+    input[0] = TREE_HASH_NODE_PREFIX;
+    memcpy(input + 1, level->below + 2 * node * digest_length, 2 * digest_length);
+
+    rv = funcs->C_DigestInit(session, &level->mechanism);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return funcs->C_Digest(session, input, 1 + 2 * digest_length, level->nodes + node * digest_length, &digest_length);
+}
+
+static void *tree_worker_run(void *arg) {
+    struct tree_worker *worker = arg;
+    struct tree_level *level = worker->level;
+    CK_SESSION_HANDLE session;
+
+    worker->rv = session_pool_acquire(level->pool, &session);
+    if (CKR_OK != worker->rv) {
+        atomic_store(&level->failed, 1);
+        return NULL;
+    }
+
+    while (!atomic_load(&level->failed)) {
+        CK_ULONG node = atomic_fetch_add(&level->next_node, 1);
+        if (node >= level->node_count) {
+            break;
+        }
+
+        worker->rv = level->leaves ? tree_hash_leaf(session, level, node) : tree_hash_node(session, level, node);
+        if (CKR_OK != worker->rv) {
+            atomic_store(&level->failed, 1);
+        }
+    }
+
+    session_pool_release(level->pool, session);
+    return NULL;
+}
+
+/**
+ * Digest every node of a level, on up to the given number of threads.
+ */
+static CK_RV tree_hash_level(struct tree_level *level, CK_ULONG threads) {
+    struct tree_worker *workers;
+    CK_ULONG started = 0;
+    CK_RV rv = CKR_OK;
+
+    if (threads > level->node_count) {
+        threads = level->node_count;
+    }
+    workers = calloc(threads, sizeof(struct tree_worker));
+    if (NULL == workers) {
+        return CKR_HOST_MEMORY;
+    }
+
+    atomic_init(&level->next_node, 0);
+    atomic_init(&level->failed, 0);
+
+    for (; started < threads; started++) {
+        workers[started].level = level;
+        if (0 != pthread_create(&workers[started].thread, NULL, tree_worker_run, &workers[started])) {
+            atomic_store(&level->failed, 1);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+    }
+    for (CK_ULONG i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (CKR_OK == rv) {
+            rv = workers[i].rv;
+        }
+    }
+
+    free(workers);
+    return rv;
+}
+
+/**
+ * Compute the Merkle tree hash of a buffer.
+ * @param pool Session pool; at most threads sessions are used at once
+ * @param mechanism Digest mechanism, such as CKM_SHA256
+ * @param data
+ * @param data_length
+ * @param leaf_size Bytes per leaf, or 0 for TREE_HASH_DEFAULT_LEAF_SIZE
+ * @param threads Number of leaves digested at once
+ * @param root Buffer of at least TREE_HASH_MAX_DIGEST_LENGTH bytes
+ * @param root_length Receives the length of the root
+ * @return CKR_MECHANISM_INVALID for mechanisms of unknown digest length, otherwise CK_RV
+ */
+CK_RV tree_hash(struct session_pool *pool,
+                CK_MECHANISM_TYPE mechanism,
+                CK_BYTE_PTR data,
+                CK_ULONG data_length,
+                CK_ULONG leaf_size,
+                CK_ULONG threads,
+                CK_BYTE_PTR root,
+                CK_ULONG_PTR root_length) {
+    struct tree_level level = {0};
+    CK_RV rv;
+
+    if (!pool || (!data && data_length) || 0 == threads || !root || !root_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    level.pool = pool;
+    level.mechanism.mechanism = mechanism;
+    level.digest_length = pkcs11_max_output_length(PKCS11_OPERATION_DIGEST, &level.mechanism, 0, 0);
+    if (0 == level.digest_length || level.digest_length > TREE_HASH_MAX_DIGEST_LENGTH) {
+        return CKR_MECHANISM_INVALID;
+    }
+    *root_length = level.digest_length;
+
+    // The empty tree is the digest of the empty string.
+    if (0 == data_length) {
+        CK_SESSION_HANDLE session;
+        rv = session_pool_acquire(pool, &session);
+        if (CKR_OK == rv) {
+            rv = funcs->C_DigestInit(session, &level.mechanism);
+            if (CKR_OK == rv) {
+                rv = funcs->C_Digest(session, NULL, 0, root, root_length);
+            }
+            session_pool_release(pool, session);
+        }
+        return rv;
+    }
+
+    level.leaves = CK_TRUE;
+    level.data = data;
+    level.data_length = data_length;
+    level.leaf_size = leaf_size ? leaf_size : TREE_HASH_DEFAULT_LEAF_SIZE;
+    level.node_count = (data_length + level.leaf_size - 1) / level.leaf_size;
+    level.nodes = malloc(level.node_count * level.digest_length);
+    if (NULL == level.nodes) {
+        return CKR_HOST_MEMORY;
+    }
+    rv = tree_hash_level(&level, threads);
+
+    level.leaves = CK_FALSE;
+    while (CKR_OK == rv && level.node_count > 1) {
+        free(level.below);
+        level.below = level.nodes;
+        level.below_count = level.node_count;
+        level.node_count = (level.below_count + 1) / 2;
+        level.nodes = malloc(level.node_count * level.digest_length);
+        if (NULL == level.nodes) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        rv = tree_hash_level(&level, threads);
+    }
+
+    if (CKR_OK == rv) {
+        memcpy(root, level.nodes, level.digest_length);
+    }
+    free(level.below);
+    free(level.nodes);
+    return rv;
+}
+
+/**
+ * Compute the Merkle tree hash of a file. The whole file is mapped, and
+ * threads read their leaves from the mapping concurrently.
+ * Parameters are as for tree_hash.
+ * @return CKR_FUNCTION_FAILED with errno set if the file cannot be mapped, otherwise CK_RV
+ */
+CK_RV tree_hash_file(struct session_pool *pool,
+                     CK_MECHANISM_TYPE mechanism,
+                     const char *path,
+                     CK_ULONG leaf_size,
+                     CK_ULONG threads,
+                     CK_BYTE_PTR root,
+                     CK_ULONG_PTR root_length) {
+    struct stat info;
+    CK_BYTE_PTR data = NULL;
+    CK_RV rv;
+    int fd;
+
+    if (!path) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return CKR_FUNCTION_FAILED;
+    }
+    if (0 != fstat(fd, &info) || (uint64_t) info.st_size > (CK_ULONG) -1) {
+        close(fd);
+        return CKR_FUNCTION_FAILED;
+    }
+    if (info.st_size > 0) {
+        data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (MAP_FAILED == data) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    rv = tree_hash(pool, mechanism, data, (CK_ULONG) info.st_size, leaf_size, threads, root, root_length);
+
+    if (NULL != data) {
+        munmap(data, (size_t) info.st_size);
+    }
+    return rv;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_TREE_HASH_H
+#define AWS_CLOUDHSM_PKCS11_TREE_HASH_H
+
+#include "digest.h"
+#include "session_pool.h"
+
+/*
+ * Merkle tree hash of large inputs, computed on many sessions at once.
+ *
+ * The layout is the Merkle Tree Hash of RFC 6962 section 2.1 (RFC 9162
+ * section 2.1.1), with the input split into leaves of leaf_size bytes, the
+ * last one possibly shorter:
+ *
+ *     MTH({})     = HASH()
+ *     MTH({d0})   = HASH(0x00 || d0)
+ *     MTH(D[n])   = HASH(0x01 || MTH(D[0:k]) || MTH(D[k:n]))
+ *
+ * where k is the largest power of two smaller than n. Any RFC 6962 library
+ * reproduces the root from the input, the hash and the leaf size. Building
+ * the tree bottom up, pairing neighbours and carrying an odd last node up a
+ * level unchanged, gives exactly this shape.
+ *
+ * Leaves are digested concurrently on sessions from the pool, each with
+ * C_DigestUpdate calls of MAPPED_FILE_DEFAULT_WINDOW bytes. The interior
+ * nodes are digested level by level the same way.
+ */
+#define TREE_HASH_DEFAULT_LEAF_SIZE (1024 * 1024)
+#define TREE_HASH_MAX_DIGEST_LENGTH 64
+
+CK_RV tree_hash(struct session_pool *pool,
+                CK_MECHANISM_TYPE mechanism,
+                CK_BYTE_PTR data,
+                CK_ULONG data_length,
+                CK_ULONG leaf_size,
+                CK_ULONG threads,
+                CK_BYTE_PTR root,
+                CK_ULONG_PTR root_length);
+
+CK_RV tree_hash_file(struct session_pool *pool,
+                     CK_MECHANISM_TYPE mechanism,
+                     const char *path,
+                     CK_ULONG leaf_size,
+                     CK_ULONG threads,
+                     CK_BYTE_PTR root,
+                     CK_ULONG_PTR root_length);
+
+#endif
@@ -21,6 +21,7 @@
 #include <string.h>
 
 #include <common.h>
+#include <output_length.h>
 
 #define AES_GCM_IV_SIZE 12
 #define AES_GCM_TAG_SIZE 16
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+
+#include "batch.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_FIELDS 10000
+#define SAMPLE_MIN_FIELD 16
+#define SAMPLE_MAX_FIELD 64
+// The one-call-per-field comparison is slow, so it runs over the first fields only.
+#define SAMPLE_SINGLE_FIELDS 1000
+
+/**
+ * Encrypt fields one at a time, the way aes_cbc_sample does: an init, a
+ * size query and the encryption for each.
+ */
+static CK_RV encrypt_fields_singly(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key,
+                                   struct batch_item *items, CK_ULONG count, CK_BYTE_PTR *outputs) {
+    CK_RV rv = CKR_OK;
+
+    for (CK_ULONG i = 0; i < count && CKR_OK == rv; i++) {
+        CK_AES_CTR_PARAMS ctr_params;
+        CK_MECHANISM mech = *mechanism;
+        CK_ULONG length = 0;
+
+        if (CKM_AES_CTR == mech.mechanism) {
+            ctr_params = *(CK_AES_CTR_PARAMS_PTR) mechanism->pParameter;
+            memcpy(ctr_params.cb, items[i].iv, sizeof(ctr_params.cb));
+            mech.pParameter = &ctr_params;
+        } else if (CKM_AES_ECB != mech.mechanism) {
+            mech.pParameter = items[i].iv;
+            mech.ulParameterLen = 16;
+        }
+
+        rv = funcs->C_EncryptInit(session, &mech, key);
+        if (CKR_OK == rv) {
+            rv = funcs->C_Encrypt(session, items[i].input, items[i].input_length, NULL, &length);
+        }
+        if (CKR_OK == rv) {
+            outputs[i] = malloc(length);
+            rv = NULL == outputs[i] ? CKR_HOST_MEMORY
+                                    : funcs->C_Encrypt(session, items[i].input, items[i].input_length, outputs[i], &length);
+        }
+    }
+    return rv;
+}
+
+/**
+ * Encrypt the fields singly and as a batch, check the results agree, and
+ * decrypt the batch again.
+ * @param session
+ * @param mechanism Mechanism, whose IV or counter block each field overrides
+ * @param key
+ * @param name
+ * @param items Fields, with input and iv set
+ * @return CK_RV
+ */
+static CK_RV compare_batch(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key,
+                           const char *name, struct batch_item *items) {
+    CK_BYTE_PTR *single_outputs = calloc(SAMPLE_SINGLE_FIELDS, sizeof(CK_BYTE_PTR));
+    struct batch_item *decrypted = calloc(SAMPLE_FIELDS, sizeof(struct batch_item));
+    CK_BYTE_PTR encrypted_arena = NULL;
+    CK_BYTE_PTR decrypted_arena = NULL;
+    CK_RV rv;
+
+    if (NULL == single_outputs || NULL == decrypted) {
+        free(single_outputs);
+        free(decrypted);
+        return CKR_HOST_MEMORY;
+    }
+
+    uint64_t start = latency_now_ns();
+    rv = encrypt_fields_singly(session, mechanism, key, items, SAMPLE_SINGLE_FIELDS, single_outputs);
+    uint64_t single_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        fprintf(stderr, "%s: encryption one field at a time failed: %lu\n", name, rv);
+        goto done;
+    }
+
+    start = latency_now_ns();
+    rv = batch_encrypt(session, mechanism, key, items, SAMPLE_FIELDS, &encrypted_arena);
+    uint64_t batch_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        fprintf(stderr, "%s: batch encryption failed: %lu\n", name, rv);
+        goto done;
+    }
+
+    for (CK_ULONG i = 0; i < SAMPLE_FIELDS && CKR_OK == rv; i++) {
+        if (CKR_OK != items[i].rv) {
+            fprintf(stderr, "%s: field %lu failed: %lu\n", name, i, items[i].rv);
+            rv = items[i].rv;
+        } else if (i < SAMPLE_SINGLE_FIELDS && 0 != memcmp(items[i].output, single_outputs[i], items[i].output_length)) {
+            fprintf(stderr, "%s: field %lu differs from its single encryption\n", name, i);
+            rv = CKR_GENERAL_ERROR;
+        }
+        decrypted[i].input = items[i].output;
+        decrypted[i].input_length = items[i].output_length;
+        decrypted[i].iv = items[i].iv;
+    }
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    rv = batch_decrypt(session, mechanism, key, decrypted, SAMPLE_FIELDS, &decrypted_arena);
+    for (CK_ULONG i = 0; i < SAMPLE_FIELDS && CKR_OK == rv; i++) {
+        if (CKR_OK != decrypted[i].rv || decrypted[i].output_length != items[i].input_length
+            || 0 != memcmp(decrypted[i].output, items[i].input, items[i].input_length)) {
+            fprintf(stderr, "%s: field %lu did not decrypt to its plaintext\n", name, i);
+            rv = CKR_GENERAL_ERROR;
+        }
+    }
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    printf("%s: %.1f us per field one at a time, %.2f us per field in a batch\n", name,
+           single_ns / 1000.0 / SAMPLE_SINGLE_FIELDS, batch_ns / 1000.0 / SAMPLE_FIELDS);
+
+done:
+    for (CK_ULONG i = 0; i < SAMPLE_SINGLE_FIELDS; i++) {
+        free(single_outputs[i]);
+    }
+    free(single_outputs);
+    free(decrypted);
+    free(encrypted_arena);
+    free(decrypted_arena);
+    return rv;
+}
+
+/**
+ * Encrypt SAMPLE_FIELDS short fields of varying length, as a tokenization
+ * job does, with CBC_PAD, CTR and ECB.
+ * @param session Active PKCS#11 session
+ * @return CK_RV
+ */
+CK_RV aes_batch_sample(CK_SESSION_HANDLE session) {
+    struct batch_item *items = calloc(SAMPLE_FIELDS, sizeof(struct batch_item));
+    CK_BYTE_PTR fields = malloc(SAMPLE_FIELDS * SAMPLE_MAX_FIELD);
+    CK_BYTE_PTR ivs = malloc(SAMPLE_FIELDS * 16);
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_RV rv;
+
+    if (NULL == items || NULL == fields || NULL == ivs) {
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+
+    rv = generate_aes_key(session, 32, &key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "AES key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    // CBC IVs must be unpredictable, so they come from the HSM, in large requests.
+    for (CK_ULONG offset = 0; offset < SAMPLE_FIELDS * 16 && CKR_OK == rv; offset += BATCH_MAX_REQUEST) {
+        CK_ULONG length = SAMPLE_FIELDS * 16 - offset;
+        rv = funcs->C_GenerateRandom(session, ivs + offset, length < BATCH_MAX_REQUEST ? length : BATCH_MAX_REQUEST);
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to generate IVs: %lu\n", rv);
+        goto done;
+    }
+
+    for (CK_ULONG i = 0; i < SAMPLE_FIELDS; i++) {
+        items[i].input = fields + i * SAMPLE_MAX_FIELD;
+        items[i].input_length = SAMPLE_MIN_FIELD + (i * 7) % (SAMPLE_MAX_FIELD - SAMPLE_MIN_FIELD + 1);
+        items[i].iv = ivs + i * 16;
+        for (CK_ULONG b = 0; b < items[i].input_length; b++) {
+            items[i].input[b] = (CK_BYTE) ('0' + (i + b) % 10);
+        }
+    }
+
+    CK_MECHANISM cbc_pad = {CKM_AES_CBC_PAD, NULL, 0};
+    rv = compare_batch(session, &cbc_pad, key, "CBC_PAD", items);
+
+    if (CKR_OK == rv) {
+        // Counter blocks are the IVs with their last four bytes cleared for the counter.
+        CK_AES_CTR_PARAMS ctr_params = {32, {0}};
+        CK_MECHANISM ctr = {CKM_AES_CTR, &ctr_params, sizeof(ctr_params)};
+        for (CK_ULONG i = 0; i < SAMPLE_FIELDS; i++) {
+            memset(items[i].iv + 12, 0, 4);
+        }
+        rv = compare_batch(session, &ctr, key, "CTR", items);
+    }
+
+    if (CKR_OK == rv) {
+        // ECB takes whole blocks only.
+        CK_MECHANISM ecb = {CKM_AES_ECB, NULL, 0};
+        for (CK_ULONG i = 0; i < SAMPLE_FIELDS; i++) {
+            items[i].input_length = SAMPLE_MIN_FIELD * (1 + i % (SAMPLE_MAX_FIELD / SAMPLE_MIN_FIELD));
+        }
+        rv = compare_batch(session, &ecb, key, "ECB", items);
+    }
+
+done:
+    if (CK_INVALID_HANDLE != key) {
+        funcs->C_DestroyObject(session, key);
+    }
+    free(items);
+    free(fields);
+    free(ivs);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    printf("\nEncrypt %d fields of %d to %d bytes in batches\n", SAMPLE_FIELDS, SAMPLE_MIN_FIELD, SAMPLE_MAX_FIELD);
+    rv = aes_batch_sample(session);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return rc;
+}
@@ -69,38 +69,31 @@ CK_RV aes_cbc_multipart_sample(CK_SESSION_HANDLE session) {
     CK_ULONG max_chunks = 4;
     CK_ULONG chunk_idx = 0;
 
-    // The encrypted chunks will be stored in the ciphertext buffer
-    CK_BYTE_PTR ciphertext = NULL;
-    CK_ULONG ciphertext_size = 0;
-    CK_ULONG encrypted_chunk_size = 0;
-
     // We store the randomly generated plaintext as well, for visual comparison
     // 512 will hold enough for this sample.
     CK_BYTE plaintext[512] = { 0 };
     CK_ULONG plaintext_size = CHUNK_SIZE * max_chunks;
 
+    // The encrypted chunks will be stored in the ciphertext buffer. Its size is
+    // known up front, so every update writes straight into it without asking first.
+    CK_ULONG ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_ENCRYPT, &mech, 0, plaintext_size);
+    CK_BYTE_PTR ciphertext = malloc(ciphertext_capacity);
+    CK_ULONG ciphertext_size = 0;
+    CK_ULONG encrypted_chunk_size = 0;
+    if (NULL == ciphertext) {
+        printf("Could not allocate memory for ciphertext\n");
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+
     while(chunk_idx < max_chunks) {
         CK_BYTE chunk[CHUNK_SIZE] = { 0 };
         get_random_data(chunk, CHUNK_SIZE);
         memcpy(&plaintext[chunk_idx * CHUNK_SIZE], chunk, CHUNK_SIZE);
         chunk_idx += 1;
 
-        // Determine how much memory will be required to hold this chunk of ciphertext.
-        rv = funcs->C_EncryptUpdate(session, chunk, CHUNK_SIZE, NULL, &encrypted_chunk_size);
-        if (CKR_OK != rv) {
-            printf("Encryption failed: %lu\n", rv);
-            goto done;
-        }
-
-        // Increase the ciphertext buffer to hold the new chunk.
-        CK_BYTE_PTR new_ciphertext = realloc(ciphertext, ciphertext_size + encrypted_chunk_size);
-        if (NULL == new_ciphertext) {
-            printf("Could not allocate memory for ciphertext\n");
-            goto done;
-        }
-        ciphertext = new_ciphertext;
-
         // Encrypt the data.
+        encrypted_chunk_size = ciphertext_capacity - ciphertext_size;
         rv = funcs->C_EncryptUpdate(session, chunk, CHUNK_SIZE, &ciphertext[ciphertext_size], &encrypted_chunk_size);
         if (CKR_OK != rv) {
             printf("Encryption failed: %lu\n", rv);
@@ -110,21 +103,8 @@ CK_RV aes_cbc_multipart_sample(CK_SESSION_HANDLE session) {
         ciphertext_size += encrypted_chunk_size;
     }
 
-    // Calculate the size needed for the final buffer. This could include a block of padding.
-    rv = funcs->C_EncryptFinal(session, NULL, &encrypted_chunk_size);
-    if (CKR_OK != rv) {
-        printf("Encryption failed: %lu\n", rv);
-        goto done;
-    }
-
-    CK_BYTE_PTR new_ciphertext = realloc(ciphertext, ciphertext_size + encrypted_chunk_size);
-    if (NULL == new_ciphertext) {
-        printf("Could not allocate memory for ciphertext\n");
-        goto done;
-    }
-    ciphertext = new_ciphertext;
-
     // Finalize the encryption, including any final padding
+    encrypted_chunk_size = ciphertext_capacity - ciphertext_size;
     rv = funcs->C_EncryptFinal(session, &ciphertext[ciphertext_size], &encrypted_chunk_size);
     if (CKR_OK != rv) {
         printf("Encryption failed: %lu\n", rv);
@@ -152,31 +132,17 @@ CK_RV aes_cbc_multipart_sample(CK_SESSION_HANDLE session) {
         goto done;
     }
 
-    // Determine how much memory is required to hold the decrypted text.
+    // Decrypt the ciphertext. The plaintext is never longer than the ciphertext.
     CK_ULONG decrypted_ciphertext_length = 0;
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_size, NULL, &decrypted_ciphertext_length);
+    CK_ULONG decrypted_ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_DECRYPT, &mech, 0, ciphertext_size);
+    printf("Allocating %lu for decryption\n", decrypted_ciphertext_capacity);
+    rv = pkcs11_single_part(funcs->C_Decrypt, session, ciphertext, ciphertext_size,
+                            &decrypted_ciphertext, &decrypted_ciphertext_capacity, &decrypted_ciphertext_length);
     if (CKR_OK != rv) {
         printf("Decryption failed: %lu\n", rv);
         goto done;
     }
 
-    // Allocate memory for the decrypted ciphertext.
-    printf("Allocating %lu for decryption\n", decrypted_ciphertext_length);
-    decrypted_ciphertext = malloc(decrypted_ciphertext_length + 1); //We want to null terminate the raw chars later
-    if (NULL == decrypted_ciphertext) {
-        rv = 1;
-        printf("Could not allocate memory for decrypted ciphertext\n");
-        goto done;
-    }
-
-    // Decrypt the ciphertext.
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_size, decrypted_ciphertext, &decrypted_ciphertext_length);
-    if (CKR_OK != rv) {
-        printf("Decryption failed: %lu\n", rv);
-        goto done;
-    }
-    decrypted_ciphertext[decrypted_ciphertext_length] = 0; // Turn the chars into a C-String via null termination
-
     printf("Decrypted ciphertext: ");
     print_bytes_as_hex(decrypted_ciphertext, decrypted_ciphertext_length);
     printf("Decrypted ciphertext length: %lu\n", decrypted_ciphertext_length);
@@ -230,24 +196,12 @@ CK_RV aes_cbc_sample(CK_SESSION_HANDLE session) {
         return rv;
     }
 
-    // Determine how much memory will be required to hold the ciphertext.
+    // Encrypt the data into a buffer sized from the mechanism, in a single call.
+    CK_BYTE_PTR ciphertext = NULL;
     CK_ULONG ciphertext_length = 0;
-    rv = funcs->C_Encrypt(session, plaintext, plaintext_length, NULL, &ciphertext_length);
-    if (CKR_OK != rv) {
-        printf("Encryption failed: %lu\n", rv);
-        return rv;
-    }
-
-    // Allocate the required memory.
-    CK_BYTE_PTR ciphertext = malloc(ciphertext_length);
-    if (NULL == ciphertext) {
-        printf("Could not allocate memory for ciphertext\n");
-        return rv;
-    }
-    memset(ciphertext, 0, ciphertext_length);
-
-    // Encrypt the data.
-    rv = funcs->C_Encrypt(session, plaintext, plaintext_length, ciphertext, &ciphertext_length);
+    CK_ULONG ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_ENCRYPT, &mech, 0, plaintext_length);
+    rv = pkcs11_single_part(funcs->C_Encrypt, session, plaintext, plaintext_length,
+                            &ciphertext, &ciphertext_capacity, &ciphertext_length);
     if (CKR_OK != rv) {
         printf("Encryption failed: %lu\n", rv);
         goto done;
@@ -268,31 +222,17 @@ CK_RV aes_cbc_sample(CK_SESSION_HANDLE session) {
         return rv;
     }
 
-    // Determine how much memory is required to hold the decrypted text.
+    // Decrypt the ciphertext. The plaintext is never longer than the ciphertext.
     CK_ULONG decrypted_ciphertext_length = 0;
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_length, NULL, &decrypted_ciphertext_length);
-    if (CKR_OK != rv) {
-        printf("Decryption failed: %lu\n", rv);
-        goto done;
-    }
-
-    // Allocate memory for the decrypted ciphertext.
-    decrypted_ciphertext = malloc(decrypted_ciphertext_length + 1); //We want to null terminate the raw chars later
-    if (NULL == decrypted_ciphertext) {
-        rv = 1;
-        printf("Could not allocate memory for decrypted ciphertext\n");
-        goto done;
-    }
-
-    // Decrypt the ciphertext.
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_length, decrypted_ciphertext, &decrypted_ciphertext_length);
+    CK_ULONG decrypted_ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_DECRYPT, &mech, 0, ciphertext_length);
+    rv = pkcs11_single_part(funcs->C_Decrypt, session, ciphertext, ciphertext_length,
+                            &decrypted_ciphertext, &decrypted_ciphertext_capacity, &decrypted_ciphertext_length);
     if (CKR_OK != rv) {
         printf("Decryption failed: %lu\n", rv);
         goto done;
     }
-    decrypted_ciphertext[decrypted_ciphertext_length] = 0; // Turn the chars into a C-String via null termination
 
-    printf("Decrypted ciphertext: %s\n", decrypted_ciphertext);
+    printf("Decrypted ciphertext: %.*s\n", (int) decrypted_ciphertext_length, decrypted_ciphertext);
     printf("Decrypted ciphertext length: %lu\n", decrypted_ciphertext_length);
 
 done:
@@ -0,0 +1,457 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "aes.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+
+#define AES_BLOCK_SIZE 16
+// The most CloudHSM takes in one request, as BATCH_MAX_REQUEST in batch.h.
+#define CTR_MAX_REQUEST 16384
+
+#define SAMPLE_THREADS 4
+#define SAMPLE_DATA_SIZE (1024 * 1024 + 5)
+
+/*
+ * CTR blocks are independent, so the input can be split into segments
+ * which are encrypted concurrently on different sessions. Each segment
+ * starts with the counter block the single-stream operation would have
+ * reached at that offset, so the output is byte-identical to one C_Encrypt
+ * over the whole input.
+ */
+struct ctr_job {
+    struct session_pool *pool;
+    CK_OBJECT_HANDLE key;
+    const CK_AES_CTR_PARAMS *params;
+    CK_BBOOL encrypt;
+    CK_BYTE_PTR in;
+    CK_BYTE_PTR out;
+    CK_ULONG length;
+    CK_ULONG segment_size;
+    CK_ULONG segment_count;
+    atomic_ulong next_segment;
+    atomic_int failed;
+};
+
+struct ctr_worker {
+    pthread_t thread;
+    struct ctr_job *job;
+    CK_RV rv;
+};
+
+/**
+ * Add a value to a big-endian 128 bit block.
+ * @return The carry out of the most significant byte.
+ */
+static unsigned int ctr_block_add(CK_BYTE block[AES_BLOCK_SIZE], uint64_t value) {
+    unsigned int carry = 0;
+
+    for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+        unsigned int sum = block[i] + (unsigned int) (value & 0xff) + carry;
+        block[i] = (CK_BYTE) sum;
+        carry = sum >> 8;
+        value >>= 8;
+    }
+
+    return carry;
+}
+
+static void ctr_counter_mask(CK_ULONG counter_bits, CK_BYTE mask[AES_BLOCK_SIZE]) {
+    for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
+        if (counter_bits >= 8) {
+            mask[i] = 0xff;
+            counter_bits -= 8;
+        } else {
+            mask[i] = (CK_BYTE) ((1u << counter_bits) - 1);
+            counter_bits = 0;
+        }
+    }
+}
+
+/**
+ * Compute the counter block used for a given block of the stream.
+ * Only the low ulCounterBits of the block are the counter; the bits above
+ * it are a nonce and never change.
+ * @param params Parameters of the single-stream operation
+ * @param block_offset Number of blocks from the start of the stream
+ * @param counter_block Receives the counter block
+ */
+void aes_ctr_counter_at(const CK_AES_CTR_PARAMS *params, uint64_t block_offset,
+                        CK_BYTE counter_block[AES_BLOCK_SIZE]) {
+    CK_BYTE mask[AES_BLOCK_SIZE];
+    CK_BYTE sum[AES_BLOCK_SIZE];
+
+    ctr_counter_mask(params->ulCounterBits, mask);
+    memcpy(sum, params->cb, AES_BLOCK_SIZE);
+    ctr_block_add(sum, block_offset);
+
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        counter_block[i] = (CK_BYTE) ((params->cb[i] & ~mask[i]) | (sum[i] & mask[i]));
+    }
+}
+
+/**
+ * Check that a stream of the given length never wraps the counter.
+ * Libraries differ in what happens when the counter wraps, so a wrapping
+ * stream could not be reproduced segment by segment.
+ */
+static CK_BBOOL ctr_counter_fits(const CK_AES_CTR_PARAMS *params, CK_ULONG length) {
+    CK_BYTE mask[AES_BLOCK_SIZE];
+    CK_BYTE counter[AES_BLOCK_SIZE];
+    uint64_t blocks = (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+
+    if (0 == params->ulCounterBits || params->ulCounterBits > 128) {
+        return CK_FALSE;
+    }
+    if (0 == blocks) {
+        return CK_TRUE;
+    }
+
+    ctr_counter_mask(params->ulCounterBits, mask);
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        counter[i] = params->cb[i] & mask[i];
+    }
+
+    // The last block uses the starting counter plus blocks - 1.
+    if (ctr_block_add(counter, blocks - 1)) {
+        return CK_FALSE;
+    }
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+        if (counter[i] & ~mask[i]) {
+            return CK_FALSE;
+        }
+    }
+
+    return CK_TRUE;
+}
+
+static CK_RV ctr_segment(CK_SESSION_HANDLE session, struct ctr_job *job, CK_ULONG segment) {
+    CK_RV rv;
+    CK_ULONG offset = segment * job->segment_size;
+    CK_ULONG length = job->length - offset;
+    CK_ULONG out_length;
+    CK_AES_CTR_PARAMS params;
+    CK_MECHANISM mech = { CKM_AES_CTR, &params, sizeof(params) };
+
+    if (length > job->segment_size) {
+        length = job->segment_size;
+    }
+    out_length = length;
+
+    params.ulCounterBits = job->params->ulCounterBits;
+    aes_ctr_counter_at(job->params, offset / AES_BLOCK_SIZE, params.cb);
+
+    if (job->encrypt) {
+        rv = funcs->C_EncryptInit(session, &mech, job->key);
+        if (CKR_OK == rv) {
+            rv = funcs->C_Encrypt(session, job->in + offset, length, job->out + offset, &out_length);
+        }
+    } else {
+        rv = funcs->C_DecryptInit(session, &mech, job->key);
+        if (CKR_OK == rv) {
+            rv = funcs->C_Decrypt(session, job->in + offset, length, job->out + offset, &out_length);
+        }
+    }
+
+    if (CKR_OK == rv && out_length != length) {
+        rv = CKR_GENERAL_ERROR;
+    }
+    return rv;
+}
+
+/**
+ * Each worker holds one session and takes segments in order until none are
+ * left, so a slow HSM simply ends up with fewer segments.
+ */
+static void *ctr_worker_run(void *arg) {
+    struct ctr_worker *worker = arg;
+    struct ctr_job *job = worker->job;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+    worker->rv = session_pool_acquire(job->pool, &session);
+    if (CKR_OK != worker->rv) {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+
+    while (!atomic_load(&job->failed)) {
+        CK_ULONG segment = atomic_fetch_add(&job->next_segment, 1);
+        if (segment >= job->segment_count) {
+            break;
+        }
+
+        worker->rv = ctr_segment(session, job, segment);
+        if (CKR_OK != worker->rv) {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+    }
+
+    session_pool_release(job->pool, session);
+    return NULL;
+}
+
+/**
+ * Encrypt or decrypt with AES CTR on several sessions at once.
+ * The result is identical to a single C_Encrypt or C_Decrypt with the same
+ * parameters.
+ * @param pool Session pool with room for the given number of threads
+ * @param key AES key
+ * @param params Counter block and counter width of the whole stream
+ * @param encrypt CK_TRUE to encrypt, CK_FALSE to decrypt
+ * @param in Input
+ * @param length Length of the input, and of the output
+ * @param out Output, which may not overlap the input
+ * @param threads Number of sessions to use
+ * @param segment_size Bytes per C_Encrypt call, a multiple of 16 and at most
+ * CTR_MAX_REQUEST. 0 splits the input evenly between the threads, in
+ * segments of at most CTR_MAX_REQUEST.
+ * @return CKR_DATA_LEN_RANGE if the counter would wrap, otherwise CK_RV.
+ */
+CK_RV aes_ctr_parallel(struct session_pool *pool, CK_OBJECT_HANDLE key,
+                       const CK_AES_CTR_PARAMS *params, CK_BBOOL encrypt,
+                       CK_BYTE_PTR in, CK_ULONG length, CK_BYTE_PTR out,
+                       CK_ULONG threads, CK_ULONG segment_size) {
+    struct ctr_job job;
+    struct ctr_worker *workers;
+    CK_ULONG started;
+    CK_RV rv = CKR_OK;
+
+    if (!pool || !params || (!in && length > 0) || (!out && length > 0) || 0 == threads) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (0 != segment_size % AES_BLOCK_SIZE || segment_size > CTR_MAX_REQUEST) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!ctr_counter_fits(params, length)) {
+        return CKR_DATA_LEN_RANGE;
+    }
+    if (0 == length) {
+        return CKR_OK;
+    }
+
+    if (0 == segment_size) {
+        segment_size = (length + threads - 1) / threads;
+        segment_size = (segment_size + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+        if (segment_size > CTR_MAX_REQUEST) {
+            segment_size = CTR_MAX_REQUEST;
+        }
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.key = key;
+    job.params = params;
+    job.encrypt = encrypt;
+    job.in = in;
+    job.out = out;
+    job.length = length;
+    job.segment_size = segment_size;
+    job.segment_count = (length + segment_size - 1) / segment_size;
+    atomic_init(&job.next_segment, 0);
+    atomic_init(&job.failed, 0);
+
+    if (threads > job.segment_count) {
+        threads = job.segment_count;
+    }
+
+    workers = calloc(threads, sizeof(struct ctr_worker));
+    if (NULL == workers) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (started = 0; started < threads; started++) {
+        workers[started].job = &job;
+        workers[started].rv = CKR_OK;
+        if (0 != pthread_create(&workers[started].thread, NULL, ctr_worker_run, &workers[started])) {
+            atomic_store(&job.failed, 1);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+    }
+
+    for (CK_ULONG i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (CKR_OK != workers[i].rv) {
+            rv = workers[i].rv;
+        }
+    }
+
+    free(workers);
+    return rv;
+}
+
+/**
+ * Encrypt a buffer on one session and again in parallel, and check both
+ * give the same ciphertext. Then decrypt in parallel.
+ * @param pool Session pool with at least SAMPLE_THREADS sessions
+ * @return CK_RV
+ */
+CK_RV aes_ctr_parallel_sample(struct session_pool *pool) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE aes_key = CK_INVALID_HANDLE;
+    CK_BYTE_PTR plaintext = NULL;
+    CK_BYTE_PTR reference = NULL;
+    CK_BYTE_PTR ciphertext = NULL;
+    CK_BYTE_PTR decrypted = NULL;
+    CK_ULONG length = SAMPLE_DATA_SIZE;
+    CK_ULONG reference_length;
+    uint64_t start;
+    uint64_t single_ns;
+    uint64_t parallel_ns;
+
+    // The counter starts close to a carry into the upper bytes, which the segments have to follow.
+    CK_AES_CTR_PARAMS params;
+    CK_BYTE ctr_bytes[16] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0xff, 0xf0};
+    params.ulCounterBits = 32;
+    memcpy(params.cb, ctr_bytes, sizeof(params.cb));
+    CK_MECHANISM mech = { CKM_AES_CTR, &params, sizeof(params) };
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+        return rv;
+    }
+
+    // Session keys are visible to every session of the application.
+    rv = generate_aes_key(session, 32, &aes_key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "AES key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    plaintext = malloc(length);
+    reference = malloc(length);
+    ciphertext = malloc(length);
+    decrypted = malloc(length);
+    if (NULL == plaintext || NULL == reference || NULL == ciphertext || NULL == decrypted) {
+        fprintf(stderr, "Could not allocate memory for the buffers\n");
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+    for (CK_ULONG i = 0; i < length; i++) {
+        plaintext[i] = (CK_BYTE) rand();
+    }
+
+    // The single-stream reference goes through the same size of request, one after another.
+    start = latency_now_ns();
+    rv = funcs->C_EncryptInit(session, &mech, aes_key);
+    reference_length = 0;
+    for (CK_ULONG offset = 0; CKR_OK == rv && offset < length; offset += CTR_MAX_REQUEST) {
+        CK_ULONG chunk = length - offset < CTR_MAX_REQUEST ? length - offset : CTR_MAX_REQUEST;
+        CK_ULONG produced = length - reference_length;
+
+        rv = funcs->C_EncryptUpdate(session, plaintext + offset, chunk, reference + reference_length, &produced);
+        reference_length += produced;
+    }
+    if (CKR_OK == rv) {
+        CK_ULONG produced = length - reference_length;
+
+        rv = funcs->C_EncryptFinal(session, reference + reference_length, &produced);
+        reference_length += produced;
+    }
+    single_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Single-stream encryption failed: %lu\n", rv);
+        goto done;
+    }
+
+    // Give the session back so the workers can use every session in the pool.
+    session_pool_release(pool, session);
+    session = CK_INVALID_HANDLE;
+
+    start = latency_now_ns();
+    rv = aes_ctr_parallel(pool, aes_key, &params, CK_TRUE, plaintext, length, ciphertext,
+                          SAMPLE_THREADS, 0);
+    parallel_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Parallel encryption failed: %lu\n", rv);
+        goto done;
+    }
+
+    if (reference_length != length || 0 != memcmp(reference, ciphertext, length)) {
+        fprintf(stderr, "Parallel ciphertext differs from the single-stream ciphertext\n");
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+
+    rv = aes_ctr_parallel(pool, aes_key, &params, CK_FALSE, ciphertext, length, decrypted,
+                          SAMPLE_THREADS, 0);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Parallel decryption failed: %lu\n", rv);
+        goto done;
+    }
+    if (0 != memcmp(plaintext, decrypted, length)) {
+        fprintf(stderr, "Parallel decryption did not restore the plaintext\n");
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+
+    printf("Encrypted %lu bytes in %.1f ms on one session and %.1f ms on %d sessions\n",
+           length, single_ns / 1e6, parallel_ns / 1e6, SAMPLE_THREADS);
+    printf("Ciphertexts are identical and decrypt to the plaintext\n");
+
+done:
+    if (CK_INVALID_HANDLE != session) {
+        session_pool_release(pool, session);
+    }
+    free(decrypted);
+    free(ciphertext);
+    free(reference);
+    free(plaintext);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 1, SAMPLE_THREADS, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nEncrypt/Decrypt with AES CTR on %d sessions\n", SAMPLE_THREADS);
+    rv = aes_ctr_parallel_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
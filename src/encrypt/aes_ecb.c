@@ -54,23 +54,11 @@ CK_RV aes_ecb_sample(CK_SESSION_HANDLE session) {
         return rv;
     }
 
-    // Determine how much memory will be required to hold the ciphertext.
-    rv = funcs->C_Encrypt(session, plaintext, plaintext_length, NULL, &ciphertext_length);
-    if (CKR_OK != rv) {
-        printf("Encryption failed: %lu\n", rv);
-        return rv;
-    }
-
-    // Allocate the required memory.
-    CK_BYTE_PTR ciphertext = malloc(ciphertext_length);
-    if (NULL == ciphertext) {
-        printf("Could not allocate memory for ciphertext\n");
-        return rv;
-    }
-    memset(ciphertext, 0, ciphertext_length);
-
-    // Encrypt the data.
-    rv = funcs->C_Encrypt(session, plaintext, plaintext_length, ciphertext, &ciphertext_length);
+    // Encrypt the data into a buffer sized from the mechanism, in a single call.
+    CK_BYTE_PTR ciphertext = NULL;
+    CK_ULONG ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_ENCRYPT, &mech, 0, plaintext_length);
+    rv = pkcs11_single_part(funcs->C_Encrypt, session, plaintext, plaintext_length,
+                            &ciphertext, &ciphertext_capacity, &ciphertext_length);
     if (CKR_OK != rv) {
         printf("Encryption failed: %lu\n", rv);
         goto done;
@@ -91,31 +79,17 @@ CK_RV aes_ecb_sample(CK_SESSION_HANDLE session) {
         return rv;
     }
 
-    // Determine how much memory is required to hold the decrypted text.
+    // Decrypt the ciphertext. The plaintext is never longer than the ciphertext.
     CK_ULONG decrypted_ciphertext_length = 0;
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_length, NULL, &decrypted_ciphertext_length);
-    if (CKR_OK != rv) {
-        printf("Decryption failed: %lu\n", rv);
-        goto done;
-    }
-
-    // Allocate memory for the decrypted ciphertext.
-    decrypted_ciphertext = malloc(decrypted_ciphertext_length + 1); //We want to null terminate the raw chars later
-    if (NULL == decrypted_ciphertext) {
-        rv = 1;
-        printf("Could not allocate memory for decrypted ciphertext\n");
-        goto done;
-    }
-
-    // Decrypt the ciphertext.
-    rv = funcs->C_Decrypt(session, ciphertext, ciphertext_length, decrypted_ciphertext, &decrypted_ciphertext_length);
+    CK_ULONG decrypted_ciphertext_capacity = pkcs11_max_output_length(PKCS11_OPERATION_DECRYPT, &mech, 0, ciphertext_length);
+    rv = pkcs11_single_part(funcs->C_Decrypt, session, ciphertext, ciphertext_length,
+                            &decrypted_ciphertext, &decrypted_ciphertext_capacity, &decrypted_ciphertext_length);
     if (CKR_OK != rv) {
         printf("Decryption failed: %lu\n", rv);
         goto done;
     }
-    decrypted_ciphertext[decrypted_ciphertext_length] = 0; // Turn the chars into a C-String via null termination
 
-    printf("Decrypted ciphertext: %s\n", decrypted_ciphertext);
+    printf("Decrypted ciphertext: %.*s\n", (int) decrypted_ciphertext_length, decrypted_ciphertext);
     printf("Decrypted ciphertext length: %lu\n", decrypted_ciphertext_length);
 
 done:
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "gcm_engine.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_THREADS 8
+#define SAMPLE_RECORDS 4000
+#define SAMPLE_RECORD_SIZE 256
+#define SAMPLE_FRAME_SIZE (SAMPLE_RECORD_SIZE + GCM_ENGINE_FRAME_OVERHEAD)
+
+struct record_job {
+    struct gcm_engine *engine;
+    CK_OBJECT_HANDLE key;
+    CK_BYTE_PTR records;
+    CK_BYTE_PTR frames;
+    atomic_ulong next_record;
+    atomic_int failed;
+};
+
+struct record_worker {
+    pthread_t thread;
+    struct record_job *job;
+    CK_RV rv;
+};
+
+/**
+ * Records are authenticated together with their sequence number, so frames
+ * cannot be reordered without detection.
+ */
+static void record_aad(CK_ULONG record, CK_BYTE aad[8]) {
+    for (int i = 7; i >= 0; i--) {
+        aad[i] = (CK_BYTE) record;
+        record >>= 8;
+    }
+}
+
+static void *record_worker_run(void *arg) {
+    struct record_worker *worker = arg;
+    struct record_job *job = worker->job;
+
+    while (!atomic_load(&job->failed)) {
+        CK_ULONG record = atomic_fetch_add(&job->next_record, 1);
+        if (record >= SAMPLE_RECORDS) {
+            break;
+        }
+
+        CK_BYTE aad[8];
+        CK_ULONG frame_length = SAMPLE_FRAME_SIZE;
+        record_aad(record, aad);
+        worker->rv = gcm_engine_encrypt(job->engine, job->key, aad, sizeof(aad),
+                                        job->records + record * SAMPLE_RECORD_SIZE, SAMPLE_RECORD_SIZE,
+                                        job->frames + record * SAMPLE_FRAME_SIZE, &frame_length);
+        if (CKR_OK != worker->rv) {
+            atomic_store(&job->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Encrypt every record the way aes_gcm_sample does: one session, a size
+ * query before each C_Encrypt, and the IV copied into the frame afterwards.
+ */
+static CK_RV encrypt_records_one_session(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key,
+                                         CK_BYTE_PTR records, CK_BYTE_PTR frames) {
+    CK_RV rv = CKR_OK;
+
+    for (CK_ULONG record = 0; record < SAMPLE_RECORDS && CKR_OK == rv; record++) {
+        CK_BYTE iv[AES_GCM_IV_SIZE] = {0};
+        CK_BYTE aad[8];
+        CK_GCM_PARAMS params = {iv, AES_GCM_IV_SIZE, 0, aad, sizeof(aad), AES_GCM_TAG_SIZE * 8};
+        CK_MECHANISM mech = {CKM_AES_GCM, &params, sizeof(params)};
+        CK_BYTE_PTR frame = frames + record * SAMPLE_FRAME_SIZE;
+        CK_ULONG ciphertext_length = 0;
+
+        record_aad(record, aad);
+        rv = funcs->C_EncryptInit(session, &mech, key);
+        if (CKR_OK == rv) {
+            rv = funcs->C_Encrypt(session, records + record * SAMPLE_RECORD_SIZE, SAMPLE_RECORD_SIZE,
+                                  NULL, &ciphertext_length);
+        }
+        if (CKR_OK == rv) {
+            rv = funcs->C_Encrypt(session, records + record * SAMPLE_RECORD_SIZE, SAMPLE_RECORD_SIZE,
+                                  frame + AES_GCM_IV_SIZE, &ciphertext_length);
+        }
+        memcpy(frame, iv, AES_GCM_IV_SIZE);
+    }
+    return rv;
+}
+
+static int compare_ivs(const void *a, const void *b) {
+    return memcmp(a, b, AES_GCM_IV_SIZE);
+}
+
+/**
+ * Decrypt every frame, and check that no IV was used twice.
+ */
+static CK_RV check_frames(struct gcm_engine *engine, CK_OBJECT_HANDLE key, CK_BYTE_PTR records, CK_BYTE_PTR frames) {
+    CK_BYTE_PTR ivs = malloc(SAMPLE_RECORDS * AES_GCM_IV_SIZE);
+    CK_BYTE plaintext[SAMPLE_RECORD_SIZE];
+    CK_RV rv = CKR_OK;
+
+    if (NULL == ivs) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (CK_ULONG record = 0; record < SAMPLE_RECORDS && CKR_OK == rv; record++) {
+        CK_BYTE_PTR frame = frames + record * SAMPLE_FRAME_SIZE;
+        CK_ULONG plaintext_length = sizeof(plaintext);
+        CK_BYTE aad[8];
+
+        record_aad(record, aad);
+        rv = gcm_engine_decrypt(engine, key, aad, sizeof(aad), frame, SAMPLE_FRAME_SIZE,
+                                plaintext, &plaintext_length);
+        if (CKR_OK == rv && (SAMPLE_RECORD_SIZE != plaintext_length
+                             || 0 != memcmp(plaintext, records + record * SAMPLE_RECORD_SIZE, SAMPLE_RECORD_SIZE))) {
+            fprintf(stderr, "Record %lu did not decrypt to its plaintext\n", record);
+            rv = CKR_GENERAL_ERROR;
+        }
+        memcpy(ivs + record * AES_GCM_IV_SIZE, frame, AES_GCM_IV_SIZE);
+    }
+
+    if (CKR_OK == rv) {
+        qsort(ivs, SAMPLE_RECORDS, AES_GCM_IV_SIZE, compare_ivs);
+        for (CK_ULONG i = 1; i < SAMPLE_RECORDS; i++) {
+            if (0 == memcmp(ivs + (i - 1) * AES_GCM_IV_SIZE, ivs + i * AES_GCM_IV_SIZE, AES_GCM_IV_SIZE)) {
+                fprintf(stderr, "An IV was used twice\n");
+                rv = CKR_GENERAL_ERROR;
+                break;
+            }
+        }
+    }
+
+    free(ivs);
+    return rv;
+}
+
+/**
+ * Encrypt records on one session as aes_gcm_sample does, then through the
+ * engine from several threads, and check the engine's frames.
+ * @param pool Session pool with SAMPLE_THREADS sessions
+ * @return CK_RV
+ */
+CK_RV aes_gcm_engine_sample(struct session_pool *pool) {
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_BYTE fixed_field[GCM_ENGINE_FIXED_FIELD_SIZE];
+    struct record_worker workers[SAMPLE_THREADS];
+    struct gcm_engine_key_stats stats;
+    struct gcm_engine *engine = NULL;
+    struct record_job job;
+    CK_SESSION_HANDLE session;
+    CK_ULONG started = 0;
+    CK_RV rv;
+
+    CK_BYTE_PTR records = malloc(SAMPLE_RECORDS * SAMPLE_RECORD_SIZE);
+    CK_BYTE_PTR frames = malloc(SAMPLE_RECORDS * SAMPLE_FRAME_SIZE);
+    if (NULL == records || NULL == frames) {
+        free(records);
+        free(frames);
+        return CKR_HOST_MEMORY;
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_RECORDS * SAMPLE_RECORD_SIZE; i++) {
+        records[i] = (CK_BYTE) (i * 31 + 7);
+    }
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    // The fixed field only has to differ between engines sharing a key; random bytes do.
+    rv = generate_aes_key(session, 32, &key);
+    if (CKR_OK == rv) {
+        rv = funcs->C_GenerateRandom(session, fixed_field, sizeof(fixed_field));
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to generate the key: %lu\n", rv);
+        session_pool_release(pool, session);
+        goto done;
+    }
+
+    uint64_t start = latency_now_ns();
+    rv = encrypt_records_one_session(session, key, records, frames);
+    uint64_t elapsed = latency_now_ns() - start;
+    session_pool_release(pool, session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Encryption on one session failed: %lu\n", rv);
+        goto done;
+    }
+    printf("One session: %.0f records/s\n", SAMPLE_RECORDS * 1e9 / (double) elapsed);
+
+    rv = gcm_engine_create(pool, 1, &engine);
+    if (CKR_OK == rv) {
+        rv = gcm_engine_add_key(engine, key, fixed_field, 0, 0);
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the GCM engine: %lu\n", rv);
+        goto done;
+    }
+
+    job.engine = engine;
+    job.key = key;
+    job.records = records;
+    job.frames = frames;
+    atomic_init(&job.next_record, 0);
+    atomic_init(&job.failed, 0);
+
+    start = latency_now_ns();
+    for (; started < SAMPLE_THREADS; started++) {
+        workers[started].job = &job;
+        workers[started].rv = CKR_OK;
+        if (0 != pthread_create(&workers[started].thread, NULL, record_worker_run, &workers[started])) {
+            atomic_store(&job.failed, 1);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+    }
+    for (CK_ULONG i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (CKR_OK != workers[i].rv && CKR_OK == rv) {
+            rv = workers[i].rv;
+        }
+    }
+    elapsed = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Encryption through the engine failed: %lu\n", rv);
+        goto done;
+    }
+    printf("GCM engine, %d threads: %.0f records/s\n", SAMPLE_THREADS, SAMPLE_RECORDS * 1e9 / (double) elapsed);
+
+    rv = check_frames(engine, key, records, frames);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    gcm_engine_key_stats(engine, key, &stats);
+    printf("%llu invocations of %llu allowed, IVs generated by the %s\n",
+           (unsigned long long) stats.invocations, (unsigned long long) stats.invocation_limit,
+           stats.module_generated_ivs ? "module" : "engine");
+
+done:
+    gcm_engine_destroy(engine);
+    if (CK_INVALID_HANDLE != key && CKR_OK == session_pool_acquire(pool, &session)) {
+        funcs->C_DestroyObject(session, key);
+        session_pool_release(pool, session);
+    }
+    free(records);
+    free(frames);
+    return rv;
+}
+
+/**
+ * Show a key being refused once it reaches its invocation limit.
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV aes_gcm_invocation_limit_sample(struct session_pool *pool) {
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_BYTE fixed_field[GCM_ENGINE_FIXED_FIELD_SIZE] = {0};
+    CK_BYTE plaintext[] = "record";
+    CK_BYTE frame[sizeof(plaintext) + GCM_ENGINE_FRAME_OVERHEAD];
+    struct gcm_engine *engine = NULL;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = generate_aes_key(session, 32, &key);
+    session_pool_release(pool, session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = gcm_engine_create(pool, 1, &engine);
+    if (CKR_OK == rv) {
+        rv = gcm_engine_add_key(engine, key, fixed_field, 0, 3);
+    }
+
+    for (int i = 0; i < 4 && CKR_OK == rv; i++) {
+        CK_ULONG frame_length = sizeof(frame);
+        CK_RV encrypt_rv = gcm_engine_encrypt(engine, key, NULL, 0, plaintext, sizeof(plaintext),
+                                              frame, &frame_length);
+        printf("Message %d: %s\n", i + 1, CKR_OK == encrypt_rv ? "encrypted" : "refused");
+        if (CKR_KEY_FUNCTION_NOT_PERMITTED == encrypt_rv && 3 == i) {
+            break;
+        }
+        if (CKR_OK != encrypt_rv || 3 == i) {
+            fprintf(stderr, "Expected only the fourth message to be refused\n");
+            rv = CKR_GENERAL_ERROR;
+        }
+    }
+
+    gcm_engine_destroy(engine);
+    if (CKR_OK == session_pool_acquire(pool, &session)) {
+        funcs->C_DestroyObject(session, key);
+        session_pool_release(pool, session);
+    }
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 1, SAMPLE_THREADS, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nEncrypt %d records with AES GCM\n", SAMPLE_RECORDS);
+    rv = aes_gcm_engine_sample(pool);
+    if (CKR_OK == rv) {
+        printf("\nRefuse a key past its invocation limit\n");
+        rv = aes_gcm_invocation_limit_sample(pool);
+    }
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+
+#include "aes.h"
+#include "session_pool.h"
+#include "key_pool.h"
+#include "latency_histogram.h"
+
+#define REQUESTS 200
+#define PAYLOAD_SIZE 1024
+#define LOW_WATERMARK 16
+#define HIGH_WATERMARK 64
+
+/**
+ * Encrypt a payload under a fresh data key, as an envelope encryption
+ * service does for every object it stores.
+ * @param session
+ * @param key Data key
+ * @param payload
+ * @param ciphertext Buffer of at least PAYLOAD_SIZE + 16 bytes
+ * @return CK_RV
+ */
+static CK_RV encrypt_payload(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key,
+                             CK_BYTE_PTR payload, CK_BYTE_PTR ciphertext) {
+    CK_BYTE iv[16] = {0};
+    CK_MECHANISM mech = {CKM_AES_CBC_PAD, iv, sizeof(iv)};
+    CK_ULONG capacity = PAYLOAD_SIZE + 16;
+    CK_ULONG ciphertext_length = 0;
+
+    CK_RV rv = funcs->C_EncryptInit(session, &mech, key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return pkcs11_single_part(funcs->C_Encrypt, session, payload, PAYLOAD_SIZE,
+                              &ciphertext, &capacity, &ciphertext_length);
+}
+
+/**
+ * Serve REQUESTS encryptions, one per millisecond, each with a new data
+ * key taken from the pool or generated inline.
+ * @return CK_RV
+ */
+static CK_RV serve_requests(CK_SESSION_HANDLE session, struct key_pool *keys, const char *name) {
+    struct latency_histogram *histogram = malloc(sizeof(struct latency_histogram));
+    CK_BYTE payload[PAYLOAD_SIZE] = {0};
+    CK_BYTE ciphertext[PAYLOAD_SIZE + 16];
+    struct timespec interval = {0, 1000000};
+    CK_RV rv = CKR_OK;
+
+    if (NULL == histogram) {
+        return CKR_HOST_MEMORY;
+    }
+    latency_histogram_init(histogram);
+
+    for (int i = 0; i < REQUESTS && CKR_OK == rv; i++) {
+        CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+
+        uint64_t start = latency_now_ns();
+        if (keys) {
+            rv = key_pool_take(keys, session, &key, NULL);
+        } else {
+            rv = generate_aes_key(session, 32, &key);
+        }
+        if (CKR_OK == rv) {
+            rv = encrypt_payload(session, key, payload, ciphertext);
+        }
+        latency_histogram_record(histogram, latency_now_ns() - start);
+
+        // Data keys are used once; a real service would wrap the key and store it with the object.
+        if (CK_INVALID_HANDLE != key) {
+            funcs->C_DestroyObject(session, key);
+        }
+        nanosleep(&interval, NULL);
+    }
+
+    if (CKR_OK == rv) {
+        printf("%s: p50 %.1f us, p99 %.1f us\n", name,
+               latency_histogram_percentile(histogram, 50.0) / 1000.0,
+               latency_histogram_percentile(histogram, 99.0) / 1000.0);
+    } else {
+        fprintf(stderr, "%s failed: %lu\n", name, rv);
+    }
+
+    free(histogram);
+    return rv;
+}
+
+/**
+ * Compare generating data keys inline with taking them from a key pool.
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV aes_key_pool_sample(struct session_pool *pool) {
+    CK_MECHANISM mech = {CKM_AES_KEY_GEN, NULL, 0};
+    CK_ULONG key_length_bytes = 32;
+    CK_ATTRIBUTE template[] = {
+            {CKA_EXTRACTABLE, &true_val,         sizeof(CK_BBOOL)},
+            {CKA_ENCRYPT,     &true_val,         sizeof(CK_BBOOL)},
+            {CKA_DECRYPT,     &true_val,         sizeof(CK_BBOOL)},
+            {CKA_VALUE_LEN,   &key_length_bytes, sizeof(CK_ULONG)},
+    };
+    struct key_pool *keys = NULL;
+    struct key_pool_stats stats;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    rv = key_pool_create(pool, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE),
+                         LOW_WATERMARK, HIGH_WATERMARK, &keys);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the key pool: %lu\n", rv);
+        return rv;
+    }
+
+    rv = key_pool_wait_full(keys);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to fill the key pool: %lu\n", rv);
+        key_pool_destroy(keys);
+        return rv;
+    }
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        key_pool_destroy(keys);
+        return rv;
+    }
+
+    rv = serve_requests(session, NULL, "Inline key generation");
+    if (CKR_OK == rv) {
+        rv = serve_requests(session, keys, "Pooled keys");
+    }
+
+    key_pool_stats(keys, &stats);
+    printf("Key pool: %lu taken, %lu generated in the background, %lu generated inline, %lu available\n",
+           stats.taken, stats.generated, stats.misses, stats.available);
+
+    session_pool_release(pool, session);
+    key_pool_destroy(keys);
+    return rv;
+}
+
+/**
+ * Take an ephemeral EC key pair from a pool, as an ECDH key agreement would.
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV ec_key_pool_sample(struct session_pool *pool) {
+    CK_MECHANISM mech = {CKM_EC_KEY_PAIR_GEN, NULL, 0};
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+    CK_ATTRIBUTE public_template[] = {
+            {CKA_EC_PARAMS, prime256v1, sizeof(prime256v1)},
+    };
+    CK_ATTRIBUTE private_template[] = {
+            {CKA_DERIVE, &true_val, sizeof(CK_BBOOL)},
+    };
+    struct key_pool *keys = NULL;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    rv = key_pool_create_key_pair(pool, &mech,
+                                  public_template, sizeof(public_template) / sizeof(CK_ATTRIBUTE),
+                                  private_template, sizeof(private_template) / sizeof(CK_ATTRIBUTE),
+                                  2, 4, &keys);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the key pair pool: %lu\n", rv);
+        return rv;
+    }
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK == rv) {
+        rv = key_pool_take(keys, session, &private_key, &public_key);
+        if (CKR_OK == rv) {
+            printf("Took EC key pair %lu / %lu\n", public_key, private_key);
+            funcs->C_DestroyObject(session, private_key);
+            funcs->C_DestroyObject(session, public_key);
+        } else {
+            fprintf(stderr, "Failed to take an EC key pair: %lu\n", rv);
+        }
+        session_pool_release(pool, session);
+    }
+
+    key_pool_destroy(keys);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    // One session generates pooled keys, the other serves requests.
+    rv = session_pool_create(args.pin, 2, 2, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nEncrypt with a new AES data key per request\n");
+    rv = aes_key_pool_sample(pool);
+    if (CKR_OK == rv) {
+        printf("\nTake an EC key pair from a pool\n");
+        rv = ec_key_pool_sample(pool);
+    }
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
@@ -0,0 +1,560 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdint.h>
+
+#include "batch.h"
+
+#define BATCH_BLOCK_SIZE 16
+
+struct batch_job {
+    CK_SESSION_HANDLE session;
+    CK_MECHANISM_PTR mechanism;
+    CK_OBJECT_HANDLE key;
+    CK_BBOOL encrypt;
+    struct batch_item *items;
+    CK_ULONG count;
+};
+
+/*
+ * Blocks gathered from the items for one ECB operation, and its output.
+ */
+struct batch_blocks {
+    CK_BYTE_PTR in;
+    CK_BYTE_PTR out;
+    CK_ULONG length;
+};
+
+static CK_BBOOL batch_is_cbc(CK_MECHANISM_TYPE mechanism) {
+    return CKM_AES_CBC == mechanism || CKM_AES_CBC_PAD == mechanism;
+}
+
+static CK_RV batch_check_mechanism(CK_MECHANISM_PTR mechanism) {
+    switch (mechanism->mechanism) {
+        case CKM_AES_ECB:
+            return CKR_OK;
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD:
+            // Without an IV in the mechanism, every item brings its own.
+            if (mechanism->pParameter && BATCH_BLOCK_SIZE != mechanism->ulParameterLen) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+            return CKR_OK;
+        case CKM_AES_CTR: {
+            CK_AES_CTR_PARAMS_PTR params = mechanism->pParameter;
+            if (!params || sizeof(CK_AES_CTR_PARAMS) != mechanism->ulParameterLen
+                || 0 == params->ulCounterBits || params->ulCounterBits > 128) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+            return CKR_OK;
+        }
+        default:
+            return CKR_MECHANISM_INVALID;
+    }
+}
+
+/**
+ * The item's IV or counter block. The mechanism's is only used for a batch
+ * of one item, since sharing it would repeat a CBC IV or a CTR keystream.
+ * @return NULL if the item has none
+ */
+static CK_BYTE_PTR batch_item_iv(struct batch_job *job, struct batch_item *item) {
+    if (item->iv) {
+        return item->iv;
+    }
+    if (job->count > 1) {
+        return NULL;
+    }
+    if (CKM_AES_CTR == job->mechanism->mechanism) {
+        return ((CK_AES_CTR_PARAMS_PTR) job->mechanism->pParameter)->cb;
+    }
+    return job->mechanism->pParameter;
+}
+
+/**
+ * Compute the counter block for a block of a CTR item. Only the low
+ * ulCounterBits of the block count; the bits above are a nonce.
+ * @return CK_FALSE if the counter wraps, which libraries handle differently.
+ */
+static CK_BBOOL batch_ctr_block(const CK_BYTE *counter_block, CK_ULONG counter_bits, CK_ULONG block,
+                                CK_BYTE out[BATCH_BLOCK_SIZE]) {
+    unsigned int carry = 0;
+    uint64_t value = block;
+
+    for (int i = BATCH_BLOCK_SIZE - 1; i >= 0; i--) {
+        unsigned int sum = counter_block[i] + (unsigned int) (value & 0xff) + carry;
+        out[i] = (CK_BYTE) sum;
+        carry = sum >> 8;
+        value >>= 8;
+    }
+    if (carry) {
+        return CK_FALSE;
+    }
+
+    // Bits above the counter must be unchanged by the addition.
+    for (int i = BATCH_BLOCK_SIZE - 1; i >= 0; i--, counter_bits = counter_bits >= 8 ? counter_bits - 8 : 0) {
+        CK_BYTE nonce_mask = counter_bits >= 8 ? 0 : (CK_BYTE) ~((1u << counter_bits) - 1);
+        if ((out[i] ^ counter_block[i]) & nonce_mask) {
+            return CK_FALSE;
+        }
+    }
+    return CK_TRUE;
+}
+
+/**
+ * Number of ECB blocks an item takes, after checking its length and IV.
+ * Sets the item's rv when the item cannot be processed.
+ */
+static CK_ULONG batch_item_blocks(struct batch_job *job, struct batch_item *item) {
+    CK_MECHANISM_TYPE mechanism = job->mechanism->mechanism;
+    CK_ULONG length = item->input_length;
+    CK_RV length_error = job->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+
+    if (!item->input && length) {
+        item->rv = CKR_ARGUMENTS_BAD;
+        return 0;
+    }
+    if ((batch_is_cbc(mechanism) || CKM_AES_CTR == mechanism) && NULL == batch_item_iv(job, item)) {
+        item->rv = CKR_MECHANISM_PARAM_INVALID;
+        return 0;
+    }
+
+    if (CKM_AES_CTR == mechanism) {
+        CK_AES_CTR_PARAMS_PTR params = job->mechanism->pParameter;
+        CK_ULONG blocks = (length + BATCH_BLOCK_SIZE - 1) / BATCH_BLOCK_SIZE;
+        CK_BYTE last[BATCH_BLOCK_SIZE];
+
+        if (blocks && !batch_ctr_block(batch_item_iv(job, item), params->ulCounterBits, blocks - 1, last)) {
+            item->rv = length_error;
+            return 0;
+        }
+        return blocks;
+    }
+
+    if (CKM_AES_CBC_PAD == mechanism && job->encrypt) {
+        return length / BATCH_BLOCK_SIZE + 1;
+    }
+    if (0 != length % BATCH_BLOCK_SIZE || (CKM_AES_CBC_PAD == mechanism && 0 == length)) {
+        item->rv = length_error;
+        return 0;
+    }
+    return length / BATCH_BLOCK_SIZE;
+}
+
+/**
+ * Run gathered blocks through AES-ECB, in as few calls as BATCH_MAX_REQUEST allows.
+ */
+static CK_RV batch_ecb(struct batch_job *job, CK_BBOOL encrypt, struct batch_blocks *blocks) {
+    CK_MECHANISM ecb = {CKM_AES_ECB, NULL, 0};
+    CK_ULONG produced;
+    CK_RV rv;
+
+    if (0 == blocks->length) {
+        return CKR_OK;
+    }
+
+    rv = encrypt ? funcs->C_EncryptInit(job->session, &ecb, job->key)
+                 : funcs->C_DecryptInit(job->session, &ecb, job->key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (blocks->length <= BATCH_MAX_REQUEST) {
+        produced = blocks->length;
+        rv = encrypt ? funcs->C_Encrypt(job->session, blocks->in, blocks->length, blocks->out, &produced)
+                     : funcs->C_Decrypt(job->session, blocks->in, blocks->length, blocks->out, &produced);
+        return (CKR_OK == rv && produced != blocks->length) ? CKR_GENERAL_ERROR : rv;
+    }
+
+    for (CK_ULONG offset = 0; offset < blocks->length; offset += BATCH_MAX_REQUEST) {
+        CK_ULONG length = blocks->length - offset;
+        if (length > BATCH_MAX_REQUEST) {
+            length = BATCH_MAX_REQUEST;
+        }
+        produced = length;
+        rv = encrypt ? funcs->C_EncryptUpdate(job->session, blocks->in + offset, length, blocks->out + offset, &produced)
+                     : funcs->C_DecryptUpdate(job->session, blocks->in + offset, length, blocks->out + offset, &produced);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+        if (produced != length) {
+            // The operation is still active; finish it before giving up.
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+    }
+
+    // ECB has nothing left over on block boundaries.
+    CK_BYTE last[BATCH_BLOCK_SIZE];
+    produced = sizeof(last);
+    CK_RV final_rv = encrypt ? funcs->C_EncryptFinal(job->session, last, &produced)
+                             : funcs->C_DecryptFinal(job->session, last, &produced);
+    return CKR_OK != rv ? rv : final_rv;
+}
+
+static CK_RV batch_blocks_alloc(struct batch_blocks *blocks, CK_ULONG block_count) {
+    blocks->length = 0;
+    blocks->in = malloc(block_count ? block_count * BATCH_BLOCK_SIZE : 1);
+    blocks->out = malloc(block_count ? block_count * BATCH_BLOCK_SIZE : 1);
+    if (NULL == blocks->in || NULL == blocks->out) {
+        free(blocks->in);
+        free(blocks->out);
+        return CKR_HOST_MEMORY;
+    }
+    return CKR_OK;
+}
+
+static void batch_blocks_free(struct batch_blocks *blocks) {
+    free(blocks->in);
+    free(blocks->out);
+}
+
+/**
+ * ECB over every item at once, or CBC decryption, which needs only the
+ * decrypted blocks and the ciphertext that preceded them.
+ */
+static CK_RV batch_all_blocks(struct batch_job *job, CK_ULONG block_count) {
+    CK_MECHANISM_TYPE mechanism = job->mechanism->mechanism;
+    struct batch_blocks blocks;
+    CK_RV rv;
+
+    rv = batch_blocks_alloc(&blocks, block_count);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+        if (CKR_OK == item->rv && item->input_length) {
+            memcpy(blocks.in + blocks.length, item->input, item->input_length);
+            blocks.length += item->input_length;
+        }
+    }
+
+    rv = batch_ecb(job, job->encrypt, &blocks);
+    if (CKR_OK != rv) {
+        batch_blocks_free(&blocks);
+        return rv;
+    }
+
+    CK_BYTE_PTR decrypted = blocks.out;
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+        if (CKR_OK != item->rv) {
+            continue;
+        }
+
+        memcpy(item->output, decrypted, item->input_length);
+        item->output_length = item->input_length;
+        decrypted += item->input_length;
+
+        if (CKM_AES_ECB == mechanism) {
+            continue;
+        }
+
+        const CK_BYTE *previous = batch_item_iv(job, item);
+        for (CK_ULONG offset = 0; offset < item->input_length; offset += BATCH_BLOCK_SIZE) {
+            for (int b = 0; b < BATCH_BLOCK_SIZE; b++) {
+                item->output[offset + b] ^= previous[b];
+            }
+            previous = item->input + offset;
+        }
+
+        if (CKM_AES_CBC_PAD == mechanism) {
+            CK_BYTE pad = item->output[item->output_length - 1];
+            CK_BYTE bad = (0 == pad || pad > BATCH_BLOCK_SIZE) ? 1 : 0;
+            for (CK_ULONG b = 0; !bad && b < pad; b++) {
+                bad |= item->output[item->output_length - 1 - b] != pad;
+            }
+            if (bad) {
+                item->rv = CKR_ENCRYPTED_DATA_INVALID;
+                item->output_length = 0;
+            } else {
+                item->output_length -= pad;
+            }
+        }
+    }
+
+    batch_blocks_free(&blocks);
+    return CKR_OK;
+}
+
+/**
+ * CTR in either direction: one ECB encryption of every counter block, then
+ * the keystream is XORed with the inputs.
+ */
+static CK_RV batch_ctr(struct batch_job *job, CK_ULONG block_count) {
+    CK_AES_CTR_PARAMS_PTR params = job->mechanism->pParameter;
+    struct batch_blocks blocks;
+    CK_RV rv;
+
+    rv = batch_blocks_alloc(&blocks, block_count);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+        if (CKR_OK != item->rv) {
+            continue;
+        }
+        for (CK_ULONG offset = 0; offset < item->input_length; offset += BATCH_BLOCK_SIZE) {
+            batch_ctr_block(batch_item_iv(job, item), params->ulCounterBits, offset / BATCH_BLOCK_SIZE,
+                            blocks.in + blocks.length);
+            blocks.length += BATCH_BLOCK_SIZE;
+        }
+    }
+
+    rv = batch_ecb(job, CK_TRUE, &blocks);
+    if (CKR_OK != rv) {
+        batch_blocks_free(&blocks);
+        return rv;
+    }
+
+    CK_BYTE_PTR keystream = blocks.out;
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+        if (CKR_OK != item->rv) {
+            continue;
+        }
+        for (CK_ULONG b = 0; b < item->input_length; b++) {
+            item->output[b] = item->input[b] ^ keystream[b];
+        }
+        item->output_length = item->input_length;
+        keystream += (item->input_length + BATCH_BLOCK_SIZE - 1) / BATCH_BLOCK_SIZE * BATCH_BLOCK_SIZE;
+    }
+
+    batch_blocks_free(&blocks);
+    return CKR_OK;
+}
+
+static void batch_padded_block(struct batch_item *item, CK_ULONG offset, CK_BYTE block[BATCH_BLOCK_SIZE]) {
+    CK_ULONG available = item->input_length > offset ? item->input_length - offset : 0;
+
+    if (available >= BATCH_BLOCK_SIZE) {
+        memcpy(block, item->input + offset, BATCH_BLOCK_SIZE);
+        return;
+    }
+    // PKCS#7 padding, the only partial block CBC_PAD produces.
+    memcpy(block, item->input + offset, available);
+    memset(block + available, (int) (BATCH_BLOCK_SIZE - available), BATCH_BLOCK_SIZE - available);
+}
+
+/**
+ * CBC encryption. Each block is chained on the ciphertext of the block
+ * before it, so block n of every item goes in the n-th ECB operation.
+ */
+static CK_RV batch_cbc_encrypt(struct batch_job *job, CK_ULONG max_blocks) {
+    CK_BBOOL pad = CKM_AES_CBC_PAD == job->mechanism->mechanism;
+    struct batch_blocks blocks;
+    CK_ULONG pending = 0;
+    CK_RV rv;
+
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        if (CKR_OK == job->items[i].rv) {
+            pending++;
+        }
+    }
+    rv = batch_blocks_alloc(&blocks, pending);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    for (CK_ULONG round = 0; round < max_blocks && CKR_OK == rv; round++) {
+        CK_ULONG offset = round * BATCH_BLOCK_SIZE;
+        CK_ULONG round_end = offset + BATCH_BLOCK_SIZE;
+
+        blocks.length = 0;
+        for (CK_ULONG i = 0; i < job->count; i++) {
+            struct batch_item *item = &job->items[i];
+            CK_ULONG item_end = pad ? (item->input_length / BATCH_BLOCK_SIZE + 1) * BATCH_BLOCK_SIZE
+                                    : item->input_length;
+            if (CKR_OK != item->rv || item_end < round_end) {
+                continue;
+            }
+
+            CK_BYTE_PTR block = blocks.in + blocks.length;
+            const CK_BYTE *previous = 0 == round ? batch_item_iv(job, item) : item->output + offset - BATCH_BLOCK_SIZE;
+            batch_padded_block(item, offset, block);
+            for (int b = 0; b < BATCH_BLOCK_SIZE; b++) {
+                block[b] ^= previous[b];
+            }
+            blocks.length += BATCH_BLOCK_SIZE;
+            item->output_length = round_end;
+        }
+
+        rv = batch_ecb(job, CK_TRUE, &blocks);
+
+        CK_BYTE_PTR encrypted = blocks.out;
+        for (CK_ULONG i = 0; i < job->count && CKR_OK == rv; i++) {
+            struct batch_item *item = &job->items[i];
+            if (CKR_OK == item->rv && item->output_length == round_end) {
+                memcpy(item->output + offset, encrypted, BATCH_BLOCK_SIZE);
+                encrypted += BATCH_BLOCK_SIZE;
+            }
+        }
+    }
+
+    batch_blocks_free(&blocks);
+    return rv;
+}
+
+/**
+ * Encrypt or decrypt every item with its own init and single-part call, for
+ * keys which may not be used with ECB.
+ */
+static void batch_each(struct batch_job *job) {
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+        CK_MECHANISM mech = *job->mechanism;
+        CK_AES_CTR_PARAMS ctr_params;
+        CK_ULONG length;
+
+        if (CKR_OK != item->rv) {
+            continue;
+        }
+
+        if (batch_is_cbc(mech.mechanism)) {
+            mech.pParameter = batch_item_iv(job, item);
+            mech.ulParameterLen = BATCH_BLOCK_SIZE;
+        } else if (CKM_AES_CTR == mech.mechanism) {
+            ctr_params = *(CK_AES_CTR_PARAMS_PTR) mech.pParameter;
+            memcpy(ctr_params.cb, batch_item_iv(job, item), BATCH_BLOCK_SIZE);
+            mech.pParameter = &ctr_params;
+        }
+
+        length = pkcs11_max_output_length(job->encrypt ? PKCS11_OPERATION_ENCRYPT : PKCS11_OPERATION_DECRYPT,
+                                          &mech, 0, item->input_length);
+        if (job->encrypt) {
+            item->rv = funcs->C_EncryptInit(job->session, &mech, job->key);
+            if (CKR_OK == item->rv) {
+                item->rv = funcs->C_Encrypt(job->session, item->input, item->input_length, item->output, &length);
+            }
+        } else {
+            item->rv = funcs->C_DecryptInit(job->session, &mech, job->key);
+            if (CKR_OK == item->rv) {
+                item->rv = funcs->C_Decrypt(job->session, item->input, item->input_length, item->output, &length);
+            }
+        }
+        item->output_length = CKR_OK == item->rv ? length : 0;
+    }
+}
+
+static CK_RV batch_run(struct batch_job *job, CK_BYTE_PTR *arena) {
+    enum pkcs11_operation operation = job->encrypt ? PKCS11_OPERATION_ENCRYPT : PKCS11_OPERATION_DECRYPT;
+    CK_MECHANISM_TYPE mechanism;
+    CK_ULONG arena_length = 0;
+    CK_ULONG block_count = 0;
+    CK_ULONG max_blocks = 0;
+    CK_RV rv;
+
+    if (!job->mechanism || (!job->items && job->count) || !arena) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    *arena = NULL;
+    mechanism = job->mechanism->mechanism;
+
+    rv = batch_check_mechanism(job->mechanism);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        arena_length += pkcs11_max_output_length(operation, job->mechanism, 0, job->items[i].input_length);
+    }
+    *arena = malloc(arena_length ? arena_length : 1);
+    if (NULL == *arena) {
+        return CKR_HOST_MEMORY;
+    }
+
+    arena_length = 0;
+    for (CK_ULONG i = 0; i < job->count; i++) {
+        struct batch_item *item = &job->items[i];
+
+        item->output = *arena + arena_length;
+        item->output_length = 0;
+        item->rv = CKR_OK;
+        arena_length += pkcs11_max_output_length(operation, job->mechanism, 0, item->input_length);
+
+        CK_ULONG blocks = batch_item_blocks(job, item);
+        block_count += blocks;
+        if (blocks > max_blocks) {
+            max_blocks = blocks;
+        }
+    }
+
+    if (batch_is_cbc(mechanism) && job->encrypt) {
+        rv = batch_cbc_encrypt(job, max_blocks);
+    } else if (CKM_AES_CTR == mechanism) {
+        rv = batch_ctr(job, block_count);
+    } else {
+        rv = batch_all_blocks(job, block_count);
+    }
+
+    if (CKM_AES_ECB != mechanism && (CKR_MECHANISM_INVALID == rv || CKR_KEY_FUNCTION_NOT_PERMITTED == rv)) {
+        batch_each(job);
+        return CKR_OK;
+    }
+    if (CKR_OK != rv) {
+        for (CK_ULONG i = 0; i < job->count; i++) {
+            if (CKR_OK == job->items[i].rv) {
+                job->items[i].rv = rv;
+                job->items[i].output_length = 0;
+            }
+        }
+    }
+    return rv;
+}
+
+/**
+ * Encrypt many messages under one key and mechanism.
+ * @param session Active PKCS#11 session
+ * @param mechanism CKM_AES_ECB, CKM_AES_CBC, CKM_AES_CBC_PAD or CKM_AES_CTR. For
+ * CBC the parameter may be NULL if every item has an IV. With more than one
+ * item, CBC and CTR items without an IV fail with CKR_MECHANISM_PARAM_INVALID.
+ * @param key AES key
+ * @param items Messages. output, output_length and rv are set for each.
+ * @param count Number of items
+ * @param arena Receives the buffer holding every output, which the caller frees
+ * @return CKR_OK when every item was attempted, with each item's result in its
+ * rv. Otherwise the error which stopped the batch, also set on every item it
+ * left unfinished.
+ */
+CK_RV batch_encrypt(CK_SESSION_HANDLE session,
+                    CK_MECHANISM_PTR mechanism,
+                    CK_OBJECT_HANDLE key,
+                    struct batch_item *items,
+                    CK_ULONG count,
+                    CK_BYTE_PTR *arena) {
+    struct batch_job job = {session, mechanism, key, CK_TRUE, items, count};
+    return batch_run(&job, arena);
+}
+
+/**
+ * Decrypt many messages under one key and mechanism.
+ * Parameters and results are as for batch_encrypt. CBC_PAD items whose
+ * padding does not check out get CKR_ENCRYPTED_DATA_INVALID.
+ */
+CK_RV batch_decrypt(CK_SESSION_HANDLE session,
+                    CK_MECHANISM_PTR mechanism,
+                    CK_OBJECT_HANDLE key,
+                    struct batch_item *items,
+                    CK_ULONG count,
+                    CK_BYTE_PTR *arena) {
+    struct batch_job job = {session, mechanism, key, CK_FALSE, items, count};
+    return batch_run(&job, arena);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef PKCS11_EXAMPLES_ENCRYPT_BATCH_H
+#define PKCS11_EXAMPLES_ENCRYPT_BATCH_H
+
+#include "aes.h"
+
+/*
+ * Encryption of many small messages under one key and mechanism.
+ *
+ * Each message is described by a batch_item, much like an iovec. All outputs
+ * are sized up front and carved out of one arena, which the caller frees.
+ *
+ * Every AES block of every item is independent under ECB, so the batch is
+ * carried out as AES-ECB over all of the items' blocks at once, with the
+ * chaining, counters and padding of the requested mode applied locally:
+ *
+ *  - CKM_AES_ECB, CTR, and CBC decryption take one ECB operation for the
+ *    whole batch.
+ *  - CBC and CBC_PAD encryption chain each block on the previous one, so take
+ *    one ECB operation per block of the longest item: five for 64 bytes of
+ *    padded data, however many items there are.
+ *
+ * An ECB operation is a C_EncryptInit or C_DecryptInit and a C_Encrypt or
+ * C_Decrypt per BATCH_MAX_REQUEST bytes. If the key may not be used with
+ * CKM_AES_ECB, for example because of CKA_ALLOWED_MECHANISMS, every item is
+ * encrypted with its own init and single C_Encrypt instead.
+ */
+#define BATCH_MAX_REQUEST 16384
+
+struct batch_item {
+    CK_BYTE_PTR input;
+    CK_ULONG input_length;
+    // IV for CBC and CBC_PAD, counter block for CTR. Required when the batch has
+    // more than one item; a single item may leave it NULL to use the mechanism's.
+    CK_BYTE_PTR iv;
+    // Set by the batch: the item's slice of the arena and its result.
+    CK_BYTE_PTR output;
+    CK_ULONG output_length;
+    CK_RV rv;
+};
+
+CK_RV batch_encrypt(CK_SESSION_HANDLE session,
+                    CK_MECHANISM_PTR mechanism,
+                    CK_OBJECT_HANDLE key,
+                    struct batch_item *items,
+                    CK_ULONG count,
+                    CK_BYTE_PTR *arena);
+
+CK_RV batch_decrypt(CK_SESSION_HANDLE session,
+                    CK_MECHANISM_PTR mechanism,
+                    CK_OBJECT_HANDLE key,
+                    struct batch_item *items,
+                    CK_ULONG count,
+                    CK_BYTE_PTR *arena);
+
+#endif //PKCS11_EXAMPLES_ENCRYPT_BATCH_H
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "gcm_engine.h"
+
+struct gcm_engine_key {
+    CK_OBJECT_HANDLE handle;
+    CK_BYTE fixed_field[GCM_ENGINE_FIXED_FIELD_SIZE];
+    atomic_uint_fast64_t invocations;
+    atomic_uint_fast64_t invocation_limit;
+    atomic_int module_generated_ivs;
+};
+
+/*
+ * Keys are only ever appended. An entry is filled in before key_count is
+ * raised past it, so encrypting threads read the table without a lock.
+ */
+struct gcm_engine {
+    struct session_pool *sessions;
+    pthread_mutex_t lock;
+    struct gcm_engine_key *keys;
+    CK_ULONG max_keys;
+    atomic_ulong key_count;
+};
+
+static struct gcm_engine_key *gcm_engine_find_key(struct gcm_engine *engine, CK_OBJECT_HANDLE key) {
+    CK_ULONG count = atomic_load(&engine->key_count);
+
+    for (CK_ULONG i = 0; i < count; i++) {
+        if (engine->keys[i].handle == key) {
+            return &engine->keys[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take the next invocation of a key, unless that would pass its limit.
+ * A compare and swap rather than an add keeps the counter from ever moving
+ * past the limit, or wrapping.
+ */
+static CK_RV gcm_engine_reserve(struct gcm_engine_key *key, uint64_t *invocation) {
+    uint_fast64_t current = atomic_load(&key->invocations);
+
+    do {
+        if (current >= atomic_load(&key->invocation_limit)) {
+            return CKR_KEY_FUNCTION_NOT_PERMITTED;
+        }
+    } while (!atomic_compare_exchange_weak(&key->invocations, &current, current + 1));
+
+    *invocation = current;
+    return CKR_OK;
+}
+
+static void gcm_engine_lower_limit(struct gcm_engine_key *key, uint64_t limit) {
+    uint_fast64_t current = atomic_load(&key->invocation_limit);
+
+    while (current > limit && !atomic_compare_exchange_weak(&key->invocation_limit, &current, limit)) {
+    }
+}
+
+/**
+ * Create an engine which encrypts on sessions from the given pool.
+ * @param sessions Session pool, which must outlive the engine
+ * @param max_keys Number of keys which can be added
+ * @param engine
+ * @return CK_RV
+ */
+CK_RV gcm_engine_create(struct session_pool *sessions, CK_ULONG max_keys, struct gcm_engine **engine) {
+    struct gcm_engine *new_engine;
+
+    if (!sessions || 0 == max_keys || !engine) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_engine = calloc(1, sizeof(struct gcm_engine));
+    if (NULL == new_engine) {
+        return CKR_HOST_MEMORY;
+    }
+    new_engine->keys = calloc(max_keys, sizeof(struct gcm_engine_key));
+    if (NULL == new_engine->keys) {
+        free(new_engine);
+        return CKR_HOST_MEMORY;
+    }
+
+    new_engine->sessions = sessions;
+    new_engine->max_keys = max_keys;
+    atomic_init(&new_engine->key_count, 0);
+    pthread_mutex_init(&new_engine->lock, NULL);
+
+    *engine = new_engine;
+    return CKR_OK;
+}
+
+/**
+ * Allow a key to encrypt through the engine.
+ * @param engine
+ * @param key AES key
+ * @param fixed_field Fixed field of every IV, unique to this engine for this key
+ * @param first_invocation Invocation count persisted from an earlier engine, or 0
+ * @param invocation_limit Maximum number of invocations, or 0 for the 2^64 the counter allows
+ * @return CKR_ARGUMENTS_BAD if the key was already added, otherwise CK_RV
+ */
+CK_RV gcm_engine_add_key(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         const CK_BYTE fixed_field[GCM_ENGINE_FIXED_FIELD_SIZE],
+                         uint64_t first_invocation,
+                         uint64_t invocation_limit) {
+    CK_RV rv = CKR_OK;
+
+    if (!engine || CK_INVALID_HANDLE == key || !fixed_field) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    CK_ULONG count = atomic_load(&engine->key_count);
+    if (NULL != gcm_engine_find_key(engine, key)) {
+        rv = CKR_ARGUMENTS_BAD;
+    } else if (count == engine->max_keys) {
+        rv = CKR_HOST_MEMORY;
+    } else {
+        struct gcm_engine_key *entry = &engine->keys[count];
+
+        entry->handle = key;
+        memcpy(entry->fixed_field, fixed_field, GCM_ENGINE_FIXED_FIELD_SIZE);
+        atomic_init(&entry->invocations, first_invocation);
+        atomic_init(&entry->invocation_limit, 0 == invocation_limit ? UINT64_MAX : invocation_limit);
+        atomic_init(&entry->module_generated_ivs, 0);
+        atomic_store(&engine->key_count, count + 1);
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return rv;
+}
+
+/**
+ * Encrypt one message into an IV || ciphertext || tag frame. Thread safe.
+ * As with C_Encrypt, a NULL frame returns the frame length, which is always
+ * the plaintext length plus GCM_ENGINE_FRAME_OVERHEAD.
+ * @param engine
+ * @param key Key added with gcm_engine_add_key
+ * @param aad Additional authenticated data, may be NULL
+ * @param aad_length
+ * @param plaintext
+ * @param plaintext_length
+ * @param frame Output frame, or NULL
+ * @param frame_length Capacity of the frame on input, length of the frame on output
+ * @return CKR_KEY_FUNCTION_NOT_PERMITTED once the key reaches its invocation
+ * limit, CKR_KEY_HANDLE_INVALID for keys which were not added, otherwise CK_RV.
+ */
+CK_RV gcm_engine_encrypt(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_BYTE_PTR aad,
+                         CK_ULONG aad_length,
+                         CK_BYTE_PTR plaintext,
+                         CK_ULONG plaintext_length,
+                         CK_BYTE_PTR frame,
+                         CK_ULONG_PTR frame_length) {
+    CK_BYTE proposed_iv[AES_GCM_IV_SIZE];
+    CK_SESSION_HANDLE session;
+    struct gcm_engine_key *entry;
+    uint64_t invocation;
+    CK_RV rv;
+
+    if (!engine || !frame_length || (!plaintext && plaintext_length) || (!aad && aad_length)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG required = plaintext_length + GCM_ENGINE_FRAME_OVERHEAD;
+    if (NULL == frame) {
+        *frame_length = required;
+        return CKR_OK;
+    }
+    if (*frame_length < required) {
+        *frame_length = required;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    entry = gcm_engine_find_key(engine, key);
+    if (NULL == entry) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+    rv = gcm_engine_reserve(entry, &invocation);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    memcpy(proposed_iv, entry->fixed_field, GCM_ENGINE_FIXED_FIELD_SIZE);
+    for (int i = AES_GCM_IV_SIZE - 1; i >= GCM_ENGINE_FIXED_FIELD_SIZE; i--) {
+        proposed_iv[i] = (CK_BYTE) invocation;
+        invocation >>= 8;
+    }
+    memcpy(frame, proposed_iv, AES_GCM_IV_SIZE);
+
+    // The IV is written straight into the frame, where a module generating its own IV replaces it.
+    CK_GCM_PARAMS params = {frame, AES_GCM_IV_SIZE, AES_GCM_IV_SIZE * 8, aad, aad_length, AES_GCM_TAG_SIZE * 8};
+    CK_MECHANISM mech = {CKM_AES_GCM, &params, sizeof(params)};
+    CK_ULONG ciphertext_length = *frame_length - AES_GCM_IV_SIZE;
+
+    rv = session_pool_acquire(engine->sessions, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = funcs->C_EncryptInit(session, &mech, key);
+    if (CKR_OK == rv) {
+        rv = funcs->C_Encrypt(session, plaintext, plaintext_length, frame + AES_GCM_IV_SIZE, &ciphertext_length);
+    }
+    session_pool_release(engine->sessions, session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (0 != memcmp(frame, proposed_iv, AES_GCM_IV_SIZE) && !atomic_exchange(&entry->module_generated_ivs, 1)) {
+        gcm_engine_lower_limit(entry, GCM_ENGINE_RANDOM_IV_LIMIT);
+    }
+
+    *frame_length = AES_GCM_IV_SIZE + ciphertext_length;
+    return CKR_OK;
+}
+
+/**
+ * Decrypt and authenticate a frame made by gcm_engine_encrypt. Thread safe.
+ * Decryption does not use IVs up, so the key need not have been added.
+ * @param engine
+ * @param key AES key
+ * @param aad Additional authenticated data the frame was encrypted with
+ * @param aad_length
+ * @param frame
+ * @param frame_length
+ * @param plaintext Buffer of at least frame_length - GCM_ENGINE_FRAME_OVERHEAD bytes
+ * @param plaintext_length Capacity of the buffer on input, plaintext length on output
+ * @return CKR_ENCRYPTED_DATA_LEN_RANGE for frames too short to hold an IV
+ * and tag, otherwise CK_RV.
+ */
+CK_RV gcm_engine_decrypt(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_BYTE_PTR aad,
+                         CK_ULONG aad_length,
+                         CK_BYTE_PTR frame,
+                         CK_ULONG frame_length,
+                         CK_BYTE_PTR plaintext,
+                         CK_ULONG_PTR plaintext_length) {
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    if (!engine || !frame || !plaintext_length || (!aad && aad_length)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (frame_length < GCM_ENGINE_FRAME_OVERHEAD) {
+        return CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+
+    CK_ULONG required = frame_length - GCM_ENGINE_FRAME_OVERHEAD;
+    if (NULL == plaintext) {
+        *plaintext_length = required;
+        return CKR_OK;
+    }
+    if (*plaintext_length < required) {
+        *plaintext_length = required;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    CK_GCM_PARAMS params = {frame, AES_GCM_IV_SIZE, AES_GCM_IV_SIZE * 8, aad, aad_length, AES_GCM_TAG_SIZE * 8};
+    CK_MECHANISM mech = {CKM_AES_GCM, &params, sizeof(params)};
+
+    rv = session_pool_acquire(engine->sessions, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = funcs->C_DecryptInit(session, &mech, key);
+    if (CKR_OK == rv) {
+        rv = funcs->C_Decrypt(session, frame + AES_GCM_IV_SIZE, frame_length - AES_GCM_IV_SIZE,
+                              plaintext, plaintext_length);
+    }
+    session_pool_release(engine->sessions, session);
+    return rv;
+}
+
+/**
+ * Report how many IVs a key has used. Callers persist invocations to resume
+ * the counter after a restart.
+ * @param engine
+ * @param key
+ * @param stats
+ * @return CKR_KEY_HANDLE_INVALID for keys which were not added, otherwise CK_RV.
+ */
+CK_RV gcm_engine_key_stats(struct gcm_engine *engine, CK_OBJECT_HANDLE key, struct gcm_engine_key_stats *stats) {
+    struct gcm_engine_key *entry;
+
+    if (!engine || !stats) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    entry = gcm_engine_find_key(engine, key);
+    if (NULL == entry) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    stats->invocations = atomic_load(&entry->invocations);
+    stats->invocation_limit = atomic_load(&entry->invocation_limit);
+    stats->module_generated_ivs = atomic_load(&entry->module_generated_ivs) ? CK_TRUE : CK_FALSE;
+    return CKR_OK;
+}
+
+/**
+ * Free the engine. The keys and the session pool are left alone.
+ * @param engine
+ */
+void gcm_engine_destroy(struct gcm_engine *engine) {
+    if (NULL == engine) {
+        return;
+    }
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->keys);
+    free(engine);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef PKCS11_EXAMPLES_ENCRYPT_GCM_ENGINE_H
+#define PKCS11_EXAMPLES_ENCRYPT_GCM_ENGINE_H
+
+#include <stdint.h>
+
+#include "aes.h"
+#include "session_pool.h"
+
+/*
+ * AES-GCM record encryption across pooled sessions.
+ *
+ * Every message is encrypted with one C_EncryptInit and one C_Encrypt on
+ * whichever pooled session is free, straight into a caller supplied frame
+ *
+ *     IV (12 bytes) || ciphertext || tag (16 bytes)
+ *
+ * so any number of threads can have messages in flight at once.
+ *
+ * IVs are built deterministically as in SP 800-38D section 8.2.1: a 4 byte
+ * fixed field followed by a 64 bit big-endian invocation counter kept per
+ * key. The fixed field must be unique to each engine instance using a key,
+ * and callers that keep a key across restarts must persist the invocation
+ * count from gcm_engine_key_stats and pass it back as first_invocation.
+ *
+ * Modules which generate GCM IVs themselves, as CloudHSM does, overwrite the
+ * proposed IV. The engine notices and frames the IV the module used, and
+ * since those IVs are random the key's invocation limit drops to the 2^32
+ * that section 8.3 allows for random IVs.
+ */
+#define GCM_ENGINE_FIXED_FIELD_SIZE 4
+#define GCM_ENGINE_FRAME_OVERHEAD (AES_GCM_IV_SIZE + AES_GCM_TAG_SIZE)
+#define GCM_ENGINE_RANDOM_IV_LIMIT (1ULL << 32)
+
+struct gcm_engine;
+
+struct gcm_engine_key_stats {
+    // IVs handed out, including ones used by failed calls, which are never reused.
+    uint64_t invocations;
+    uint64_t invocation_limit;
+    // The module replaced the deterministic IVs with its own.
+    CK_BBOOL module_generated_ivs;
+};
+
+CK_RV gcm_engine_create(struct session_pool *sessions, CK_ULONG max_keys, struct gcm_engine **engine);
+
+CK_RV gcm_engine_add_key(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         const CK_BYTE fixed_field[GCM_ENGINE_FIXED_FIELD_SIZE],
+                         uint64_t first_invocation,
+                         uint64_t invocation_limit);
+
+CK_RV gcm_engine_encrypt(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_BYTE_PTR aad,
+                         CK_ULONG aad_length,
+                         CK_BYTE_PTR plaintext,
+                         CK_ULONG plaintext_length,
+                         CK_BYTE_PTR frame,
+                         CK_ULONG_PTR frame_length);
+
+CK_RV gcm_engine_decrypt(struct gcm_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_BYTE_PTR aad,
+                         CK_ULONG aad_length,
+                         CK_BYTE_PTR frame,
+                         CK_ULONG frame_length,
+                         CK_BYTE_PTR plaintext,
+                         CK_ULONG_PTR plaintext_length);
+
+CK_RV gcm_engine_key_stats(struct gcm_engine *engine, CK_OBJECT_HANDLE key, struct gcm_engine_key_stats *stats);
+
+void gcm_engine_destroy(struct gcm_engine *engine);
+
+#endif //PKCS11_EXAMPLES_ENCRYPT_GCM_ENGINE_H
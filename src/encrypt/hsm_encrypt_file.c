@@ -0,0 +1,843 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "aes.h"
+#include "gopt.h"
+
+/*
+ * Streams a file of any size through the multipart encrypt or decrypt API.
+ *
+ * The input is read one chunk at a time by a read-ahead thread into two
+ * alternating buffers, so the next chunk is read from disk while the HSM
+ * processes the current one. Each chunk is passed to a single
+ * C_EncryptUpdate or C_DecryptUpdate call into a reusable output buffer,
+ * so memory use depends on the chunk size and not on the file size.
+ *
+ * The output file starts with a header which records the mode and IV:
+ *   magic (8 bytes) || mode (1 byte) || IV length (1 byte) || IV (16 bytes, zero padded)
+ * For GCM, the first 10 bytes of the header are authenticated as AAD and
+ * the tag follows the ciphertext.
+ */
+
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
+#define AES_BLOCK_SIZE 16
+
+#define FILE_MAGIC "HSMENC01"
+#define FILE_MAGIC_SIZE 8
+#define FILE_IV_SIZE 16
+#define FILE_AAD_SIZE (FILE_MAGIC_SIZE + 2)
+#define FILE_HEADER_SIZE (FILE_AAD_SIZE + FILE_IV_SIZE)
+
+// The CTR counter block is a random nonce followed by a 64 bit block counter.
+#define CTR_NONCE_SIZE 8
+#define CTR_COUNTER_BITS 64
+
+struct file_mode {
+    const char *name;
+    CK_BYTE id;
+    CK_MECHANISM_TYPE mechanism;
+    CK_ULONG iv_length;
+};
+
+static const struct file_mode file_modes[] = {
+        { "cbc", 1, CKM_AES_CBC_PAD, AES_BLOCK_SIZE },
+        { "ctr", 2, CKM_AES_CTR,     AES_BLOCK_SIZE },
+        { "gcm", 3, CKM_AES_GCM,     AES_GCM_IV_SIZE },
+};
+
+#define FILE_MODES_LEN (sizeof(file_modes) / sizeof(file_modes[0]))
+
+struct file_header {
+    CK_BYTE bytes[FILE_HEADER_SIZE];
+    const struct file_mode *mode;
+};
+
+/*
+ * Mechanism parameters have to outlive the Init call and, for GCM
+ * encryption, the whole operation, since the HSM writes the IV to pIv.
+ */
+struct cipher_params {
+    CK_MECHANISM mechanism;
+    CK_AES_CTR_PARAMS ctr;
+    CK_GCM_PARAMS gcm;
+};
+
+struct stream_chunk {
+    CK_BYTE_PTR data;
+    size_t length;
+    int full;
+    int last;
+};
+
+/*
+ * Two buffers shared by the read-ahead thread and the thread calling the HSM.
+ * The reader fills a buffer only once the consumer has released it.
+ */
+struct read_ahead {
+    FILE *in;
+    size_t chunk_size;
+    struct stream_chunk chunks[2];
+    unsigned int next;
+    int error;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t thread;
+};
+
+struct file_arguments {
+    char *pin;
+    char *library;
+    const struct file_mode *mode;
+    char *key_label;
+    char *in;
+    char *out;
+    CK_BBOOL decrypt;
+    size_t chunk_size;
+};
+
+static void *read_ahead_run(void *arg) {
+    struct read_ahead *ra = arg;
+
+    for (unsigned int i = 0; ; i ^= 1) {
+        struct stream_chunk *chunk = &ra->chunks[i];
+        size_t length;
+        int error;
+
+        pthread_mutex_lock(&ra->lock);
+        while (chunk->full && !ra->stop) {
+            pthread_cond_wait(&ra->changed, &ra->lock);
+        }
+        if (ra->stop) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        length = fread(chunk->data, 1, ra->chunk_size, ra->in);
+        error = ferror(ra->in);
+
+        pthread_mutex_lock(&ra->lock);
+        chunk->length = length;
+        chunk->last = length < ra->chunk_size;
+        chunk->full = 1;
+        if (error) {
+            ra->error = 1;
+        }
+        pthread_cond_broadcast(&ra->changed);
+        pthread_mutex_unlock(&ra->lock);
+
+        if (chunk->last) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void read_ahead_free(struct read_ahead *ra) {
+    free(ra->chunks[0].data);
+    free(ra->chunks[1].data);
+    pthread_cond_destroy(&ra->changed);
+    pthread_mutex_destroy(&ra->lock);
+}
+
+static CK_RV read_ahead_start(struct read_ahead *ra, FILE *in, size_t chunk_size) {
+    memset(ra, 0, sizeof(*ra));
+    ra->in = in;
+    ra->chunk_size = chunk_size;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->changed, NULL);
+
+    ra->chunks[0].data = malloc(chunk_size);
+    ra->chunks[1].data = malloc(chunk_size);
+    if (NULL == ra->chunks[0].data || NULL == ra->chunks[1].data) {
+        fprintf(stderr, "Could not allocate memory for the input buffers\n");
+        read_ahead_free(ra);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (0 != pthread_create(&ra->thread, NULL, read_ahead_run, ra)) {
+        fprintf(stderr, "Could not start the read-ahead thread\n");
+        read_ahead_free(ra);
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Wait for the next chunk of input.
+ * @param ra
+ * @return The chunk, which the caller gives back with read_ahead_release,
+ * or NULL if reading the input failed.
+ */
+static struct stream_chunk *read_ahead_next(struct read_ahead *ra) {
+    struct stream_chunk *chunk = &ra->chunks[ra->next];
+
+    pthread_mutex_lock(&ra->lock);
+    while (!chunk->full) {
+        pthread_cond_wait(&ra->changed, &ra->lock);
+    }
+    if (ra->error) {
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return chunk;
+}
+
+static void read_ahead_release(struct read_ahead *ra, struct stream_chunk *chunk) {
+    pthread_mutex_lock(&ra->lock);
+    chunk->full = 0;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+    ra->next ^= 1;
+}
+
+static void read_ahead_stop(struct read_ahead *ra) {
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->changed);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+    read_ahead_free(ra);
+}
+
+static CK_RV write_output(FILE *out, CK_BYTE_PTR data, CK_ULONG length) {
+    if (length > 0 && fwrite(data, 1, length, out) != length) {
+        fprintf(stderr, "Failed writing the output\n");
+        return CKR_GENERAL_ERROR;
+    }
+    return CKR_OK;
+}
+
+/**
+ * Make sure the output buffer can hold the length the library asked for.
+ * This is only needed when a library holds back more output than a block,
+ * for example the plaintext of GCM decryption until the tag is verified.
+ */
+static CK_RV grow_output(CK_BYTE_PTR *output, CK_ULONG *capacity, CK_ULONG length) {
+    CK_BYTE_PTR larger;
+
+    if (length <= *capacity) {
+        return CKR_OK;
+    }
+
+    larger = realloc(*output, length);
+    if (NULL == larger) {
+        fprintf(stderr, "Could not allocate memory for the output\n");
+        return CKR_HOST_MEMORY;
+    }
+    *output = larger;
+    *capacity = length;
+    return CKR_OK;
+}
+
+/**
+ * Run an initialized multipart encrypt or decrypt operation over a file.
+ * @param session Session with an active encrypt or decrypt operation
+ * @param decrypt CK_TRUE to continue a decrypt operation
+ * @param in Input, positioned after any header
+ * @param out Output
+ * @param chunk_size Bytes passed to each update call
+ * @return CK_RV
+ */
+static CK_RV stream_file(CK_SESSION_HANDLE session, CK_BBOOL decrypt,
+                         FILE *in, FILE *out, size_t chunk_size) {
+    CK_RV rv;
+    CK_C_EncryptUpdate update = decrypt ? funcs->C_DecryptUpdate : funcs->C_EncryptUpdate;
+    CK_C_EncryptFinal final = decrypt ? funcs->C_DecryptFinal : funcs->C_EncryptFinal;
+    struct read_ahead ra;
+    CK_BYTE_PTR output;
+    CK_ULONG capacity;
+    CK_ULONG output_length;
+
+    // An update returns at most the input plus the block held back from the previous update.
+    capacity = (CK_ULONG) chunk_size + 2 * AES_BLOCK_SIZE;
+    output = malloc(capacity);
+    if (NULL == output) {
+        fprintf(stderr, "Could not allocate memory for the output\n");
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = read_ahead_start(&ra, in, chunk_size);
+    if (CKR_OK != rv) {
+        free(output);
+        return rv;
+    }
+
+    for (;;) {
+        struct stream_chunk *chunk = read_ahead_next(&ra);
+        int last;
+
+        if (NULL == chunk) {
+            fprintf(stderr, "Failed reading the input\n");
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+
+        if (chunk->length > 0) {
+            output_length = capacity;
+            rv = update(session, chunk->data, (CK_ULONG) chunk->length, output, &output_length);
+            if (CKR_BUFFER_TOO_SMALL == rv) {
+                rv = grow_output(&output, &capacity, output_length);
+                if (CKR_OK == rv) {
+                    rv = update(session, chunk->data, (CK_ULONG) chunk->length, output, &output_length);
+                }
+            }
+            if (CKR_OK != rv) {
+                fprintf(stderr, "%s update failed: %lu\n", decrypt ? "Decryption" : "Encryption", rv);
+                break;
+            }
+            rv = write_output(out, output, output_length);
+            if (CKR_OK != rv) {
+                break;
+            }
+        }
+
+        last = chunk->last;
+        read_ahead_release(&ra, chunk);
+        if (last) {
+            break;
+        }
+    }
+
+    read_ahead_stop(&ra);
+
+    if (CKR_OK == rv) {
+        output_length = capacity;
+        rv = final(session, output, &output_length);
+        if (CKR_BUFFER_TOO_SMALL == rv) {
+            rv = grow_output(&output, &capacity, output_length);
+            if (CKR_OK == rv) {
+                rv = final(session, output, &output_length);
+            }
+        }
+        if (CKR_OK != rv) {
+            fprintf(stderr, "%s final failed: %lu\n", decrypt ? "Decryption" : "Encryption", rv);
+        } else {
+            rv = write_output(out, output, output_length);
+        }
+    }
+
+    free(output);
+    return rv;
+}
+
+static void setup_mechanism(struct file_header *header, struct cipher_params *params) {
+    const struct file_mode *mode = header->mode;
+    CK_BYTE_PTR iv = &header->bytes[FILE_AAD_SIZE];
+
+    memset(params, 0, sizeof(*params));
+    params->mechanism.mechanism = mode->mechanism;
+
+    switch (mode->mechanism) {
+        case CKM_AES_CTR:
+            memcpy(params->ctr.cb, iv, sizeof(params->ctr.cb));
+            params->ctr.ulCounterBits = CTR_COUNTER_BITS;
+            params->mechanism.pParameter = &params->ctr;
+            params->mechanism.ulParameterLen = sizeof(params->ctr);
+            break;
+        case CKM_AES_GCM:
+            params->gcm.pIv = iv;
+            params->gcm.ulIvLen = mode->iv_length;
+            params->gcm.ulIvBits = mode->iv_length * 8;
+            params->gcm.pAAD = header->bytes;
+            params->gcm.ulAADLen = FILE_AAD_SIZE;
+            params->gcm.ulTagBits = AES_GCM_TAG_SIZE * 8;
+            params->mechanism.pParameter = &params->gcm;
+            params->mechanism.ulParameterLen = sizeof(params->gcm);
+            break;
+        default:
+            params->mechanism.pParameter = iv;
+            params->mechanism.ulParameterLen = mode->iv_length;
+            break;
+    }
+}
+
+static CK_RV write_header(FILE *out, struct file_header *header) {
+    return write_output(out, header->bytes, FILE_HEADER_SIZE);
+}
+
+static CK_RV read_header(FILE *in, struct file_header *header) {
+    if (fread(header->bytes, 1, FILE_HEADER_SIZE, in) != FILE_HEADER_SIZE
+        || 0 != memcmp(header->bytes, FILE_MAGIC, FILE_MAGIC_SIZE)) {
+        fprintf(stderr, "The input is not a file written by hsm_encrypt_file\n");
+        return CKR_ENCRYPTED_DATA_INVALID;
+    }
+
+    header->mode = NULL;
+    for (size_t i = 0; i < FILE_MODES_LEN; i++) {
+        if (file_modes[i].id == header->bytes[FILE_MAGIC_SIZE]) {
+            header->mode = &file_modes[i];
+        }
+    }
+    if (NULL == header->mode || header->mode->iv_length != header->bytes[FILE_MAGIC_SIZE + 1]) {
+        fprintf(stderr, "The input was encrypted with an unknown mode\n");
+        return CKR_ENCRYPTED_DATA_INVALID;
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Encrypt a file. The IV is random: CBC and CTR IVs come from the HSM's RNG,
+ * while the HSM generates the GCM IV itself during encryption.
+ * @param session Active PKCS#11 session
+ * @param key AES key with CKA_ENCRYPT
+ * @param mode
+ * @param in
+ * @param out Output, which must be seekable for GCM
+ * @param chunk_size
+ * @return CK_RV
+ */
+CK_RV encrypt_file(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, const struct file_mode *mode,
+                   FILE *in, FILE *out, size_t chunk_size) {
+    CK_RV rv;
+    struct file_header header;
+    struct cipher_params params;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.bytes, FILE_MAGIC, FILE_MAGIC_SIZE);
+    header.bytes[FILE_MAGIC_SIZE] = mode->id;
+    header.bytes[FILE_MAGIC_SIZE + 1] = (CK_BYTE) mode->iv_length;
+    header.mode = mode;
+
+    if (CKM_AES_CBC_PAD == mode->mechanism) {
+        rv = funcs->C_GenerateRandom(session, &header.bytes[FILE_AAD_SIZE], mode->iv_length);
+    } else if (CKM_AES_CTR == mode->mechanism) {
+        rv = funcs->C_GenerateRandom(session, &header.bytes[FILE_AAD_SIZE], CTR_NONCE_SIZE);
+    } else {
+        rv = CKR_OK;
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to generate an IV: %lu\n", rv);
+        return rv;
+    }
+
+    setup_mechanism(&header, &params);
+    rv = funcs->C_EncryptInit(session, &params.mechanism, key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Encryption Init failed: %lu\n", rv);
+        return rv;
+    }
+
+    rv = write_header(out, &header);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = stream_file(session, CK_FALSE, in, out, chunk_size);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    // The GCM IV is only known for certain once the operation is complete.
+    if (CKM_AES_GCM == mode->mechanism) {
+        if (0 != fseek(out, 0, SEEK_SET)) {
+            fprintf(stderr, "GCM output must be written to a seekable file\n");
+            return CKR_GENERAL_ERROR;
+        }
+        rv = write_header(out, &header);
+        if (CKR_OK == rv && 0 != fseek(out, 0, SEEK_END)) {
+            rv = CKR_GENERAL_ERROR;
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Decrypt a file written by encrypt_file.
+ * GCM plaintext is written to out before C_DecryptFinal checks the tag,
+ * so the caller must discard out unless this returns CKR_OK.
+ * @param session Active PKCS#11 session
+ * @param key AES key with CKA_DECRYPT
+ * @param in
+ * @param out
+ * @param chunk_size
+ * @return CK_RV
+ */
+CK_RV decrypt_file(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key,
+                   FILE *in, FILE *out, size_t chunk_size) {
+    CK_RV rv;
+    struct file_header header;
+    struct cipher_params params;
+
+    rv = read_header(in, &header);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    setup_mechanism(&header, &params);
+    rv = funcs->C_DecryptInit(session, &params.mechanism, key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Decryption Init failed: %lu\n", rv);
+        return rv;
+    }
+
+    return stream_file(session, CK_TRUE, in, out, chunk_size);
+}
+
+static CK_RV find_key_with_label(CK_SESSION_HANDLE session, char *label, CK_OBJECT_HANDLE_PTR key) {
+    CK_RV rv;
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_KEY_TYPE key_type = CKK_AES;
+    CK_ULONG found = 0;
+
+    CK_ATTRIBUTE template[] = {
+            {CKA_CLASS,    &key_class, sizeof(key_class)},
+            {CKA_KEY_TYPE, &key_type,  sizeof(key_type)},
+            {CKA_LABEL,    label,      (CK_ULONG) strlen(label)},
+    };
+
+    rv = funcs->C_FindObjectsInit(session, template, sizeof(template) / sizeof(CK_ATTRIBUTE));
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Can't initialize search: %lu\n", rv);
+        return rv;
+    }
+
+    rv = funcs->C_FindObjects(session, key, 1, &found);
+    funcs->C_FindObjectsFinal(session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Can't run search: %lu\n", rv);
+        return rv;
+    }
+
+    if (0 == found) {
+        fprintf(stderr, "Didn't find an AES key labelled %s\n", label);
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Encrypt and decrypt a generated file in every mode with a session key,
+ * and check the decrypted file matches the original.
+ * The file is a few chunks long and not block aligned, so it exercises
+ * the read-ahead and the held back padding block.
+ * @param session Active PKCS#11 session
+ * @param chunk_size
+ * @return CK_RV
+ */
+CK_RV encrypt_file_self_test(CK_SESSION_HANDLE session, size_t chunk_size) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    size_t length = chunk_size * 5 / 2 + 7;
+    CK_BYTE_PTR original = NULL;
+    CK_BYTE_PTR restored = NULL;
+    FILE *plaintext = NULL;
+
+    rv = generate_aes_key(session, 32, &key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "AES key generation failed: %lu\n", rv);
+        return rv;
+    }
+
+    original = malloc(length);
+    restored = malloc(length + 1);
+    plaintext = tmpfile();
+    if (NULL == original || NULL == restored || NULL == plaintext) {
+        fprintf(stderr, "Could not set up the test file\n");
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        original[i] = (CK_BYTE) rand();
+    }
+    rv = write_output(plaintext, original, (CK_ULONG) length);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    for (size_t i = 0; i < FILE_MODES_LEN && CKR_OK == rv; i++) {
+        FILE *ciphertext = tmpfile();
+        FILE *decrypted = tmpfile();
+        long ciphertext_length;
+
+        if (NULL == ciphertext || NULL == decrypted) {
+            fprintf(stderr, "Could not create temporary files\n");
+            rv = CKR_GENERAL_ERROR;
+        }
+
+        if (CKR_OK == rv) {
+            rewind(plaintext);
+            rv = encrypt_file(session, key, &file_modes[i], plaintext, ciphertext, chunk_size);
+        }
+        if (CKR_OK == rv) {
+            ciphertext_length = ftell(ciphertext);
+            rewind(ciphertext);
+            rv = decrypt_file(session, key, ciphertext, decrypted, chunk_size);
+        }
+        if (CKR_OK == rv) {
+            size_t restored_length;
+
+            rewind(decrypted);
+            restored_length = fread(restored, 1, length + 1, decrypted);
+            if (restored_length != length || 0 != memcmp(original, restored, length)) {
+                fprintf(stderr, "Decrypted file does not match the original in %s mode\n", file_modes[i].name);
+                rv = CKR_GENERAL_ERROR;
+            } else {
+                printf("%s: %lu bytes encrypted to %ld bytes and restored\n",
+                       file_modes[i].name, (unsigned long) length, ciphertext_length);
+            }
+        }
+
+        if (NULL != ciphertext) {
+            fclose(ciphertext);
+        }
+        if (NULL != decrypted) {
+            fclose(decrypted);
+        }
+    }
+
+done:
+    if (NULL != plaintext) {
+        fclose(plaintext);
+    }
+    free(restored);
+    free(original);
+    return rv;
+}
+
+/**
+ * Create a temporary file next to path, so it can later be renamed over path.
+ * @param path Final output path
+ * @param temporary Receives the temporary path, which the caller frees
+ * @return The open file, or NULL on failure
+ */
+static FILE *open_temporary_output(const char *path, char **temporary) {
+    size_t temporary_length = strlen(path) + sizeof(".XXXXXX");
+    FILE *file;
+    int fd;
+
+    *temporary = malloc(temporary_length);
+    if (NULL == *temporary) {
+        return NULL;
+    }
+    snprintf(*temporary, temporary_length, "%s.XXXXXX", path);
+
+    fd = mkstemp(*temporary);
+    if (fd < 0) {
+        free(*temporary);
+        *temporary = NULL;
+        return NULL;
+    }
+
+    file = fdopen(fd, "wb");
+    if (NULL == file) {
+        close(fd);
+        remove(*temporary);
+        free(*temporary);
+        *temporary = NULL;
+    }
+    return file;
+}
+
+static void show_help(void) {
+    printf("\n\t--pin <user:password>\n\t[--library <path/to/pkcs11>]\n");
+    printf("\t[--mode <cbc|ctr|gcm>]\n\t[--chunk-size <bytes>]\n");
+    printf("\t[--key <AES key label> --in <file> --out <file> [--decrypt]]\n\n");
+    printf("Without --in and --out, every mode is tested with a generated file and a session key.\n");
+}
+
+static int get_file_args(int argc, char **argv, struct file_arguments *args) {
+    if (!args || !argv || argc == 0) {
+        return -1;
+    }
+
+    struct option options[9];
+
+    options[0].long_name  = "pin";
+    options[0].short_name = 0;
+    options[0].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[1].long_name  = "library";
+    options[1].short_name = 0;
+    options[1].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[2].long_name  = "mode";
+    options[2].short_name = 0;
+    options[2].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[3].long_name  = "key";
+    options[3].short_name = 0;
+    options[3].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[4].long_name  = "in";
+    options[4].short_name = 0;
+    options[4].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[5].long_name  = "out";
+    options[5].short_name = 0;
+    options[5].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[6].long_name  = "decrypt";
+    options[6].short_name = 0;
+    options[6].flags      = GOPT_ARGUMENT_FORBIDDEN;
+
+    options[7].long_name  = "chunk-size";
+    options[7].short_name = 0;
+    options[7].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[8].flags      = GOPT_LAST;
+
+    gopt (argv, options);
+
+    if (options[0].count != 1) {
+        show_help();
+        return -1;
+    }
+
+    args->pin = options[0].argument;
+    args->library = options[1].argument;
+    if (!args->library) {
+        args->library = DEFAULT_PKCS11_LIBRARY_PATH;
+    }
+
+    args->mode = &file_modes[0];
+    if (options[2].argument) {
+        args->mode = NULL;
+        for (size_t i = 0; i < FILE_MODES_LEN; i++) {
+            if (0 == strcmp(options[2].argument, file_modes[i].name)) {
+                args->mode = &file_modes[i];
+            }
+        }
+        if (NULL == args->mode) {
+            fprintf(stderr, "Unknown mode: %s\n", options[2].argument);
+            show_help();
+            return -1;
+        }
+    }
+
+    args->key_label = options[3].argument;
+    args->in = options[4].argument;
+    args->out = options[5].argument;
+    args->decrypt = options[6].count > 0 ? CK_TRUE : CK_FALSE;
+
+    args->chunk_size = DEFAULT_CHUNK_SIZE;
+    if (options[7].argument) {
+        args->chunk_size = strtoul(options[7].argument, NULL, 0);
+    }
+
+    if (0 == args->chunk_size || (!args->in != !args->out) || (args->in && !args->key_label)) {
+        show_help();
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    FILE *in = NULL;
+    FILE *out = NULL;
+    char *temporary = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct file_arguments args = {0};
+    if (get_file_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    if (NULL == args.in) {
+        printf("\nEncrypt/Decrypt a file in every mode\n");
+        rv = encrypt_file_self_test(session, args.chunk_size);
+        if (CKR_OK == rv) {
+            rc = EXIT_SUCCESS;
+        }
+        goto done;
+    }
+
+    rv = find_key_with_label(session, args.key_label, &key);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    in = fopen(args.in, "rb");
+    if (NULL == in) {
+        fprintf(stderr, "Could not open %s\n", args.in);
+        goto done;
+    }
+    // Nothing reaches --out until the operation has finished: in particular,
+    // GCM plaintext is only kept once C_DecryptFinal has verified the tag.
+    out = open_temporary_output(args.out, &temporary);
+    if (NULL == out) {
+        fprintf(stderr, "Could not create a temporary file for %s\n", args.out);
+        goto done;
+    }
+
+    if (args.decrypt) {
+        rv = decrypt_file(session, key, in, out, args.chunk_size);
+    } else {
+        rv = encrypt_file(session, key, args.mode, in, out, args.chunk_size);
+    }
+
+    if (0 != fclose(out)) {
+        fprintf(stderr, "Failed writing %s\n", args.out);
+        rv = CKR_GENERAL_ERROR;
+    }
+    out = NULL;
+
+    if (CKR_OK == rv && 0 != rename(temporary, args.out)) {
+        fprintf(stderr, "Could not write %s\n", args.out);
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+done:
+    if (NULL != in) {
+        fclose(in);
+    }
+    if (NULL != out) {
+        fclose(out);
+    }
+    if (NULL != temporary) {
+        if (EXIT_SUCCESS != rc) {
+            remove(temporary);
+        }
+        free(temporary);
+    }
+
+    pkcs11_finalize_session(session);
+
+    return rc;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "find.h"
+#ifndef _WIN32
+#include "object_cache.h"
+#endif
+
+/**
+ * The batch size for the next C_FindObjects call. Batches start small, so
+ * searches for a single key stay cheap, and double up to the cap. Once the
+ * cap is reached, each further round trip returns at most max_batch handles,
+ * so the number of round trips grows linearly with the result size.
+ */
+static CK_ULONG find_next_batch(CK_ULONG batch, CK_ULONG max_batch) {
+    return batch >= max_batch / 2 ? max_batch : batch * 2;
+}
+
+/**
+ * Find keys that match a passed CK_ATTRIBUTE template.
+ * Memory will be allocated in a passed pointer, and reallocated as more keys
+ * are found. The number of found keys is returned through the count parameter.
+ * @param hSession
+ * @param template
+ * @param hObject
+ * @param count
+ * @return
+ */
+CK_RV find_by_attr(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count, CK_ULONG *count,
+                   CK_OBJECT_HANDLE_PTR *hObject) {
+    return find_by_attr_batched(hSession, template, attr_count, FIND_DEFAULT_MAX_BATCH, count, hObject);
+}
+
+/**
+ * Find keys like find_by_attr, with a cap on the number of handles each
+ * C_FindObjects call returns. The handle array grows geometrically, so it
+ * is reallocated a logarithmic number of times.
+ * @param hSession
+ * @param template
+ * @param attr_count
+ * @param max_batch Largest batch to request, or 0 for FIND_DEFAULT_MAX_BATCH
+ * @param count
+ * @param hObject
+ * @return
+ */
+CK_RV find_by_attr_batched(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count,
+                           CK_ULONG max_batch, CK_ULONG *count, CK_OBJECT_HANDLE_PTR *hObject) {
+    CK_RV rv;
+
+    if (NULL == hObject || NULL == template || NULL == count) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (0 == max_batch) {
+        max_batch = FIND_DEFAULT_MAX_BATCH;
+    }
+
+    rv = funcs->C_FindObjectsInit(hSession, template, attr_count);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Can't initialize search\n");
+        return rv;
+    }
+
+    // The caller's array may be smaller than it looks, so the first batch always reallocates it.
+    CK_ULONG capacity = 0;
+    CK_ULONG batch = FIND_INITIAL_BATCH < max_batch ? FIND_INITIAL_BATCH : max_batch;
+    bool searching = 1;
+    *count = 0;
+    while (searching) {
+        CK_ULONG found = 0;
+        if (capacity - *count < batch) {
+            CK_ULONG grown = capacity * 2 > *count + batch ? capacity * 2 : *count + batch;
+            CK_OBJECT_HANDLE_PTR handles = realloc(*hObject, grown * sizeof(CK_OBJECT_HANDLE));
+            if (NULL == handles) {
+                fprintf(stderr, "Could not allocate memory for objects\n");
+                funcs->C_FindObjectsFinal(hSession);
+                return CKR_HOST_MEMORY;
+            }
+            *hObject = handles;
+            capacity = grown;
+        }
+
+        CK_OBJECT_HANDLE_PTR loc = *hObject;
+        rv = funcs->C_FindObjects(hSession, &loc[*count], batch, &found);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "Can't run search\n");
+            funcs->C_FindObjectsFinal(hSession);
+            return rv;
+        }
+
+        (*count) += found;
+
+        if (0 == found)
+            searching = 0;
+
+        batch = find_next_batch(batch, max_batch);
+    }
+
+    rv = funcs->C_FindObjectsFinal(hSession);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Can't finalize search\n");
+        return rv;
+    }
+
+    if (0 == *count) {
+        fprintf(stderr, "Didn't find requested key\n");
+        return rv;
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Stream the keys that match a passed CK_ATTRIBUTE template to a callback,
+ * one batch at a time, without collecting every handle. Memory use is bounded
+ * by the batch cap however many objects match.
+ * @param hSession
+ * @param template
+ * @param attr_count
+ * @param max_batch Largest batch to request, or 0 for FIND_DEFAULT_MAX_BATCH
+ * @param callback Called with each non-empty batch. The handles are only valid
+ *   during the call. Returning anything but CKR_OK ends the search with that value.
+ * @param context Passed to the callback
+ * @return
+ */
+CK_RV find_each_by_attr(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count,
+                        CK_ULONG max_batch, find_callback callback, void *context) {
+    CK_OBJECT_HANDLE_PTR handles = NULL;
+    CK_ULONG capacity = 0;
+    CK_RV rv;
+
+    if (NULL == template || NULL == callback) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (0 == max_batch) {
+        max_batch = FIND_DEFAULT_MAX_BATCH;
+    }
+
+    rv = funcs->C_FindObjectsInit(hSession, template, attr_count);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Can't initialize search\n");
+        return rv;
+    }
+
+    CK_ULONG batch = FIND_INITIAL_BATCH < max_batch ? FIND_INITIAL_BATCH : max_batch;
+    bool searching = 1;
+    while (searching) {
+        CK_ULONG found = 0;
+        if (capacity < batch) {
+            CK_OBJECT_HANDLE_PTR grown = realloc(handles, batch * sizeof(CK_OBJECT_HANDLE));
+            if (NULL == grown) {
+                fprintf(stderr, "Could not allocate memory for objects\n");
+                rv = CKR_HOST_MEMORY;
+                break;
+            }
+            handles = grown;
+            capacity = batch;
+        }
+
+        rv = funcs->C_FindObjects(hSession, handles, batch, &found);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "Can't run search\n");
+            break;
+        }
+
+        if (0 == found) {
+            searching = 0;
+        } else {
+            rv = callback(context, handles, found);
+            if (rv != CKR_OK) {
+                break;
+            }
+        }
+
+        batch = find_next_batch(batch, max_batch);
+    }
+
+    free(handles);
+
+    if (rv != CKR_OK) {
+        funcs->C_FindObjectsFinal(hSession);
+        return rv;
+    }
+
+    rv = funcs->C_FindObjectsFinal(hSession);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "Can't finalize search\n");
+    }
+    return rv;
+}
+
+#ifndef _WIN32
+/**
+ * Find objects like find_by_attr, answering repeated searches from the
+ * process-wide object cache. Only templates made of CKA_LABEL, CKA_CLASS,
+ * CKA_KEY_TYPE and CKA_ID are cached; other searches always reach the HSM.
+ * @param hSession
+ * @param template
+ * @param attr_count
+ * @param count
+ * @param hObject Receives an array of handles, which the caller must free
+ * @return
+ */
+CK_RV find_by_attr_cached(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count, CK_ULONG *count,
+                          CK_OBJECT_HANDLE_PTR *hObject) {
+    CK_OBJECT_HANDLE_PTR cached = NULL;
+    CK_ULONG cached_count = 0;
+    CK_RV rv;
+
+    if (NULL == hObject || NULL == template || NULL == count) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (object_cache_get(template, attr_count, &cached, &cached_count)) {
+        free(*hObject);
+        *hObject = cached;
+        *count = cached_count;
+        return CKR_OK;
+    }
+
+    rv = find_by_attr(hSession, template, attr_count, count, hObject);
+    if (CKR_OK == rv) {
+        object_cache_put(template, attr_count, *hObject, *count);
+    }
+    return rv;
+}
+#endif
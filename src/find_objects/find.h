@@ -0,0 +1,47 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __FIND_H__
+#define __FIND_H__
+
+#include "common.h"
+
+/*
+ * C_FindObjects batches start at FIND_INITIAL_BATCH handles and double with
+ * each call, up to a cap which defaults to FIND_DEFAULT_MAX_BATCH.
+ */
+#define FIND_INITIAL_BATCH 32
+#define FIND_DEFAULT_MAX_BATCH 4096
+
+/**
+ * Receives one batch of found handles.
+ * @return CKR_OK to continue the search, anything else to end it
+ */
+typedef CK_RV (*find_callback)(void *context, CK_OBJECT_HANDLE_PTR handles, CK_ULONG count);
+
+CK_RV find_by_attr(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count, CK_ULONG *count,
+                   CK_OBJECT_HANDLE_PTR *hObject);
+CK_RV find_by_attr_batched(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count,
+                           CK_ULONG max_batch, CK_ULONG *count, CK_OBJECT_HANDLE_PTR *hObject);
+CK_RV find_each_by_attr(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count,
+                        CK_ULONG max_batch, find_callback callback, void *context);
+
+#ifndef _WIN32
+CK_RV find_by_attr_cached(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count, CK_ULONG *count,
+                          CK_OBJECT_HANDLE_PTR *hObject);
+#endif
+
+#endif
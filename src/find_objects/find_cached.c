@@ -0,0 +1,184 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "find.h"
+#include "destroy.h"
+#include "latency_histogram.h"
+
+#define LOOKUPS 100
+
+/**
+ * Generate a session AES key with a label. pkcs11_generate_key drops the cached
+ * searches the new key could match.
+ * @param session
+ * @param template Key template
+ * @param attribute_count
+ * @param key
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+static CK_RV generate_labeled_key(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR template, CK_ULONG attribute_count,
+                                  CK_OBJECT_HANDLE_PTR key) {
+    CK_MECHANISM mech = {CKM_AES_KEY_GEN, NULL, 0};
+
+    return pkcs11_generate_key(session, &mech, template, attribute_count, key);
+}
+
+/**
+ * Look up a label repeatedly, and report the average time per lookup.
+ * @param session
+ * @param attr Search template
+ * @param cached Whether to use the object cache
+ * @param handle Receives the first handle found
+ * @return CK_RV Value returned by the PKCS#11 library. This will indicate success or failure.
+ */
+static CK_RV time_lookups(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR attr, CK_BBOOL cached,
+                          CK_OBJECT_HANDLE_PTR handle) {
+    CK_OBJECT_HANDLE_PTR found_objects = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv = CKR_OK;
+
+    uint64_t start = latency_now_ns();
+    for (int i = 0; i < LOOKUPS && CKR_OK == rv; i++) {
+        if (cached) {
+            rv = find_by_attr_cached(session, attr, 1, &count, &found_objects);
+        } else {
+            rv = find_by_attr(session, attr, 1, &count, &found_objects);
+        }
+    }
+    uint64_t elapsed = latency_now_ns() - start;
+
+    if (CKR_OK != rv || 0 == count) {
+        fprintf(stderr, "Could not find the key\n");
+        free(found_objects);
+        return CKR_OK == rv ? CKR_GENERAL_ERROR : rv;
+    }
+
+    *handle = found_objects[0];
+    printf("%s lookups: %.1f us each, found handle %lu\n",
+           cached ? "Cached" : "Uncached", elapsed / 1000.0 / LOOKUPS, *handle);
+    free(found_objects);
+    return CKR_OK;
+}
+
+/**
+ * Resolve a label through the object cache, and show that destroying or
+ * generating a key invalidates the cached result.
+ * @param session
+ */
+CK_RV find_cached_example(CK_SESSION_HANDLE session) {
+    CK_BYTE_PTR label = "Cached Label";
+    CK_ULONG key_length_bytes = 32;
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE found = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE_PTR found_objects = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv;
+
+    CK_ATTRIBUTE template[] = {
+            {CKA_TOKEN,     &false_val,        sizeof(CK_BBOOL)},
+            {CKA_LABEL,     label,             (CK_ULONG) strlen(label)},
+            {CKA_VALUE_LEN, &key_length_bytes, sizeof(CK_ULONG)}
+    };
+    CK_ATTRIBUTE attr[] = {
+            {CKA_LABEL, label, (CK_ULONG) strlen(label)},
+    };
+
+    rv = generate_labeled_key(session, template, sizeof(template) / sizeof(CK_ATTRIBUTE), &key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to generate an AES key: %lu\n", rv);
+        return rv;
+    }
+
+    rv = time_lookups(session, attr, CK_FALSE, &found);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = time_lookups(session, attr, CK_TRUE, &found);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = destroy_object(session, key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to destroy the key: %lu\n", rv);
+        return rv;
+    }
+
+    rv = find_by_attr_cached(session, attr, 1, &count, &found_objects);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (0 != count) {
+        fprintf(stderr, "The destroyed key is still cached\n");
+        free(found_objects);
+        return CKR_GENERAL_ERROR;
+    }
+    printf("The destroyed key is no longer found\n");
+
+    rv = generate_labeled_key(session, template, sizeof(template) / sizeof(CK_ATTRIBUTE), &key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to generate an AES key: %lu\n", rv);
+        return rv;
+    }
+
+    rv = find_by_attr_cached(session, attr, 1, &count, &found_objects);
+    if (CKR_OK != rv || 1 != count || found_objects[0] != key) {
+        fprintf(stderr, "Could not find the new key\n");
+        free(found_objects);
+        return CKR_OK == rv ? CKR_GENERAL_ERROR : rv;
+    }
+    printf("Found the new key with handle %lu\n", found_objects[0]);
+    free(found_objects);
+
+    return destroy_object(session, key);
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    rv = find_cached_example(session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return EXIT_SUCCESS;
+}
@@ -17,73 +17,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <stdbool.h>
 
 #include "common.h"
-
-/**
- * Find keys that match a passed CK_ATTRIBUTE template.
- * Memory will be allocated in a passed pointer, and reallocated as more keys
- * are found. The number of found keys is returned through the count parameter.
- * @param hSession
- * @param template
- * @param hObject
- * @param count
- * @return
- */
-CK_RV find_by_attr(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE *template, CK_ULONG attr_count, CK_ULONG *count,
-                   CK_OBJECT_HANDLE_PTR *hObject) {
-    CK_RV rv;
-
-    if (NULL == hObject || NULL == template || NULL == count) {
-        return CKR_ARGUMENTS_BAD;
-    }
-
-    rv = funcs->C_FindObjectsInit(hSession, template, attr_count);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Can't initialize search\n");
-        return rv;
-    }
-
-    CK_ULONG max_objects = 25;
-    bool searching = 1;
-    *count = 0;
-    while (searching) {
-        CK_ULONG found = 0;
-        *hObject = realloc(*hObject, (*count + max_objects) * sizeof(CK_OBJECT_HANDLE));
-        if (NULL == *hObject) {
-            fprintf(stderr, "Could not allocate memory for objects\n");
-            return CKR_HOST_MEMORY;
-        }
-
-        CK_OBJECT_HANDLE_PTR loc = *hObject;
-        rv = funcs->C_FindObjects(hSession, &loc[*count], max_objects, &found);
-        if (rv != CKR_OK) {
-            fprintf(stderr, "Can't run search\n");
-            funcs->C_FindObjectsFinal(hSession);
-            return rv;
-        }
-
-        (*count) += found;
-
-        if (0 == found)
-            searching = 0;
-    }
-
-    rv = funcs->C_FindObjectsFinal(hSession);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Can't finalize search\n");
-        return rv;
-    }
-
-    if (0 == *count) {
-        fprintf(stderr, "Didn't find requested key\n");
-        return rv;
-    }
-
-    return CKR_OK;
-}
-
+#include "find.h"
 
 /**
  * Generate an AES key.
@@ -107,7 +43,7 @@ CK_RV generate_aes_key(CK_SESSION_HANDLE session,
             {CKA_VALUE_LEN, &key_length_bytes, sizeof(CK_ULONG)}
     };
 
-    rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
+    rv = pkcs11_generate_key(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
     return rv;
 }
 
@@ -137,7 +73,7 @@ CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
             {CKA_SIGN, &true_val, sizeof(CK_BBOOL)},
     };
 
-    rv = funcs->C_GenerateKeyPair(session,
+    rv = pkcs11_generate_key_pair(session,
                                   &mech,
                                   public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
                                   private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
@@ -273,6 +209,59 @@ CK_RV find_keys_by_search_template(CK_SESSION_HANDLE session) {
     return CKR_OK;
 }
 
+/**
+ * Counts the handles streamed by find_each_by_attr.
+ */
+struct stream_count {
+    CK_ULONG objects;
+    CK_ULONG batches;
+};
+
+static CK_RV count_batch(void *context, CK_OBJECT_HANDLE_PTR handles, CK_ULONG count) {
+    struct stream_count *totals = context;
+    totals->objects += count;
+    totals->batches++;
+    return CKR_OK;
+}
+
+/**
+ * Create many AES keys with the same label, and stream their handles in
+ * growing batches instead of collecting them in one array.
+ * @param session
+ */
+CK_RV find_keys_streaming_example(CK_SESSION_HANDLE session) {
+    CK_BYTE_PTR label = "Bulk Label";
+    CK_ULONG key_count = 500;
+    CK_RV rv;
+
+    for (CK_ULONG i = 0; i < key_count; i++) {
+        CK_OBJECT_HANDLE aes_key = CK_INVALID_HANDLE;
+        rv = generate_aes_key(session, 32, label, (CK_ULONG) strlen(label), &aes_key);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to generate an AES key: %lu\n", rv);
+            return rv;
+        }
+    }
+
+    CK_ATTRIBUTE attr[] = {
+            {CKA_LABEL, label, (CK_ULONG) strlen(label)},
+    };
+
+    struct stream_count totals = {0};
+    rv = find_each_by_attr(session, attr, 1, 256, count_batch, &totals);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Could not stream the keys\n");
+        return rv;
+    }
+
+    printf("Streamed %lu keys in %lu batches\n", totals.objects, totals.batches);
+    if (totals.objects != key_count) {
+        fprintf(stderr, "Expected %lu keys\n", key_count);
+        return CKR_GENERAL_ERROR;
+    }
+    return CKR_OK;
+}
+
 int main(int argc, char **argv) {
     CK_RV rv;
     CK_SESSION_HANDLE session;
@@ -304,6 +293,12 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    printf("\n\nStreaming keys by label\n");
+    rv = find_keys_streaming_example(session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
     pkcs11_finalize_session(session);
 
     return EXIT_SUCCESS;
@@ -39,7 +39,7 @@ CK_RV generate_aes_key(CK_SESSION_HANDLE session,
             {CKA_VALUE_LEN, &key_length_bytes, sizeof(CK_ULONG)}
     };
 
-    rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
+    rv = pkcs11_generate_key(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
     return rv;
 }
 
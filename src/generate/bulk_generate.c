@@ -0,0 +1,426 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "common.h"
+#include "gopt.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+#include "public_key.h"
+
+#define DEFAULT_COUNT 100
+#define DEFAULT_THREADS 4
+#define DEFAULT_KEY_SPEC "ec:prime256v1"
+#define DEFAULT_LABEL_PREFIX "bulk"
+#define PROGRESS_INTERVAL_NS 1000000000ull
+
+struct key_spec {
+    const char *name;
+    CK_KEY_TYPE key_type;
+    CK_ULONG modulus_bits;
+    const CK_BYTE *curve;
+    CK_ULONG curve_length;
+};
+
+static const CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+static const CK_BYTE secp384r1[] = {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22};
+static const CK_BYTE secp521r1[] = {0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23};
+
+static const struct key_spec key_specs[] = {
+        { "rsa:2048",      CKK_RSA, 2048, NULL,       0 },
+        { "rsa:3072",      CKK_RSA, 3072, NULL,       0 },
+        { "rsa:4096",      CKK_RSA, 4096, NULL,       0 },
+        { "ec:prime256v1", CKK_EC,  0,    prime256v1, sizeof(prime256v1) },
+        { "ec:secp384r1",  CKK_EC,  0,    secp384r1,  sizeof(secp384r1) },
+        { "ec:secp521r1",  CKK_EC,  0,    secp521r1,  sizeof(secp521r1) },
+};
+
+static const size_t key_specs_len = (sizeof(key_specs)/sizeof(key_specs[0]));
+
+struct bulk_arguments {
+    char *pin;
+    char *library;
+    char *output;
+    char *label_prefix;
+    const struct key_spec *spec;
+    unsigned long count;
+    unsigned long threads;
+    CK_BBOOL token;
+};
+
+/**
+ * Work shared by the generator threads. Each thread takes the next key
+ * index, generates the pair on its own session and appends a record to the
+ * output as soon as the pair exists.
+ */
+struct bulk_job {
+    struct bulk_arguments *args;
+    struct session_pool *pool;
+    FILE *output;
+    pthread_mutex_t output_lock;
+    atomic_ulong next_index;
+    atomic_ulong completed;
+    atomic_ulong failed;
+    atomic_int stop;
+    // Guarded by output_lock.
+    CK_RV last_error;
+};
+
+static void show_help(void) {
+    printf("\n\t--pin <user:password>\n\t[--library <path/to/pkcs11>]\n");
+    printf("\t--output <path> File the key records are appended to\n");
+    printf("\t[--count <key pairs>]\n\t[--threads <count>]\n\t[--label-prefix <prefix>]\n");
+    printf("\t[--token] Generate token keys; session keys are gone when the tool exits\n");
+    printf("\t[--key-spec <spec>] One of:");
+    for (size_t i = 0; i < key_specs_len; i++) {
+        printf(" %s", key_specs[i].name);
+    }
+    printf("\n\n");
+    printf("Each line of the output is: label,public key handle,private key handle,base64 SPKI\n\n");
+}
+
+static int get_bulk_args(int argc, char **argv, struct bulk_arguments *args) {
+    if (!args || !argv || argc == 0) {
+        return -1;
+    }
+
+    struct option options[9];
+
+    options[0].long_name  = "pin";
+    options[0].short_name = 0;
+    options[0].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[1].long_name  = "library";
+    options[1].short_name = 0;
+    options[1].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[2].long_name  = "output";
+    options[2].short_name = 0;
+    options[2].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[3].long_name  = "count";
+    options[3].short_name = 0;
+    options[3].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[4].long_name  = "threads";
+    options[4].short_name = 0;
+    options[4].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[5].long_name  = "key-spec";
+    options[5].short_name = 0;
+    options[5].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[6].long_name  = "label-prefix";
+    options[6].short_name = 0;
+    options[6].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[7].long_name  = "token";
+    options[7].short_name = 0;
+    options[7].flags      = GOPT_ARGUMENT_FORBIDDEN;
+
+    options[8].flags      = GOPT_LAST;
+
+    gopt (argv, options);
+
+    if (options[0].count != 1 || options[2].count != 1) {
+        show_help();
+        return -1;
+    }
+
+    args->pin = options[0].argument;
+    args->library = options[1].argument;
+    if (!args->library) {
+        args->library = DEFAULT_PKCS11_LIBRARY_PATH;
+    }
+    args->output = options[2].argument;
+
+    args->count = DEFAULT_COUNT;
+    if (options[3].argument) {
+        args->count = strtoul(options[3].argument, NULL, 0);
+    }
+
+    args->threads = DEFAULT_THREADS;
+    if (options[4].argument) {
+        args->threads = strtoul(options[4].argument, NULL, 0);
+    }
+
+    const char *spec = options[5].argument ? options[5].argument : DEFAULT_KEY_SPEC;
+    args->spec = NULL;
+    for (size_t i = 0; i < key_specs_len; i++) {
+        if (0 == strcmp(spec, key_specs[i].name)) {
+            args->spec = &key_specs[i];
+        }
+    }
+    if (!args->spec) {
+        fprintf(stderr, "Unknown key spec: %s\n", spec);
+        show_help();
+        return -1;
+    }
+
+    args->label_prefix = options[6].argument ? options[6].argument : DEFAULT_LABEL_PREFIX;
+    args->token = options[7].count > 0 ? CK_TRUE : CK_FALSE;
+
+    if (0 == args->threads || 0 == args->count) {
+        show_help();
+        return -1;
+    }
+
+    return 0;
+}
+
+static CK_RV generate_key_pair(CK_SESSION_HANDLE session, struct bulk_arguments *args, const char *label,
+                               CK_OBJECT_HANDLE_PTR public_key, CK_OBJECT_HANDLE_PTR private_key) {
+    const struct key_spec *spec = args->spec;
+    CK_MECHANISM mech = {CKK_RSA == spec->key_type ? CKM_RSA_X9_31_KEY_PAIR_GEN : CKM_EC_KEY_PAIR_GEN, NULL, 0};
+    CK_BYTE public_exponent[] = {0x01, 0x00, 0x01};
+    CK_ULONG modulus_bits = spec->modulus_bits;
+    CK_ULONG label_length = (CK_ULONG) strlen(label);
+
+    CK_ATTRIBUTE rsa_public_template[] = {
+            {CKA_VERIFY,          &true_val,       sizeof(CK_BBOOL)},
+            {CKA_TOKEN,           &args->token,    sizeof(CK_BBOOL)},
+            {CKA_LABEL,           (CK_VOID_PTR) label, label_length},
+            {CKA_MODULUS_BITS,    &modulus_bits,   sizeof(CK_ULONG)},
+            {CKA_PUBLIC_EXPONENT, public_exponent, sizeof(public_exponent)},
+    };
+
+    CK_ATTRIBUTE ec_public_template[] = {
+            {CKA_VERIFY,    &true_val,             sizeof(CK_BBOOL)},
+            {CKA_TOKEN,     &args->token,          sizeof(CK_BBOOL)},
+            {CKA_LABEL,     (CK_VOID_PTR) label,   label_length},
+            {CKA_EC_PARAMS, (CK_VOID_PTR) spec->curve, spec->curve_length},
+    };
+
+    CK_ATTRIBUTE private_template[] = {
+            {CKA_SIGN,  &true_val,           sizeof(CK_BBOOL)},
+            {CKA_TOKEN, &args->token,        sizeof(CK_BBOOL)},
+            {CKA_LABEL, (CK_VOID_PTR) label, label_length},
+    };
+
+    if (CKK_RSA == spec->key_type) {
+        return pkcs11_generate_key_pair(session, &mech,
+                                        rsa_public_template, sizeof(rsa_public_template) / sizeof(CK_ATTRIBUTE),
+                                        private_template, sizeof(private_template) / sizeof(CK_ATTRIBUTE),
+                                        public_key, private_key);
+    }
+    return pkcs11_generate_key_pair(session, &mech,
+                                    ec_public_template, sizeof(ec_public_template) / sizeof(CK_ATTRIBUTE),
+                                    private_template, sizeof(private_template) / sizeof(CK_ATTRIBUTE),
+                                    public_key, private_key);
+}
+
+/**
+ * Append one key record. Records are written in completion order, not index order.
+ */
+static CK_RV write_record(struct bulk_job *job, const char *label, CK_OBJECT_HANDLE public_key,
+                          CK_OBJECT_HANDLE private_key, CK_BYTE_PTR spki, CK_ULONG spki_length) {
+    unsigned char *encoded = malloc(4 * ((spki_length + 2) / 3) + 1);
+    int failed;
+
+    if (NULL == encoded) {
+        return CKR_HOST_MEMORY;
+    }
+    EVP_EncodeBlock(encoded, spki, (int) spki_length);
+
+    pthread_mutex_lock(&job->output_lock);
+    failed = fprintf(job->output, "%s,%lu,%lu,%s\n", label, public_key, private_key, encoded) < 0;
+    pthread_mutex_unlock(&job->output_lock);
+
+    free(encoded);
+    return failed ? CKR_FUNCTION_FAILED : CKR_OK;
+}
+
+/**
+ * Remember the most recent failure. Workers share output_lock for this too.
+ */
+static void record_error(struct bulk_job *job, CK_RV rv) {
+    pthread_mutex_lock(&job->output_lock);
+    job->last_error = rv;
+    pthread_mutex_unlock(&job->output_lock);
+}
+
+static void *bulk_worker_run(void *arg) {
+    struct bulk_job *job = arg;
+    struct bulk_arguments *args = job->args;
+    CK_SESSION_HANDLE session;
+    char label[256];
+
+    CK_RV rv = session_pool_acquire(job->pool, &session);
+    if (CKR_OK != rv) {
+        record_error(job, rv);
+        atomic_store(&job->stop, 1);
+        return NULL;
+    }
+
+    while (!atomic_load(&job->stop)) {
+        CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+        CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+        CK_BYTE_PTR spki = NULL;
+        CK_ULONG spki_length = 0;
+
+        unsigned long index = atomic_fetch_add(&job->next_index, 1);
+        if (index >= args->count) {
+            break;
+        }
+        snprintf(label, sizeof(label), "%s-%lu", args->label_prefix, index);
+
+        rv = generate_key_pair(session, args, label, &public_key, &private_key);
+        if (CKR_OK == rv) {
+            rv = public_key_spki(session, public_key, &spki, &spki_length);
+        }
+        if (CKR_OK == rv) {
+            rv = write_record(job, label, public_key, private_key, spki, spki_length);
+        }
+        OPENSSL_free(spki);
+
+        if (CKR_OK == rv) {
+            atomic_fetch_add(&job->completed, 1);
+        } else {
+            fprintf(stderr, "Failed to generate %s: %lu\n", label, rv);
+            // A pair without a record would be left behind, and with --token it would persist.
+            if (CK_INVALID_HANDLE != private_key) {
+                funcs->C_DestroyObject(session, private_key);
+            }
+            if (CK_INVALID_HANDLE != public_key) {
+                funcs->C_DestroyObject(session, public_key);
+            }
+            record_error(job, rv);
+            atomic_fetch_add(&job->failed, 1);
+        }
+    }
+
+    session_pool_release(job->pool, session);
+    return NULL;
+}
+
+/**
+ * Print progress every second until every key pair is done.
+ */
+static void report_progress(struct bulk_job *job, pthread_t *threads, unsigned long started, uint64_t start) {
+    struct timespec poll = {0, 100000000};
+    uint64_t last_report = start;
+
+    while (atomic_load(&job->completed) + atomic_load(&job->failed) < job->args->count
+           && !atomic_load(&job->stop)) {
+        nanosleep(&poll, NULL);
+
+        uint64_t now = latency_now_ns();
+        if (now - last_report >= PROGRESS_INTERVAL_NS) {
+            unsigned long completed = atomic_load(&job->completed);
+            printf("%lu/%lu key pairs, %.1f per second\n",
+                   completed, job->args->count, completed / ((now - start) / 1e9));
+            fflush(stdout);
+            last_report = now;
+        }
+    }
+
+    for (unsigned long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct bulk_arguments args = {0};
+    struct bulk_job job;
+    pthread_t *threads = NULL;
+    unsigned long started = 0;
+    int rc = EXIT_FAILURE;
+
+    if (get_bulk_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.args = &args;
+    job.last_error = CKR_OK;
+    atomic_init(&job.next_index, 0);
+    atomic_init(&job.completed, 0);
+    atomic_init(&job.failed, 0);
+    atomic_init(&job.stop, 0);
+    pthread_mutex_init(&job.output_lock, NULL);
+
+    job.output = fopen(args.output, "w");
+    if (NULL == job.output) {
+        fprintf(stderr, "Could not open %s\n", args.output);
+        return rc;
+    }
+
+    threads = calloc(args.threads, sizeof(pthread_t));
+    if (NULL == threads) {
+        fprintf(stderr, "Could not allocate memory for the workers\n");
+        fclose(job.output);
+        return rc;
+    }
+
+    // Nothing to finalize if the library did not load.
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        fclose(job.output);
+        pthread_mutex_destroy(&job.output_lock);
+        free(threads);
+        return rc;
+    }
+
+    // One session per thread, so generations run side by side.
+    rv = session_pool_create(args.pin, args.threads, args.threads, &job.pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to open %lu sessions: %lu\n", args.threads, rv);
+        goto done;
+    }
+
+    uint64_t start = latency_now_ns();
+    for (; started < args.threads; started++) {
+        if (0 != pthread_create(&threads[started], NULL, bulk_worker_run, &job)) {
+            fprintf(stderr, "Failed to start worker %lu\n", started);
+            atomic_store(&job.stop, 1);
+            break;
+        }
+    }
+    report_progress(&job, threads, started, start);
+    double seconds = (latency_now_ns() - start) / 1e9;
+
+    unsigned long completed = atomic_load(&job.completed);
+    printf("Generated %lu %s key pairs in %.2f s, %.1f per second, with %lu threads\n",
+           completed, args.spec->name, seconds, completed / seconds, args.threads);
+    if (completed == args.count) {
+        rc = EXIT_SUCCESS;
+    } else {
+        fprintf(stderr, "%lu key pairs failed, last error: %lu\n", args.count - completed, job.last_error);
+    }
+
+done:
+    if (0 != fclose(job.output)) {
+        fprintf(stderr, "Could not write %s\n", args.output);
+        rc = EXIT_FAILURE;
+    }
+    if (NULL != job.pool) {
+        session_pool_destroy(job.pool);
+    }
+    funcs->C_Finalize(NULL);
+    pthread_mutex_destroy(&job.output_lock);
+    free(threads);
+    return rc;
+}
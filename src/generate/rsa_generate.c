@@ -49,7 +49,7 @@ CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
             {CKA_TOKEN, &false_val, sizeof(CK_BBOOL)},
     };
 
-    rv = funcs->C_GenerateKeyPair(session,
+    rv = pkcs11_generate_key_pair(session,
                                   &mech,
                                   public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
                                   private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+#include "random_pool.h"
+
+#define SAMPLE_THREADS 4
+#define NONCE_SIZE 12
+#define POOLED_NONCES 100000
+#define DIRECT_NONCES 1000
+
+struct nonce_worker {
+    pthread_t thread;
+    struct session_pool *sessions;
+    struct random_pool *random;
+    unsigned long count;
+    CK_RV rv;
+};
+
+/**
+ * Generate nonces from the random pool, or with one C_GenerateRandom call each.
+ */
+static void *nonce_worker_run(void *arg) {
+    struct nonce_worker *worker = arg;
+    CK_BYTE nonce[NONCE_SIZE];
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+    if (NULL == worker->random) {
+        worker->rv = session_pool_acquire(worker->sessions, &session);
+        if (CKR_OK != worker->rv) {
+            return NULL;
+        }
+    }
+
+    for (unsigned long i = 0; i < worker->count && CKR_OK == worker->rv; i++) {
+        if (worker->random) {
+            worker->rv = random_pool_generate(worker->random, nonce, sizeof(nonce));
+        } else {
+            worker->rv = funcs->C_GenerateRandom(session, nonce, sizeof(nonce));
+        }
+    }
+
+    if (CK_INVALID_HANDLE != session) {
+        session_pool_release(worker->sessions, session);
+    }
+    return NULL;
+}
+
+/**
+ * Generate nonces on SAMPLE_THREADS threads, and report the time per nonce.
+ * @param random NULL to call C_GenerateRandom for every nonce
+ * @return CK_RV
+ */
+static CK_RV time_nonces(struct session_pool *sessions, struct random_pool *random, unsigned long count,
+                         const char *name) {
+    struct nonce_worker workers[SAMPLE_THREADS];
+    int started = 0;
+    CK_RV rv = CKR_OK;
+
+    memset(workers, 0, sizeof(workers));
+    uint64_t start = latency_now_ns();
+    for (; started < SAMPLE_THREADS; started++) {
+        workers[started].sessions = sessions;
+        workers[started].random = random;
+        workers[started].count = count;
+        workers[started].rv = CKR_OK;
+        if (0 != pthread_create(&workers[started].thread, NULL, nonce_worker_run, &workers[started])) {
+            rv = CKR_FUNCTION_FAILED;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (CKR_OK != workers[i].rv) {
+            rv = workers[i].rv;
+        }
+    }
+    uint64_t elapsed = latency_now_ns() - start;
+
+    if (CKR_OK != rv) {
+        fprintf(stderr, "%s failed: %lu\n", name, rv);
+        return rv;
+    }
+
+    printf("%s: %lu nonces in %.3f s, %.0f ns per nonce\n", name, SAMPLE_THREADS * count,
+           elapsed / 1e9, (double) elapsed / (SAMPLE_THREADS * count));
+    return CKR_OK;
+}
+
+/**
+ * Compare nonces from C_GenerateRandom, from prefetched HSM blocks and from
+ * a CTR_DRBG seeded by the HSM.
+ * @param sessions
+ * @return CK_RV
+ */
+CK_RV random_nonces_sample(struct session_pool *sessions) {
+    struct random_pool_options options = { RANDOM_POOL_DIRECT, 0, 0, 0 };
+    struct random_pool *random = NULL;
+    struct random_pool_stats stats;
+    CK_RV rv;
+
+    rv = time_nonces(sessions, NULL, DIRECT_NONCES, "C_GenerateRandom per nonce");
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = random_pool_create(sessions, &options, &random);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the random pool: %lu\n", rv);
+        return rv;
+    }
+    rv = time_nonces(sessions, random, POOLED_NONCES, "Prefetched HSM blocks");
+    random_pool_stats(random, &stats);
+    printf("  %lu blocks prefetched, %lu fetched inline\n", stats.blocks_prefetched, stats.blocks_fetched_inline);
+    random_pool_destroy(random);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    options.mode = RANDOM_POOL_CTR_DRBG;
+    options.reseed_interval = 10000;
+    rv = random_pool_create(sessions, &options, &random);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the random pool: %lu\n", rv);
+        return rv;
+    }
+    rv = time_nonces(sessions, random, POOLED_NONCES, "CTR_DRBG seeded by the HSM");
+    random_pool_stats(random, &stats);
+    printf("  %lu reseeds\n", stats.reseeds);
+    random_pool_destroy(random);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    // A session per nonce thread, plus one for the prefetching thread.
+    rv = session_pool_create(args.pin, 1, SAMPLE_THREADS + 1, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("Generate %d byte nonces on %d threads\n", NONCE_SIZE, SAMPLE_THREADS);
+    rv = random_nonces_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
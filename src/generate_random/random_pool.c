@@ -0,0 +1,520 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "random_pool.h"
+
+#define DRBG_KEY_LENGTH 32
+#define DRBG_BLOCK_LENGTH 16
+#define DRBG_SEED_LENGTH (DRBG_KEY_LENGTH + DRBG_BLOCK_LENGTH)
+// SP 800-90A allows at most 2^19 bits per CTR_DRBG request.
+#define DRBG_MAX_REQUEST 65536
+#define DRBG_MAX_RESEED_INTERVAL (1ull << 48)
+
+/**
+ * State of one thread using the pool.
+ */
+struct random_thread {
+    struct random_pool *pool;
+    struct random_thread *next;
+
+    // Block being served, and the bytes of it not yet handed out.
+    CK_BYTE_PTR block;
+    CK_ULONG position;
+
+    EVP_CIPHER_CTX *cipher;
+    CK_BYTE key[DRBG_KEY_LENGTH];
+    CK_BYTE v[DRBG_BLOCK_LENGTH];
+    unsigned long long reseed_counter;
+    CK_BBOOL seeded;
+};
+
+struct random_pool {
+    struct random_pool_options options;
+    struct session_pool *sessions;
+    CK_SESSION_HANDLE session;
+
+    pthread_key_t thread_key;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Signalled when a block is taken, or the pool is being destroyed.
+    pthread_cond_t fill;
+
+    // Full blocks, and empty blocks to refill.
+    CK_BYTE_PTR *ready;
+    CK_ULONG ready_count;
+    CK_BYTE_PTR *spare;
+    CK_ULONG spare_count;
+
+    struct random_thread *threads;
+    struct random_pool_stats stats;
+    CK_RV last_error;
+    CK_BBOOL stopping;
+};
+
+/**
+ * Keep an empty block for refilling, or free it when enough are kept.
+ * Called with the pool lock held.
+ */
+static void random_pool_recycle(struct random_pool *pool, CK_BYTE_PTR block) {
+    if (pool->spare_count < pool->options.ready_blocks + 1) {
+        pool->spare[pool->spare_count++] = block;
+    } else {
+        OPENSSL_cleanse(block, pool->options.block_size);
+        free(block);
+    }
+}
+
+static void *random_pool_fill_run(void *arg) {
+    struct random_pool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        if (pool->ready_count == pool->options.ready_blocks || CKR_OK != pool->last_error) {
+            // After a failure, requesting threads fetch inline until the next block is taken.
+            pool->last_error = CKR_OK;
+            pthread_cond_wait(&pool->fill, &pool->lock);
+            continue;
+        }
+
+        CK_BYTE_PTR block = pool->spare_count > 0 ? pool->spare[--pool->spare_count] : NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        CK_RV rv = CKR_HOST_MEMORY;
+        if (NULL == block) {
+            block = malloc(pool->options.block_size);
+        }
+        if (NULL != block) {
+            rv = funcs->C_GenerateRandom(pool->session, block, pool->options.block_size);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        if (CKR_OK == rv) {
+            pool->ready[pool->ready_count++] = block;
+            pool->stats.blocks_prefetched++;
+        } else {
+            pool->last_error = rv;
+            if (NULL != block) {
+                random_pool_recycle(pool, block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * Replace a thread's used block with a full one.
+ */
+static CK_RV random_thread_refill(struct random_thread *thread) {
+    struct random_pool *pool = thread->pool;
+    CK_SESSION_HANDLE session;
+    CK_RV rv;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->ready_count > 0) {
+        CK_BYTE_PTR block = pool->ready[--pool->ready_count];
+        if (NULL != thread->block) {
+            random_pool_recycle(pool, thread->block);
+        }
+        thread->block = block;
+        thread->position = 0;
+        pthread_cond_signal(&pool->fill);
+        pthread_mutex_unlock(&pool->lock);
+        return CKR_OK;
+    }
+    pool->stats.blocks_fetched_inline++;
+    pthread_cond_signal(&pool->fill);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (NULL == thread->block) {
+        thread->block = malloc(pool->options.block_size);
+        if (NULL == thread->block) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    rv = session_pool_acquire(pool->sessions, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = funcs->C_GenerateRandom(session, thread->block, pool->options.block_size);
+    session_pool_release(pool->sessions, session);
+
+    thread->position = CKR_OK == rv ? 0 : pool->options.block_size;
+    return rv;
+}
+
+/**
+ * Copy bytes from the block stream, wiping them from the block.
+ */
+static CK_RV random_thread_read(struct random_thread *thread, CK_BYTE_PTR output, CK_ULONG length) {
+    CK_ULONG block_size = thread->pool->options.block_size;
+
+    while (length > 0) {
+        if (thread->position == block_size) {
+            CK_RV rv = random_thread_refill(thread);
+            if (CKR_OK != rv) {
+                return rv;
+            }
+        }
+
+        CK_ULONG count = block_size - thread->position < length ? block_size - thread->position : length;
+        memcpy(output, thread->block + thread->position, count);
+        OPENSSL_cleanse(thread->block + thread->position, count);
+        thread->position += count;
+        output += count;
+        length -= count;
+    }
+    return CKR_OK;
+}
+
+static void drbg_increment(CK_BYTE_PTR v) {
+    for (int i = DRBG_BLOCK_LENGTH - 1; i >= 0; i--) {
+        if (0 != ++v[i]) {
+            break;
+        }
+    }
+}
+
+/**
+ * Encrypt successive counter values under the current key.
+ */
+static CK_RV drbg_keystream(struct random_thread *thread, CK_BYTE_PTR output, CK_ULONG length) {
+    CK_BYTE block[DRBG_BLOCK_LENGTH];
+    int written;
+
+    while (length > 0) {
+        drbg_increment(thread->v);
+        if (1 != EVP_EncryptUpdate(thread->cipher, block, &written, thread->v, DRBG_BLOCK_LENGTH)) {
+            return CKR_FUNCTION_FAILED;
+        }
+        CK_ULONG count = length < DRBG_BLOCK_LENGTH ? length : DRBG_BLOCK_LENGTH;
+        memcpy(output, block, count);
+        output += count;
+        length -= count;
+    }
+    OPENSSL_cleanse(block, sizeof(block));
+    return CKR_OK;
+}
+
+/**
+ * CTR_DRBG_Update: derive a new key and counter, mixing in provided data.
+ */
+static CK_RV drbg_update(struct random_thread *thread, const CK_BYTE *provided) {
+    CK_BYTE temp[DRBG_SEED_LENGTH];
+    CK_RV rv = drbg_keystream(thread, temp, sizeof(temp));
+
+    if (CKR_OK == rv) {
+        for (int i = 0; provided && i < DRBG_SEED_LENGTH; i++) {
+            temp[i] ^= provided[i];
+        }
+        memcpy(thread->key, temp, DRBG_KEY_LENGTH);
+        memcpy(thread->v, temp + DRBG_KEY_LENGTH, DRBG_BLOCK_LENGTH);
+        if (1 != EVP_EncryptInit_ex(thread->cipher, NULL, NULL, thread->key, NULL)) {
+            rv = CKR_FUNCTION_FAILED;
+        }
+    }
+    OPENSSL_cleanse(temp, sizeof(temp));
+    return rv;
+}
+
+/**
+ * Instantiate or reseed the DRBG from HSM entropy.
+ */
+static CK_RV drbg_seed(struct random_thread *thread) {
+    CK_BYTE entropy[DRBG_SEED_LENGTH];
+    CK_RV rv;
+
+    if (NULL == thread->cipher) {
+        thread->cipher = EVP_CIPHER_CTX_new();
+        if (NULL == thread->cipher) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    rv = random_thread_read(thread, entropy, sizeof(entropy));
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (!thread->seeded) {
+        memset(thread->key, 0, sizeof(thread->key));
+        memset(thread->v, 0, sizeof(thread->v));
+        if (1 != EVP_EncryptInit_ex(thread->cipher, EVP_aes_256_ecb(), NULL, thread->key, NULL)) {
+            OPENSSL_cleanse(entropy, sizeof(entropy));
+            return CKR_FUNCTION_FAILED;
+        }
+        EVP_CIPHER_CTX_set_padding(thread->cipher, 0);
+    }
+
+    rv = drbg_update(thread, entropy);
+    OPENSSL_cleanse(entropy, sizeof(entropy));
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (thread->seeded) {
+        pthread_mutex_lock(&thread->pool->lock);
+        thread->pool->stats.reseeds++;
+        pthread_mutex_unlock(&thread->pool->lock);
+    }
+    thread->seeded = CK_TRUE;
+    thread->reseed_counter = 1;
+    return CKR_OK;
+}
+
+static CK_RV drbg_generate(struct random_thread *thread, CK_BYTE_PTR output, CK_ULONG length) {
+    while (length > 0) {
+        CK_ULONG count = length < DRBG_MAX_REQUEST ? length : DRBG_MAX_REQUEST;
+        CK_RV rv;
+
+        if (!thread->seeded || thread->reseed_counter > thread->pool->options.reseed_interval) {
+            rv = drbg_seed(thread);
+            if (CKR_OK != rv) {
+                return rv;
+            }
+        }
+
+        rv = drbg_keystream(thread, output, count);
+        if (CKR_OK == rv) {
+            rv = drbg_update(thread, NULL);
+        }
+        if (CKR_OK != rv) {
+            return rv;
+        }
+
+        thread->reseed_counter++;
+        output += count;
+        length -= count;
+    }
+    return CKR_OK;
+}
+
+static void random_thread_free(struct random_thread *thread) {
+    if (NULL != thread->block) {
+        OPENSSL_cleanse(thread->block, thread->pool->options.block_size);
+        free(thread->block);
+    }
+    EVP_CIPHER_CTX_free(thread->cipher);
+    OPENSSL_cleanse(thread->key, sizeof(thread->key));
+    OPENSSL_cleanse(thread->v, sizeof(thread->v));
+    free(thread);
+}
+
+/**
+ * Called when a thread which used the pool exits.
+ */
+static void random_thread_exit(void *value) {
+    struct random_thread *thread = value;
+    struct random_pool *pool = thread->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (struct random_thread **link = &pool->threads; *link; link = &(*link)->next) {
+        if (*link == thread) {
+            *link = thread->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    random_thread_free(thread);
+}
+
+static struct random_thread *random_thread_get(struct random_pool *pool) {
+    struct random_thread *thread = pthread_getspecific(pool->thread_key);
+    if (thread) {
+        return thread;
+    }
+
+    thread = calloc(1, sizeof(struct random_thread));
+    if (NULL == thread) {
+        return NULL;
+    }
+    thread->pool = pool;
+    // Start empty, so the first request takes a ready block.
+    thread->position = pool->options.block_size;
+
+    if (0 != pthread_setspecific(pool->thread_key, thread)) {
+        free(thread);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    thread->next = pool->threads;
+    pool->threads = thread;
+    pthread_mutex_unlock(&pool->lock);
+    return thread;
+}
+
+/**
+ * Create a random pool, which starts prefetching in the background.
+ * @param sessions Session pool to take the prefetching session from
+ * @param options NULL for RANDOM_POOL_DIRECT with the default sizes
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV random_pool_create(struct session_pool *sessions,
+                         const struct random_pool_options *options,
+                         struct random_pool **pool) {
+    struct random_pool *created;
+    CK_RV rv;
+
+    if (!sessions || !pool) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    created = calloc(1, sizeof(struct random_pool));
+    if (NULL == created) {
+        return CKR_HOST_MEMORY;
+    }
+
+    created->sessions = sessions;
+    created->options.mode = options ? options->mode : RANDOM_POOL_DIRECT;
+    created->options.block_size = options && options->block_size ? options->block_size
+                                                                  : RANDOM_POOL_DEFAULT_BLOCK_SIZE;
+    created->options.ready_blocks = options && options->ready_blocks ? options->ready_blocks
+                                                                     : RANDOM_POOL_DEFAULT_READY_BLOCKS;
+    created->options.reseed_interval = options && options->reseed_interval ? options->reseed_interval
+                                                                           : RANDOM_POOL_DEFAULT_RESEED_INTERVAL;
+    if (created->options.reseed_interval > DRBG_MAX_RESEED_INTERVAL) {
+        free(created);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // Every block is either ready, spare, or being filled by the background thread.
+    created->ready = calloc(created->options.ready_blocks, sizeof(CK_BYTE_PTR));
+    created->spare = calloc(created->options.ready_blocks + 1, sizeof(CK_BYTE_PTR));
+    if (NULL == created->ready || NULL == created->spare) {
+        free(created->ready);
+        free(created->spare);
+        free(created);
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = session_pool_acquire(sessions, &created->session);
+    if (CKR_OK != rv) {
+        free(created->ready);
+        free(created->spare);
+        free(created);
+        return rv;
+    }
+
+    pthread_mutex_init(&created->lock, NULL);
+    pthread_cond_init(&created->fill, NULL);
+    if (0 != pthread_key_create(&created->thread_key, random_thread_exit)) {
+        rv = CKR_FUNCTION_FAILED;
+    } else if (0 != pthread_create(&created->thread, NULL, random_pool_fill_run, created)) {
+        pthread_key_delete(created->thread_key);
+        rv = CKR_FUNCTION_FAILED;
+    }
+    if (CKR_OK != rv) {
+        session_pool_release(sessions, created->session);
+        pthread_cond_destroy(&created->fill);
+        pthread_mutex_destroy(&created->lock);
+        free(created->ready);
+        free(created->spare);
+        free(created);
+        return rv;
+    }
+
+    *pool = created;
+    return CKR_OK;
+}
+
+/**
+ * Fill a buffer with random bytes. Safe to call from any number of threads.
+ * @param pool
+ * @param output
+ * @param length
+ * @return CK_RV
+ */
+CK_RV random_pool_generate(struct random_pool *pool, CK_BYTE_PTR output, CK_ULONG length) {
+    struct random_thread *thread;
+
+    if (!pool || (!output && length > 0)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    thread = random_thread_get(pool);
+    if (NULL == thread) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (RANDOM_POOL_CTR_DRBG == pool->options.mode) {
+        return drbg_generate(thread, output, length);
+    }
+    return random_thread_read(thread, output, length);
+}
+
+void random_pool_stats(struct random_pool *pool, struct random_pool_stats *stats) {
+    if (!pool || !stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stop prefetching, wipe every buffered byte and free the pool. Threads
+ * must not use the pool during or after this call.
+ * @param pool
+ */
+void random_pool_destroy(struct random_pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = CK_TRUE;
+    pthread_cond_signal(&pool->fill);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+
+    // Threads which are still running keep a dangling key value, but its destructor no longer runs.
+    pthread_key_delete(pool->thread_key);
+    while (pool->threads) {
+        struct random_thread *next = pool->threads->next;
+        random_thread_free(pool->threads);
+        pool->threads = next;
+    }
+
+    for (CK_ULONG i = 0; i < pool->ready_count; i++) {
+        OPENSSL_cleanse(pool->ready[i], pool->options.block_size);
+        free(pool->ready[i]);
+    }
+    for (CK_ULONG i = 0; i < pool->spare_count; i++) {
+        free(pool->spare[i]);
+    }
+
+    session_pool_release(pool->sessions, pool->session);
+    pthread_cond_destroy(&pool->fill);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->ready);
+    free(pool->spare);
+    free(pool);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __RANDOM_POOL_H__
+#define __RANDOM_POOL_H__
+
+#include "common.h"
+#include "session_pool.h"
+
+/*
+ * Buffered random numbers from the HSM.
+ *
+ * A background thread fetches blocks with C_GenerateRandom on a session it
+ * holds, and keeps a few blocks ready. Each thread using the pool serves
+ * requests from its own block, and swaps an empty block for a ready one
+ * under a short lock, so small requests such as nonces and IVs are memory
+ * copies. Bytes are wiped from the block as they are handed out. If no
+ * block is ready, the thread fetches one itself on a pooled session.
+ *
+ * In RANDOM_POOL_CTR_DRBG mode each thread instead runs an SP 800-90A
+ * CTR_DRBG with AES-256 and no derivation function. The DRBG is seeded
+ * with 48 bytes of HSM entropy from the block stream, and reseeded from it
+ * every reseed_interval requests.
+ */
+enum random_pool_mode {
+    RANDOM_POOL_DIRECT,
+    RANDOM_POOL_CTR_DRBG,
+};
+
+#define RANDOM_POOL_DEFAULT_BLOCK_SIZE 4096
+#define RANDOM_POOL_DEFAULT_READY_BLOCKS 8
+#define RANDOM_POOL_DEFAULT_RESEED_INTERVAL 65536
+
+struct random_pool_options {
+    enum random_pool_mode mode;
+    CK_ULONG block_size;
+    CK_ULONG ready_blocks;
+    // DRBG requests between reseeds, at most 2^48 as SP 800-90A allows.
+    CK_ULONG reseed_interval;
+};
+
+struct random_pool_stats {
+    // Blocks fetched by the background thread.
+    CK_ULONG blocks_prefetched;
+    // Blocks fetched by a requesting thread because none was ready.
+    CK_ULONG blocks_fetched_inline;
+    CK_ULONG reseeds;
+};
+
+struct random_pool;
+
+CK_RV random_pool_create(struct session_pool *sessions,
+                         const struct random_pool_options *options,
+                         struct random_pool **pool);
+
+CK_RV random_pool_generate(struct random_pool *pool, CK_BYTE_PTR output, CK_ULONG length);
+
+void random_pool_stats(struct random_pool *pool, struct random_pool_stats *stats);
+
+void random_pool_destroy(struct random_pool *pool);
+
+#endif
@@ -0,0 +1,444 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "gopt.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+#include "find.h"
+#include "attributes.h"
+#include "inventory_file.h"
+
+#define DEFAULT_THREADS 4
+#define OBJECTS_PER_CHUNK 256
+
+// Column order of the attributes read for every object.
+enum inventory_column {
+    COLUMN_CLASS,
+    COLUMN_KEY_TYPE,
+    COLUMN_LABEL,
+    COLUMN_ID,
+};
+
+static CK_ATTRIBUTE_TYPE inventory_types[] = { CKA_CLASS, CKA_KEY_TYPE, CKA_LABEL, CKA_ID };
+
+struct inventory_arguments {
+    char *pin;
+    char *library;
+    char *output;
+    unsigned long threads;
+    unsigned long generate;
+};
+
+/**
+ * Handles collected by the search, grown geometrically.
+ */
+struct handle_list {
+    CK_OBJECT_HANDLE_PTR handles;
+    CK_ULONG count;
+    CK_ULONG capacity;
+};
+
+/**
+ * Attribute reads shared by the workers. Each worker takes the next chunk of
+ * handles and reads it on its own session.
+ */
+struct inventory_job {
+    struct session_pool *pool;
+    struct handle_list *objects;
+    CK_ULONG chunk_count;
+    struct attributes_table **tables;
+    atomic_ulong next_chunk;
+    atomic_ulong failed;
+    CK_RV first_error;
+    pthread_mutex_t error_lock;
+};
+
+static void show_help(void) {
+    printf("\n\t--pin <user:password>\n\t[--library <path/to/pkcs11>]\n");
+    printf("\t--output <path> Inventory file to write\n\t[--threads <count>]\n");
+    printf("\t[--generate <count>] Generate session AES keys first, to try the tool on an empty partition\n\n");
+}
+
+static int get_inventory_args(int argc, char **argv, struct inventory_arguments *args) {
+    if (!args || !argv || argc == 0) {
+        return -1;
+    }
+
+    struct option options[6];
+
+    options[0].long_name  = "pin";
+    options[0].short_name = 0;
+    options[0].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[1].long_name  = "library";
+    options[1].short_name = 0;
+    options[1].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[2].long_name  = "output";
+    options[2].short_name = 0;
+    options[2].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[3].long_name  = "threads";
+    options[3].short_name = 0;
+    options[3].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[4].long_name  = "generate";
+    options[4].short_name = 0;
+    options[4].flags      = GOPT_ARGUMENT_REQUIRED;
+
+    options[5].flags      = GOPT_LAST;
+
+    gopt (argv, options);
+
+    if (options[0].count != 1 || options[2].count != 1) {
+        show_help();
+        return -1;
+    }
+
+    args->pin = options[0].argument;
+    args->library = options[1].argument;
+    if (!args->library) {
+        args->library = DEFAULT_PKCS11_LIBRARY_PATH;
+    }
+    args->output = options[2].argument;
+
+    args->threads = DEFAULT_THREADS;
+    if (options[3].argument) {
+        args->threads = strtoul(options[3].argument, NULL, 0);
+    }
+
+    args->generate = 0;
+    if (options[4].argument) {
+        args->generate = strtoul(options[4].argument, NULL, 0);
+    }
+
+    if (0 == args->threads) {
+        show_help();
+        return -1;
+    }
+
+    return 0;
+}
+
+static CK_RV collect_handles(void *context, CK_OBJECT_HANDLE_PTR handles, CK_ULONG count) {
+    struct handle_list *list = context;
+
+    if (list->capacity - list->count < count) {
+        CK_ULONG capacity = list->capacity * 2 > list->count + count ? list->capacity * 2 : list->count + count;
+        CK_OBJECT_HANDLE_PTR grown = realloc(list->handles, capacity * sizeof(CK_OBJECT_HANDLE));
+        if (NULL == grown) {
+            fprintf(stderr, "Could not allocate memory for objects\n");
+            return CKR_HOST_MEMORY;
+        }
+        list->handles = grown;
+        list->capacity = capacity;
+    }
+
+    memcpy(&list->handles[list->count], handles, count * sizeof(CK_OBJECT_HANDLE));
+    list->count += count;
+    return CKR_OK;
+}
+
+static CK_RV generate_keys(CK_SESSION_HANDLE session, unsigned long count) {
+    CK_MECHANISM mech = {CKM_AES_KEY_GEN, NULL, 0};
+    CK_ULONG key_length_bytes = 32;
+    char label[32];
+
+    for (unsigned long i = 0; i < count; i++) {
+        CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+        CK_BYTE id[sizeof(unsigned long)];
+
+        snprintf(label, sizeof(label), "inventory key %lu", i);
+        memcpy(id, &i, sizeof(id));
+        CK_ATTRIBUTE template[] = {
+                {CKA_TOKEN,     &false_val,        sizeof(CK_BBOOL)},
+                {CKA_LABEL,     label,             (CK_ULONG) strlen(label)},
+                {CKA_ID,        id,                sizeof(id)},
+                {CKA_VALUE_LEN, &key_length_bytes, sizeof(CK_ULONG)}
+        };
+
+        CK_RV rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), &key);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to generate an AES key: %lu\n", rv);
+            return rv;
+        }
+    }
+    return CKR_OK;
+}
+
+static void job_fail(struct inventory_job *job, CK_RV rv) {
+    pthread_mutex_lock(&job->error_lock);
+    if (CKR_OK == job->first_error) {
+        job->first_error = rv;
+    }
+    pthread_mutex_unlock(&job->error_lock);
+    atomic_store(&job->failed, 1);
+}
+
+static void *inventory_worker_run(void *arg) {
+    struct inventory_job *job = arg;
+    CK_SESSION_HANDLE session;
+
+    CK_RV rv = session_pool_acquire(job->pool, &session);
+    if (CKR_OK != rv) {
+        job_fail(job, rv);
+        return NULL;
+    }
+
+    while (!atomic_load(&job->failed)) {
+        CK_ULONG chunk = atomic_fetch_add(&job->next_chunk, 1);
+        if (chunk >= job->chunk_count) {
+            break;
+        }
+
+        CK_ULONG first = chunk * OBJECTS_PER_CHUNK;
+        CK_ULONG count = job->objects->count - first < OBJECTS_PER_CHUNK
+                         ? job->objects->count - first : OBJECTS_PER_CHUNK;
+        rv = attributes_get_bulk(session, &job->objects->handles[first], count,
+                                 inventory_types, sizeof(inventory_types) / sizeof(inventory_types[0]),
+                                 &job->tables[chunk]);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to read attributes: %lu\n", rv);
+            job_fail(job, rv);
+        }
+    }
+
+    session_pool_release(job->pool, session);
+    return NULL;
+}
+
+/**
+ * Read an attribute holding a CK_ULONG, such as CKA_CLASS, from a table.
+ */
+static uint64_t table_ulong(const struct attributes_table *table, CK_ULONG object, enum inventory_column column) {
+    CK_ULONG length = 0;
+    const uint8_t *value = attributes_table_value(table, object, column, &length);
+    CK_ULONG result;
+
+    if (NULL == value || sizeof(CK_ULONG) != length) {
+        return INVENTORY_UNAVAILABLE;
+    }
+    memcpy(&result, value, sizeof(result));
+    return result;
+}
+
+/**
+ * Read the attributes of every object across the pool, and write them to the inventory file.
+ * @return CK_RV
+ */
+static CK_RV write_inventory(struct inventory_arguments *args, struct session_pool *pool,
+                             struct handle_list *objects, CK_ULONG *skipped) {
+    struct inventory_job job;
+    struct inventory_writer *writer = NULL;
+    pthread_t *threads;
+    unsigned long started = 0;
+    CK_RV rv;
+
+    memset(&job, 0, sizeof(job));
+    job.pool = pool;
+    job.objects = objects;
+    job.chunk_count = (objects->count + OBJECTS_PER_CHUNK - 1) / OBJECTS_PER_CHUNK;
+    job.first_error = CKR_OK;
+    atomic_init(&job.next_chunk, 0);
+    atomic_init(&job.failed, 0);
+    pthread_mutex_init(&job.error_lock, NULL);
+
+    job.tables = calloc(job.chunk_count ? job.chunk_count : 1, sizeof(struct attributes_table *));
+    threads = calloc(args->threads, sizeof(pthread_t));
+    if (NULL == job.tables || NULL == threads) {
+        fprintf(stderr, "Could not allocate memory for the workers\n");
+        free(job.tables);
+        free(threads);
+        pthread_mutex_destroy(&job.error_lock);
+        return CKR_HOST_MEMORY;
+    }
+
+    for (; started < args->threads; started++) {
+        if (0 != pthread_create(&threads[started], NULL, inventory_worker_run, &job)) {
+            fprintf(stderr, "Failed to start worker %lu\n", started);
+            job_fail(&job, CKR_FUNCTION_FAILED);
+            break;
+        }
+    }
+    for (unsigned long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    rv = job.first_error;
+    if (CKR_OK == rv) {
+        rv = inventory_writer_open(args->output, objects->count, &writer);
+    }
+
+    // Chunks are written in search order, whichever worker read them.
+    for (CK_ULONG chunk = 0; CKR_OK == rv && chunk < job.chunk_count; chunk++) {
+        struct attributes_table *table = job.tables[chunk];
+        for (CK_ULONG i = 0; CKR_OK == rv && i < table->object_count; i++) {
+            CK_ULONG label_length = 0;
+            CK_ULONG id_length = 0;
+
+            // Objects destroyed since the search are left out.
+            if (CKR_OK != table->object_rv[i]) {
+                (*skipped)++;
+                continue;
+            }
+
+            const uint8_t *label = attributes_table_value(table, i, COLUMN_LABEL, &label_length);
+            const uint8_t *id = attributes_table_value(table, i, COLUMN_ID, &id_length);
+            rv = inventory_writer_add(writer, table->objects[i],
+                                      table_ulong(table, i, COLUMN_CLASS),
+                                      table_ulong(table, i, COLUMN_KEY_TYPE),
+                                      label, label ? label_length : 0,
+                                      id, id ? id_length : 0);
+        }
+    }
+
+    if (NULL != writer) {
+        CK_RV close_rv = inventory_writer_close(writer);
+        if (CKR_OK == rv) {
+            rv = close_rv;
+        }
+    }
+
+    for (CK_ULONG chunk = 0; chunk < job.chunk_count; chunk++) {
+        attributes_table_free(job.tables[chunk]);
+    }
+    free(job.tables);
+    free(threads);
+    pthread_mutex_destroy(&job.error_lock);
+    return rv;
+}
+
+/**
+ * Map the inventory file back, and summarize it by class.
+ * @return CK_RV
+ */
+static CK_RV summarize_inventory(const char *path, CK_ULONG expected) {
+    struct inventory *inventory = NULL;
+    uint64_t by_class[5] = {0};
+    uint64_t other = 0;
+
+    CK_RV rv = inventory_open(path, &inventory);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    uint64_t count = inventory_count(inventory);
+    const uint64_t *classes = inventory_classes(inventory);
+    for (uint64_t i = 0; i < count; i++) {
+        if (classes[i] < sizeof(by_class) / sizeof(by_class[0])) {
+            by_class[classes[i]]++;
+        } else {
+            other++;
+        }
+    }
+
+    printf("%s holds %lu objects: %lu secret keys, %lu private keys, %lu public keys, "
+           "%lu certificates, %lu other\n",
+           path, (unsigned long) count, (unsigned long) by_class[CKO_SECRET_KEY],
+           (unsigned long) by_class[CKO_PRIVATE_KEY], (unsigned long) by_class[CKO_PUBLIC_KEY],
+           (unsigned long) by_class[CKO_CERTIFICATE], (unsigned long) (by_class[CKO_DATA] + other));
+
+    if (count != expected) {
+        fprintf(stderr, "Expected %lu objects in %s\n", expected, path);
+        rv = CKR_GENERAL_ERROR;
+    }
+
+    inventory_close(inventory);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct inventory_arguments args = {0};
+    struct session_pool *pool = NULL;
+    struct handle_list objects = {0};
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_ATTRIBUTE match_all[1] = {{0, NULL, 0}};
+    CK_ULONG skipped = 0;
+    int rc = EXIT_FAILURE;
+
+    if (get_inventory_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, args.threads, args.threads, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to open %lu sessions: %lu\n", args.threads, rv);
+        goto done;
+    }
+
+    // Session keys are visible to every session of the application, so the workers see them.
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    rv = generate_keys(session, args.generate);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    uint64_t start = latency_now_ns();
+    // An empty template matches every object.
+    rv = find_each_by_attr(session, match_all, 0, 0, collect_handles, &objects);
+    session_pool_release(pool, session);
+    session = CK_INVALID_HANDLE;
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    uint64_t found = latency_now_ns();
+
+    rv = write_inventory(&args, pool, &objects, &skipped);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    uint64_t written = latency_now_ns();
+
+    printf("Found %lu objects in %.3f s, read and wrote their attributes in %.3f s with %lu threads\n",
+           objects.count, (found - start) / 1e9, (written - found) / 1e9, args.threads);
+    if (skipped > 0) {
+        printf("Skipped %lu objects destroyed during the inventory\n", skipped);
+    }
+
+    rv = summarize_inventory(args.output, objects.count - skipped);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+done:
+    if (CK_INVALID_HANDLE != session) {
+        session_pool_release(pool, session);
+    }
+    if (NULL != pool) {
+        session_pool_destroy(pool);
+    }
+    free(objects.handles);
+    funcs->C_Finalize(NULL);
+    return rc;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "inventory_file.h"
+
+struct inventory_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t object_count;
+    uint64_t created;
+    uint64_t handles_offset;
+    uint64_t classes_offset;
+    uint64_t key_types_offset;
+    uint64_t label_offsets_offset;
+    uint64_t id_offsets_offset;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+};
+
+/**
+ * A blob column being built: the end offset of each value, and the values.
+ */
+struct blob_column {
+    uint64_t *ends;
+    uint8_t *heap;
+    uint64_t heap_size;
+    uint64_t heap_capacity;
+};
+
+struct inventory_writer {
+    char *path;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t *handles;
+    uint64_t *classes;
+    uint64_t *key_types;
+    struct blob_column labels;
+    struct blob_column ids;
+};
+
+struct inventory {
+    void *map;
+    size_t map_size;
+    const struct inventory_header *header;
+    const uint64_t *handles;
+    const uint64_t *classes;
+    const uint64_t *key_types;
+    const uint64_t *label_offsets;
+    const uint64_t *id_offsets;
+    const uint8_t *heap;
+};
+
+static CK_RV blob_column_add(struct blob_column *column, uint64_t index, const uint8_t *value, CK_ULONG length) {
+    if (column->heap_size + length > column->heap_capacity) {
+        uint64_t capacity = column->heap_capacity ? column->heap_capacity * 2 : 4096;
+        while (capacity < column->heap_size + length) {
+            capacity *= 2;
+        }
+        uint8_t *heap = realloc(column->heap, capacity);
+        if (NULL == heap) {
+            return CKR_HOST_MEMORY;
+        }
+        column->heap = heap;
+        column->heap_capacity = capacity;
+    }
+
+    if (length > 0) {
+        memcpy(column->heap + column->heap_size, value, length);
+    }
+    column->heap_size += length;
+    column->ends[index] = column->heap_size;
+    return CKR_OK;
+}
+
+static void inventory_writer_free(struct inventory_writer *writer) {
+    free(writer->path);
+    free(writer->handles);
+    free(writer->classes);
+    free(writer->key_types);
+    free(writer->labels.ends);
+    free(writer->labels.heap);
+    free(writer->ids.ends);
+    free(writer->ids.heap);
+    free(writer);
+}
+
+/**
+ * Start an inventory file. Nothing is written until inventory_writer_close,
+ * which replaces the file in one rename.
+ * @param path
+ * @param capacity The most objects which will be added
+ * @param writer
+ * @return CK_RV
+ */
+CK_RV inventory_writer_open(const char *path, CK_ULONG capacity, struct inventory_writer **writer) {
+    struct inventory_writer *created;
+
+    if (!path || !writer) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    created = calloc(1, sizeof(struct inventory_writer));
+    if (NULL == created) {
+        return CKR_HOST_MEMORY;
+    }
+
+    created->capacity = capacity;
+    created->path = strdup(path);
+    created->handles = malloc((capacity ? capacity : 1) * sizeof(uint64_t));
+    created->classes = malloc((capacity ? capacity : 1) * sizeof(uint64_t));
+    created->key_types = malloc((capacity ? capacity : 1) * sizeof(uint64_t));
+    created->labels.ends = malloc(capacity * sizeof(uint64_t) + sizeof(uint64_t));
+    created->ids.ends = malloc(capacity * sizeof(uint64_t) + sizeof(uint64_t));
+    if (!created->path || !created->handles || !created->classes || !created->key_types
+        || !created->labels.ends || !created->ids.ends) {
+        inventory_writer_free(created);
+        return CKR_HOST_MEMORY;
+    }
+
+    *writer = created;
+    return CKR_OK;
+}
+
+/**
+ * Add one object to an inventory.
+ * @param writer
+ * @param handle
+ * @param object_class The object's CKA_CLASS, or INVENTORY_UNAVAILABLE
+ * @param key_type The object's CKA_KEY_TYPE, or INVENTORY_UNAVAILABLE
+ * @param label
+ * @param label_length
+ * @param id
+ * @param id_length
+ * @return CK_RV
+ */
+CK_RV inventory_writer_add(struct inventory_writer *writer,
+                           CK_OBJECT_HANDLE handle,
+                           uint64_t object_class,
+                           uint64_t key_type,
+                           const uint8_t *label,
+                           CK_ULONG label_length,
+                           const uint8_t *id,
+                           CK_ULONG id_length) {
+    CK_RV rv;
+
+    if (!writer || writer->count == writer->capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    rv = blob_column_add(&writer->labels, writer->count, label, label ? label_length : 0);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    rv = blob_column_add(&writer->ids, writer->count, id, id ? id_length : 0);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    writer->handles[writer->count] = handle;
+    writer->classes[writer->count] = object_class;
+    writer->key_types[writer->count] = key_type;
+    writer->count++;
+    return CKR_OK;
+}
+
+static int write_offsets(FILE *file, const uint64_t *ends, uint64_t count, uint64_t base) {
+    uint64_t offset = base;
+    if (1 != fwrite(&offset, sizeof(uint64_t), 1, file)) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        offset = base + ends[i];
+        if (1 != fwrite(&offset, sizeof(uint64_t), 1, file)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the inventory file and free the writer.
+ * @param writer
+ * @return CK_RV
+ */
+CK_RV inventory_writer_close(struct inventory_writer *writer) {
+    struct inventory_header header;
+    uint64_t column_size;
+    uint64_t offsets_size;
+    size_t temporary_length;
+    char *temporary;
+    FILE *file;
+    int failed;
+    int fd;
+
+    if (!writer) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    column_size = writer->count * sizeof(uint64_t);
+    offsets_size = column_size + sizeof(uint64_t);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INVENTORY_MAGIC, sizeof(header.magic));
+    header.version = INVENTORY_VERSION;
+    header.header_size = sizeof(header);
+    header.object_count = writer->count;
+    header.created = (uint64_t) time(NULL);
+    header.handles_offset = sizeof(header);
+    header.classes_offset = header.handles_offset + column_size;
+    header.key_types_offset = header.classes_offset + column_size;
+    header.label_offsets_offset = header.key_types_offset + column_size;
+    header.id_offsets_offset = header.label_offsets_offset + offsets_size;
+    header.heap_offset = header.id_offsets_offset + offsets_size;
+    header.heap_size = writer->labels.heap_size + writer->ids.heap_size;
+
+    // Readers never see a partly written file, and concurrent writers each get their own.
+    temporary_length = strlen(writer->path) + sizeof(".XXXXXX");
+    temporary = malloc(temporary_length);
+    if (NULL == temporary) {
+        inventory_writer_free(writer);
+        return CKR_HOST_MEMORY;
+    }
+    snprintf(temporary, temporary_length, "%s.XXXXXX", writer->path);
+
+    fd = mkstemp(temporary);
+    file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (NULL == file) {
+        fprintf(stderr, "Could not create a temporary file for %s\n", writer->path);
+        if (fd >= 0) {
+            close(fd);
+            remove(temporary);
+        }
+        free(temporary);
+        inventory_writer_free(writer);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    failed = 1 != fwrite(&header, sizeof(header), 1, file)
+             || writer->count != fwrite(writer->handles, sizeof(uint64_t), writer->count, file)
+             || writer->count != fwrite(writer->classes, sizeof(uint64_t), writer->count, file)
+             || writer->count != fwrite(writer->key_types, sizeof(uint64_t), writer->count, file)
+             || 0 != write_offsets(file, writer->labels.ends, writer->count, 0)
+             || 0 != write_offsets(file, writer->ids.ends, writer->count, writer->labels.heap_size)
+             || writer->labels.heap_size != fwrite(writer->labels.heap, 1, writer->labels.heap_size, file)
+             || writer->ids.heap_size != fwrite(writer->ids.heap, 1, writer->ids.heap_size, file);
+    failed = 0 != fclose(file) || failed;
+
+    if (failed || 0 != rename(temporary, writer->path)) {
+        fprintf(stderr, "Could not write %s\n", writer->path);
+        remove(temporary);
+        failed = 1;
+    }
+
+    free(temporary);
+    inventory_writer_free(writer);
+    return failed ? CKR_FUNCTION_FAILED : CKR_OK;
+}
+
+static int column_fits(uint64_t offset, uint64_t count, uint64_t file_size) {
+    return offset <= file_size && count <= (file_size - offset) / sizeof(uint64_t) && 0 == offset % sizeof(uint64_t);
+}
+
+static int offsets_valid(const uint64_t *offsets, uint64_t count, uint64_t heap_size) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (offsets[i] > offsets[i + 1]) {
+            return 0;
+        }
+    }
+    return offsets[count] <= heap_size;
+}
+
+/**
+ * Map an inventory file for reading.
+ * @param path
+ * @param inventory
+ * @return CK_RV CKR_FUNCTION_FAILED if the file can not be read or is not a valid inventory
+ */
+CK_RV inventory_open(const char *path, struct inventory **inventory) {
+    struct inventory *opened;
+    const struct inventory_header *header;
+    struct stat status;
+    int fd;
+
+    if (!path || !inventory) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return CKR_FUNCTION_FAILED;
+    }
+    if (0 != fstat(fd, &status) || (uint64_t) status.st_size < sizeof(struct inventory_header)) {
+        fprintf(stderr, "%s is not an inventory\n", path);
+        close(fd);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    opened = calloc(1, sizeof(struct inventory));
+    if (NULL == opened) {
+        close(fd);
+        return CKR_HOST_MEMORY;
+    }
+
+    opened->map_size = (size_t) status.st_size;
+    opened->map = mmap(NULL, opened->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == opened->map) {
+        fprintf(stderr, "Could not map %s\n", path);
+        free(opened);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    header = opened->map;
+    uint64_t n = header->object_count;
+    uint64_t size = opened->map_size;
+    if (0 != memcmp(header->magic, INVENTORY_MAGIC, sizeof(header->magic))
+        || INVENTORY_VERSION != header->version
+        || sizeof(struct inventory_header) != header->header_size
+        || n > size / sizeof(uint64_t)
+        || !column_fits(header->handles_offset, n, size)
+        || !column_fits(header->classes_offset, n, size)
+        || !column_fits(header->key_types_offset, n, size)
+        || !column_fits(header->label_offsets_offset, n + 1, size)
+        || !column_fits(header->id_offsets_offset, n + 1, size)
+        || header->heap_offset > size
+        || header->heap_size > size - header->heap_offset) {
+        fprintf(stderr, "%s is not a valid inventory\n", path);
+        inventory_close(opened);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    const uint8_t *base = opened->map;
+    opened->header = header;
+    opened->handles = (const uint64_t *) (base + header->handles_offset);
+    opened->classes = (const uint64_t *) (base + header->classes_offset);
+    opened->key_types = (const uint64_t *) (base + header->key_types_offset);
+    opened->label_offsets = (const uint64_t *) (base + header->label_offsets_offset);
+    opened->id_offsets = (const uint64_t *) (base + header->id_offsets_offset);
+    opened->heap = base + header->heap_offset;
+
+    if (!offsets_valid(opened->label_offsets, n, header->heap_size)
+        || !offsets_valid(opened->id_offsets, n, header->heap_size)) {
+        fprintf(stderr, "%s is not a valid inventory\n", path);
+        inventory_close(opened);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    *inventory = opened;
+    return CKR_OK;
+}
+
+uint64_t inventory_count(const struct inventory *inventory) {
+    return inventory->header->object_count;
+}
+
+/**
+ * @return When the inventory was written, in seconds since the epoch
+ */
+uint64_t inventory_created(const struct inventory *inventory) {
+    return inventory->header->created;
+}
+
+const uint64_t *inventory_handles(const struct inventory *inventory) {
+    return inventory->handles;
+}
+
+const uint64_t *inventory_classes(const struct inventory *inventory) {
+    return inventory->classes;
+}
+
+const uint64_t *inventory_key_types(const struct inventory *inventory) {
+    return inventory->key_types;
+}
+
+/**
+ * The label of an object, which is not NUL terminated.
+ * @return NULL if index is out of range
+ */
+const uint8_t *inventory_label(const struct inventory *inventory, uint64_t index, uint64_t *length) {
+    if (index >= inventory->header->object_count) {
+        return NULL;
+    }
+    *length = inventory->label_offsets[index + 1] - inventory->label_offsets[index];
+    return inventory->heap + inventory->label_offsets[index];
+}
+
+/**
+ * The CKA_ID of an object.
+ * @return NULL if index is out of range
+ */
+const uint8_t *inventory_id(const struct inventory *inventory, uint64_t index, uint64_t *length) {
+    if (index >= inventory->header->object_count) {
+        return NULL;
+    }
+    *length = inventory->id_offsets[index + 1] - inventory->id_offsets[index];
+    return inventory->heap + inventory->id_offsets[index];
+}
+
+void inventory_close(struct inventory *inventory) {
+    if (!inventory) {
+        return;
+    }
+    munmap(inventory->map, inventory->map_size);
+    free(inventory);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __INVENTORY_FILE_H__
+#define __INVENTORY_FILE_H__
+
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * Columnar snapshot of the objects on a partition.
+ *
+ * The file starts with a header, followed by 8-byte aligned columns:
+ * object handles, classes and key types as uint64_t arrays, then label and
+ * ID offsets as uint64_t arrays of object_count + 1 entries indexing a blob
+ * heap at the end of the file. The label of object i is the heap bytes from
+ * label_offsets[i] to label_offsets[i + 1]. Values are in host byte order.
+ *
+ * A class or key type the object does not have is INVENTORY_UNAVAILABLE.
+ * Reading maps the file, so queries touch only the columns they use.
+ */
+#define INVENTORY_MAGIC "HSMINV\0\1"
+#define INVENTORY_VERSION 1
+#define INVENTORY_UNAVAILABLE UINT64_MAX
+
+struct inventory_writer;
+struct inventory;
+
+CK_RV inventory_writer_open(const char *path, CK_ULONG capacity, struct inventory_writer **writer);
+CK_RV inventory_writer_add(struct inventory_writer *writer,
+                           CK_OBJECT_HANDLE handle,
+                           uint64_t object_class,
+                           uint64_t key_type,
+                           const uint8_t *label,
+                           CK_ULONG label_length,
+                           const uint8_t *id,
+                           CK_ULONG id_length);
+CK_RV inventory_writer_close(struct inventory_writer *writer);
+
+CK_RV inventory_open(const char *path, struct inventory **inventory);
+uint64_t inventory_count(const struct inventory *inventory);
+uint64_t inventory_created(const struct inventory *inventory);
+const uint64_t *inventory_handles(const struct inventory *inventory);
+const uint64_t *inventory_classes(const struct inventory *inventory);
+const uint64_t *inventory_key_types(const struct inventory *inventory);
+const uint8_t *inventory_label(const struct inventory *inventory, uint64_t index, uint64_t *length);
+const uint8_t *inventory_id(const struct inventory *inventory, uint64_t index, uint64_t *length);
+void inventory_close(struct inventory *inventory);
+
+#endif
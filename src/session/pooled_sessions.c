@@ -0,0 +1,156 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "session_pool.h"
+
+#define WORKER_COUNT 8
+#define OPERATIONS_PER_WORKER 16
+#define RANDOM_LENGTH 16
+
+struct worker {
+    pthread_t thread;
+    struct session_pool *pool;
+    CK_RV rv;
+};
+
+/**
+ * Each worker checks a session out of the pool for a single operation, and
+ * returns it straight away so other workers can use it.
+ */
+static void *worker_run(void *arg) {
+    struct worker *worker = arg;
+    CK_BYTE random_data[RANDOM_LENGTH];
+
+    for (int i = 0; i < OPERATIONS_PER_WORKER; i++) {
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+        worker->rv = session_pool_acquire(worker->pool, &session);
+        if (CKR_OK != worker->rv) {
+            fprintf(stderr, "Failed to acquire a session: %lu\n", worker->rv);
+            return NULL;
+        }
+
+        worker->rv = funcs->C_GenerateRandom(session, random_data, sizeof(random_data));
+        session_pool_release(worker->pool, session);
+        if (CKR_OK != worker->rv) {
+            fprintf(stderr, "Random data generation failed: %lu\n", worker->rv);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+CK_RV session_pool_sample(struct session_pool *pool) {
+    struct worker workers[WORKER_COUNT];
+    CK_ULONG open_sessions = 0;
+    CK_ULONG idle_sessions = 0;
+    CK_RV rv = CKR_OK;
+    int started = 0;
+
+    for (; started < WORKER_COUNT; started++) {
+        workers[started].pool = pool;
+        workers[started].rv = CKR_OK;
+        if (0 != pthread_create(&workers[started].thread, NULL, worker_run, &workers[started])) {
+            fprintf(stderr, "Failed to start worker %d\n", started);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+    }
+
+    // Workers already running still use the pool, so wait for them even if one failed to start.
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (CKR_OK == rv) {
+            rv = workers[i].rv;
+        }
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    session_pool_stats(pool, &open_sessions, &idle_sessions);
+    printf("%d workers completed %d operations on %lu sessions\n",
+           WORKER_COUNT, WORKER_COUNT * OPERATIONS_PER_WORKER, open_sessions);
+
+    // With no work left, give the extra sessions back to the cluster.
+    printf("Trimmed %lu idle sessions\n", session_pool_trim(pool));
+
+    // A non-blocking acquire fails with CKR_SESSION_COUNT once every session is checked out.
+    rv = session_pool_resize(pool, 1, 1);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to resize the pool: %lu\n", rv);
+        return rv;
+    }
+
+    CK_SESSION_HANDLE first = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE second = CK_INVALID_HANDLE;
+    rv = session_pool_try_acquire(pool, &first);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+        return rv;
+    }
+
+    rv = session_pool_try_acquire(pool, &second);
+    session_pool_release(pool, first);
+    if (CKR_SESSION_COUNT != rv) {
+        fprintf(stderr, "Expected CKR_SESSION_COUNT from an exhausted pool, got: %lu\n", rv);
+        session_pool_release(pool, second);
+        return CKR_GENERAL_ERROR;
+    }
+    printf("Non-blocking acquire on an exhausted pool returned CKR_SESSION_COUNT\n");
+
+    return CKR_OK;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 2, 4, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("Sharing a pool of 2 to 4 sessions between %d threads\n", WORKER_COUNT);
+    rv = session_pool_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
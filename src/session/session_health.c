@@ -0,0 +1,217 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "session_pool.h"
+#include "latency_histogram.h"
+
+#define MIN_SESSIONS 4
+#define MAX_SESSIONS 8
+#define MONITOR_INTERVAL_MS 20
+#define RECOVERY_TIMEOUT_MS 5000
+#define REQUEST_COUNT 64
+#define RANDOM_LENGTH 16
+
+/**
+ * Run requests one after another, each on a pooled session. A session which
+ * fails because it was lost is discarded, so the pool does not hand it out again.
+ * @param pool
+ * @param failures Receives the number of failed requests
+ * @return CK_RV
+ */
+static CK_RV run_requests(struct session_pool *pool, CK_ULONG *failures) {
+    CK_BYTE random_data[RANDOM_LENGTH];
+
+    *failures = 0;
+    for (int i = 0; i < REQUEST_COUNT; i++) {
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+        CK_RV rv = session_pool_acquire(pool, &session);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+            return rv;
+        }
+
+        rv = funcs->C_GenerateRandom(session, random_data, sizeof(random_data));
+        if (session_pool_is_lost(rv)) {
+            session_pool_discard(pool, session);
+        } else {
+            session_pool_release(pool, session);
+        }
+        if (CKR_OK != rv) {
+            (*failures)++;
+        }
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Wait for the monitor to count at least target reconnects and relogins.
+ * @return CK_RV
+ */
+static CK_RV wait_for_recovery(struct session_pool *pool, CK_ULONG reconnects, CK_ULONG relogins) {
+    struct timespec pause = { 0, 1000000L };
+    struct session_pool_health health;
+
+    for (int waited = 0; waited < RECOVERY_TIMEOUT_MS; waited++) {
+        session_pool_health(pool, &health);
+        if (health.reconnects >= reconnects && health.relogins >= relogins) {
+            return CKR_OK;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    fprintf(stderr, "The monitor did not recover the pool, last error: %lu\n", health.last_error);
+    return CKR_GENERAL_ERROR;
+}
+
+static void print_health(struct session_pool *pool) {
+    struct session_pool_health health;
+    CK_ULONG open_sessions = 0;
+
+    session_pool_health(pool, &health);
+    session_pool_stats(pool, &open_sessions, NULL);
+    printf("%lu open sessions, %lu probes, %lu lost, %lu relogins, %lu reconnects, %lu failed reconnects\n",
+           open_sessions, health.probes, health.lost, health.relogins, health.reconnects,
+           health.reconnect_failures);
+    printf("Recovery latency: last %.1f us, max %.1f us\n",
+           health.last_recovery_ns / 1e3, health.max_recovery_ns / 1e3);
+}
+
+/**
+ * Close every session on the slot, as a failover of the HSM does, then log
+ * the slot out, and let the pool's monitor recover from both before the
+ * next requests arrive.
+ * @param pool
+ * @return CK_RV
+ */
+CK_RV session_health_sample(struct session_pool *pool) {
+    CK_SLOT_ID slot_id;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    struct session_pool_health health;
+    CK_ULONG failures = 0;
+    CK_RV rv;
+
+    rv = pkcs11_get_slot(&slot_id);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = session_pool_monitor_start(pool, MONITOR_INTERVAL_MS);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to start the monitor: %lu\n", rv);
+        return rv;
+    }
+
+    rv = run_requests(pool, &failures);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    printf("Before the failover: %d requests, %lu failed\n", REQUEST_COUNT, failures);
+
+    // Every session dies and the slot is logged out.
+    uint64_t failover = latency_now_ns();
+    rv = funcs->C_CloseAllSessions(slot_id);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to close the sessions: %lu\n", rv);
+        return rv;
+    }
+
+    rv = wait_for_recovery(pool, MIN_SESSIONS, 0);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    printf("The monitor replaced %d sessions %.1f ms after the failover\n",
+           MIN_SESSIONS, (latency_now_ns() - failover) / 1e6);
+
+    rv = run_requests(pool, &failures);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    printf("After the failover: %d requests, %lu failed\n", REQUEST_COUNT, failures);
+    if (0 != failures) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    // The sessions survive, but the slot is logged out.
+    session_pool_health(pool, &health);
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    funcs->C_Logout(session);
+    session_pool_release(pool, session);
+
+    rv = wait_for_recovery(pool, health.reconnects, health.relogins + 1);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    printf("The monitor logged the slot in again\n");
+
+    rv = run_requests(pool, &failures);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    printf("After the logout: %d requests, %lu failed\n", REQUEST_COUNT, failures);
+    if (0 != failures) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    session_pool_monitor_stop(pool);
+    print_health(pool);
+
+    return CKR_OK;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, MIN_SESSIONS, MAX_SESSIONS, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("Monitoring a pool of %d to %d sessions every %d ms\n", MIN_SESSIONS, MAX_SESSIONS, MONITOR_INTERVAL_MS);
+    rv = session_health_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
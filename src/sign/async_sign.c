@@ -0,0 +1,237 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <poll.h>
+#include <stdatomic.h>
+
+#include "sign.h"
+#include "pkcs11_async.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_WORKERS 4
+#define SAMPLE_REQUESTS 2000
+#define SAMPLE_REAP_BATCH 64
+#define MESSAGE_SIZE 64
+
+/**
+ * One signing request, which stays alive until its completion is reaped.
+ */
+struct sign_request {
+    CK_OBJECT_HANDLE key;
+    CK_BYTE message[MESSAGE_SIZE];
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG signature_length;
+};
+
+/**
+ * The blocking helper, run on a worker's session.
+ */
+static CK_RV sign_operation(CK_SESSION_HANDLE session, void *arg) {
+    struct sign_request *request = arg;
+
+    request->signature_length = sizeof(request->signature);
+    return generate_signature(session, request->key, CKM_ECDSA_SHA256, request->message, MESSAGE_SIZE,
+                              request->signature, &request->signature_length, CK_FALSE);
+}
+
+static void count_completion(void *arg, CK_RV rv) {
+    atomic_ulong *failures = arg;
+
+    if (CKR_OK != rv) {
+        atomic_fetch_add(failures, 1);
+    }
+}
+
+/**
+ * Sign requests from an event loop: submit them all without blocking, then
+ * wait on the completion descriptor with poll and reap the results in
+ * batches. Also complete requests through a callback and a future.
+ * @param pool Session pool with room for SAMPLE_WORKERS + 1 sessions
+ * @return CK_RV
+ */
+static CK_RV async_sign_sample(struct session_pool *pool) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    struct pkcs11_async *async = NULL;
+    struct pkcs11_async_future *future = NULL;
+    struct pkcs11_async_completion completions[SAMPLE_REAP_BATCH];
+    struct pkcs11_async_stats stats;
+    struct sign_request *requests = NULL;
+    atomic_ulong callback_failures;
+    uint64_t slowest_submit_ns = 0;
+    CK_ULONG reaped = 0;
+    CK_ULONG wakeups = 0;
+
+    // openssl ecparam -name prime256v1 -outform DER | hexdump -C
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    atomic_init(&callback_failures, 0);
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+        return rv;
+    }
+
+    rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &public_key, &private_key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "EC key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    requests = calloc(SAMPLE_REQUESTS, sizeof(struct sign_request));
+    if (NULL == requests) {
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_REQUESTS; i++) {
+        requests[i].key = private_key;
+        snprintf((char *) requests[i].message, MESSAGE_SIZE, "{\"request\":%lu}", i);
+    }
+
+    rv = pkcs11_async_create(pool, SAMPLE_WORKERS, &async);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to start the async executor: %lu\n", rv);
+        goto done;
+    }
+
+    uint64_t start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_REQUESTS; i++) {
+        uint64_t submit_start = latency_now_ns();
+
+        rv = pkcs11_async_submit(async, sign_operation, &requests[i], NULL);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to submit a signing request: %lu\n", rv);
+            goto done;
+        }
+        if (latency_now_ns() - submit_start > slowest_submit_ns) {
+            slowest_submit_ns = latency_now_ns() - submit_start;
+        }
+    }
+
+    // The event loop: an epoll based server adds the descriptor to its set.
+    struct pollfd completion_fd = { pkcs11_async_fd(async), POLLIN, 0 };
+    while (reaped < SAMPLE_REQUESTS) {
+        if (poll(&completion_fd, 1, -1) < 0) {
+            perror("poll");
+            rv = CKR_GENERAL_ERROR;
+            goto done;
+        }
+        wakeups++;
+
+        CK_ULONG count = pkcs11_async_reap(async, completions, SAMPLE_REAP_BATCH);
+        for (CK_ULONG i = 0; i < count; i++) {
+            if (CKR_OK != completions[i].rv) {
+                fprintf(stderr, "Signature generation failed: %lu\n", completions[i].rv);
+                rv = completions[i].rv;
+                goto done;
+            }
+        }
+        reaped += count;
+    }
+    printf("Signed %d messages in %.1f ms on %d workers, reaped in %lu wakeups\n",
+           SAMPLE_REQUESTS, (latency_now_ns() - start) / 1e6, SAMPLE_WORKERS, wakeups);
+    printf("Slowest submit: %.1f us\n", slowest_submit_ns / 1e3);
+
+    for (CK_ULONG i = 0; i < SAMPLE_REQUESTS; i += SAMPLE_REQUESTS / 8) {
+        rv = verify_signature(session, public_key, CKM_ECDSA_SHA256, requests[i].message, MESSAGE_SIZE,
+                              requests[i].signature, requests[i].signature_length);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Verification failed: %lu\n", rv);
+            goto done;
+        }
+    }
+    printf("Verified a sample of the reaped signatures\n");
+
+    // Callbacks run on the worker threads.
+    for (CK_ULONG i = 0; i < SAMPLE_REAP_BATCH; i++) {
+        rv = pkcs11_async_submit(async, sign_operation, &requests[i], count_completion);
+        if (CKR_OK != rv) {
+            goto done;
+        }
+    }
+
+    // A future, for callers which need the result before they carry on.
+    rv = pkcs11_async_submit_future(async, sign_operation, &requests[SAMPLE_REAP_BATCH], &future);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    rv = pkcs11_async_future_wait(future);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Signature generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    while (pkcs11_async_stats(async, &stats), stats.queue_depth + stats.in_flight > 0) {
+        poll(NULL, 0, 1);
+    }
+    printf("%lu operations completed, %lu failed, %lu unreaped\n",
+           stats.completed, stats.failed, stats.unreaped);
+    if (0 != atomic_load(&callback_failures) || 0 != stats.failed || 0 != stats.unreaped) {
+        rv = CKR_GENERAL_ERROR;
+    }
+
+done:
+    pkcs11_async_future_free(future);
+    pkcs11_async_destroy(async);
+
+    if (CK_INVALID_HANDLE != public_key) {
+        funcs->C_DestroyObject(session, public_key);
+    }
+    if (CK_INVALID_HANDLE != private_key) {
+        funcs->C_DestroyObject(session, private_key);
+    }
+    session_pool_release(pool, session);
+    free(requests);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 1, SAMPLE_WORKERS + 1, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nSign with EC from an event loop on %d workers\n", SAMPLE_WORKERS);
+    rv = async_sign_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
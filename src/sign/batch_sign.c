@@ -0,0 +1,226 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdatomic.h>
+
+#include "sign.h"
+#include "sign_engine.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_WORKERS 4
+#define SAMPLE_QUEUE_CAPACITY 256
+#define SAMPLE_MESSAGES 2000
+#define SAMPLE_FUTURES 8
+#define MESSAGE_SIZE 64
+#define MAX_SIGNATURE_LENGTH 256
+
+struct batch_results {
+    atomic_ulong signed_count;
+    atomic_ulong failed_count;
+};
+
+static void count_signature(void *context, CK_RV rv, CK_BYTE_PTR signature, CK_ULONG signature_length) {
+    struct batch_results *results = context;
+
+    if (CKR_OK == rv && signature_length > 0) {
+        atomic_fetch_add(&results->signed_count, 1);
+    } else {
+        atomic_fetch_add(&results->failed_count, 1);
+    }
+}
+
+static void print_engine_stats(const char *when, struct sign_engine *engine) {
+    struct sign_engine_stats stats;
+
+    sign_engine_stats(engine, &stats);
+    printf("%s: %lu queued, %lu in flight, %lu of %lu completed, %lu failed\n",
+           when, stats.queue_depth, stats.in_flight, stats.completed, stats.submitted, stats.failed);
+}
+
+/**
+ * Sign a batch of token-sized messages one at a time on a single session,
+ * then through the signing engine, and verify a few of the engine's signatures.
+ * @param pool Session pool with room for SAMPLE_WORKERS + 1 sessions
+ * @return CK_RV
+ */
+CK_RV batch_sign_sample(struct session_pool *pool) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+    struct sign_engine *engine = NULL;
+    struct sign_future *futures[SAMPLE_FUTURES] = { NULL };
+    struct batch_results results;
+    CK_BYTE_PTR messages = NULL;
+    uint64_t start;
+    uint64_t single_ns;
+    uint64_t engine_ns;
+
+    // openssl ecparam -name prime256v1 -outform DER | hexdump -C
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    atomic_init(&results.signed_count, 0);
+    atomic_init(&results.failed_count, 0);
+
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+        return rv;
+    }
+
+    // Session keys are visible to every session of the application.
+    rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &public_key, &private_key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "EC key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    messages = calloc(SAMPLE_MESSAGES, MESSAGE_SIZE);
+    if (NULL == messages) {
+        fprintf(stderr, "Could not allocate memory for the messages\n");
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_MESSAGES; i++) {
+        snprintf((char *) messages + i * MESSAGE_SIZE, MESSAGE_SIZE,
+                 "eyJhbGciOiJFUzI1NiJ9.{\"sub\":\"client-%lu\"}", i);
+    }
+
+    start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_MESSAGES; i++) {
+        CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+        CK_ULONG signature_length = sizeof(signature);
+
+        rv = generate_signature(session, private_key, mech.mechanism, messages + i * MESSAGE_SIZE,
+                                MESSAGE_SIZE, signature, &signature_length, CK_FALSE);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Signature generation failed: %lu\n", rv);
+            goto done;
+        }
+    }
+    single_ns = latency_now_ns() - start;
+
+    rv = sign_engine_create(pool, SAMPLE_WORKERS, SAMPLE_QUEUE_CAPACITY, &engine);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to start the signing engine: %lu\n", rv);
+        goto done;
+    }
+
+    start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_MESSAGES; i++) {
+        rv = sign_engine_submit(engine, private_key, &mech, messages + i * MESSAGE_SIZE, MESSAGE_SIZE,
+                                count_signature, &results);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to submit a signing request: %lu\n", rv);
+            goto done;
+        }
+        if (SAMPLE_MESSAGES / 2 == i) {
+            print_engine_stats("Halfway through submitting", engine);
+        }
+    }
+    sign_engine_flush(engine);
+    engine_ns = latency_now_ns() - start;
+    print_engine_stats("After flushing", engine);
+
+    if (SAMPLE_MESSAGES != atomic_load(&results.signed_count)) {
+        fprintf(stderr, "%lu signing requests failed\n", atomic_load(&results.failed_count));
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+
+    printf("Signed %d messages in %.1f ms on one session and %.1f ms with %d workers\n",
+           SAMPLE_MESSAGES, single_ns / 1e6, engine_ns / 1e6, SAMPLE_WORKERS);
+
+    // Futures suit callers which need the signature before they carry on.
+    for (CK_ULONG i = 0; i < SAMPLE_FUTURES; i++) {
+        rv = sign_engine_submit_future(engine, private_key, &mech, messages + i * MESSAGE_SIZE,
+                                       MESSAGE_SIZE, &futures[i]);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to submit a signing request: %lu\n", rv);
+            goto done;
+        }
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_FUTURES; i++) {
+        CK_BYTE_PTR signature = NULL;
+        CK_ULONG signature_length = 0;
+
+        rv = sign_future_wait(futures[i], &signature, &signature_length);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Signature generation failed: %lu\n", rv);
+            goto done;
+        }
+
+        rv = verify_signature(session, public_key, mech.mechanism, messages + i * MESSAGE_SIZE,
+                              MESSAGE_SIZE, signature, signature_length);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Verification failed: %lu\n", rv);
+            goto done;
+        }
+    }
+    printf("Verified %d signatures returned through futures\n", SAMPLE_FUTURES);
+
+done:
+    for (CK_ULONG i = 0; i < SAMPLE_FUTURES; i++) {
+        sign_future_free(futures[i]);
+    }
+    sign_engine_destroy(engine);
+
+    if (CK_INVALID_HANDLE != public_key) {
+        funcs->C_DestroyObject(session, public_key);
+    }
+    if (CK_INVALID_HANDLE != private_key) {
+        funcs->C_DestroyObject(session, private_key);
+    }
+    session_pool_release(pool, session);
+    free(messages);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 1, SAMPLE_WORKERS + 1, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nBatch sign with EC on %d workers\n", SAMPLE_WORKERS);
+    rv = batch_sign_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
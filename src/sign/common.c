@@ -14,7 +14,33 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <errno.h>
+
 #include "sign.h"
+#ifdef SIGN_HASH_LOCALLY
+#include "prehash.h"
+#endif
+#include "mapped_file.h"
+#include "output_length.h"
+
+/**
+ * Set up a mechanism with no parameters, or for the PSS mechanisms, with
+ * MGF1 over the message hash and a salt as long as the digest.
+ */
+static void sign_mechanism(CK_MECHANISM_TYPE mechanism, CK_RSA_PKCS_PSS_PARAMS *pss_params, CK_MECHANISM_PTR mech) {
+    mech->mechanism = mechanism;
+    mech->ulParameterLen = 0;
+    mech->pParameter = NULL;
+
+#ifdef SIGN_HASH_LOCALLY
+    const struct prehash *prehash = prehash_find(mechanism);
+    if (prehash && CKM_RSA_PKCS_PSS == prehash->raw_mechanism) {
+        prehash_pss_params(prehash, pss_params);
+        mech->pParameter = pss_params;
+        mech->ulParameterLen = sizeof(*pss_params);
+    }
+#endif
+}
 
 CK_RV generate_signature(CK_SESSION_HANDLE session,
                          CK_OBJECT_HANDLE key,
@@ -22,17 +48,26 @@ CK_RV generate_signature(CK_SESSION_HANDLE session,
                          CK_BYTE_PTR data,
                          CK_ULONG data_length,
                          CK_BYTE_PTR signature,
-                         CK_ULONG_PTR signature_length) {
+                         CK_ULONG_PTR signature_length,
+                         CK_BBOOL hash_locally) {
     CK_RV rv;
     CK_MECHANISM mech;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
 
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
+    // Only the digest crosses the network; the HSM signs it with the raw mechanism.
+    if (hash_locally) {
+#ifdef SIGN_HASH_LOCALLY
+        return prehash_sign(session, key, mechanism, data, data_length, signature, signature_length);
+#else
+        return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+    }
+
+    sign_mechanism(mechanism, &pss_params, &mech);
 
     rv = funcs->C_SignInit(session, &mech, key);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_Sign(session, data, data_length, signature, signature_length);
@@ -45,22 +80,31 @@ CK_RV multi_part_generate_signature(CK_SESSION_HANDLE session,
                                     CK_BYTE_PTR data,
                                     CK_ULONG data_length,
                                     CK_BYTE_PTR signature,
-                                    CK_ULONG_PTR signature_length) {
+                                    CK_ULONG_PTR signature_length,
+                                    CK_BBOOL hash_locally) {
     CK_RV rv;
     CK_MECHANISM mech;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
 
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
+    // Hashing locally replaces the update calls, and a single C_Sign signs the digest.
+    if (hash_locally) {
+#ifdef SIGN_HASH_LOCALLY
+        return prehash_sign(session, key, mechanism, data, data_length, signature, signature_length);
+#else
+        return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+    }
+
+    sign_mechanism(mechanism, &pss_params, &mech);
 
     rv = funcs->C_SignInit(session, &mech, key);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_SignUpdate(session, data, data_length);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_SignFinal(session, signature, signature_length);
@@ -76,14 +120,13 @@ CK_RV verify_signature(CK_SESSION_HANDLE session,
                        CK_ULONG signature_length) {
     CK_RV rv;
     CK_MECHANISM mech;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
 
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
+    sign_mechanism(mechanism, &pss_params, &mech);
 
     rv = funcs->C_VerifyInit(session, &mech, key);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_Verify(session, data, data_length, signature, signature_length);
@@ -99,21 +142,125 @@ CK_RV multi_part_verify_signature(CK_SESSION_HANDLE session,
                                   CK_ULONG signature_length) {
     CK_RV rv;
     CK_MECHANISM mech;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
 
-    mech.mechanism = mechanism;
-    mech.ulParameterLen = 0;
-    mech.pParameter = NULL;
+    sign_mechanism(mechanism, &pss_params, &mech);
 
     rv = funcs->C_VerifyInit(session, &mech, key);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_VerifyUpdate(session, data, data_length);
     if (CKR_OK != rv) {
-        return !CKR_OK;
+        return rv;
     }
 
     rv = funcs->C_VerifyFinal(session, signature, signature_length);    
     return rv;
 }
+
+#ifndef _WIN32
+static CK_RV sign_window(void *context, CK_BYTE_PTR window, CK_ULONG window_length) {
+    return funcs->C_SignUpdate(*(CK_SESSION_HANDLE *) context, window, window_length);
+}
+
+#ifdef SIGN_HASH_LOCALLY
+static CK_RV hash_window(void *context, CK_BYTE_PTR window, CK_ULONG window_length) {
+    return 1 == EVP_DigestUpdate(context, window, window_length) ? CKR_OK : CKR_FUNCTION_FAILED;
+}
+
+/**
+ * Hash a file locally and sign the digest on the HSM.
+ */
+static CK_RV prehash_sign_file(CK_SESSION_HANDLE session,
+                               CK_OBJECT_HANDLE key,
+                               CK_MECHANISM_TYPE mechanism,
+                               const char *path,
+                               CK_ULONG window_size,
+                               CK_BYTE_PTR signature,
+                               CK_ULONG_PTR signature_length) {
+    CK_BYTE digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    CK_RV rv = CKR_FUNCTION_FAILED;
+
+    const struct prehash *prehash = prehash_find(mechanism);
+    const EVP_MD *md = prehash ? prehash_md(prehash) : NULL;
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    if (NULL == context) {
+        return CKR_HOST_MEMORY;
+    }
+    if (1 == EVP_DigestInit_ex(context, md, NULL)) {
+        rv = mapped_file_each_window(path, window_size, hash_window, context);
+    }
+    if (CKR_OK == rv && 1 != EVP_DigestFinal_ex(context, digest, &digest_length)) {
+        rv = CKR_FUNCTION_FAILED;
+    }
+    EVP_MD_CTX_free(context);
+
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    return prehash_sign_digest(session, key, prehash, digest, signature, signature_length);
+}
+#endif
+
+/**
+ * Sign a file without reading it into memory. The file is mapped a span at
+ * a time and sent in windows of window_size bytes, one C_SignUpdate each,
+ * or with hash_locally, hashed with OpenSSL and only the digest signed.
+ * @param session
+ * @param key
+ * @param mechanism Hash and sign mechanism, such as CKM_SHA256_RSA_PKCS
+ * @param path File to sign
+ * @param window_size Bytes per C_SignUpdate, or 0 for MAPPED_FILE_DEFAULT_WINDOW
+ * @param signature
+ * @param signature_length
+ * @param hash_locally
+ * @return CK_RV, or CKR_FUNCTION_FAILED with errno set if the file could not be read
+ */
+CK_RV multi_part_generate_file_signature(CK_SESSION_HANDLE session,
+                                         CK_OBJECT_HANDLE key,
+                                         CK_MECHANISM_TYPE mechanism,
+                                         const char *path,
+                                         CK_ULONG window_size,
+                                         CK_BYTE_PTR signature,
+                                         CK_ULONG_PTR signature_length,
+                                         CK_BBOOL hash_locally) {
+    CK_RV rv;
+    CK_MECHANISM mech;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
+    CK_BYTE discard[PKCS11_MAX_RSA_MODULUS_BYTES];
+
+    if (hash_locally) {
+#ifdef SIGN_HASH_LOCALLY
+        return prehash_sign_file(session, key, mechanism, path, window_size, signature, signature_length);
+#else
+        return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+    }
+
+    sign_mechanism(mechanism, &pss_params, &mech);
+
+    rv = funcs->C_SignInit(session, &mech, key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = mapped_file_each_window(path, window_size, sign_window, &session);
+    if (CKR_OK != rv) {
+        // Finish the operation if the file, rather than the HSM, failed.
+        int saved_errno = errno;
+        CK_ULONG discard_length = sizeof(discard);
+        funcs->C_SignFinal(session, discard, &discard_length);
+        errno = saved_errno;
+        return rv;
+    }
+
+    return funcs->C_SignFinal(session, signature, signature_length);
+}
+#endif
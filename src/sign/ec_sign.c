@@ -45,7 +45,7 @@ CK_RV generate_ec_keypair(CK_SESSION_HANDLE session,
             {CKA_SIGN, &true_val, sizeof(CK_BBOOL)},
     };
 
-    rv = funcs->C_GenerateKeyPair(session,
+    rv = pkcs11_generate_key_pair(session,
                                   &mech,
                                   public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
                                   private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
@@ -85,7 +85,7 @@ CK_RV ec_sign_verify(CK_SESSION_HANDLE session) {
     }
 
     rv = generate_signature(session, privkey, mechanism,
-                           data, data_length, signature, &signature_length);
+                           data, data_length, signature, &signature_length, CK_FALSE);
     if (CKR_OK == rv) {
         unsigned char *hex_signature = NULL;
         bytes_to_new_hexstring(signature, signature_length, &hex_signature);
@@ -110,6 +110,26 @@ CK_RV ec_sign_verify(CK_SESSION_HANDLE session) {
         return rv;
     }
 
+#ifdef SIGN_HASH_LOCALLY
+    // Hash the data locally and have the HSM sign only the digest with CKM_ECDSA.
+    // The signature verifies with the combined mechanism.
+    signature_length = MAX_SIGNATURE_LENGTH;
+    rv = generate_signature(session, privkey, mechanism,
+                            data, data_length, signature, &signature_length, CK_TRUE);
+    if (CKR_OK != rv) {
+        printf("Signature generation over a local hash failed: %lu\n", rv);
+        return rv;
+    }
+
+    rv = verify_signature(session, pubkey, mechanism, data, data_length, signature, signature_length);
+    if (CKR_OK == rv) {
+        printf("Verification of the signature over a local hash successful\n");
+    } else {
+        printf("Verification of the signature over a local hash failed: %lu\n", rv);
+        return rv;
+    }
+#endif
+
     return 0;
 }
 
@@ -144,7 +164,7 @@ CK_RV multi_part_ec_sign_verify(CK_SESSION_HANDLE session) {
     }
 
     rv = multi_part_generate_signature(session, privkey, mechanism, data,
-                                       data_length, signature, &signature_length);
+                                       data_length, signature, &signature_length, CK_FALSE);
     if (CKR_OK == rv) {
         unsigned char *hex_signature = NULL;
         bytes_to_new_hexstring(signature, signature_length, &hex_signature);
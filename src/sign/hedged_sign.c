@@ -0,0 +1,227 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "sign.h"
+#include "pkcs11_retry.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_HEDGE_WORKERS 4
+#define SAMPLE_SIGNATURES 400
+#define MESSAGE_SIZE 64
+
+static void print_latency(const char *label, const struct latency_histogram *latency) {
+    printf("%s: p50 %.1f us, p99 %.1f us, max %.1f us\n", label,
+           latency_histogram_percentile(latency, 50.0) / 1e3,
+           latency_histogram_percentile(latency, 99.0) / 1e3,
+           latency->max_ns / 1e3);
+}
+
+static void print_retry_stats(struct pkcs11_retry *retry) {
+    struct pkcs11_retry_stats stats;
+
+    pkcs11_retry_stats(retry, &stats);
+    printf("%lu calls, %lu attempts, %lu retries, %lu hedges (%lu won), %lu fatal, %lu exhausted\n",
+           stats.calls, stats.attempts, stats.retries, stats.hedges, stats.hedge_wins,
+           stats.fatal, stats.exhausted);
+}
+
+/**
+ * Sign SAMPLE_SIGNATURES messages one after another and record each call's latency.
+ */
+static CK_RV sign_messages(struct pkcs11_retry *retry, CK_OBJECT_HANDLE key, struct latency_histogram *latency) {
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+    CK_BYTE message[MESSAGE_SIZE] = { 0 };
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+
+    latency_histogram_init(latency);
+    for (CK_ULONG i = 0; i < SAMPLE_SIGNATURES; i++) {
+        CK_ULONG signature_length = sizeof(signature);
+
+        snprintf((char *) message, sizeof(message), "{\"request\":%lu}", i);
+        uint64_t start = latency_now_ns();
+        CK_RV rv = pkcs11_retry_sign(retry, key, &mech, message, sizeof(message), signature, &signature_length);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Signature generation failed: %lu\n", rv);
+            return rv;
+        }
+        latency_histogram_record(latency, latency_now_ns() - start);
+    }
+
+    return CKR_OK;
+}
+
+/**
+ * Sign through the retry layer: recover from a lost session, then compare
+ * the tail latency of plain calls with hedged calls, and show that a bad
+ * signature is not retried.
+ * @param pool Session pool with room for SAMPLE_HEDGE_WORKERS + 2 sessions
+ * @return CK_RV
+ */
+static CK_RV hedged_sign_sample(struct session_pool *pool) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    CK_SESSION_HANDLE lost = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+    CK_MECHANISM sha256 = { CKM_SHA256, NULL, 0 };
+    CK_BYTE message[MESSAGE_SIZE] = "a message which is signed with retries";
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG signature_length = sizeof(signature);
+    CK_BYTE digest[32];
+    CK_ULONG digest_length = sizeof(digest);
+    CK_BYTE nonce[16];
+    struct pkcs11_retry_policy policy;
+    struct pkcs11_retry *retry = NULL;
+    struct pkcs11_retry *hedged = NULL;
+    struct latency_histogram latency;
+
+    // openssl ecparam -name prime256v1 -outform DER | hexdump -C
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    // Session keys are destroyed with the session which created them, so keep it checked out.
+    rv = session_pool_acquire(pool, &session);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to acquire a session: %lu\n", rv);
+        return rv;
+    }
+
+    rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &public_key, &private_key);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "EC key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    pkcs11_retry_policy_default(&policy);
+    rv = pkcs11_retry_create(pool, &policy, &retry);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the retry layer: %lu\n", rv);
+        goto done;
+    }
+
+    // Close a pooled session behind the pool's back, as a failover would.
+    // The next call picks it up, fails, and is retried on another session.
+    rv = session_pool_acquire(pool, &lost);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    funcs->C_CloseSession(lost);
+    session_pool_release(pool, lost);
+
+    rv = pkcs11_retry_sign(retry, private_key, &mech, message, sizeof(message), signature, &signature_length);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Signing on a lost session was not retried: %lu\n", rv);
+        goto done;
+    }
+    printf("Signed after losing a session: ");
+    print_retry_stats(retry);
+
+    // A bad signature is an answer, not a transient error.
+    signature[0] ^= 1;
+    rv = pkcs11_retry_verify(retry, public_key, &mech, message, sizeof(message), signature, signature_length);
+    signature[0] ^= 1;
+    if (CKR_SIGNATURE_INVALID != rv) {
+        fprintf(stderr, "Expected CKR_SIGNATURE_INVALID for an altered signature, got: %lu\n", rv);
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+    printf("Verifying an altered signature failed without retries: ");
+    print_retry_stats(retry);
+
+    rv = sign_messages(retry, private_key, &latency);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    print_latency("Without hedging", &latency);
+
+    policy.hedge_workers = SAMPLE_HEDGE_WORKERS;
+    rv = pkcs11_retry_create(pool, &policy, &hedged);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the hedging retry layer: %lu\n", rv);
+        goto done;
+    }
+
+    rv = sign_messages(hedged, private_key, &latency);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    print_latency("With hedging", &latency);
+    print_retry_stats(hedged);
+
+    // Verifying, digesting and generating random data hedge the same way.
+    rv = pkcs11_retry_verify(hedged, public_key, &mech, message, sizeof(message), signature, signature_length);
+    if (CKR_OK == rv) {
+        rv = pkcs11_retry_digest(hedged, &sha256, message, sizeof(message), digest, &digest_length);
+    }
+    if (CKR_OK == rv) {
+        rv = pkcs11_retry_generate_random(hedged, nonce, sizeof(nonce));
+    }
+    if (CKR_OK != rv) {
+        fprintf(stderr, "A hedged call failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Verified, digested and generated random data with hedging\n");
+
+done:
+    pkcs11_retry_destroy(hedged);
+    pkcs11_retry_destroy(retry);
+
+    if (CK_INVALID_HANDLE != public_key) {
+        funcs->C_DestroyObject(session, public_key);
+    }
+    if (CK_INVALID_HANDLE != private_key) {
+        funcs->C_DestroyObject(session, private_key);
+    }
+    session_pool_release(pool, session);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    struct session_pool *pool = NULL;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = session_pool_create(args.pin, 2, SAMPLE_HEDGE_WORKERS + 2, &pool);
+    if (CKR_OK != rv) {
+        fprintf(stderr, "Failed to create the session pool: %lu\n", rv);
+        return rc;
+    }
+
+    printf("\nSign with EC through the retry layer\n");
+    rv = hedged_sign_sample(pool);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+    session_pool_destroy(pool);
+    funcs->C_Finalize(NULL);
+
+    return rc;
+}
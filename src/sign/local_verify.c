@@ -0,0 +1,181 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+
+#include "sign.h"
+#include "verify_cache.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_VERIFICATIONS 500
+
+/**
+ * Verify the same signature on the HSM and locally SAMPLE_VERIFICATIONS
+ * times each, then check a tampered signature is rejected locally.
+ * @param session
+ * @param cache
+ * @param private_key
+ * @param public_key
+ * @param mechanism
+ * @return CK_RV
+ */
+static CK_RV compare_verification(CK_SESSION_HANDLE session,
+                                  struct verify_cache *cache,
+                                  CK_OBJECT_HANDLE private_key,
+                                  CK_OBJECT_HANDLE public_key,
+                                  CK_MECHANISM_TYPE mechanism) {
+    CK_RV rv;
+    CK_BYTE_PTR data = "{\"sub\":\"client-42\",\"scope\":\"read write\"}";
+    CK_ULONG data_length = (CK_ULONG) strlen(data);
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG signature_length = MAX_SIGNATURE_LENGTH;
+    uint64_t start;
+    uint64_t hsm_ns;
+    uint64_t local_ns;
+
+    rv = generate_signature(session, private_key, mechanism, data, data_length,
+                            signature, &signature_length, CK_FALSE);
+    if (CKR_OK != rv) {
+        printf("Signature generation failed: %lu\n", rv);
+        return rv;
+    }
+
+    start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_VERIFICATIONS && CKR_OK == rv; i++) {
+        rv = verify_signature(session, public_key, mechanism, data, data_length, signature, signature_length);
+    }
+    hsm_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        printf("Verification on the HSM failed: %lu\n", rv);
+        return rv;
+    }
+
+    // The first verification reads the public key; the rest never leave the process.
+    start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_VERIFICATIONS && CKR_OK == rv; i++) {
+        rv = verify_signature_locally(cache, session, public_key, mechanism, data, data_length,
+                                      signature, signature_length);
+    }
+    local_ns = latency_now_ns() - start;
+    if (CKR_OK != rv) {
+        printf("Local verification failed: %lu\n", rv);
+        return rv;
+    }
+
+    printf("Verified %d times in %.1f ms on the HSM and %.1f ms locally\n",
+           SAMPLE_VERIFICATIONS, hsm_ns / 1e6, local_ns / 1e6);
+
+    signature[signature_length / 2] ^= 0x01;
+    rv = verify_signature_locally(cache, session, public_key, mechanism, data, data_length,
+                                  signature, signature_length);
+    if (CKR_SIGNATURE_INVALID != rv) {
+        printf("Local verification accepted a tampered signature: %lu\n", rv);
+        return CKR_GENERAL_ERROR;
+    }
+    printf("Tampered signature rejected locally\n");
+
+    return CKR_OK;
+}
+
+CK_RV local_verify_sample(CK_SESSION_HANDLE session) {
+    CK_RV rv;
+    struct verify_cache *cache = NULL;
+    CK_OBJECT_HANDLE rsa_public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE rsa_private_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE ec_public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE ec_private_key = CK_INVALID_HANDLE;
+
+    // openssl ecparam -name prime256v1 -outform DER | hexdump -C
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    rv = verify_cache_create(&cache);
+    if (CKR_OK != rv) {
+        printf("Could not create the public key cache: %lu\n", rv);
+        return rv;
+    }
+
+    rv = generate_rsa_keypair(session, 2048, &rsa_public_key, &rsa_private_key);
+    if (CKR_OK != rv) {
+        printf("RSA key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    printf("RSA PSS with SHA-256\n");
+    rv = compare_verification(session, cache, rsa_private_key, rsa_public_key, CKM_SHA256_RSA_PKCS_PSS);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    printf("RSA PKCS #1 v1.5 with SHA-512\n");
+    rv = compare_verification(session, cache, rsa_private_key, rsa_public_key, CKM_SHA512_RSA_PKCS);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &ec_public_key, &ec_private_key);
+    if (CKR_OK != rv) {
+        printf("EC key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    printf("ECDSA with SHA-256\n");
+    rv = compare_verification(session, cache, ec_private_key, ec_public_key, CKM_ECDSA_SHA256);
+
+done:
+    // Handles can be reused after the objects are destroyed, so drop them from the cache first.
+    if (CK_INVALID_HANDLE != rsa_public_key) {
+        verify_cache_invalidate(cache, rsa_public_key);
+        funcs->C_DestroyObject(session, rsa_public_key);
+        funcs->C_DestroyObject(session, rsa_private_key);
+    }
+    if (CK_INVALID_HANDLE != ec_public_key) {
+        verify_cache_invalidate(cache, ec_public_key);
+        funcs->C_DestroyObject(session, ec_public_key);
+        funcs->C_DestroyObject(session, ec_private_key);
+    }
+    verify_cache_destroy(cache);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Verify signatures with cached public keys\n");
+    rv = local_verify_sample(session);
+    if (CKR_OK != rv) {
+        return EXIT_FAILURE;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return EXIT_SUCCESS;
+}
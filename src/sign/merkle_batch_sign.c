@@ -0,0 +1,206 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+
+#include "sign.h"
+#include "merkle_sign.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_RECORD_COUNT 10000
+#define SAMPLE_RECORD_LENGTH 64
+#define SAMPLE_SIGNED_ONE_BY_ONE 200
+
+/**
+ * Sign a batch of records with one tree head signature, check every
+ * record's inclusion proof, and check that altered records and proofs are
+ * rejected.
+ * @param session Active PKCS#11 session
+ * @param cache Public key cache
+ * @param public_key
+ * @param private_key
+ * @param mechanism Combined hash and sign mechanism
+ * @return CK_RV
+ */
+static CK_RV merkle_batch_sign_sample(CK_SESSION_HANDLE session,
+                                      struct verify_cache *cache,
+                                      CK_OBJECT_HANDLE public_key,
+                                      CK_OBJECT_HANDLE private_key,
+                                      CK_MECHANISM_TYPE mechanism) {
+    CK_BYTE_PTR records = malloc(SAMPLE_RECORD_COUNT * SAMPLE_RECORD_LENGTH);
+    CK_BYTE_PTR messages[SAMPLE_RECORD_COUNT];
+    CK_ULONG lengths[SAMPLE_RECORD_COUNT];
+    CK_BYTE path[MERKLE_MAX_PROOF_HASHES * EVP_MAX_MD_SIZE];
+    CK_ULONG path_hashes;
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG signature_length;
+    struct merkle_batch *batch = NULL;
+    CK_RV rv = CKR_OK;
+
+    if (NULL == records) {
+        return CKR_HOST_MEMORY;
+    }
+    for (CK_ULONG i = 0; i < SAMPLE_RECORD_COUNT; i++) {
+        messages[i] = records + i * SAMPLE_RECORD_LENGTH;
+        lengths[i] = SAMPLE_RECORD_LENGTH;
+        snprintf((char *) messages[i], SAMPLE_RECORD_LENGTH, "record %lu: audit event", i);
+    }
+
+    // Signing each record is one HSM round trip per record.
+    uint64_t start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_SIGNED_ONE_BY_ONE && CKR_OK == rv; i++) {
+        signature_length = sizeof(signature);
+        rv = generate_signature(session, private_key, mechanism, messages[i], lengths[i],
+                                signature, &signature_length, CK_FALSE);
+    }
+    if (CKR_OK != rv) {
+        printf("Signing a record failed: %lu\n", rv);
+        goto done;
+    }
+    double one_by_one = (latency_now_ns() - start) / 1e3 / SAMPLE_SIGNED_ONE_BY_ONE;
+    printf("One signature per record: %.1f us per record\n", one_by_one);
+
+    start = latency_now_ns();
+    rv = merkle_sign_batch(session, private_key, mechanism, messages, lengths, SAMPLE_RECORD_COUNT, &batch);
+    if (CKR_OK != rv) {
+        printf("Signing the batch failed: %lu\n", rv);
+        goto done;
+    }
+    double batched = (latency_now_ns() - start) / 1e3 / SAMPLE_RECORD_COUNT;
+    printf("One signature per %d records: %.2f us per record (%.0fx)\n",
+           SAMPLE_RECORD_COUNT, batched, one_by_one / batched);
+
+    start = latency_now_ns();
+    for (CK_ULONG i = 0; i < SAMPLE_RECORD_COUNT && CKR_OK == rv; i++) {
+        rv = merkle_batch_proof(batch, i, path, &path_hashes);
+        if (CKR_OK == rv) {
+            rv = merkle_verify(cache, session, public_key, mechanism, messages[i], lengths[i], i,
+                               batch->tree_size, path, path_hashes, batch->signature, batch->signature_length);
+        }
+        if (CKR_OK != rv) {
+            printf("Record %lu did not verify: %lu\n", i, rv);
+        }
+    }
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    printf("Verified every record locally: %.1f us per record\n",
+           (latency_now_ns() - start) / 1e3 / SAMPLE_RECORD_COUNT);
+
+    // An altered record, a proof for another index and an altered path must all fail.
+    CK_ULONG index = SAMPLE_RECORD_COUNT - 1;
+    rv = merkle_batch_proof(batch, index, path, &path_hashes);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+    messages[index][0] ^= 1;
+    CK_RV altered_record = merkle_verify(cache, session, public_key, mechanism, messages[index], lengths[index],
+                                         index, batch->tree_size, path, path_hashes,
+                                         batch->signature, batch->signature_length);
+    messages[index][0] ^= 1;
+    CK_RV moved_record = merkle_verify(cache, session, public_key, mechanism, messages[index], lengths[index],
+                                       index - 1, batch->tree_size, path, path_hashes,
+                                       batch->signature, batch->signature_length);
+    path[0] ^= 1;
+    CK_RV altered_path = merkle_verify(cache, session, public_key, mechanism, messages[index], lengths[index],
+                                       index, batch->tree_size, path, path_hashes,
+                                       batch->signature, batch->signature_length);
+    if (CKR_SIGNATURE_INVALID != altered_record || CKR_SIGNATURE_INVALID != moved_record
+        || CKR_SIGNATURE_INVALID != altered_path) {
+        printf("An altered record or proof was accepted: %lu %lu %lu\n", altered_record, moved_record, altered_path);
+        rv = CKR_GENERAL_ERROR;
+        goto done;
+    }
+    printf("Altered records and proofs are rejected\n");
+
+done:
+    merkle_batch_free(batch);
+    free(records);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE ec_public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE ec_private_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE rsa_public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE rsa_private_key = CK_INVALID_HANDLE;
+    struct verify_cache *cache = NULL;
+    int rc = EXIT_FAILURE;
+
+    // openssl ecparam -name prime256v1 -outform DER | hexdump -C
+    CK_BYTE prime256v1[] = {0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07};
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = verify_cache_create(&cache);
+    if (CKR_OK != rv) {
+        printf("Could not create the public key cache: %lu\n", rv);
+        goto done;
+    }
+
+    rv = generate_ec_keypair(session, prime256v1, sizeof(prime256v1), &ec_public_key, &ec_private_key);
+    if (CKR_OK != rv) {
+        printf("EC key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    printf("\nBatch sign records with ECDSA P-256\n");
+    rv = merkle_batch_sign_sample(session, cache, ec_public_key, ec_private_key, CKM_ECDSA_SHA256);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    rv = generate_rsa_keypair(session, 2048, &rsa_public_key, &rsa_private_key);
+    if (CKR_OK != rv) {
+        printf("RSA key generation failed: %lu\n", rv);
+        goto done;
+    }
+
+    printf("\nBatch sign records with RSA PKCS #1 v1.5\n");
+    rv = merkle_batch_sign_sample(session, cache, rsa_public_key, rsa_private_key, CKM_SHA256_RSA_PKCS);
+    if (CKR_OK == rv) {
+        rc = EXIT_SUCCESS;
+    }
+
+done:
+    verify_cache_invalidate(cache, ec_public_key);
+    verify_cache_invalidate(cache, rsa_public_key);
+    verify_cache_destroy(cache);
+    funcs->C_DestroyObject(session, ec_public_key);
+    funcs->C_DestroyObject(session, ec_private_key);
+    funcs->C_DestroyObject(session, rsa_public_key);
+    funcs->C_DestroyObject(session, rsa_private_key);
+    pkcs11_finalize_session(session);
+
+    return rc;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+
+#include "sign.h"
+#include "prehash.h"
+#include "merkle_sign.h"
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+#define MERKLE_TREE_HEAD_CONTEXT_LENGTH (sizeof(MERKLE_TREE_HEAD_CONTEXT) - 1)
+#define MERKLE_TREE_HEAD_SIZE_LENGTH 8
+#define MERKLE_TREE_HEAD_MAX_LENGTH (MERKLE_TREE_HEAD_CONTEXT_LENGTH + MERKLE_TREE_HEAD_SIZE_LENGTH + EVP_MAX_MD_SIZE)
+
+static CK_RV merkle_hash(EVP_MD_CTX *context, const EVP_MD *md, CK_BYTE prefix,
+                         const CK_BYTE *first, CK_ULONG first_length,
+                         const CK_BYTE *second, CK_ULONG second_length,
+                         CK_BYTE_PTR out) {
+    if (1 != EVP_DigestInit_ex(context, md, NULL)
+        || 1 != EVP_DigestUpdate(context, &prefix, 1)
+        || 1 != EVP_DigestUpdate(context, first, first_length)
+        || (second_length && 1 != EVP_DigestUpdate(context, second, second_length))
+        || 1 != EVP_DigestFinal_ex(context, out, NULL)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    return CKR_OK;
+}
+
+/**
+ * The bytes the HSM signs: the context string, the tree size and the root.
+ */
+static CK_ULONG merkle_tree_head(CK_ULONG tree_size, const CK_BYTE *root, CK_ULONG digest_length,
+                                 CK_BYTE tree_head[MERKLE_TREE_HEAD_MAX_LENGTH]) {
+    CK_BYTE_PTR size_bytes = tree_head + MERKLE_TREE_HEAD_CONTEXT_LENGTH;
+    uint64_t size = tree_size;
+
+    memcpy(tree_head, MERKLE_TREE_HEAD_CONTEXT, MERKLE_TREE_HEAD_CONTEXT_LENGTH);
+    for (int i = MERKLE_TREE_HEAD_SIZE_LENGTH - 1; i >= 0; i--) {
+        size_bytes[i] = (CK_BYTE) size;
+        size >>= 8;
+    }
+    memcpy(size_bytes + MERKLE_TREE_HEAD_SIZE_LENGTH, root, digest_length);
+    return MERKLE_TREE_HEAD_CONTEXT_LENGTH + MERKLE_TREE_HEAD_SIZE_LENGTH + digest_length;
+}
+
+/**
+ * Hash every message into a tree and sign its head on the HSM.
+ * @param session
+ * @param key Private key
+ * @param mechanism Combined hash and sign mechanism, such as CKM_ECDSA_SHA256.
+ * The tree uses the same hash.
+ * @param messages
+ * @param message_lengths
+ * @param count Number of messages, at least one
+ * @param batch Receives the signed tree, which merkle_batch_free releases
+ * @return CKR_MECHANISM_INVALID for mechanisms which do not hash the message, otherwise CK_RV
+ */
+CK_RV merkle_sign_batch(CK_SESSION_HANDLE session,
+                        CK_OBJECT_HANDLE key,
+                        CK_MECHANISM_TYPE mechanism,
+                        CK_BYTE_PTR *messages,
+                        CK_ULONG_PTR message_lengths,
+                        CK_ULONG count,
+                        struct merkle_batch **batch) {
+    CK_BYTE tree_head[MERKLE_TREE_HEAD_MAX_LENGTH];
+    struct merkle_batch *new_batch;
+    EVP_MD_CTX *context;
+    CK_RV rv = CKR_OK;
+
+    if (!messages || !message_lengths || 0 == count || !batch) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    const struct prehash *prehash = prehash_find(mechanism);
+    const EVP_MD *md = prehash ? prehash_md(prehash) : NULL;
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    new_batch = calloc(1, sizeof(struct merkle_batch));
+    context = EVP_MD_CTX_new();
+    if (NULL == new_batch || NULL == context) {
+        free(new_batch);
+        EVP_MD_CTX_free(context);
+        return CKR_HOST_MEMORY;
+    }
+    new_batch->mechanism = mechanism;
+    new_batch->tree_size = count;
+    new_batch->digest_length = prehash->digest_length;
+
+    CK_ULONG digest_length = new_batch->digest_length;
+    CK_ULONG level_size = count;
+    CK_BYTE_PTR level = malloc(count * digest_length);
+    if (NULL == level) {
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+    new_batch->levels[0] = level;
+    new_batch->level_sizes[0] = count;
+    new_batch->level_count = 1;
+
+    for (CK_ULONG i = 0; i < count && CKR_OK == rv; i++) {
+        if (!messages[i] && message_lengths[i]) {
+            rv = CKR_ARGUMENTS_BAD;
+        } else {
+            rv = merkle_hash(context, md, MERKLE_LEAF_PREFIX, messages[i], message_lengths[i], NULL, 0,
+                             level + i * digest_length);
+        }
+    }
+
+    // Pair up neighbours; an odd node at the end of a level moves up unchanged.
+    while (CKR_OK == rv && level_size > 1) {
+        CK_ULONG parent_size = (level_size + 1) / 2;
+        CK_BYTE_PTR parents = malloc(parent_size * digest_length);
+        if (NULL == parents) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        new_batch->levels[new_batch->level_count] = parents;
+        new_batch->level_sizes[new_batch->level_count] = parent_size;
+        new_batch->level_count++;
+
+        for (CK_ULONG i = 0; i < parent_size && CKR_OK == rv; i++) {
+            if (2 * i + 1 == level_size) {
+                memcpy(parents + i * digest_length, level + 2 * i * digest_length, digest_length);
+            } else {
+                rv = merkle_hash(context, md, MERKLE_NODE_PREFIX,
+                                 level + 2 * i * digest_length, digest_length,
+                                 level + (2 * i + 1) * digest_length, digest_length,
+                                 parents + i * digest_length);
+            }
+        }
+        level = parents;
+        level_size = parent_size;
+    }
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    memcpy(new_batch->root, level, digest_length);
+    new_batch->signature_length = sizeof(new_batch->signature);
+    rv = generate_signature(session, key, mechanism, tree_head,
+                            merkle_tree_head(count, new_batch->root, digest_length, tree_head),
+                            new_batch->signature, &new_batch->signature_length, CK_FALSE);
+
+done:
+    EVP_MD_CTX_free(context);
+    if (CKR_OK != rv) {
+        merkle_batch_free(new_batch);
+        return rv;
+    }
+    *batch = new_batch;
+    return CKR_OK;
+}
+
+/**
+ * Read the audit path of a message from a signed batch.
+ * @param batch
+ * @param index Index of the message in the batch
+ * @param path Buffer of MERKLE_MAX_PROOF_HASHES * batch->digest_length bytes
+ * @param path_hashes Receives the number of hashes in the path
+ * @return CK_RV
+ */
+CK_RV merkle_batch_proof(const struct merkle_batch *batch,
+                         CK_ULONG index,
+                         CK_BYTE_PTR path,
+                         CK_ULONG_PTR path_hashes) {
+    if (!batch || !path || !path_hashes || index >= batch->tree_size) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *path_hashes = 0;
+    for (CK_ULONG l = 0; l + 1 < batch->level_count; l++, index /= 2) {
+        CK_ULONG sibling = index ^ 1;
+        // A node without a sibling moved up unchanged, and adds nothing to the path.
+        if (sibling < batch->level_sizes[l]) {
+            memcpy(path + *path_hashes * batch->digest_length,
+                   batch->levels[l] + sibling * batch->digest_length, batch->digest_length);
+            (*path_hashes)++;
+        }
+    }
+    return CKR_OK;
+}
+
+void merkle_batch_free(struct merkle_batch *batch) {
+    if (NULL == batch) {
+        return;
+    }
+    for (CK_ULONG l = 0; l < batch->level_count; l++) {
+        free(batch->levels[l]);
+    }
+    free(batch);
+}
+
+/**
+ * Recompute the root from a message and its audit path, following the
+ * verification algorithm of RFC 9162 section 2.1.3.2.
+ */
+static CK_RV merkle_root_from_path(const EVP_MD *md, CK_ULONG digest_length,
+                                   CK_BYTE_PTR message, CK_ULONG message_length,
+                                   CK_ULONG index, CK_ULONG tree_size,
+                                   CK_BYTE_PTR path, CK_ULONG path_hashes, CK_BYTE_PTR root) {
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    CK_ULONG fn = index;
+    CK_ULONG sn = tree_size - 1;
+    CK_RV rv;
+
+    if (NULL == context) {
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = merkle_hash(context, md, MERKLE_LEAF_PREFIX, message, message_length, NULL, 0, root);
+    for (CK_ULONG p = 0; p < path_hashes && CKR_OK == rv; p++) {
+        CK_BYTE_PTR sibling = path + p * digest_length;
+
+        if (0 == sn) {
+            rv = CKR_SIGNATURE_INVALID;
+        } else if ((fn & 1) || fn == sn) {
+            rv = merkle_hash(context, md, MERKLE_NODE_PREFIX, sibling, digest_length, root, digest_length, root);
+            while (0 == (fn & 1) && 0 != fn) {
+                fn >>= 1;
+                sn >>= 1;
+            }
+        } else {
+            rv = merkle_hash(context, md, MERKLE_NODE_PREFIX, root, digest_length, sibling, digest_length, root);
+        }
+        fn >>= 1;
+        sn >>= 1;
+    }
+    if (CKR_OK == rv && 0 != sn) {
+        rv = CKR_SIGNATURE_INVALID;
+    }
+
+    EVP_MD_CTX_free(context);
+    return rv;
+}
+
+/**
+ * Verify one message of a signed batch from its inclusion proof and the
+ * tree head signature, on the client.
+ * @param cache Public key cache, see verify_signature_locally
+ * @param session Session used to read the public key on a cache miss
+ * @param public_key
+ * @param mechanism Mechanism the batch was signed with
+ * @param message
+ * @param message_length
+ * @param index Index of the message in the batch
+ * @param tree_size Number of messages in the batch
+ * @param path Audit path from merkle_batch_proof
+ * @param path_hashes Number of hashes in the path
+ * @param signature Tree head signature
+ * @param signature_length
+ * @return CKR_SIGNATURE_INVALID if the message, proof or signature do not match, otherwise CK_RV
+ */
+CK_RV merkle_verify(struct verify_cache *cache,
+                    CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE public_key,
+                    CK_MECHANISM_TYPE mechanism,
+                    CK_BYTE_PTR message,
+                    CK_ULONG message_length,
+                    CK_ULONG index,
+                    CK_ULONG tree_size,
+                    CK_BYTE_PTR path,
+                    CK_ULONG path_hashes,
+                    CK_BYTE_PTR signature,
+                    CK_ULONG signature_length) {
+    CK_BYTE tree_head[MERKLE_TREE_HEAD_MAX_LENGTH];
+    CK_BYTE root[EVP_MAX_MD_SIZE];
+    CK_RV rv;
+
+    if ((!message && message_length) || (!path && path_hashes) || !signature) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (index >= tree_size || path_hashes > MERKLE_MAX_PROOF_HASHES) {
+        return CKR_SIGNATURE_INVALID;
+    }
+
+    const struct prehash *prehash = prehash_find(mechanism);
+    const EVP_MD *md = prehash ? prehash_md(prehash) : NULL;
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    rv = merkle_root_from_path(md, prehash->digest_length, message, message_length, index, tree_size,
+                               path, path_hashes, root);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    return verify_signature_locally(cache, session, public_key, mechanism, tree_head,
+                                    merkle_tree_head(tree_size, root, prehash->digest_length, tree_head),
+                                    signature, signature_length);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_MERKLE_SIGN_H
+#define AWS_CLOUDHSM_PKCS11_MERKLE_SIGN_H
+
+#include <openssl/evp.h>
+
+#include "common.h"
+#include "verify_cache.h"
+
+/*
+ * One HSM signature over a whole batch of messages.
+ *
+ * The messages are hashed locally into a Merkle tree with the layout of
+ * RFC 6962 section 2.1, using the hash of the signing mechanism:
+ *
+ *     leaf = HASH(0x00 || message)
+ *     node = HASH(0x01 || left || right)
+ *
+ * and the HSM signs, with the batch's mechanism, the tree head
+ *
+ *     "merkle-batch-v1" (15 bytes) || tree size (8 bytes, big-endian) || root
+ *
+ * The fixed context string keeps a batch signature from also being a valid
+ * signature over a record of the same length signed directly with the key.
+ *
+ * Each message is then covered by the tree head signature together with
+ * its inclusion proof: its index, the tree size and the audit path of
+ * RFC 6962 section 2.1.1. A verifier recomputes the root from the message
+ * and the proof, and checks the signature over the tree head, without the
+ * other messages of the batch.
+ */
+#define MERKLE_MAX_PROOF_HASHES 64
+#define MERKLE_TREE_HEAD_CONTEXT "merkle-batch-v1"
+
+struct merkle_batch {
+    CK_MECHANISM_TYPE mechanism;
+    CK_ULONG tree_size;
+    CK_ULONG digest_length;
+    CK_BYTE root[EVP_MAX_MD_SIZE];
+    CK_BYTE signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG signature_length;
+    // Every level of the tree, leaves first, from which proofs are read.
+    CK_ULONG level_count;
+    CK_BYTE_PTR levels[MERKLE_MAX_PROOF_HASHES + 1];
+    CK_ULONG level_sizes[MERKLE_MAX_PROOF_HASHES + 1];
+};
+
+CK_RV merkle_sign_batch(CK_SESSION_HANDLE session,
+                        CK_OBJECT_HANDLE key,
+                        CK_MECHANISM_TYPE mechanism,
+                        CK_BYTE_PTR *messages,
+                        CK_ULONG_PTR message_lengths,
+                        CK_ULONG count,
+                        struct merkle_batch **batch);
+
+CK_RV merkle_batch_proof(const struct merkle_batch *batch,
+                         CK_ULONG index,
+                         CK_BYTE_PTR path,
+                         CK_ULONG_PTR path_hashes);
+
+void merkle_batch_free(struct merkle_batch *batch);
+
+CK_RV merkle_verify(struct verify_cache *cache,
+                    CK_SESSION_HANDLE session,
+                    CK_OBJECT_HANDLE public_key,
+                    CK_MECHANISM_TYPE mechanism,
+                    CK_BYTE_PTR message,
+                    CK_ULONG message_length,
+                    CK_ULONG index,
+                    CK_ULONG tree_size,
+                    CK_BYTE_PTR path,
+                    CK_ULONG path_hashes,
+                    CK_BYTE_PTR signature,
+                    CK_ULONG signature_length);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+
+#include "prehash.h"
+
+// DigestInfo prefixes from RFC 8017 section 9.2, note 1.
+static const CK_BYTE sha1_digest_info[] = {
+        0x30, 0x21, 0x30, 0x09, 0x06, 0x05, 0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14
+};
+static const CK_BYTE sha224_digest_info[] = {
+        0x30, 0x2d, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00, 0x04, 0x1c
+};
+static const CK_BYTE sha256_digest_info[] = {
+        0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+static const CK_BYTE sha384_digest_info[] = {
+        0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00, 0x04, 0x30
+};
+static const CK_BYTE sha512_digest_info[] = {
+        0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00, 0x04, 0x40
+};
+
+#define DIGEST_INFO(prefix) prefix, sizeof(prefix)
+
+static const struct prehash prehashes[] = {
+        { CKM_ECDSA_SHA1,          CKM_ECDSA,        CKM_SHA_1,  0,               20, NULL, 0 },
+        { CKM_ECDSA_SHA224,        CKM_ECDSA,        CKM_SHA224, 0,               28, NULL, 0 },
+        { CKM_ECDSA_SHA256,        CKM_ECDSA,        CKM_SHA256, 0,               32, NULL, 0 },
+        { CKM_ECDSA_SHA384,        CKM_ECDSA,        CKM_SHA384, 0,               48, NULL, 0 },
+        { CKM_ECDSA_SHA512,        CKM_ECDSA,        CKM_SHA512, 0,               64, NULL, 0 },
+        { CKM_SHA1_RSA_PKCS_PSS,   CKM_RSA_PKCS_PSS, CKM_SHA_1,  CKG_MGF1_SHA1,   20, NULL, 0 },
+        { CKM_SHA224_RSA_PKCS_PSS, CKM_RSA_PKCS_PSS, CKM_SHA224, CKG_MGF1_SHA224, 28, NULL, 0 },
+        { CKM_SHA256_RSA_PKCS_PSS, CKM_RSA_PKCS_PSS, CKM_SHA256, CKG_MGF1_SHA256, 32, NULL, 0 },
+        { CKM_SHA384_RSA_PKCS_PSS, CKM_RSA_PKCS_PSS, CKM_SHA384, CKG_MGF1_SHA384, 48, NULL, 0 },
+        { CKM_SHA512_RSA_PKCS_PSS, CKM_RSA_PKCS_PSS, CKM_SHA512, CKG_MGF1_SHA512, 64, NULL, 0 },
+        { CKM_SHA1_RSA_PKCS,       CKM_RSA_PKCS,     CKM_SHA_1,  0,               20, DIGEST_INFO(sha1_digest_info) },
+        { CKM_SHA224_RSA_PKCS,     CKM_RSA_PKCS,     CKM_SHA224, 0,               28, DIGEST_INFO(sha224_digest_info) },
+        { CKM_SHA256_RSA_PKCS,     CKM_RSA_PKCS,     CKM_SHA256, 0,               32, DIGEST_INFO(sha256_digest_info) },
+        { CKM_SHA384_RSA_PKCS,     CKM_RSA_PKCS,     CKM_SHA384, 0,               48, DIGEST_INFO(sha384_digest_info) },
+        { CKM_SHA512_RSA_PKCS,     CKM_RSA_PKCS,     CKM_SHA512, 0,               64, DIGEST_INFO(sha512_digest_info) },
+};
+
+/**
+ * Look up how to sign with a combined mechanism after hashing locally.
+ * @param mechanism Combined hash and sign mechanism, such as CKM_ECDSA_SHA256
+ * @return NULL if the mechanism does not hash the message
+ */
+const struct prehash *prehash_find(CK_MECHANISM_TYPE mechanism) {
+    for (size_t i = 0; i < sizeof(prehashes) / sizeof(prehashes[0]); i++) {
+        if (prehashes[i].mechanism == mechanism) {
+            return &prehashes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Fill in the PSS parameters both the combined and the raw mechanism use:
+ * MGF1 with the message hash, and a salt as long as the digest.
+ * @param prehash
+ * @param params
+ */
+void prehash_pss_params(const struct prehash *prehash, CK_RSA_PKCS_PSS_PARAMS *params) {
+    params->hashAlg = prehash->hash;
+    params->mgf = prehash->mgf;
+    params->sLen = prehash->digest_length;
+}
+
+/**
+ * The OpenSSL digest which matches the hash of a mechanism.
+ * @param prehash
+ * @return NULL if OpenSSL does not provide the digest
+ */
+const EVP_MD *prehash_md(const struct prehash *prehash) {
+    switch (prehash->hash) {
+        case CKM_SHA_1:
+            return EVP_sha1();
+        case CKM_SHA224:
+            return EVP_sha224();
+        case CKM_SHA256:
+            return EVP_sha256();
+        case CKM_SHA384:
+            return EVP_sha384();
+        case CKM_SHA512:
+            return EVP_sha512();
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Sign a digest made locally with the raw mechanism matching a combined one.
+ * The signature is the one the combined mechanism would produce.
+ * @param session
+ * @param key
+ * @param prehash Entry for the combined mechanism, from prehash_find
+ * @param digest Digest of the message, prehash->digest_length bytes
+ * @param signature
+ * @param signature_length
+ * @return CK_RV
+ */
+CK_RV prehash_sign_digest(CK_SESSION_HANDLE session,
+                          CK_OBJECT_HANDLE key,
+                          const struct prehash *prehash,
+                          const CK_BYTE *digest,
+                          CK_BYTE_PTR signature,
+                          CK_ULONG_PTR signature_length) {
+    CK_RV rv;
+    CK_BYTE input[sizeof(sha512_digest_info) + EVP_MAX_MD_SIZE];
+    CK_ULONG prefix_length;
+    CK_RSA_PKCS_PSS_PARAMS pss_params;
+    CK_MECHANISM mech = { 0, NULL, 0 };
+
+    // CKM_RSA_PKCS signs the DER DigestInfo, the other raw mechanisms the bare digest.
+    prefix_length = prehash->digest_info_length;
+    if (prefix_length > 0) {
+        memcpy(input, prehash->digest_info, prefix_length);
+    }
+    memcpy(input + prefix_length, digest, prehash->digest_length);
+
+    mech.mechanism = prehash->raw_mechanism;
+    if (CKM_RSA_PKCS_PSS == prehash->raw_mechanism) {
+        prehash_pss_params(prehash, &pss_params);
+        mech.pParameter = &pss_params;
+        mech.ulParameterLen = sizeof(pss_params);
+    }
+
+    rv = funcs->C_SignInit(session, &mech, key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    return funcs->C_Sign(session, input, prefix_length + prehash->digest_length, signature, signature_length);
+}
+
+/**
+ * Hash data with OpenSSL, which uses the SHA extensions or vector
+ * instructions of the CPU where available, then sign the digest on the HSM.
+ * The signature is the one the combined mechanism would produce.
+ * @param session
+ * @param key
+ * @param mechanism Combined hash and sign mechanism, such as CKM_SHA256_RSA_PKCS_PSS
+ * @param data
+ * @param data_length
+ * @param signature
+ * @param signature_length
+ * @return CKR_MECHANISM_INVALID if the mechanism does not hash the message
+ */
+CK_RV prehash_sign(CK_SESSION_HANDLE session,
+                   CK_OBJECT_HANDLE key,
+                   CK_MECHANISM_TYPE mechanism,
+                   CK_BYTE_PTR data,
+                   CK_ULONG data_length,
+                   CK_BYTE_PTR signature,
+                   CK_ULONG_PTR signature_length) {
+    CK_BYTE digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+
+    const struct prehash *prehash = prehash_find(mechanism);
+    const EVP_MD *md = prehash ? prehash_md(prehash) : NULL;
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    if (1 != EVP_Digest(data, data_length, digest, &digest_length, md, NULL)) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    return prehash_sign_digest(session, key, prehash, digest, signature, signature_length);
+}
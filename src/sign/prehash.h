@@ -0,0 +1,63 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_PREHASH_H
+#define AWS_CLOUDHSM_PKCS11_PREHASH_H
+
+#include <openssl/evp.h>
+
+#include "common.h"
+
+/*
+ * Hash on the client, sign the digest on the HSM.
+ *
+ * A combined mechanism such as CKM_ECDSA_SHA512 sends the whole message to
+ * the HSM. Hashing locally and signing the digest with the matching raw
+ * mechanism (CKM_ECDSA, CKM_RSA_PKCS_PSS or CKM_RSA_PKCS) only sends the
+ * digest, and produces signatures which verify with the combined mechanism.
+ */
+struct prehash {
+    CK_MECHANISM_TYPE mechanism;        // Combined hash and sign mechanism
+    CK_MECHANISM_TYPE raw_mechanism;    // Mechanism which signs the digest
+    CK_MECHANISM_TYPE hash;
+    CK_RSA_PKCS_MGF_TYPE mgf;
+    CK_ULONG digest_length;
+    const CK_BYTE *digest_info;         // DER DigestInfo prefix for CKM_RSA_PKCS
+    CK_ULONG digest_info_length;
+};
+
+const struct prehash *prehash_find(CK_MECHANISM_TYPE mechanism);
+
+const EVP_MD *prehash_md(const struct prehash *prehash);
+
+void prehash_pss_params(const struct prehash *prehash, CK_RSA_PKCS_PSS_PARAMS *params);
+
+CK_RV prehash_sign_digest(CK_SESSION_HANDLE session,
+                          CK_OBJECT_HANDLE key,
+                          const struct prehash *prehash,
+                          const CK_BYTE *digest,
+                          CK_BYTE_PTR signature,
+                          CK_ULONG_PTR signature_length);
+
+CK_RV prehash_sign(CK_SESSION_HANDLE session,
+                   CK_OBJECT_HANDLE key,
+                   CK_MECHANISM_TYPE mechanism,
+                   CK_BYTE_PTR data,
+                   CK_ULONG data_length,
+                   CK_BYTE_PTR signature,
+                   CK_ULONG_PTR signature_length);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+
+#include "public_key.h"
+
+// Large enough for a 4096 bit modulus and any named curve point or parameters.
+#define MAX_PUBLIC_ATTRIBUTE_LENGTH 512
+
+static EVP_PKEY *rsa_public_key(CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent) {
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa = RSA_new();
+    BIGNUM *n = BN_bin2bn(modulus->pValue, (int) modulus->ulValueLen, NULL);
+    BIGNUM *e = BN_bin2bn(exponent->pValue, (int) exponent->ulValueLen, NULL);
+
+    if (rsa && n && e && 1 == RSA_set0_key(rsa, n, e, NULL)) {
+        n = NULL;
+        e = NULL;
+        pkey = EVP_PKEY_new();
+        if (pkey && 1 != EVP_PKEY_assign_RSA(pkey, rsa)) {
+            EVP_PKEY_free(pkey);
+            pkey = NULL;
+        } else if (pkey) {
+            rsa = NULL;
+        }
+    }
+
+    BN_free(n);
+    BN_free(e);
+    RSA_free(rsa);
+    return pkey;
+}
+
+/**
+ * CKA_EC_POINT holds the point as a DER OCTET STRING, though some libraries
+ * return the bare point; accept both.
+ */
+static EVP_PKEY *ec_public_key(CK_ATTRIBUTE_PTR params, CK_ATTRIBUTE_PTR point) {
+    EVP_PKEY *pkey = NULL;
+    EC_KEY *ec = NULL;
+    EC_GROUP *group = NULL;
+    EC_POINT *public_point = NULL;
+    ASN1_OCTET_STRING *octets = NULL;
+    const unsigned char *p = params->pValue;
+    const unsigned char *point_bytes = point->pValue;
+    size_t point_length = point->ulValueLen;
+
+    group = d2i_ECPKParameters(NULL, &p, (long) params->ulValueLen);
+    if (!group) {
+        goto done;
+    }
+
+    p = point->pValue;
+    octets = d2i_ASN1_OCTET_STRING(NULL, &p, (long) point->ulValueLen);
+    if (octets && p == (const unsigned char *) point->pValue + point->ulValueLen) {
+        point_bytes = ASN1_STRING_get0_data(octets);
+        point_length = (size_t) ASN1_STRING_length(octets);
+    }
+
+    ec = EC_KEY_new();
+    public_point = EC_POINT_new(group);
+    if (!ec || !public_point
+        || 1 != EC_KEY_set_group(ec, group)
+        || 1 != EC_POINT_oct2point(group, public_point, point_bytes, point_length, NULL)
+        || 1 != EC_KEY_set_public_key(ec, public_point)) {
+        goto done;
+    }
+
+    pkey = EVP_PKEY_new();
+    if (pkey && 1 != EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+        EVP_PKEY_free(pkey);
+        pkey = NULL;
+    } else if (pkey) {
+        ec = NULL;
+    }
+
+done:
+    ASN1_OCTET_STRING_free(octets);
+    EC_POINT_free(public_point);
+    EC_GROUP_free(group);
+    EC_KEY_free(ec);
+    return pkey;
+}
+
+/**
+ * Read the public components of a key from the HSM and build an OpenSSL key.
+ * @param session
+ * @param key Public key handle, or a private key handle whose public components are readable
+ * @param pkey Receives the key, which the caller frees with EVP_PKEY_free
+ * @return CKR_KEY_TYPE_INCONSISTENT for keys other than RSA and EC
+ */
+CK_RV public_key_fetch(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, EVP_PKEY **pkey) {
+    CK_RV rv;
+    CK_KEY_TYPE key_type = 0;
+    CK_BYTE first[MAX_PUBLIC_ATTRIBUTE_LENGTH];
+    CK_BYTE second[MAX_PUBLIC_ATTRIBUTE_LENGTH];
+
+    CK_ATTRIBUTE type_template[] = {
+            {CKA_KEY_TYPE, &key_type, sizeof(key_type)},
+    };
+    rv = funcs->C_GetAttributeValue(session, key, type_template, 1);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    CK_ATTRIBUTE template[] = {
+            {CKK_RSA == key_type ? CKA_MODULUS : CKA_EC_PARAMS,        first,  sizeof(first)},
+            {CKK_RSA == key_type ? CKA_PUBLIC_EXPONENT : CKA_EC_POINT, second, sizeof(second)},
+    };
+    if (CKK_RSA != key_type && CKK_EC != key_type) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    rv = funcs->C_GetAttributeValue(session, key, template, 2);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    *pkey = (CKK_RSA == key_type) ? rsa_public_key(&template[0], &template[1])
+                                  : ec_public_key(&template[0], &template[1]);
+    return *pkey ? CKR_OK : CKR_KEY_HANDLE_INVALID;
+}
+
+/**
+ * Read the public components of a key from the HSM and encode them as a DER
+ * SubjectPublicKeyInfo.
+ * @param session
+ * @param key Public key handle
+ * @param spki Receives the encoding, which the caller frees with OPENSSL_free
+ * @param spki_length
+ * @return CK_RV
+ */
+CK_RV public_key_spki(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, CK_BYTE_PTR *spki, CK_ULONG_PTR spki_length) {
+    EVP_PKEY *pkey = NULL;
+    unsigned char *der = NULL;
+    int length;
+
+    CK_RV rv = public_key_fetch(session, key, &pkey);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    length = i2d_PUBKEY(pkey, &der);
+    EVP_PKEY_free(pkey);
+    if (length <= 0) {
+        return CKR_HOST_MEMORY;
+    }
+
+    *spki = der;
+    *spki_length = (CK_ULONG) length;
+    return CKR_OK;
+}
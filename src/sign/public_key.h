@@ -0,0 +1,31 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_PUBLIC_KEY_H
+#define AWS_CLOUDHSM_PKCS11_PUBLIC_KEY_H
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "common.h"
+
+/*
+ * RSA and EC public keys read from the HSM into OpenSSL.
+ */
+CK_RV public_key_fetch(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, EVP_PKEY **pkey);
+CK_RV public_key_spki(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key, CK_BYTE_PTR *spki, CK_ULONG_PTR spki_length);
+
+#endif
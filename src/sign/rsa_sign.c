@@ -47,7 +47,7 @@ CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
             {CKA_SIGN, &true_val, sizeof(CK_BBOOL)},
     };
 
-    rv = funcs->C_GenerateKeyPair(session,
+    rv = pkcs11_generate_key_pair(session,
                                   &mech,
                                   public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
                                   private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
@@ -76,7 +76,7 @@ CK_RV rsa_sign_verify(CK_SESSION_HANDLE session) {
     CK_MECHANISM_TYPE mechanism = CKM_SHA512_RSA_PKCS;
 
     rv = generate_signature(session, signing_private_key, mechanism,
-                            data, data_length, signature, &signature_length);
+                            data, data_length, signature, &signature_length, CK_FALSE);
     if (CKR_OK == rv) {
         unsigned char *hex_signature = NULL;
         bytes_to_new_hexstring(signature, signature_length, &hex_signature);
@@ -103,6 +103,26 @@ CK_RV rsa_sign_verify(CK_SESSION_HANDLE session) {
         return rv;
     }
 
+#ifdef SIGN_HASH_LOCALLY
+    // Hash the data locally and have the HSM sign only the DigestInfo with CKM_RSA_PKCS.
+    // PKCS #1 v1.5 signatures are deterministic, so both signatures are identical.
+    CK_BYTE local_hash_signature[MAX_SIGNATURE_LENGTH];
+    CK_ULONG local_hash_signature_length = MAX_SIGNATURE_LENGTH;
+    rv = generate_signature(session, signing_private_key, mechanism,
+                            data, data_length, local_hash_signature, &local_hash_signature_length, CK_TRUE);
+    if (CKR_OK != rv) {
+        printf("Signature generation over a local hash failed: %lu\n", rv);
+        return rv;
+    }
+
+    if (local_hash_signature_length != signature_length
+        || 0 != memcmp(local_hash_signature, signature, signature_length)) {
+        printf("Signature over a local hash differs from the HSM's signature\n");
+        return CKR_GENERAL_ERROR;
+    }
+    printf("Signature over a local hash is identical\n");
+#endif
+
     return CKR_OK;
 }
 
@@ -126,7 +146,7 @@ CK_RV multi_part_rsa_sign_verify(CK_SESSION_HANDLE session) {
     CK_MECHANISM_TYPE mechanism = CKM_SHA512_RSA_PKCS;
 
     rv = multi_part_generate_signature(session, signing_private_key, mechanism,
-                                       data, data_length, signature, &signature_length);
+                                       data, data_length, signature, &signature_length, CK_FALSE);
     if (CKR_OK == rv) {
         unsigned char *hex_signature = NULL;
         bytes_to_new_hexstring(signature, signature_length, &hex_signature);
@@ -153,5 +173,27 @@ CK_RV multi_part_rsa_sign_verify(CK_SESSION_HANDLE session) {
         return EXIT_FAILURE;
     }
 
+#ifdef SIGN_HASH_LOCALLY
+    // Hash locally and sign the digest with CKM_RSA_PKCS_PSS. The signature
+    // verifies with CKM_SHA256_RSA_PKCS_PSS and the same PSS parameters.
+    mechanism = CKM_SHA256_RSA_PKCS_PSS;
+    signature_length = MAX_SIGNATURE_LENGTH;
+    rv = multi_part_generate_signature(session, signing_private_key, mechanism,
+                                       data, data_length, signature, &signature_length, CK_TRUE);
+    if (CKR_OK != rv) {
+        printf("PSS signature generation over a local hash failed: %lu\n", rv);
+        return rv;
+    }
+
+    rv = multi_part_verify_signature(session, signing_public_key, mechanism,
+                                     data, data_length, signature, signature_length);
+    if (CKR_OK == rv) {
+        printf("Verification of the PSS signature over a local hash successful\n");
+    } else {
+        printf("Verification of the PSS signature over a local hash failed: %lu\n", rv);
+        return EXIT_FAILURE;
+    }
+#endif
+
     return CKR_OK;
 }
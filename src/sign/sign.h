@@ -11,13 +11,25 @@ CK_RV rsa_sign_verify(CK_SESSION_HANDLE session);
 CK_RV ec_sign_verify(CK_SESSION_HANDLE session);
 CK_RV multi_part_rsa_sign_verify(CK_SESSION_HANDLE session);
 CK_RV multi_part_ec_sign_verify(CK_SESSION_HANDLE session);
+CK_RV generate_ec_keypair(CK_SESSION_HANDLE session,
+                          CK_BYTE_PTR named_curve_oid,
+                          CK_ULONG named_curve_oid_len,
+                          CK_OBJECT_HANDLE_PTR public_key,
+                          CK_OBJECT_HANDLE_PTR private_key);
+CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
+                           CK_ULONG key_length_bits,
+                           CK_OBJECT_HANDLE_PTR public_key,
+                           CK_OBJECT_HANDLE_PTR private_key);
+// hash_locally needs a build with prehash.c and SIGN_HASH_LOCALLY defined;
+// otherwise it fails with CKR_FUNCTION_NOT_SUPPORTED.
 CK_RV generate_signature(CK_SESSION_HANDLE session,
                          CK_OBJECT_HANDLE key,
                          CK_MECHANISM_TYPE mechanism,
                          CK_BYTE_PTR data,
                          CK_ULONG data_length,
                          CK_BYTE_PTR signature,
-                         CK_ULONG_PTR signature_length);
+                         CK_ULONG_PTR signature_length,
+                         CK_BBOOL hash_locally);
 CK_RV verify_signature(CK_SESSION_HANDLE session,
                        CK_OBJECT_HANDLE key,
                        CK_MECHANISM_TYPE mechanism,
@@ -31,7 +43,18 @@ CK_RV multi_part_generate_signature(CK_SESSION_HANDLE session,
                                     CK_BYTE_PTR data,
                                     CK_ULONG data_length,
                                     CK_BYTE_PTR signature,
-                                    CK_ULONG_PTR signature_length);
+                                    CK_ULONG_PTR signature_length,
+                                    CK_BBOOL hash_locally);
+#ifndef _WIN32
+CK_RV multi_part_generate_file_signature(CK_SESSION_HANDLE session,
+                                         CK_OBJECT_HANDLE key,
+                                         CK_MECHANISM_TYPE mechanism,
+                                         const char *path,
+                                         CK_ULONG window_size,
+                                         CK_BYTE_PTR signature,
+                                         CK_ULONG_PTR signature_length,
+                                         CK_BBOOL hash_locally);
+#endif
 CK_RV multi_part_verify_signature(CK_SESSION_HANDLE session,
                                   CK_OBJECT_HANDLE key,
                                   CK_MECHANISM_TYPE mechanism,
@@ -0,0 +1,530 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "sign_engine.h"
+#include "output_length.h"
+
+struct sign_request {
+    CK_OBJECT_HANDLE key;
+    CK_MECHANISM mechanism;
+    CK_BYTE_PTR data;
+    CK_ULONG data_length;
+    sign_engine_callback callback;
+    void *context;
+    CK_BBOOL stop;
+};
+
+/*
+ * Bounded multi-producer multi-consumer ring. Each cell carries a sequence
+ * number which tells producers and consumers whose turn it is, so both
+ * sides claim a position with one compare-and-swap and never take a lock.
+ */
+struct sign_cell {
+    atomic_size_t sequence;
+    struct sign_request request;
+};
+
+struct sign_worker {
+    pthread_t thread;
+    struct sign_engine *engine;
+    CK_SESSION_HANDLE session;
+    CK_BYTE_PTR signature;
+    CK_ULONG signature_capacity;
+};
+
+struct sign_engine {
+    struct session_pool *pool;
+
+    struct sign_cell *cells;
+    size_t mask;
+    atomic_size_t enqueue_position;
+    atomic_size_t dequeue_position;
+
+    // Free cells for producers and queued requests for workers, so either
+    // side can sleep without polling the ring.
+    sem_t free_cells;
+    sem_t queued;
+
+    struct sign_worker *workers;
+    CK_ULONG worker_count;
+
+    atomic_ulong submitted;
+    atomic_ulong started;
+    atomic_ulong completed;
+    atomic_ulong failed;
+
+    // Wakes sign_engine_flush when requests complete.
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    atomic_int flushing;
+};
+
+struct sign_future {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    CK_BBOOL done;
+    CK_RV rv;
+    CK_BYTE_PTR signature;
+    CK_ULONG signature_length;
+};
+
+static void sign_sem_wait(sem_t *sem) {
+    while (0 != sem_wait(sem) && EINTR == errno) {
+    }
+}
+
+static CK_BBOOL sign_queue_push(struct sign_engine *engine, const struct sign_request *request) {
+    size_t position = atomic_load_explicit(&engine->enqueue_position, memory_order_relaxed);
+    struct sign_cell *cell;
+
+    for (;;) {
+        cell = &engine->cells[position & engine->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+        if (0 == difference) {
+            if (atomic_compare_exchange_weak_explicit(&engine->enqueue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return CK_FALSE;
+        } else {
+            position = atomic_load_explicit(&engine->enqueue_position, memory_order_relaxed);
+        }
+    }
+
+    cell->request = *request;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+    return CK_TRUE;
+}
+
+static CK_BBOOL sign_queue_pop(struct sign_engine *engine, struct sign_request *request) {
+    size_t position = atomic_load_explicit(&engine->dequeue_position, memory_order_relaxed);
+    struct sign_cell *cell;
+
+    for (;;) {
+        cell = &engine->cells[position & engine->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+
+        if (0 == difference) {
+            if (atomic_compare_exchange_weak_explicit(&engine->dequeue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return CK_FALSE;
+        } else {
+            position = atomic_load_explicit(&engine->dequeue_position, memory_order_relaxed);
+        }
+    }
+
+    *request = cell->request;
+    atomic_store_explicit(&cell->sequence, position + engine->mask + 1, memory_order_release);
+    return CK_TRUE;
+}
+
+/**
+ * Queue a request, waiting for a free cell if the queue is full.
+ */
+static void sign_engine_enqueue(struct sign_engine *engine, const struct sign_request *request) {
+    sign_sem_wait(&engine->free_cells);
+
+    // A free cell is reserved for us, so the push only fails while another
+    // producer is between claiming and publishing the cell ahead of it.
+    while (!sign_queue_push(engine, request)) {
+        sched_yield();
+    }
+    sem_post(&engine->queued);
+}
+
+static void sign_engine_dequeue(struct sign_engine *engine, struct sign_request *request) {
+    sign_sem_wait(&engine->queued);
+
+    // The request we were counted for may be published after one queued
+    // behind it, so wait for the head cell to be filled.
+    while (!sign_queue_pop(engine, request)) {
+        sched_yield();
+    }
+    sem_post(&engine->free_cells);
+}
+
+static void sign_worker_complete(struct sign_engine *engine, struct sign_request *request, CK_RV rv,
+                                 CK_BYTE_PTR signature, CK_ULONG signature_length) {
+    if (CKR_OK != rv) {
+        atomic_fetch_add(&engine->failed, 1);
+    }
+    request->callback(request->context, rv, signature, signature_length);
+
+    atomic_fetch_add(&engine->completed, 1);
+    if (atomic_load(&engine->flushing)) {
+        pthread_mutex_lock(&engine->lock);
+        pthread_cond_broadcast(&engine->idle);
+        pthread_mutex_unlock(&engine->lock);
+    }
+}
+
+static void *sign_worker_run(void *arg) {
+    struct sign_worker *worker = arg;
+    struct sign_engine *engine = worker->engine;
+    struct sign_request request;
+
+    for (;;) {
+        CK_ULONG signature_length = 0;
+        CK_RV rv;
+
+        sign_engine_dequeue(engine, &request);
+        if (request.stop) {
+            break;
+        }
+        atomic_fetch_add(&engine->started, 1);
+
+        rv = funcs->C_SignInit(worker->session, &request.mechanism, request.key);
+        if (CKR_OK == rv) {
+            rv = pkcs11_single_part(funcs->C_Sign, worker->session, request.data, request.data_length,
+                                    &worker->signature, &worker->signature_capacity, &signature_length);
+        }
+
+        sign_worker_complete(engine, &request, rv, worker->signature, signature_length);
+    }
+
+    return NULL;
+}
+
+static void sign_future_complete(void *context, CK_RV rv, CK_BYTE_PTR signature, CK_ULONG signature_length) {
+    struct sign_future *future = context;
+
+    if (CKR_OK == rv) {
+        future->signature = malloc(signature_length ? signature_length : 1);
+        if (NULL == future->signature) {
+            rv = CKR_HOST_MEMORY;
+        } else {
+            memcpy(future->signature, signature, signature_length);
+            future->signature_length = signature_length;
+        }
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->rv = rv;
+    future->done = CK_TRUE;
+    pthread_cond_broadcast(&future->done_cond);
+    pthread_mutex_unlock(&future->lock);
+}
+
+/**
+ * Start an engine with the given number of workers.
+ * Each worker checks a session out of the pool for the lifetime of the engine.
+ * @param pool Session pool with room for at least workers sessions
+ * @param workers Number of worker threads and sessions
+ * @param queue_capacity Number of requests which may be queued before
+ * sign_engine_submit waits. Rounded up to a power of two.
+ * @param engine Location where the new engine will be written
+ * @return CK_RV
+ */
+CK_RV sign_engine_create(struct session_pool *pool,
+                         CK_ULONG workers,
+                         CK_ULONG queue_capacity,
+                         struct sign_engine **engine) {
+    CK_RV rv = CKR_OK;
+    struct sign_engine *new_engine;
+    size_t capacity = 1;
+    CK_ULONG started = 0;
+
+    if (!pool || !engine || 0 == workers || 0 == queue_capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // The stop requests for the workers need a cell each.
+    while (capacity < queue_capacity || capacity < workers) {
+        capacity <<= 1;
+    }
+
+    new_engine = calloc(1, sizeof(struct sign_engine));
+    if (NULL == new_engine) {
+        return CKR_HOST_MEMORY;
+    }
+    new_engine->cells = calloc(capacity, sizeof(struct sign_cell));
+    new_engine->workers = calloc(workers, sizeof(struct sign_worker));
+    if (NULL == new_engine->cells || NULL == new_engine->workers) {
+        free(new_engine->cells);
+        free(new_engine->workers);
+        free(new_engine);
+        return CKR_HOST_MEMORY;
+    }
+
+    new_engine->pool = pool;
+    new_engine->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&new_engine->cells[i].sequence, i);
+    }
+    atomic_init(&new_engine->enqueue_position, 0);
+    atomic_init(&new_engine->dequeue_position, 0);
+    atomic_init(&new_engine->submitted, 0);
+    atomic_init(&new_engine->started, 0);
+    atomic_init(&new_engine->completed, 0);
+    atomic_init(&new_engine->failed, 0);
+    atomic_init(&new_engine->flushing, 0);
+    sem_init(&new_engine->free_cells, 0, (unsigned int) capacity);
+    sem_init(&new_engine->queued, 0, 0);
+    pthread_mutex_init(&new_engine->lock, NULL);
+    pthread_cond_init(&new_engine->idle, NULL);
+
+    for (CK_ULONG i = 0; i < workers; i++) {
+        struct sign_worker *worker = &new_engine->workers[i];
+
+        worker->engine = new_engine;
+        worker->signature_capacity = PKCS11_MAX_RSA_MODULUS_BYTES;
+        rv = session_pool_acquire(pool, &worker->session);
+        if (CKR_OK != rv) {
+            fprintf(stderr, "Failed to acquire a session for signing worker %lu: %lu\n", i, rv);
+            break;
+        }
+        if (0 != pthread_create(&worker->thread, NULL, sign_worker_run, worker)) {
+            session_pool_release(pool, worker->session);
+            rv = CKR_GENERAL_ERROR;
+            break;
+        }
+        new_engine->worker_count = ++started;
+    }
+
+    if (CKR_OK != rv) {
+        sign_engine_destroy(new_engine);
+        return rv;
+    }
+
+    *engine = new_engine;
+    return CKR_OK;
+}
+
+/**
+ * Queue a request to sign data. Waits if the queue is full.
+ * The mechanism is copied, but its parameter and the data must stay valid
+ * until the callback runs.
+ * @param engine
+ * @param key Private key, or secret key for MAC mechanisms
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param callback Called on a worker thread with the result
+ * @param context Passed to the callback
+ * @return CK_RV
+ */
+CK_RV sign_engine_submit(struct sign_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_MECHANISM_PTR mechanism,
+                         CK_BYTE_PTR data,
+                         CK_ULONG data_length,
+                         sign_engine_callback callback,
+                         void *context) {
+    struct sign_request request;
+
+    if (!engine || !mechanism || !callback || (!data && data_length > 0)) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    request.key = key;
+    request.mechanism = *mechanism;
+    request.data = data;
+    request.data_length = data_length;
+    request.callback = callback;
+    request.context = context;
+    request.stop = CK_FALSE;
+
+    atomic_fetch_add(&engine->submitted, 1);
+    sign_engine_enqueue(engine, &request);
+    return CKR_OK;
+}
+
+/**
+ * Queue a request to sign data and return a future for its signature.
+ * The mechanism parameter and the data must stay valid until the future completes.
+ * @param engine
+ * @param key
+ * @param mechanism
+ * @param data
+ * @param data_length
+ * @param future Receives a future which must be freed with sign_future_free
+ * @return CK_RV
+ */
+CK_RV sign_engine_submit_future(struct sign_engine *engine,
+                                CK_OBJECT_HANDLE key,
+                                CK_MECHANISM_PTR mechanism,
+                                CK_BYTE_PTR data,
+                                CK_ULONG data_length,
+                                struct sign_future **future) {
+    CK_RV rv;
+    struct sign_future *new_future;
+
+    if (!future) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_future = calloc(1, sizeof(struct sign_future));
+    if (NULL == new_future) {
+        return CKR_HOST_MEMORY;
+    }
+    pthread_mutex_init(&new_future->lock, NULL);
+    pthread_cond_init(&new_future->done_cond, NULL);
+
+    rv = sign_engine_submit(engine, key, mechanism, data, data_length, sign_future_complete, new_future);
+    if (CKR_OK != rv) {
+        sign_future_free(new_future);
+        return rv;
+    }
+
+    *future = new_future;
+    return CKR_OK;
+}
+
+/**
+ * Wait for a future to complete.
+ * @param future
+ * @param signature Receives the signature, which is owned by the future
+ * @param signature_length
+ * @return Result of the signing operation
+ */
+CK_RV sign_future_wait(struct sign_future *future, CK_BYTE_PTR *signature, CK_ULONG_PTR signature_length) {
+    CK_RV rv;
+
+    if (!future) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        pthread_cond_wait(&future->done_cond, &future->lock);
+    }
+    rv = future->rv;
+    pthread_mutex_unlock(&future->lock);
+
+    if (signature) {
+        *signature = future->signature;
+    }
+    if (signature_length) {
+        *signature_length = future->signature_length;
+    }
+    return rv;
+}
+
+/**
+ * Free a future. Waits for it to complete first, since the worker still
+ * holds a pointer to it until then.
+ * @param future
+ */
+void sign_future_free(struct sign_future *future) {
+    if (!future) {
+        return;
+    }
+
+    sign_future_wait(future, NULL, NULL);
+    pthread_cond_destroy(&future->done_cond);
+    pthread_mutex_destroy(&future->lock);
+    free(future->signature);
+    free(future);
+}
+
+/**
+ * Wait until every request submitted before the call has completed.
+ * @param engine
+ */
+void sign_engine_flush(struct sign_engine *engine) {
+    CK_ULONG target;
+
+    if (!engine) {
+        return;
+    }
+
+    target = atomic_load(&engine->submitted);
+
+    pthread_mutex_lock(&engine->lock);
+    atomic_fetch_add(&engine->flushing, 1);
+    while (atomic_load(&engine->completed) < target) {
+        pthread_cond_wait(&engine->idle, &engine->lock);
+    }
+    atomic_fetch_sub(&engine->flushing, 1);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/**
+ * Read the engine's counters. The values are read one at a time while the
+ * workers run, so they are a close snapshot rather than an exact one.
+ * @param engine
+ * @param stats
+ */
+void sign_engine_stats(struct sign_engine *engine, struct sign_engine_stats *stats) {
+    CK_ULONG submitted;
+    CK_ULONG started;
+    CK_ULONG completed;
+
+    if (!engine || !stats) {
+        return;
+    }
+
+    // Read in the order the counters are updated, so no difference is negative.
+    completed = atomic_load(&engine->completed);
+    started = atomic_load(&engine->started);
+    submitted = atomic_load(&engine->submitted);
+
+    stats->queue_depth = submitted - started;
+    stats->in_flight = started - completed;
+    stats->submitted = submitted;
+    stats->completed = completed;
+    stats->failed = atomic_load(&engine->failed);
+}
+
+/**
+ * Complete every queued request, stop the workers and return their sessions to the pool.
+ * @param engine
+ */
+void sign_engine_destroy(struct sign_engine *engine) {
+    struct sign_request stop = { 0 };
+
+    if (!engine) {
+        return;
+    }
+
+    // Each worker takes one stop request after the requests queued ahead of it.
+    stop.stop = CK_TRUE;
+    for (CK_ULONG i = 0; i < engine->worker_count; i++) {
+        sign_engine_enqueue(engine, &stop);
+    }
+    for (CK_ULONG i = 0; i < engine->worker_count; i++) {
+        pthread_join(engine->workers[i].thread, NULL);
+        session_pool_release(engine->pool, engine->workers[i].session);
+        free(engine->workers[i].signature);
+    }
+
+    pthread_cond_destroy(&engine->idle);
+    pthread_mutex_destroy(&engine->lock);
+    sem_destroy(&engine->queued);
+    sem_destroy(&engine->free_cells);
+    free(engine->workers);
+    free(engine->cells);
+    free(engine);
+}
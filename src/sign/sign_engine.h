@@ -0,0 +1,81 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_SIGN_ENGINE_H
+#define AWS_CLOUDHSM_PKCS11_SIGN_ENGINE_H
+
+#include "common.h"
+#include "session_pool.h"
+
+/*
+ * Batch signing engine.
+ *
+ * Callers queue (key, mechanism, data) requests and a fixed set of worker
+ * threads signs them, each on its own session from a session pool. The
+ * queue is a bounded lock-free ring, so submitting from many threads does
+ * not serialize on a lock. Workers drain the queue back to back and only
+ * sleep when it is empty, which keeps every session busy under load.
+ *
+ * A request completes either through a callback, which runs on the worker
+ * thread, or through a future the caller waits on.
+ */
+struct sign_engine;
+struct sign_future;
+
+/**
+ * Called on a worker thread when a request completes.
+ * The signature is only valid until the callback returns.
+ */
+typedef void (*sign_engine_callback)(void *context, CK_RV rv,
+                                     CK_BYTE_PTR signature, CK_ULONG signature_length);
+
+struct sign_engine_stats {
+    CK_ULONG queue_depth;   // Submitted and not yet picked up by a worker
+    CK_ULONG in_flight;     // Picked up by a worker and not yet completed
+    CK_ULONG submitted;
+    CK_ULONG completed;
+    CK_ULONG failed;
+};
+
+CK_RV sign_engine_create(struct session_pool *pool,
+                         CK_ULONG workers,
+                         CK_ULONG queue_capacity,
+                         struct sign_engine **engine);
+
+CK_RV sign_engine_submit(struct sign_engine *engine,
+                         CK_OBJECT_HANDLE key,
+                         CK_MECHANISM_PTR mechanism,
+                         CK_BYTE_PTR data,
+                         CK_ULONG data_length,
+                         sign_engine_callback callback,
+                         void *context);
+
+CK_RV sign_engine_submit_future(struct sign_engine *engine,
+                                CK_OBJECT_HANDLE key,
+                                CK_MECHANISM_PTR mechanism,
+                                CK_BYTE_PTR data,
+                                CK_ULONG data_length,
+                                struct sign_future **future);
+
+CK_RV sign_future_wait(struct sign_future *future, CK_BYTE_PTR *signature, CK_ULONG_PTR signature_length);
+void sign_future_free(struct sign_future *future);
+
+void sign_engine_flush(struct sign_engine *engine);
+void sign_engine_stats(struct sign_engine *engine, struct sign_engine_stats *stats);
+
+void sign_engine_destroy(struct sign_engine *engine);
+
+#endif
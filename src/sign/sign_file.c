@@ -0,0 +1,156 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "sign.h"
+#include "mapped_file.h"
+#include "latency_histogram.h"
+
+#define SAMPLE_FILE_SIZE (64 * 1024 * 1024)
+#define SAMPLE_WRITE_SIZE (1024 * 1024)
+
+/**
+ * Write SAMPLE_FILE_SIZE bytes to a new temporary file, standing in for a
+ * release artifact.
+ * @param path Template for mkstemp, replaced with the file's name
+ * @return CK_RV
+ */
+static CK_RV write_sample_file(char *path) {
+    CK_BYTE_PTR block = malloc(SAMPLE_WRITE_SIZE);
+    CK_RV rv = CKR_OK;
+    int fd;
+
+    if (NULL == block) {
+        return CKR_HOST_MEMORY;
+    }
+    for (size_t i = 0; i < SAMPLE_WRITE_SIZE; i++) {
+        block[i] = (CK_BYTE) (i * 131 + 17);
+    }
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        free(block);
+        return CKR_FUNCTION_FAILED;
+    }
+    for (size_t written = 0; written < SAMPLE_FILE_SIZE && CKR_OK == rv; written += SAMPLE_WRITE_SIZE) {
+        if (SAMPLE_WRITE_SIZE != write(fd, block, SAMPLE_WRITE_SIZE)) {
+            perror("write");
+            rv = CKR_FUNCTION_FAILED;
+        }
+    }
+
+    close(fd);
+    free(block);
+    return rv;
+}
+
+/**
+ * Sign a file by streaming it to the HSM and by hashing it locally. Both
+ * give the same RSA PKCS #1 v1.5 signature.
+ * @param session Active PKCS#11 session
+ * @return CK_RV
+ */
+CK_RV sign_file_sample(CK_SESSION_HANDLE session) {
+    char path[] = "/tmp/hsm_sign_XXXXXX";
+    CK_OBJECT_HANDLE public_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE private_key = CK_INVALID_HANDLE;
+    CK_BYTE streamed[MAX_SIGNATURE_LENGTH];
+    CK_BYTE prehashed[MAX_SIGNATURE_LENGTH];
+    CK_ULONG streamed_length = sizeof(streamed);
+    CK_ULONG prehashed_length = sizeof(prehashed);
+    struct rusage usage;
+    CK_RV rv;
+
+    rv = generate_rsa_keypair(session, 2048, &public_key, &private_key);
+    if (CKR_OK != rv) {
+        printf("RSA key generation failed: %lu\n", rv);
+        return rv;
+    }
+
+    rv = write_sample_file(path);
+    if (CKR_OK != rv) {
+        goto done;
+    }
+
+    uint64_t start = latency_now_ns();
+    rv = multi_part_generate_file_signature(session, private_key, CKM_SHA256_RSA_PKCS, path, 0,
+                                            streamed, &streamed_length, CK_FALSE);
+    if (CKR_OK != rv) {
+        printf("Signing the file on the HSM failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Streamed to the HSM in %d byte windows: %.1f ms\n", MAPPED_FILE_DEFAULT_WINDOW,
+           (latency_now_ns() - start) / 1e6);
+
+    start = latency_now_ns();
+    rv = multi_part_generate_file_signature(session, private_key, CKM_SHA256_RSA_PKCS, path, 0,
+                                            prehashed, &prehashed_length, CK_TRUE);
+    if (CKR_OK != rv) {
+        printf("Signing the file's local digest failed: %lu\n", rv);
+        goto done;
+    }
+    printf("Hashed locally: %.1f ms\n", (latency_now_ns() - start) / 1e6);
+
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS for a %d MiB file: %ld KiB\n", SAMPLE_FILE_SIZE / (1024 * 1024), usage.ru_maxrss);
+
+    if (streamed_length != prehashed_length || 0 != memcmp(streamed, prehashed, streamed_length)) {
+        printf("The signatures differ\n");
+        rv = CKR_GENERAL_ERROR;
+    }
+
+done:
+    unlink(path);
+    funcs->C_DestroyObject(session, public_key);
+    funcs->C_DestroyObject(session, private_key);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+    CK_RV rv;
+    CK_SESSION_HANDLE session;
+    int rc = EXIT_FAILURE;
+
+    struct pkcs_arguments args = {0};
+    if (get_pkcs_args(argc, argv, &args) < 0) {
+        return rc;
+    }
+
+    rv = pkcs11_initialize(args.library);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    rv = pkcs11_open_session(args.pin, &session);
+    if (CKR_OK != rv) {
+        return rc;
+    }
+
+    printf("\nSign a file with RSA\n");
+    if (CKR_OK == sign_file_sample(session)) {
+        rc = EXIT_SUCCESS;
+    }
+
+    pkcs11_finalize_session(session);
+
+    return rc;
+}
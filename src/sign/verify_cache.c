@@ -0,0 +1,293 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+#include "verify_cache.h"
+#include "prehash.h"
+#include "public_key.h"
+
+#define VERIFY_CACHE_BUCKETS 256
+
+struct verify_cache_entry {
+    CK_OBJECT_HANDLE key;
+    EVP_PKEY *pkey;
+    struct verify_cache_entry *next;
+};
+
+struct verify_cache {
+    pthread_rwlock_t lock;
+    struct verify_cache_entry *buckets[VERIFY_CACHE_BUCKETS];
+};
+
+static struct verify_cache_entry **verify_cache_bucket(struct verify_cache *cache, CK_OBJECT_HANDLE key) {
+    return &cache->buckets[(key * 0x9e3779b1u) % VERIFY_CACHE_BUCKETS];
+}
+
+/**
+ * Create an empty cache of public keys.
+ * @param cache Location where the new cache will be written
+ * @return CK_RV
+ */
+CK_RV verify_cache_create(struct verify_cache **cache) {
+    struct verify_cache *new_cache;
+
+    if (!cache) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    new_cache = calloc(1, sizeof(struct verify_cache));
+    if (NULL == new_cache) {
+        return CKR_HOST_MEMORY;
+    }
+    if (0 != pthread_rwlock_init(&new_cache->lock, NULL)) {
+        free(new_cache);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *cache = new_cache;
+    return CKR_OK;
+}
+
+/**
+ * Forget the cached public key of a handle.
+ * @param cache
+ * @param key
+ */
+void verify_cache_invalidate(struct verify_cache *cache, CK_OBJECT_HANDLE key) {
+    struct verify_cache_entry **link;
+    struct verify_cache_entry *removed = NULL;
+
+    if (!cache) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&cache->lock);
+    for (link = verify_cache_bucket(cache, key); *link; link = &(*link)->next) {
+        if ((*link)->key == key) {
+            removed = *link;
+            *link = removed->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (removed) {
+        EVP_PKEY_free(removed->pkey);
+        free(removed);
+    }
+}
+
+/**
+ * Free the cache and every key in it.
+ * @param cache
+ */
+void verify_cache_destroy(struct verify_cache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    for (size_t i = 0; i < VERIFY_CACHE_BUCKETS; i++) {
+        struct verify_cache_entry *entry = cache->buckets[i];
+        while (entry) {
+            struct verify_cache_entry *next = entry->next;
+            EVP_PKEY_free(entry->pkey);
+            free(entry);
+            entry = next;
+        }
+    }
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache);
+}
+
+/**
+ * Find the cached key for a handle, reading it from the HSM on a miss.
+ * The caller owns a reference to the returned key.
+ */
+static CK_RV verify_cache_get(struct verify_cache *cache, CK_SESSION_HANDLE session,
+                              CK_OBJECT_HANDLE key, EVP_PKEY **pkey) {
+    CK_RV rv;
+    struct verify_cache_entry *entry;
+    struct verify_cache_entry *added;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    for (entry = *verify_cache_bucket(cache, key); entry; entry = entry->next) {
+        if (entry->key == key) {
+            EVP_PKEY_up_ref(entry->pkey);
+            *pkey = entry->pkey;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    if (entry) {
+        return CKR_OK;
+    }
+
+    // Several threads may miss at once; the first one to insert wins.
+    added = calloc(1, sizeof(struct verify_cache_entry));
+    if (NULL == added) {
+        return CKR_HOST_MEMORY;
+    }
+    rv = public_key_fetch(session, key, &added->pkey);
+    if (CKR_OK != rv) {
+        free(added);
+        return rv;
+    }
+    added->key = key;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    for (entry = *verify_cache_bucket(cache, key); entry; entry = entry->next) {
+        if (entry->key == key) {
+            break;
+        }
+    }
+    if (!entry) {
+        added->next = *verify_cache_bucket(cache, key);
+        *verify_cache_bucket(cache, key) = added;
+        entry = added;
+        added = NULL;
+    }
+    EVP_PKEY_up_ref(entry->pkey);
+    *pkey = entry->pkey;
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (added) {
+        EVP_PKEY_free(added->pkey);
+        free(added);
+    }
+    return CKR_OK;
+}
+
+/**
+ * PKCS#11 ECDSA signatures are r || s; OpenSSL verifies a DER ECDSA-Sig-Value.
+ */
+static CK_RV ecdsa_signature_der(CK_BYTE_PTR signature, CK_ULONG signature_length,
+                                 unsigned char **der, int *der_length) {
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    BIGNUM *r = BN_bin2bn(signature, (int) (signature_length / 2), NULL);
+    BIGNUM *s = BN_bin2bn(signature + signature_length / 2, (int) (signature_length / 2), NULL);
+
+    *der = NULL;
+    if (sig && r && s && 1 == ECDSA_SIG_set0(sig, r, s)) {
+        r = NULL;
+        s = NULL;
+        *der_length = i2d_ECDSA_SIG(sig, der);
+    }
+
+    BN_free(r);
+    BN_free(s);
+    ECDSA_SIG_free(sig);
+    return (*der && *der_length > 0) ? CKR_OK : CKR_HOST_MEMORY;
+}
+
+/**
+ * Verify a signature with the public key of a handle, without a round trip
+ * to the HSM once the key is cached. Supports the combined hash and sign
+ * mechanisms, with the PSS parameters generate_signature uses.
+ * @param cache
+ * @param session Session used to read the public key on a cache miss
+ * @param key Public key handle
+ * @param mechanism Combined mechanism, such as CKM_ECDSA_SHA256 or CKM_SHA256_RSA_PKCS_PSS
+ * @param data
+ * @param data_length
+ * @param signature
+ * @param signature_length
+ * @return CKR_SIGNATURE_INVALID if the signature does not match, like C_Verify.
+ * CKR_MECHANISM_INVALID if the mechanism can only be verified on the HSM.
+ */
+CK_RV verify_signature_locally(struct verify_cache *cache,
+                               CK_SESSION_HANDLE session,
+                               CK_OBJECT_HANDLE key,
+                               CK_MECHANISM_TYPE mechanism,
+                               CK_BYTE_PTR data,
+                               CK_ULONG data_length,
+                               CK_BYTE_PTR signature,
+                               CK_ULONG signature_length) {
+    CK_RV rv;
+    EVP_PKEY *pkey = NULL;
+    EVP_MD_CTX *md_ctx = NULL;
+    EVP_PKEY_CTX *pkey_ctx = NULL;
+    unsigned char *der = NULL;
+    int der_length = 0;
+    const unsigned char *to_verify = signature;
+    size_t to_verify_length = signature_length;
+
+    if (!cache || (!data && data_length > 0) || !signature) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    const struct prehash *prehash = prehash_find(mechanism);
+    const EVP_MD *md = prehash ? prehash_md(prehash) : NULL;
+    if (!md) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    rv = verify_cache_get(cache, session, key, &pkey);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    CK_BBOOL ecdsa = (CKM_ECDSA == prehash->raw_mechanism) ? CK_TRUE : CK_FALSE;
+    if ((ecdsa ? EVP_PKEY_EC : EVP_PKEY_RSA) != EVP_PKEY_id(pkey)) {
+        rv = CKR_KEY_TYPE_INCONSISTENT;
+        goto done;
+    }
+
+    if (ecdsa) {
+        if (0 == signature_length || 0 != signature_length % 2) {
+            rv = CKR_SIGNATURE_LEN_RANGE;
+            goto done;
+        }
+        rv = ecdsa_signature_der(signature, signature_length, &der, &der_length);
+        if (CKR_OK != rv) {
+            goto done;
+        }
+        to_verify = der;
+        to_verify_length = (size_t) der_length;
+    }
+
+    rv = CKR_FUNCTION_FAILED;
+    md_ctx = EVP_MD_CTX_new();
+    if (!md_ctx || 1 != EVP_DigestVerifyInit(md_ctx, &pkey_ctx, md, NULL, pkey)) {
+        goto done;
+    }
+    if (CKM_RSA_PKCS_PSS == prehash->raw_mechanism) {
+        if (1 != EVP_PKEY_CTX_set_rsa_padding(pkey_ctx, RSA_PKCS1_PSS_PADDING)
+            || 1 != EVP_PKEY_CTX_set_rsa_mgf1_md(pkey_ctx, md)
+            || 1 != EVP_PKEY_CTX_set_rsa_pss_saltlen(pkey_ctx, (int) prehash->digest_length)) {
+            goto done;
+        }
+    }
+    if (1 != EVP_DigestVerifyUpdate(md_ctx, data, data_length)) {
+        goto done;
+    }
+
+    rv = (1 == EVP_DigestVerifyFinal(md_ctx, to_verify, to_verify_length)) ? CKR_OK : CKR_SIGNATURE_INVALID;
+
+done:
+    OPENSSL_free(der);
+    EVP_MD_CTX_free(md_ctx);
+    EVP_PKEY_free(pkey);
+    return rv;
+}
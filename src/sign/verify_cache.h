@@ -0,0 +1,48 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef AWS_CLOUDHSM_PKCS11_VERIFY_CACHE_H
+#define AWS_CLOUDHSM_PKCS11_VERIFY_CACHE_H
+
+#include "common.h"
+
+/*
+ * Signature verification on the client.
+ *
+ * Verifying only needs the public key, so the HSM does not have to be
+ * involved. The first verification with a key handle reads CKA_MODULUS and
+ * CKA_PUBLIC_EXPONENT, or CKA_EC_PARAMS and CKA_EC_POINT, and caches the
+ * OpenSSL key. Later verifications with the handle run entirely in process.
+ *
+ * The cache is safe to share between threads. Handles may be reused once
+ * an object is destroyed, so invalidate a handle before destroying its key.
+ */
+struct verify_cache;
+
+CK_RV verify_cache_create(struct verify_cache **cache);
+void verify_cache_invalidate(struct verify_cache *cache, CK_OBJECT_HANDLE key);
+void verify_cache_destroy(struct verify_cache *cache);
+
+CK_RV verify_signature_locally(struct verify_cache *cache,
+                               CK_SESSION_HANDLE session,
+                               CK_OBJECT_HANDLE key,
+                               CK_MECHANISM_TYPE mechanism,
+                               CK_BYTE_PTR data,
+                               CK_ULONG data_length,
+                               CK_BYTE_PTR signature,
+                               CK_ULONG signature_length);
+
+#endif
@@ -0,0 +1,823 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include "soft_pkcs11.h"
+
+#define SOFT_AES_BLOCK_SIZE 16
+#define SOFT_DES_BLOCK_SIZE 8
+#define SOFT_GCM_IV_SIZE 12
+
+void soft_operation_reset(struct soft_operation *op) {
+    EVP_CIPHER_CTX_free(op->cipher);
+    EVP_MD_CTX_free(op->md);
+    soft_key_release(&op->key);
+    OPENSSL_free(op->oaep_label);
+    if (op->data) {
+        OPENSSL_clear_free(op->data, op->data_capacity);
+    }
+    memset(op, 0, sizeof(*op));
+}
+
+CK_RV soft_data_append(struct soft_operation *op, CK_BYTE_PTR data, CK_ULONG data_length) {
+    if (!data && data_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (op->data_length + data_length > op->data_capacity) {
+        CK_ULONG capacity = op->data_capacity ? op->data_capacity : 256;
+        while (capacity < op->data_length + data_length) {
+            capacity *= 2;
+        }
+
+        CK_BYTE_PTR grown = OPENSSL_malloc(capacity);
+        if (!grown) {
+            return CKR_HOST_MEMORY;
+        }
+        if (op->data) {
+            memcpy(grown, op->data, op->data_length);
+            OPENSSL_clear_free(op->data, op->data_capacity);
+        }
+        op->data = grown;
+        op->data_capacity = capacity;
+    }
+
+    if (data_length) {
+        memcpy(op->data + op->data_length, data, data_length);
+    }
+    op->data_length += data_length;
+    return CKR_OK;
+}
+
+const EVP_MD *soft_md_from_mechanism(CK_MECHANISM_TYPE type) {
+    switch (type) {
+        case CKM_SHA_1:
+        case CKM_SHA_1_HMAC:
+        case CKM_SHA1_RSA_PKCS:
+        case CKM_SHA1_RSA_PKCS_PSS:
+        case CKM_ECDSA_SHA1:
+            return EVP_sha1();
+        case CKM_SHA224:
+        case CKM_SHA224_HMAC:
+        case CKM_SHA224_RSA_PKCS:
+        case CKM_SHA224_RSA_PKCS_PSS:
+        case CKM_ECDSA_SHA224:
+            return EVP_sha224();
+        case CKM_SHA256:
+        case CKM_SHA256_HMAC:
+        case CKM_SHA256_RSA_PKCS:
+        case CKM_SHA256_RSA_PKCS_PSS:
+        case CKM_ECDSA_SHA256:
+            return EVP_sha256();
+        case CKM_SHA384:
+        case CKM_SHA384_HMAC:
+        case CKM_SHA384_RSA_PKCS:
+        case CKM_SHA384_RSA_PKCS_PSS:
+        case CKM_ECDSA_SHA384:
+            return EVP_sha384();
+        case CKM_SHA512:
+        case CKM_SHA512_HMAC:
+        case CKM_SHA512_RSA_PKCS:
+        case CKM_SHA512_RSA_PKCS_PSS:
+        case CKM_ECDSA_SHA512:
+            return EVP_sha512();
+        default:
+            return NULL;
+    }
+}
+
+const EVP_MD *soft_md_from_mgf(CK_RSA_PKCS_MGF_TYPE mgf) {
+    switch (mgf) {
+        case CKG_MGF1_SHA1:
+            return EVP_sha1();
+        case CKG_MGF1_SHA224:
+            return EVP_sha224();
+        case CKG_MGF1_SHA256:
+            return EVP_sha256();
+        case CKG_MGF1_SHA384:
+            return EVP_sha384();
+        case CKG_MGF1_SHA512:
+            return EVP_sha512();
+        default:
+            return NULL;
+    }
+}
+
+CK_RV soft_rsa_pkcs_params(struct soft_operation *op, CK_MECHANISM_PTR mechanism) {
+    switch (mechanism->mechanism) {
+        case CKM_RSA_PKCS_OAEP: {
+            CK_RSA_PKCS_OAEP_PARAMS *params = mechanism->pParameter;
+            if (!params || sizeof(CK_RSA_PKCS_OAEP_PARAMS) != mechanism->ulParameterLen) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+
+            op->padding = RSA_PKCS1_OAEP_PADDING;
+            op->pkey_md = soft_md_from_mechanism(params->hashAlg);
+            op->mgf1_md = soft_md_from_mgf(params->mgf);
+            if (!op->pkey_md || !op->mgf1_md) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+
+            if (CKZ_DATA_SPECIFIED == params->source && params->pSourceData && params->ulSourceDataLen) {
+                op->oaep_label = OPENSSL_memdup(params->pSourceData, params->ulSourceDataLen);
+                if (!op->oaep_label) {
+                    return CKR_HOST_MEMORY;
+                }
+                op->oaep_label_length = params->ulSourceDataLen;
+            }
+            return CKR_OK;
+        }
+        case CKM_RSA_PKCS_PSS:
+        case CKM_SHA1_RSA_PKCS_PSS:
+        case CKM_SHA224_RSA_PKCS_PSS:
+        case CKM_SHA256_RSA_PKCS_PSS:
+        case CKM_SHA384_RSA_PKCS_PSS:
+        case CKM_SHA512_RSA_PKCS_PSS: {
+            CK_RSA_PKCS_PSS_PARAMS *params = mechanism->pParameter;
+            if (!params || sizeof(CK_RSA_PKCS_PSS_PARAMS) != mechanism->ulParameterLen) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+
+            op->padding = RSA_PKCS1_PSS_PADDING;
+            op->pkey_md = soft_md_from_mechanism(params->hashAlg);
+            op->mgf1_md = soft_md_from_mgf(params->mgf);
+            op->salt_length = (int) params->sLen;
+            if (!op->pkey_md || !op->mgf1_md) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+
+            // A hashing mechanism must hash with the algorithm its parameters name.
+            const EVP_MD *md = soft_md_from_mechanism(mechanism->mechanism);
+            if (md && md != op->pkey_md) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+            return CKR_OK;
+        }
+        default:
+            op->padding = RSA_PKCS1_PADDING;
+            op->pkey_md = soft_md_from_mechanism(mechanism->mechanism);
+            return CKR_OK;
+    }
+}
+
+/**
+ * Apply the RSA padding parameters of an operation to an OpenSSL context.
+ */
+static CK_RV soft_rsa_ctx_params(struct soft_operation *op, EVP_PKEY_CTX *ctx) {
+    if (1 != EVP_PKEY_CTX_set_rsa_padding(ctx, op->padding)) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    if (RSA_PKCS1_OAEP_PADDING == op->padding) {
+        if (1 != EVP_PKEY_CTX_set_rsa_oaep_md(ctx, op->pkey_md)
+            || 1 != EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, op->mgf1_md)) {
+            return CKR_FUNCTION_FAILED;
+        }
+        if (op->oaep_label) {
+            // The context takes ownership of the label.
+            unsigned char *label = OPENSSL_memdup(op->oaep_label, op->oaep_label_length);
+            if (!label || 1 != EVP_PKEY_CTX_set0_rsa_oaep_label(ctx, label, (int) op->oaep_label_length)) {
+                OPENSSL_free(label);
+                return CKR_FUNCTION_FAILED;
+            }
+        }
+    }
+    return CKR_OK;
+}
+
+/**
+ * Single part RSA encryption or decryption.
+ */
+static CK_RV soft_rsa_crypt(struct soft_operation *op,
+                            CK_BYTE_PTR in, CK_ULONG in_length,
+                            CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    size_t modulus_length = (size_t) EVP_PKEY_size(op->key.pkey);
+    size_t length = modulus_length;
+    CK_RV rv = CKR_FUNCTION_FAILED;
+
+    if (!out) {
+        *out_length = (CK_ULONG) modulus_length;
+        return CKR_OK;
+    }
+    if (!op->encrypt && in_length != modulus_length) {
+        return CKR_ENCRYPTED_DATA_LEN_RANGE;
+    }
+
+    CK_BYTE_PTR result = OPENSSL_malloc(modulus_length);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(op->key.pkey, NULL);
+    if (!result || !ctx) {
+        rv = CKR_HOST_MEMORY;
+        goto done;
+    }
+
+    if (op->encrypt) {
+        if (1 != EVP_PKEY_encrypt_init(ctx) || CKR_OK != soft_rsa_ctx_params(op, ctx)) {
+            goto done;
+        }
+        if (1 != EVP_PKEY_encrypt(ctx, result, &length, in, in_length)) {
+            rv = CKR_DATA_LEN_RANGE;
+            goto done;
+        }
+    } else {
+        if (1 != EVP_PKEY_decrypt_init(ctx) || CKR_OK != soft_rsa_ctx_params(op, ctx)) {
+            goto done;
+        }
+        if (1 != EVP_PKEY_decrypt(ctx, result, &length, in, in_length)) {
+            rv = CKR_ENCRYPTED_DATA_INVALID;
+            goto done;
+        }
+    }
+
+    if (*out_length < length) {
+        rv = CKR_BUFFER_TOO_SMALL;
+    } else {
+        memcpy(out, result, length);
+        rv = CKR_OK;
+    }
+    *out_length = (CK_ULONG) length;
+
+done:
+    EVP_PKEY_CTX_free(ctx);
+    if (result) {
+        OPENSSL_clear_free(result, modulus_length);
+    }
+    return rv;
+}
+
+/**
+ * Select the OpenSSL cipher for a symmetric mechanism and key.
+ */
+static const EVP_CIPHER *soft_symmetric_cipher(CK_MECHANISM_TYPE mechanism, struct soft_key *key) {
+    if (CKM_DES3_ECB == mechanism) {
+        return (CKK_DES3 == key->key_type && 24 == key->value_length) ? EVP_des_ede3_ecb() : NULL;
+    }
+    if (CKK_AES != key->key_type) {
+        return NULL;
+    }
+
+    int index = (int) key->value_length / 8 - 2;
+    if (index < 0 || index > 2 || 0 != key->value_length % 8) {
+        return NULL;
+    }
+
+    switch (mechanism) {
+        case CKM_AES_ECB: {
+            const EVP_CIPHER *ciphers[] = { EVP_aes_128_ecb(), EVP_aes_192_ecb(), EVP_aes_256_ecb() };
+            return ciphers[index];
+        }
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD: {
+            const EVP_CIPHER *ciphers[] = { EVP_aes_128_cbc(), EVP_aes_192_cbc(), EVP_aes_256_cbc() };
+            return ciphers[index];
+        }
+        case CKM_AES_CTR: {
+            const EVP_CIPHER *ciphers[] = { EVP_aes_128_ctr(), EVP_aes_192_ctr(), EVP_aes_256_ctr() };
+            return ciphers[index];
+        }
+        case CKM_AES_GCM: {
+            const EVP_CIPHER *ciphers[] = { EVP_aes_128_gcm(), EVP_aes_192_gcm(), EVP_aes_256_gcm() };
+            return ciphers[index];
+        }
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * Start AES-GCM. When encrypting the IV is generated here and returned in
+ * the mechanism parameters, as the CloudHSM library does.
+ */
+static CK_RV soft_gcm_init(struct soft_operation *op, CK_MECHANISM_PTR mechanism) {
+    CK_GCM_PARAMS *params = mechanism->pParameter;
+    int length = 0;
+
+    if (!params || sizeof(CK_GCM_PARAMS) != mechanism->ulParameterLen || !params->pIv
+        || 0 == params->ulIvLen || (!params->pAAD && params->ulAADLen)) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (params->ulTagBits < 96 || params->ulTagBits > 128 || 0 != params->ulTagBits % 8) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (op->encrypt) {
+        if (SOFT_GCM_IV_SIZE != params->ulIvLen) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+        if (1 != RAND_bytes(params->pIv, SOFT_GCM_IV_SIZE)) {
+            return CKR_FUNCTION_FAILED;
+        }
+    }
+
+    op->tag_length = params->ulTagBits / 8;
+    if (1 != EVP_CIPHER_CTX_ctrl(op->cipher, EVP_CTRL_GCM_SET_IVLEN, (int) params->ulIvLen, NULL)
+        || 1 != EVP_CipherInit_ex(op->cipher, NULL, NULL, op->key.value, params->pIv, op->encrypt ? 1 : 0)) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (params->ulAADLen && 1 != EVP_CipherUpdate(op->cipher, NULL, &length, params->pAAD, (int) params->ulAADLen)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    return CKR_OK;
+}
+
+CK_RV soft_cipher_init(struct soft_operation *op, CK_MECHANISM_PTR mechanism, CK_BBOOL encrypt) {
+    const CK_BYTE *iv = NULL;
+
+    op->mechanism = mechanism->mechanism;
+    op->encrypt = encrypt;
+
+    if (CKM_RSA_PKCS == mechanism->mechanism || CKM_RSA_PKCS_OAEP == mechanism->mechanism) {
+        if (CKK_RSA != op->key.key_type || !op->key.pkey) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        CK_RV rv = soft_rsa_pkcs_params(op, mechanism);
+        if (CKR_OK == rv) {
+            op->active = CK_TRUE;
+        }
+        return rv;
+    }
+
+    const EVP_CIPHER *cipher = soft_symmetric_cipher(mechanism->mechanism, &op->key);
+    if (!cipher) {
+        return soft_mechanism_find(mechanism->mechanism) ? CKR_KEY_TYPE_INCONSISTENT : CKR_MECHANISM_INVALID;
+    }
+
+    switch (mechanism->mechanism) {
+        case CKM_AES_CBC:
+        case CKM_AES_CBC_PAD:
+            if (!mechanism->pParameter || SOFT_AES_BLOCK_SIZE != mechanism->ulParameterLen) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+            iv = mechanism->pParameter;
+            break;
+        case CKM_AES_CTR: {
+            CK_AES_CTR_PARAMS *params = mechanism->pParameter;
+            if (!params || sizeof(CK_AES_CTR_PARAMS) != mechanism->ulParameterLen
+                || 0 == params->ulCounterBits || params->ulCounterBits > 128) {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+            iv = params->cb;
+            break;
+        }
+        default:
+            break;
+    }
+
+    op->cipher = EVP_CIPHER_CTX_new();
+    if (!op->cipher) {
+        return CKR_HOST_MEMORY;
+    }
+
+    // GCM sets its key and IV once the IV length is known.
+    const CK_BYTE *key = (CKM_AES_GCM == mechanism->mechanism) ? NULL : op->key.value;
+    if (1 != EVP_CipherInit_ex(op->cipher, cipher, NULL, key, iv, encrypt ? 1 : 0)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    EVP_CIPHER_CTX_set_padding(op->cipher, CKM_AES_CBC_PAD == mechanism->mechanism ? 1 : 0);
+
+    op->block_size = (CK_ULONG) EVP_CIPHER_CTX_block_size(op->cipher);
+    if (CKM_AES_GCM == mechanism->mechanism) {
+        CK_RV rv = soft_gcm_init(op, mechanism);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+    }
+
+    op->active = CK_TRUE;
+    return CKR_OK;
+}
+
+/**
+ * The number of bytes C_EncryptUpdate or C_DecryptUpdate returns for a part.
+ * Block modes return whole blocks; CBC_PAD decryption also holds back the
+ * last block, which may be padding, and GCM decryption returns nothing
+ * until the tag has been checked.
+ */
+static CK_ULONG soft_update_length(struct soft_operation *op, CK_ULONG in_length) {
+    CK_ULONG total = op->pending + in_length;
+
+    if (CKM_AES_GCM == op->mechanism) {
+        return op->encrypt ? in_length : 0;
+    }
+    if (1 == op->block_size) {
+        return in_length;
+    }
+    if (!op->encrypt && CKM_AES_CBC_PAD == op->mechanism) {
+        return total ? ((total - 1) / op->block_size) * op->block_size : 0;
+    }
+    return (total / op->block_size) * op->block_size;
+}
+
+/**
+ * Complete the operation on a copy of the cipher context, so a length query or a
+ * short buffer leaves the real operation untouched. GCM decryption runs over
+ * the buffered ciphertext, whose last tag_length bytes are the tag.
+ * @param op
+ * @param in Final input for a single part operation, or NULL.
+ * @param in_length
+ * @param out Receives the output; must hold in_length + data_length + 2 blocks + the tag.
+ * @param out_length
+ * @return
+ */
+static CK_RV soft_cipher_complete(struct soft_operation *op, CK_BYTE_PTR in, CK_ULONG in_length,
+                                  CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    int length = 0;
+    CK_ULONG produced = 0;
+    CK_RV rv = CKR_OK;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx || 1 != EVP_CIPHER_CTX_copy(ctx, op->cipher)) {
+        EVP_CIPHER_CTX_free(ctx);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (CKM_AES_GCM == op->mechanism && !op->encrypt) {
+        CK_BYTE_PTR data = in ? in : op->data;
+        CK_ULONG data_length = in ? in_length : op->data_length;
+        if (data_length < op->tag_length) {
+            rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+            goto done;
+        }
+
+        CK_ULONG ciphertext_length = data_length - op->tag_length;
+        if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, (int) op->tag_length, data + ciphertext_length)
+            || 1 != EVP_DecryptUpdate(ctx, out, &length, data, (int) ciphertext_length)) {
+            rv = CKR_FUNCTION_FAILED;
+            goto done;
+        }
+        produced = (CK_ULONG) length;
+        if (1 != EVP_DecryptFinal_ex(ctx, out + produced, &length)) {
+            rv = CKR_ENCRYPTED_DATA_INVALID;
+            goto done;
+        }
+        produced += (CK_ULONG) length;
+        *out_length = produced;
+        goto done;
+    }
+
+    if (1 != op->block_size && CKM_AES_CBC_PAD != op->mechanism
+        && 0 != (op->pending + in_length) % op->block_size) {
+        rv = op->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+        goto done;
+    }
+
+    if (in && in_length) {
+        if (1 != EVP_CipherUpdate(ctx, out, &length, in, (int) in_length)) {
+            rv = CKR_FUNCTION_FAILED;
+            goto done;
+        }
+        produced = (CK_ULONG) length;
+    }
+
+    if (1 != EVP_CipherFinal_ex(ctx, out + produced, &length)) {
+        rv = op->encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_INVALID;
+        goto done;
+    }
+    produced += (CK_ULONG) length;
+
+    if (CKM_AES_GCM == op->mechanism) {
+        if (1 != EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, (int) op->tag_length, out + produced)) {
+            rv = CKR_FUNCTION_FAILED;
+            goto done;
+        }
+        produced += op->tag_length;
+    }
+    *out_length = produced;
+
+done:
+    EVP_CIPHER_CTX_free(ctx);
+    return rv;
+}
+
+/**
+ * Run soft_cipher_complete into scratch space and hand the result to the
+ * caller following the PKCS#11 length conventions.
+ */
+static CK_RV soft_cipher_finish(struct soft_operation *op, CK_BYTE_PTR in, CK_ULONG in_length,
+                                CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    CK_ULONG capacity = in_length + op->data_length + 2 * op->block_size + SOFT_AES_BLOCK_SIZE;
+    CK_ULONG length = 0;
+
+    CK_BYTE_PTR result = OPENSSL_malloc(capacity);
+    if (!result) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = soft_cipher_complete(op, in, in_length, result, &length);
+    if (CKR_OK == rv && out) {
+        if (*out_length < length) {
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(out, result, length);
+        }
+    }
+    if (CKR_OK == rv || CKR_BUFFER_TOO_SMALL == rv) {
+        *out_length = length;
+    }
+
+    OPENSSL_clear_free(result, capacity);
+    return rv;
+}
+
+CK_RV soft_cipher_single(struct soft_operation *op,
+                         CK_BYTE_PTR in, CK_ULONG in_length,
+                         CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    if (!in && in_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (op->key.pkey) {
+        return soft_rsa_crypt(op, in, in_length, out, out_length);
+    }
+    return soft_cipher_finish(op, in, in_length, out, out_length);
+}
+
+CK_RV soft_aes_key_wrap(CK_BYTE_PTR kek, CK_ULONG kek_length, CK_BBOOL pad,
+                        CK_BYTE_PTR in, CK_ULONG in_length,
+                        CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    const EVP_CIPHER *cipher = NULL;
+    int length = 0;
+    int final_length = 0;
+
+    switch (kek_length) {
+        case 16: cipher = pad ? EVP_aes_128_wrap_pad() : EVP_aes_128_wrap(); break;
+        case 24: cipher = pad ? EVP_aes_192_wrap_pad() : EVP_aes_192_wrap(); break;
+        case 32: cipher = pad ? EVP_aes_256_wrap_pad() : EVP_aes_256_wrap(); break;
+        default: return CKR_WRAPPING_KEY_SIZE_RANGE;
+    }
+
+    CK_ULONG required = ((in_length + 7) / 8) * 8 + 8;
+    if (*out_length < required) {
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    if (!pad && (in_length < 16 || 0 != in_length % 8)) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return CKR_HOST_MEMORY;
+    }
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+    CK_RV rv = CKR_FUNCTION_FAILED;
+    if (1 == EVP_EncryptInit_ex(ctx, cipher, NULL, kek, NULL)
+        && 1 == EVP_EncryptUpdate(ctx, out, &length, in, (int) in_length)
+        && 1 == EVP_EncryptFinal_ex(ctx, out + length, &final_length)) {
+        *out_length = (CK_ULONG) (length + final_length);
+        rv = CKR_OK;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return rv;
+}
+
+CK_RV soft_aes_key_unwrap(CK_BYTE_PTR kek, CK_ULONG kek_length, CK_BBOOL pad,
+                          CK_BYTE_PTR in, CK_ULONG in_length,
+                          CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    const EVP_CIPHER *cipher = NULL;
+    int length = 0;
+    int final_length = 0;
+
+    switch (kek_length) {
+        case 16: cipher = pad ? EVP_aes_128_wrap_pad() : EVP_aes_128_wrap(); break;
+        case 24: cipher = pad ? EVP_aes_192_wrap_pad() : EVP_aes_192_wrap(); break;
+        case 32: cipher = pad ? EVP_aes_256_wrap_pad() : EVP_aes_256_wrap(); break;
+        default: return CKR_UNWRAPPING_KEY_SIZE_RANGE;
+    }
+
+    if (in_length < 16 || 0 != in_length % 8) {
+        return CKR_WRAPPED_KEY_LEN_RANGE;
+    }
+    if (*out_length < in_length) {
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+        return CKR_HOST_MEMORY;
+    }
+    EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+
+    CK_RV rv = CKR_WRAPPED_KEY_INVALID;
+    if (1 == EVP_DecryptInit_ex(ctx, cipher, NULL, kek, NULL)
+        && EVP_DecryptUpdate(ctx, out, &length, in, (int) in_length) > 0
+        && length > 0
+        && 1 == EVP_DecryptFinal_ex(ctx, out + length, &final_length)) {
+        *out_length = (CK_ULONG) (length + final_length);
+        rv = CKR_OK;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return rv;
+}
+
+/**
+ * Start an encryption or decryption operation on a session.
+ */
+static CK_RV soft_crypt_init(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                             CK_BBOOL encrypt) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pMechanism) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!soft_is_logged_in()) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    struct soft_operation *op = encrypt ? &session->encrypt : &session->decrypt;
+    if (op->active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    const struct soft_mechanism *mechanism = soft_mechanism_find(pMechanism->mechanism);
+    if (!mechanism || !(mechanism->flags & (encrypt ? CKF_ENCRYPT : CKF_DECRYPT))) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    soft_round_trip();
+
+    rv = soft_object_get_key(hKey, encrypt ? CKA_ENCRYPT : CKA_DECRYPT, &op->key);
+    if (CKR_OK == rv) {
+        rv = soft_cipher_init(op, pMechanism, encrypt);
+    }
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+    }
+    return rv;
+}
+
+/**
+ * Fetch the active operation for a crypt call.
+ */
+static CK_RV soft_crypt_operation(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt, struct soft_operation **op) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    *op = encrypt ? &session->encrypt : &session->decrypt;
+    if (!(*op)->active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    return CKR_OK;
+}
+
+/**
+ * Single part encryption or decryption. The operation ends unless the call
+ * only asked for, or was short of, the output length.
+ */
+static CK_RV soft_crypt(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt,
+                        CK_BYTE_PTR in, CK_ULONG in_length,
+                        CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_crypt_operation(hSession, encrypt, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!out_length) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    rv = soft_cipher_single(op, in, in_length, out, out_length);
+    if (CKR_BUFFER_TOO_SMALL != rv && !(CKR_OK == rv && !out)) {
+        soft_operation_reset(op);
+    }
+    return rv;
+}
+
+static CK_RV soft_crypt_update(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt,
+                               CK_BYTE_PTR in, CK_ULONG in_length,
+                               CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    struct soft_operation *op = NULL;
+    int length = 0;
+
+    CK_RV rv = soft_crypt_operation(hSession, encrypt, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!in && in_length) || !out_length) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (op->key.pkey) {
+        // RSA is single part only.
+        soft_operation_reset(op);
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    soft_round_trip();
+
+    CK_ULONG required = soft_update_length(op, in_length);
+    if (!out) {
+        *out_length = required;
+        return CKR_OK;
+    }
+    if (*out_length < required) {
+        *out_length = required;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    if (CKM_AES_GCM == op->mechanism && !op->encrypt) {
+        rv = soft_data_append(op, in, in_length);
+    } else if (in_length && 1 != EVP_CipherUpdate(op->cipher, out, &length, in, (int) in_length)) {
+        rv = CKR_FUNCTION_FAILED;
+    }
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+        return rv;
+    }
+
+    op->pending = op->pending + in_length - required;
+    *out_length = required;
+    return CKR_OK;
+}
+
+static CK_RV soft_crypt_final(CK_SESSION_HANDLE hSession, CK_BBOOL encrypt,
+                              CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_crypt_operation(hSession, encrypt, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!out_length) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (op->key.pkey) {
+        soft_operation_reset(op);
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    soft_round_trip();
+
+    rv = soft_cipher_finish(op, NULL, 0, out, out_length);
+    if (CKR_BUFFER_TOO_SMALL != rv && !(CKR_OK == rv && !out)) {
+        soft_operation_reset(op);
+    }
+    return rv;
+}
+
+CK_RV C_EncryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return soft_crypt_init(hSession, pMechanism, hKey, CK_TRUE);
+}
+
+CK_RV C_Encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen) {
+    return soft_crypt(hSession, CK_TRUE, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+}
+
+CK_RV C_EncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                      CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen) {
+    return soft_crypt_update(hSession, CK_TRUE, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+}
+
+CK_RV C_EncryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart,
+                     CK_ULONG_PTR pulLastEncryptedPartLen) {
+    return soft_crypt_final(hSession, CK_TRUE, pLastEncryptedPart, pulLastEncryptedPartLen);
+}
+
+CK_RV C_DecryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return soft_crypt_init(hSession, pMechanism, hKey, CK_FALSE);
+}
+
+CK_RV C_Decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen,
+                CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen) {
+    return soft_crypt(hSession, CK_FALSE, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+}
+
+CK_RV C_DecryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+                      CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen) {
+    return soft_crypt_update(hSession, CK_FALSE, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+}
+
+CK_RV C_DecryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen) {
+    return soft_crypt_final(hSession, CK_FALSE, pLastPart, pulLastPartLen);
+}
@@ -0,0 +1,1229 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/cmac.h>
+#include <openssl/ec.h>
+#include <openssl/hmac.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "soft_pkcs11.h"
+
+#define SOFT_DEFAULT_PUBLIC_EXPONENT 65537
+#define SOFT_KEY_WRAP_BLOCK 8
+
+/**
+ * Check a secret key length is valid for its key type.
+ * @param key_type
+ * @param length Length in bytes.
+ * @return CK_TRUE if a key of this type may have this length.
+ */
+static CK_BBOOL soft_secret_key_length_valid(CK_KEY_TYPE key_type, CK_ULONG length) {
+    switch (key_type) {
+        case CKK_AES:
+            return (16 == length || 24 == length || 32 == length) ? CK_TRUE : CK_FALSE;
+        case CKK_DES3:
+            return (24 == length) ? CK_TRUE : CK_FALSE;
+        default:
+            return (length > 0 && length <= SOFT_MAX_SECRET_KEY_LENGTH) ? CK_TRUE : CK_FALSE;
+    }
+}
+
+/**
+ * Give every byte of a DES key odd parity, as DES key generation requires.
+ */
+static void soft_des_set_parity(CK_BYTE_PTR key, CK_ULONG length) {
+    for (CK_ULONG i = 0; i < length; i++) {
+        CK_BYTE value = key[i] & 0xfe;
+        CK_BYTE bits = 0;
+        for (int bit = 1; bit < 8; bit++) {
+            bits ^= (value >> bit) & 1;
+        }
+        key[i] = value | (bits ^ 1);
+    }
+}
+
+CK_KEY_TYPE soft_pkey_key_type(EVP_PKEY *pkey) {
+    switch (EVP_PKEY_base_id(pkey)) {
+        case EVP_PKEY_RSA:
+            return CKK_RSA;
+        case EVP_PKEY_EC:
+            return CKK_EC;
+        default:
+            return CK_UNAVAILABLE_INFORMATION;
+    }
+}
+
+static CK_RV soft_bn_attribute(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type, const BIGNUM *bn) {
+    int length = BN_num_bytes(bn);
+    CK_BYTE_PTR value = malloc(length ? length : 1);
+    if (!value) {
+        return CKR_HOST_MEMORY;
+    }
+
+    BN_bn2bin(bn, value);
+    CK_RV rv = soft_attributes_set(list, type, value, (CK_ULONG) length);
+    free(value);
+    return rv;
+}
+
+/**
+ * Encode the named curve of an EC key as the DER OID CKA_EC_PARAMS holds.
+ */
+static CK_RV soft_ec_params_attribute(struct soft_attribute_list *list, const EC_GROUP *group) {
+    ASN1_OBJECT *oid = OBJ_nid2obj(EC_GROUP_get_curve_name(group));
+    unsigned char *der = NULL;
+
+    int length = oid ? i2d_ASN1_OBJECT(oid, &der) : -1;
+    if (length <= 0) {
+        return CKR_DOMAIN_PARAMS_INVALID;
+    }
+
+    CK_RV rv = soft_attributes_set(list, CKA_EC_PARAMS, der, (CK_ULONG) length);
+    OPENSSL_free(der);
+    return rv;
+}
+
+/**
+ * Encode an EC public point as the DER OCTET STRING CKA_EC_POINT holds.
+ */
+static CK_RV soft_ec_point_attribute(struct soft_attribute_list *list, const EC_KEY *ec) {
+    unsigned char *point = NULL;
+    unsigned char *der = NULL;
+    CK_RV rv = CKR_FUNCTION_FAILED;
+
+    size_t point_length = EC_KEY_key2buf(ec, POINT_CONVERSION_UNCOMPRESSED, &point, NULL);
+    ASN1_OCTET_STRING *octets = ASN1_OCTET_STRING_new();
+    if (point_length > 0 && octets && ASN1_OCTET_STRING_set(octets, point, (int) point_length)) {
+        int length = i2d_ASN1_OCTET_STRING(octets, &der);
+        if (length > 0) {
+            rv = soft_attributes_set(list, CKA_EC_POINT, der, (CK_ULONG) length);
+        }
+    }
+
+    OPENSSL_free(der);
+    OPENSSL_free(point);
+    ASN1_OCTET_STRING_free(octets);
+    return rv;
+}
+
+CK_RV soft_pkey_attributes(EVP_PKEY *pkey, CK_OBJECT_CLASS key_class, struct soft_attribute_list *list) {
+    if (EVP_PKEY_RSA == EVP_PKEY_base_id(pkey)) {
+        const RSA *rsa = EVP_PKEY_get0_RSA(pkey);
+        const BIGNUM *n = NULL;
+        const BIGNUM *e = NULL;
+        RSA_get0_key(rsa, &n, &e, NULL);
+
+        CK_RV rv = soft_bn_attribute(list, CKA_MODULUS, n);
+        if (CKR_OK == rv) {
+            rv = soft_bn_attribute(list, CKA_PUBLIC_EXPONENT, e);
+        }
+        if (CKR_OK == rv) {
+            CK_ULONG bits = (CK_ULONG) BN_num_bits(n);
+            rv = soft_attributes_set(list, CKA_MODULUS_BITS, &bits, sizeof(bits));
+        }
+        return rv;
+    }
+
+    if (EVP_PKEY_EC == EVP_PKEY_base_id(pkey)) {
+        const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(pkey);
+
+        CK_RV rv = soft_ec_params_attribute(list, EC_KEY_get0_group(ec));
+        if (CKR_OK == rv && CKO_PUBLIC_KEY == key_class) {
+            rv = soft_ec_point_attribute(list, ec);
+        }
+        return rv;
+    }
+
+    return CKR_KEY_TYPE_INCONSISTENT;
+}
+
+/**
+ * Decode a DER named curve OID, as held in CKA_EC_PARAMS.
+ * @return The OpenSSL NID of the curve, or NID_undef.
+ */
+static int soft_ec_curve_from_params(CK_ATTRIBUTE_PTR params) {
+    if (!params || !params->pValue) {
+        return NID_undef;
+    }
+
+    const unsigned char *der = params->pValue;
+    ASN1_OBJECT *oid = d2i_ASN1_OBJECT(NULL, &der, (long) params->ulValueLen);
+    if (!oid) {
+        return NID_undef;
+    }
+
+    int nid = OBJ_obj2nid(oid);
+    ASN1_OBJECT_free(oid);
+    return nid;
+}
+
+/**
+ * Decode an EC point which is either a raw octet string, or a DER OCTET STRING
+ * wrapping one as in CKA_EC_POINT. Both forms are seen in ECDH public data.
+ */
+static EC_POINT *soft_ec_point_decode(const EC_GROUP *group, CK_BYTE_PTR data, CK_ULONG length) {
+    EC_POINT *point = EC_POINT_new(group);
+    if (!point) {
+        return NULL;
+    }
+
+    if (1 == EC_POINT_oct2point(group, point, data, length, NULL)) {
+        return point;
+    }
+
+    const unsigned char *der = data;
+    ASN1_OCTET_STRING *octets = d2i_ASN1_OCTET_STRING(NULL, &der, (long) length);
+    if (octets && 1 == EC_POINT_oct2point(group, point, ASN1_STRING_get0_data(octets),
+                                          (size_t) ASN1_STRING_length(octets), NULL)) {
+        ASN1_OCTET_STRING_free(octets);
+        return point;
+    }
+
+    ASN1_OCTET_STRING_free(octets);
+    EC_POINT_free(point);
+    return NULL;
+}
+
+/**
+ * Build an EC public key from a curve and a point.
+ */
+static CK_RV soft_ec_public_key(int nid, CK_BYTE_PTR data, CK_ULONG length, EVP_PKEY **pkey) {
+    CK_RV rv = CKR_ATTRIBUTE_VALUE_INVALID;
+    EC_POINT *point = NULL;
+
+    EC_KEY *ec = EC_KEY_new_by_curve_name(nid);
+    if (!ec) {
+        return CKR_CURVE_NOT_SUPPORTED;
+    }
+
+    point = soft_ec_point_decode(EC_KEY_get0_group(ec), data, length);
+    if (point && 1 == EC_KEY_set_public_key(ec, point)) {
+        *pkey = EVP_PKEY_new();
+        if (*pkey && 1 == EVP_PKEY_assign_EC_KEY(*pkey, ec)) {
+            ec = NULL;
+            rv = CKR_OK;
+        } else {
+            EVP_PKEY_free(*pkey);
+            *pkey = NULL;
+            rv = CKR_HOST_MEMORY;
+        }
+    }
+
+    EC_POINT_free(point);
+    EC_KEY_free(ec);
+    return rv;
+}
+
+CK_RV soft_public_key_from_template(CK_KEY_TYPE key_type, CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                    EVP_PKEY **pkey) {
+    if (CKK_RSA == key_type) {
+        CK_ATTRIBUTE_PTR modulus = soft_template_find(template, count, CKA_MODULUS);
+        CK_ATTRIBUTE_PTR exponent = soft_template_find(template, count, CKA_PUBLIC_EXPONENT);
+        if (!modulus || !exponent) {
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+
+        RSA *rsa = RSA_new();
+        BIGNUM *n = BN_bin2bn(modulus->pValue, (int) modulus->ulValueLen, NULL);
+        BIGNUM *e = BN_bin2bn(exponent->pValue, (int) exponent->ulValueLen, NULL);
+        if (!rsa || !n || !e || 1 != RSA_set0_key(rsa, n, e, NULL)) {
+            BN_free(n);
+            BN_free(e);
+            RSA_free(rsa);
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+
+        *pkey = EVP_PKEY_new();
+        if (!*pkey || 1 != EVP_PKEY_assign_RSA(*pkey, rsa)) {
+            EVP_PKEY_free(*pkey);
+            RSA_free(rsa);
+            return CKR_HOST_MEMORY;
+        }
+        return CKR_OK;
+    }
+
+    if (CKK_EC == key_type) {
+        CK_ATTRIBUTE_PTR point = soft_template_find(template, count, CKA_EC_POINT);
+        int nid = soft_ec_curve_from_params(soft_template_find(template, count, CKA_EC_PARAMS));
+        if (!point || !point->pValue || NID_undef == nid) {
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+        return soft_ec_public_key(nid, point->pValue, point->ulValueLen, pkey);
+    }
+
+    return CKR_ATTRIBUTE_VALUE_INVALID;
+}
+
+/**
+ * Common checks for every key management call.
+ */
+static CK_RV soft_key_call_begin(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_FLAGS flag) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pMechanism) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!soft_is_logged_in()) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    const struct soft_mechanism *mechanism = soft_mechanism_find(pMechanism->mechanism);
+    if (!mechanism || !(mechanism->flags & flag)) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    soft_round_trip();
+    return CKR_OK;
+}
+
+CK_RV C_GenerateKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                    CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phKey) {
+    CK_BYTE value[SOFT_MAX_SECRET_KEY_LENGTH];
+    CK_ULONG length = 0;
+    CK_KEY_TYPE key_type;
+
+    CK_RV rv = soft_key_call_begin(hSession, pMechanism, CKF_GENERATE);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!pTemplate && ulCount) || !phKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    switch (pMechanism->mechanism) {
+        case CKM_AES_KEY_GEN:
+            key_type = CKK_AES;
+            rv = soft_template_get_ulong(pTemplate, ulCount, CKA_VALUE_LEN, &length);
+            break;
+        case CKM_DES3_KEY_GEN:
+            key_type = CKK_DES3;
+            length = 24;
+            break;
+        default:
+            key_type = CKK_GENERIC_SECRET;
+            rv = soft_template_get_ulong(pTemplate, ulCount, CKA_VALUE_LEN, &length);
+            break;
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!soft_secret_key_length_valid(key_type, length)) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    if (1 != RAND_bytes(value, (int) length)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    if (CKK_DES3 == key_type) {
+        soft_des_set_parity(value, length);
+    }
+
+    rv = soft_object_create_secret_key(hSession, pTemplate, ulCount, key_type, value, length,
+                                       pMechanism->mechanism, phKey);
+    OPENSSL_cleanse(value, sizeof(value));
+    return rv;
+}
+
+/**
+ * Generate an RSA key with the size and exponent from the public key template.
+ */
+static CK_RV soft_generate_rsa(CK_ATTRIBUTE_PTR template, CK_ULONG count, EVP_PKEY **pkey) {
+    CK_ULONG bits = 0;
+    BIGNUM *exponent = NULL;
+
+    CK_RV rv = soft_template_get_ulong(template, count, CKA_MODULUS_BITS, &bits);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (bits < 1024 || bits > 8192) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    CK_ATTRIBUTE_PTR public_exponent = soft_template_find(template, count, CKA_PUBLIC_EXPONENT);
+    if (public_exponent) {
+        exponent = BN_bin2bn(public_exponent->pValue, (int) public_exponent->ulValueLen, NULL);
+    } else {
+        exponent = BN_new();
+        if (exponent && 1 != BN_set_word(exponent, SOFT_DEFAULT_PUBLIC_EXPONENT)) {
+            BN_free(exponent);
+            exponent = NULL;
+        }
+    }
+    if (!exponent) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (!ctx || 1 != EVP_PKEY_keygen_init(ctx) || 1 != EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, (int) bits)) {
+        BN_free(exponent);
+        EVP_PKEY_CTX_free(ctx);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    // The context owns the exponent once it is accepted.
+    if (1 != EVP_PKEY_CTX_set_rsa_keygen_pubexp(ctx, exponent)) {
+        BN_free(exponent);
+        EVP_PKEY_CTX_free(ctx);
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    rv = (1 == EVP_PKEY_keygen(ctx, pkey)) ? CKR_OK : CKR_FUNCTION_FAILED;
+    EVP_PKEY_CTX_free(ctx);
+    return rv;
+}
+
+/**
+ * Generate an EC key on the named curve from the public key template.
+ */
+static CK_RV soft_generate_ec(CK_ATTRIBUTE_PTR template, CK_ULONG count, EVP_PKEY **pkey) {
+    CK_ATTRIBUTE_PTR params = soft_template_find(template, count, CKA_EC_PARAMS);
+    if (!params) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+
+    int nid = soft_ec_curve_from_params(params);
+    if (NID_undef == nid) {
+        return CKR_DOMAIN_PARAMS_INVALID;
+    }
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (!ctx || 1 != EVP_PKEY_keygen_init(ctx)) {
+        EVP_PKEY_CTX_free(ctx);
+        return CKR_FUNCTION_FAILED;
+    }
+    if (1 != EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, nid)
+        || 1 != EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE)) {
+        EVP_PKEY_CTX_free(ctx);
+        return CKR_CURVE_NOT_SUPPORTED;
+    }
+
+    CK_RV rv = (1 == EVP_PKEY_keygen(ctx, pkey)) ? CKR_OK : CKR_CURVE_NOT_SUPPORTED;
+    EVP_PKEY_CTX_free(ctx);
+    return rv;
+}
+
+CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                        CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount,
+                        CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount,
+                        CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey) {
+    EVP_PKEY *pkey = NULL;
+
+    CK_RV rv = soft_key_call_begin(hSession, pMechanism, CKF_GENERATE_KEY_PAIR);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!pPublicKeyTemplate && ulPublicKeyAttributeCount) || (!pPrivateKeyTemplate && ulPrivateKeyAttributeCount)
+        || !phPublicKey || !phPrivateKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (CKM_EC_KEY_PAIR_GEN == pMechanism->mechanism) {
+        rv = soft_generate_ec(pPublicKeyTemplate, ulPublicKeyAttributeCount, &pkey);
+    } else {
+        rv = soft_generate_rsa(pPublicKeyTemplate, ulPublicKeyAttributeCount, &pkey);
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = soft_object_create_key_pair(hSession,
+                                     pPublicKeyTemplate, ulPublicKeyAttributeCount,
+                                     pPrivateKeyTemplate, ulPrivateKeyAttributeCount,
+                                     pkey, pMechanism->mechanism, phPublicKey, phPrivateKey);
+    EVP_PKEY_free(pkey);
+    return rv;
+}
+
+/**
+ * Serialize the key being wrapped. Secret keys are wrapped as their value and
+ * private keys as an unencrypted PKCS#8 PrivateKeyInfo, like the CloudHSM library.
+ * @param key
+ * @param material Receives a buffer to release with OPENSSL_clear_free.
+ * @param length
+ * @return
+ */
+static CK_RV soft_key_material(struct soft_key *key, CK_BYTE_PTR *material, CK_ULONG_PTR length) {
+    if (CKO_SECRET_KEY == key->key_class) {
+        *material = OPENSSL_malloc(key->value_length);
+        if (!*material) {
+            return CKR_HOST_MEMORY;
+        }
+        memcpy(*material, key->value, key->value_length);
+        *length = key->value_length;
+        return CKR_OK;
+    }
+
+    if (CKO_PRIVATE_KEY != key->key_class) {
+        return CKR_KEY_NOT_WRAPPABLE;
+    }
+
+    PKCS8_PRIV_KEY_INFO *info = EVP_PKEY2PKCS8(key->pkey);
+    unsigned char *der = NULL;
+    int der_length = info ? i2d_PKCS8_PRIV_KEY_INFO(info, &der) : -1;
+    PKCS8_PRIV_KEY_INFO_free(info);
+    if (der_length <= 0) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    *material = der;
+    *length = (CK_ULONG) der_length;
+    return CKR_OK;
+}
+
+/**
+ * Pad key material for the CloudHSM AES key wrap mechanisms, which apply
+ * RFC 3394 to material padded out to the 8 byte block.
+ */
+static CK_RV soft_cloudhsm_wrap_pad(CK_MECHANISM_TYPE mechanism, CK_BYTE_PTR in, CK_ULONG in_length,
+                                    CK_BYTE_PTR *out, CK_ULONG_PTR out_length) {
+    CK_ULONG padding = 0;
+
+    if (CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD == mechanism) {
+        padding = SOFT_KEY_WRAP_BLOCK - (in_length % SOFT_KEY_WRAP_BLOCK);
+    } else if (CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD == mechanism) {
+        padding = (SOFT_KEY_WRAP_BLOCK - (in_length % SOFT_KEY_WRAP_BLOCK)) % SOFT_KEY_WRAP_BLOCK;
+    } else if (0 != in_length % SOFT_KEY_WRAP_BLOCK) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    *out = OPENSSL_malloc(in_length + padding);
+    if (!*out) {
+        return CKR_HOST_MEMORY;
+    }
+
+    memcpy(*out, in, in_length);
+    memset(*out + in_length, CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD == mechanism ? (int) padding : 0, padding);
+    *out_length = in_length + padding;
+    return CKR_OK;
+}
+
+/**
+ * Remove CloudHSM AES key wrap padding after unwrapping. Zero padding can not
+ * be removed unambiguously, so CKA_VALUE_LEN from the template is used when present.
+ */
+static CK_RV soft_cloudhsm_wrap_unpad(CK_MECHANISM_TYPE mechanism, CK_BYTE_PTR data, CK_ULONG_PTR length,
+                                      CK_ATTRIBUTE_PTR template, CK_ULONG count) {
+    if (CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD == mechanism) {
+        CK_BYTE padding = *length ? data[*length - 1] : 0;
+        if (0 == padding || padding > SOFT_KEY_WRAP_BLOCK || padding > *length) {
+            return CKR_WRAPPED_KEY_INVALID;
+        }
+        for (CK_ULONG i = *length - padding; i < *length; i++) {
+            if (data[i] != padding) {
+                return CKR_WRAPPED_KEY_INVALID;
+            }
+        }
+        *length -= padding;
+    } else if (CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD == mechanism) {
+        CK_ULONG value_length = 0;
+        if (CKR_OK == soft_template_get_ulong(template, count, CKA_VALUE_LEN, &value_length)) {
+            if (value_length > *length) {
+                return CKR_TEMPLATE_INCONSISTENT;
+            }
+            *length = value_length;
+        }
+    }
+    return CKR_OK;
+}
+
+/**
+ * Encrypt or decrypt with an RSA key for wrapping, using the RSA mechanism parameters.
+ * The output buffer is allocated here.
+ */
+static CK_RV soft_rsa_wrap_crypt(EVP_PKEY *pkey, CK_MECHANISM_PTR mechanism, CK_BBOOL encrypt,
+                                 CK_BYTE_PTR in, CK_ULONG in_length,
+                                 CK_BYTE_PTR *out, CK_ULONG_PTR out_length) {
+    struct soft_operation op;
+    memset(&op, 0, sizeof(op));
+
+    op.key.key_class = encrypt ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY;
+    op.key.key_type = CKK_RSA;
+    op.key.pkey = pkey;
+    EVP_PKEY_up_ref(pkey);
+
+    CK_RV rv = soft_cipher_init(&op, mechanism, encrypt);
+    if (CKR_OK == rv) {
+        rv = soft_cipher_single(&op, in, in_length, NULL, out_length);
+    }
+    if (CKR_OK == rv) {
+        *out = OPENSSL_malloc(*out_length);
+        rv = *out ? soft_cipher_single(&op, in, in_length, *out, out_length) : CKR_HOST_MEMORY;
+    }
+
+    soft_operation_reset(&op);
+    return rv;
+}
+
+/**
+ * Encrypt or decrypt with AES-GCM for wrapping. The tag follows the ciphertext.
+ */
+static CK_RV soft_gcm_wrap_crypt(struct soft_key *key, CK_MECHANISM_PTR mechanism, CK_BBOOL encrypt,
+                                 CK_BYTE_PTR in, CK_ULONG in_length,
+                                 CK_BYTE_PTR *out, CK_ULONG_PTR out_length) {
+    struct soft_operation op;
+    memset(&op, 0, sizeof(op));
+    op.key = *key;
+    if (op.key.pkey) {
+        EVP_PKEY_up_ref(op.key.pkey);
+    }
+
+    CK_RV rv = soft_cipher_init(&op, mechanism, encrypt);
+    if (CKR_OK == rv) {
+        *out_length = in_length + op.tag_length;
+        *out = OPENSSL_malloc(*out_length);
+        rv = *out ? soft_cipher_single(&op, in, in_length, *out, out_length) : CKR_HOST_MEMORY;
+    }
+
+    soft_operation_reset(&op);
+    return rv;
+}
+
+/**
+ * Wrap key material with CKM_RSA_AES_KEY_WRAP: an ephemeral AES key wrapped
+ * with RSA OAEP, followed by the material wrapped with the ephemeral key (RFC 5649).
+ */
+static CK_RV soft_rsa_aes_wrap(EVP_PKEY *pkey, CK_RSA_AES_KEY_WRAP_PARAMS *params,
+                               CK_BYTE_PTR material, CK_ULONG material_length,
+                               CK_BYTE_PTR *out, CK_ULONG_PTR out_length) {
+    CK_BYTE ephemeral[32];
+    CK_ULONG ephemeral_length = params->ulAESKeyBits / 8;
+    CK_BYTE_PTR wrapped_ephemeral = NULL;
+    CK_ULONG wrapped_ephemeral_length = 0;
+    CK_MECHANISM oaep = { CKM_RSA_PKCS_OAEP, params->pOAEPParams, sizeof(CK_RSA_PKCS_OAEP_PARAMS) };
+
+    if (!soft_secret_key_length_valid(CKK_AES, ephemeral_length) || !params->pOAEPParams) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (1 != RAND_bytes(ephemeral, (int) ephemeral_length)) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    CK_RV rv = soft_rsa_wrap_crypt(pkey, &oaep, CK_TRUE, ephemeral, ephemeral_length,
+                                   &wrapped_ephemeral, &wrapped_ephemeral_length);
+    if (CKR_OK == rv) {
+        CK_ULONG wrapped_length = material_length + 2 * SOFT_KEY_WRAP_BLOCK;
+        *out = OPENSSL_malloc(wrapped_ephemeral_length + wrapped_length);
+        if (!*out) {
+            rv = CKR_HOST_MEMORY;
+        } else {
+            memcpy(*out, wrapped_ephemeral, wrapped_ephemeral_length);
+            rv = soft_aes_key_wrap(ephemeral, ephemeral_length, CK_TRUE, material, material_length,
+                                   *out + wrapped_ephemeral_length, &wrapped_length);
+            *out_length = wrapped_ephemeral_length + wrapped_length;
+        }
+    }
+
+    OPENSSL_free(wrapped_ephemeral);
+    OPENSSL_cleanse(ephemeral, sizeof(ephemeral));
+    return rv;
+}
+
+static CK_RV soft_rsa_aes_unwrap(EVP_PKEY *pkey, CK_RSA_AES_KEY_WRAP_PARAMS *params,
+                                 CK_BYTE_PTR in, CK_ULONG in_length,
+                                 CK_BYTE_PTR *out, CK_ULONG_PTR out_length) {
+    CK_BYTE_PTR ephemeral = NULL;
+    CK_ULONG ephemeral_length = 0;
+    CK_ULONG wrapped_ephemeral_length = (CK_ULONG) EVP_PKEY_size(pkey);
+    CK_MECHANISM oaep = { CKM_RSA_PKCS_OAEP, params->pOAEPParams, sizeof(CK_RSA_PKCS_OAEP_PARAMS) };
+
+    if (!params->pOAEPParams) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (in_length <= wrapped_ephemeral_length) {
+        return CKR_WRAPPED_KEY_LEN_RANGE;
+    }
+
+    CK_RV rv = soft_rsa_wrap_crypt(pkey, &oaep, CK_FALSE, in, wrapped_ephemeral_length,
+                                   &ephemeral, &ephemeral_length);
+    if (CKR_OK == rv && ephemeral_length != params->ulAESKeyBits / 8) {
+        rv = CKR_WRAPPED_KEY_INVALID;
+    }
+    if (CKR_OK == rv) {
+        *out_length = in_length - wrapped_ephemeral_length;
+        *out = OPENSSL_malloc(*out_length);
+        rv = *out ? soft_aes_key_unwrap(ephemeral, ephemeral_length, CK_TRUE, in + wrapped_ephemeral_length,
+                                        in_length - wrapped_ephemeral_length, *out, out_length)
+                  : CKR_HOST_MEMORY;
+    }
+
+    OPENSSL_clear_free(ephemeral, ephemeral_length);
+    return rv;
+}
+
+/**
+ * Check the wrapping key suits the mechanism.
+ */
+static CK_RV soft_wrapping_key_check(CK_MECHANISM_TYPE mechanism, struct soft_key *key) {
+    switch (mechanism) {
+        case CKM_RSA_PKCS:
+        case CKM_RSA_PKCS_OAEP:
+        case CKM_RSA_AES_KEY_WRAP:
+            return (CKK_RSA == key->key_type) ? CKR_OK : CKR_WRAPPING_KEY_TYPE_INCONSISTENT;
+        default:
+            return (CKK_AES == key->key_type && CKO_SECRET_KEY == key->key_class)
+                   ? CKR_OK : CKR_WRAPPING_KEY_TYPE_INCONSISTENT;
+    }
+}
+
+CK_RV C_WrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey,
+                CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen) {
+    struct soft_key wrapping_key;
+    struct soft_key key;
+    CK_BYTE_PTR material = NULL;
+    CK_ULONG material_length = 0;
+    CK_BYTE_PTR wrapped = NULL;
+    CK_ULONG wrapped_length = 0;
+
+    CK_RV rv = soft_key_call_begin(hSession, pMechanism, CKF_WRAP);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulWrappedKeyLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    rv = soft_object_get_key(hWrappingKey, CKA_WRAP, &wrapping_key);
+    if (CKR_KEY_HANDLE_INVALID == rv) {
+        return CKR_WRAPPING_KEY_HANDLE_INVALID;
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = soft_wrapping_key_check(pMechanism->mechanism, &wrapping_key);
+    if (CKR_OK == rv) {
+        rv = soft_object_get_wrappable_key(hWrappingKey, hKey, &key);
+        if (CKR_OK == rv) {
+            rv = soft_key_material(&key, &material, &material_length);
+            soft_key_release(&key);
+        }
+    }
+
+    if (CKR_OK == rv) {
+        switch (pMechanism->mechanism) {
+            case CKM_AES_GCM:
+                rv = soft_gcm_wrap_crypt(&wrapping_key, pMechanism, CK_TRUE, material, material_length,
+                                         &wrapped, &wrapped_length);
+                break;
+            case CKM_AES_KEY_WRAP_PAD:
+                wrapped_length = material_length + 2 * SOFT_KEY_WRAP_BLOCK;
+                wrapped = OPENSSL_malloc(wrapped_length);
+                rv = wrapped ? soft_aes_key_wrap(wrapping_key.value, wrapping_key.value_length, CK_TRUE,
+                                                 material, material_length, wrapped, &wrapped_length)
+                             : CKR_HOST_MEMORY;
+                break;
+            case CKM_RSA_PKCS:
+            case CKM_RSA_PKCS_OAEP:
+                rv = soft_rsa_wrap_crypt(wrapping_key.pkey, pMechanism, CK_TRUE, material, material_length,
+                                         &wrapped, &wrapped_length);
+                break;
+            case CKM_RSA_AES_KEY_WRAP:
+                if (!pMechanism->pParameter || sizeof(CK_RSA_AES_KEY_WRAP_PARAMS) != pMechanism->ulParameterLen) {
+                    rv = CKR_MECHANISM_PARAM_INVALID;
+                    break;
+                }
+                rv = soft_rsa_aes_wrap(wrapping_key.pkey, pMechanism->pParameter, material, material_length,
+                                       &wrapped, &wrapped_length);
+                break;
+            default: {
+                // CKM_AES_KEY_WRAP and the CloudHSM variants are RFC 3394 over padded material.
+                CK_BYTE_PTR padded = NULL;
+                CK_ULONG padded_length = 0;
+                rv = soft_cloudhsm_wrap_pad(pMechanism->mechanism, material, material_length,
+                                            &padded, &padded_length);
+                if (CKR_OK == rv) {
+                    wrapped_length = padded_length + SOFT_KEY_WRAP_BLOCK;
+                    wrapped = OPENSSL_malloc(wrapped_length);
+                    rv = wrapped ? soft_aes_key_wrap(wrapping_key.value, wrapping_key.value_length, CK_FALSE,
+                                                     padded, padded_length, wrapped, &wrapped_length)
+                                 : CKR_HOST_MEMORY;
+                    OPENSSL_clear_free(padded, padded_length);
+                }
+                break;
+            }
+        }
+    }
+
+    if (CKR_OK == rv) {
+        if (!pWrappedKey) {
+            *pulWrappedKeyLen = wrapped_length;
+        } else if (*pulWrappedKeyLen < wrapped_length) {
+            *pulWrappedKeyLen = wrapped_length;
+            rv = CKR_BUFFER_TOO_SMALL;
+        } else {
+            memcpy(pWrappedKey, wrapped, wrapped_length);
+            *pulWrappedKeyLen = wrapped_length;
+        }
+    }
+
+    OPENSSL_free(wrapped);
+    if (material) {
+        OPENSSL_clear_free(material, material_length);
+    }
+    soft_key_release(&wrapping_key);
+    return rv;
+}
+
+/**
+ * Turn unwrapped material into a new object of the class the template asks for.
+ */
+static CK_RV soft_unwrapped_key_create(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                       CK_BYTE_PTR material, CK_ULONG material_length,
+                                       CK_OBJECT_HANDLE_PTR handle) {
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+
+    CK_RV rv = soft_template_get_ulong(template, count, CKA_CLASS, &key_class);
+    if (CKR_OK == rv) {
+        rv = soft_template_get_ulong(template, count, CKA_KEY_TYPE, &key_type);
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (CKO_SECRET_KEY == key_class) {
+        if (!soft_secret_key_length_valid(key_type, material_length)) {
+            return CKR_WRAPPED_KEY_INVALID;
+        }
+        return soft_object_create_secret_key(hSession, template, count, key_type, material, material_length,
+                                             CK_UNAVAILABLE_INFORMATION, handle);
+    }
+
+    if (CKO_PRIVATE_KEY != key_class) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    const unsigned char *der = material;
+    PKCS8_PRIV_KEY_INFO *info = d2i_PKCS8_PRIV_KEY_INFO(NULL, &der, (long) material_length);
+    EVP_PKEY *pkey = info ? EVP_PKCS82PKEY(info) : NULL;
+    PKCS8_PRIV_KEY_INFO_free(info);
+    if (!pkey) {
+        return CKR_WRAPPED_KEY_INVALID;
+    }
+
+    rv = soft_object_create_private_key(hSession, template, count, pkey, handle);
+    EVP_PKEY_free(pkey);
+    return rv;
+}
+
+CK_RV C_UnwrapKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+                  CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, CK_ULONG ulWrappedKeyLen,
+                  CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey) {
+    struct soft_key unwrapping_key;
+    CK_ATTRIBUTE_PTR template = NULL;
+    CK_ULONG count = 0;
+    CK_BYTE_PTR material = NULL;
+    CK_ULONG material_length = 0;
+
+    CK_RV rv = soft_key_call_begin(hSession, pMechanism, CKF_UNWRAP);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pWrappedKey || (!pTemplate && ulAttributeCount) || !phKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    rv = soft_object_get_key(hUnwrappingKey, CKA_UNWRAP, &unwrapping_key);
+    if (CKR_KEY_HANDLE_INVALID == rv) {
+        return CKR_UNWRAPPING_KEY_HANDLE_INVALID;
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    rv = soft_wrapping_key_check(pMechanism->mechanism, &unwrapping_key);
+    if (CKR_WRAPPING_KEY_TYPE_INCONSISTENT == rv) {
+        rv = CKR_UNWRAPPING_KEY_TYPE_INCONSISTENT;
+    }
+    if (CKR_OK == rv) {
+        rv = soft_object_unwrap_template(hUnwrappingKey, pTemplate, ulAttributeCount, &template, &count);
+    }
+
+    if (CKR_OK == rv) {
+        switch (pMechanism->mechanism) {
+            case CKM_AES_GCM:
+                rv = soft_gcm_wrap_crypt(&unwrapping_key, pMechanism, CK_FALSE, pWrappedKey, ulWrappedKeyLen,
+                                         &material, &material_length);
+                break;
+            case CKM_AES_KEY_WRAP_PAD:
+                material_length = ulWrappedKeyLen;
+                material = OPENSSL_malloc(material_length);
+                rv = material ? soft_aes_key_unwrap(unwrapping_key.value, unwrapping_key.value_length, CK_TRUE,
+                                                    pWrappedKey, ulWrappedKeyLen, material, &material_length)
+                              : CKR_HOST_MEMORY;
+                break;
+            case CKM_RSA_PKCS:
+            case CKM_RSA_PKCS_OAEP:
+                rv = soft_rsa_wrap_crypt(unwrapping_key.pkey, pMechanism, CK_FALSE, pWrappedKey, ulWrappedKeyLen,
+                                         &material, &material_length);
+                break;
+            case CKM_RSA_AES_KEY_WRAP:
+                if (!pMechanism->pParameter || sizeof(CK_RSA_AES_KEY_WRAP_PARAMS) != pMechanism->ulParameterLen) {
+                    rv = CKR_MECHANISM_PARAM_INVALID;
+                    break;
+                }
+                rv = soft_rsa_aes_unwrap(unwrapping_key.pkey, pMechanism->pParameter, pWrappedKey, ulWrappedKeyLen,
+                                         &material, &material_length);
+                break;
+            default:
+                material_length = ulWrappedKeyLen;
+                material = OPENSSL_malloc(material_length);
+                rv = material ? soft_aes_key_unwrap(unwrapping_key.value, unwrapping_key.value_length, CK_FALSE,
+                                                    pWrappedKey, ulWrappedKeyLen, material, &material_length)
+                              : CKR_HOST_MEMORY;
+                if (CKR_OK == rv) {
+                    rv = soft_cloudhsm_wrap_unpad(pMechanism->mechanism, material, &material_length,
+                                                  template, count);
+                }
+                break;
+        }
+    }
+
+    if (CKR_OK == rv) {
+        rv = soft_unwrapped_key_create(hSession, template, count, material, material_length, phKey);
+    }
+
+    if (material) {
+        OPENSSL_clear_free(material, material_length);
+    }
+    free(template);
+    soft_key_release(&unwrapping_key);
+    return rv;
+}
+
+/**
+ * CKM_ECDH1_DERIVE without a KDF: the shared secret is the x coordinate of
+ * the product, and the new key takes its leftmost bytes.
+ */
+static CK_RV soft_derive_ecdh(struct soft_key *base_key, CK_MECHANISM_PTR mechanism,
+                              CK_BYTE_PTR value, CK_ULONG length) {
+    CK_ECDH1_DERIVE_PARAMS *params = mechanism->pParameter;
+    EVP_PKEY *peer = NULL;
+    unsigned char *secret = NULL;
+    size_t secret_length = 0;
+
+    if (!params || sizeof(CK_ECDH1_DERIVE_PARAMS) != mechanism->ulParameterLen || !params->pPublicData) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (CKD_NULL != params->kdf) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (CKK_EC != base_key->key_type || CKO_PRIVATE_KEY != base_key->key_class) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    const EC_KEY *ec = EVP_PKEY_get0_EC_KEY(base_key->pkey);
+    CK_RV rv = soft_ec_public_key(EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)),
+                                  params->pPublicData, params->ulPublicDataLen, &peer);
+    if (CKR_OK != rv) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(base_key->pkey, NULL);
+    rv = CKR_FUNCTION_FAILED;
+    if (ctx && 1 == EVP_PKEY_derive_init(ctx) && 1 == EVP_PKEY_derive_set_peer(ctx, peer)
+        && 1 == EVP_PKEY_derive(ctx, NULL, &secret_length)) {
+        secret = OPENSSL_malloc(secret_length);
+        if (secret && 1 == EVP_PKEY_derive(ctx, secret, &secret_length)) {
+            if (length > secret_length) {
+                rv = CKR_KEY_SIZE_RANGE;
+            } else {
+                memcpy(value, secret, length);
+                rv = CKR_OK;
+            }
+        }
+    }
+
+    if (secret) {
+        OPENSSL_clear_free(secret, secret_length);
+    }
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return rv;
+}
+
+/**
+ * Write an integer big endian into a field of width bits.
+ */
+static CK_RV soft_encode_width(CK_ULONG value, CK_ULONG width, CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    if (0 == width || width > 64 || 0 != width % 8) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+
+    CK_ULONG bytes = width / 8;
+    for (CK_ULONG i = 0; i < bytes; i++) {
+        out[bytes - 1 - i] = (CK_BYTE) ((unsigned long long) value >> (8 * i));
+    }
+    *out_length = bytes;
+    return CKR_OK;
+}
+
+/**
+ * One block of the pseudo random function for the SP 800-108 KDFs.
+ */
+static CK_RV soft_kdf_prf(CK_MECHANISM_TYPE prf, struct soft_key *key,
+                          CK_BYTE_PTR data, CK_ULONG data_length,
+                          CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    if (CKM_AES_CMAC == prf) {
+        const EVP_CIPHER *cipher = NULL;
+        switch (key->value_length) {
+            case 16: cipher = EVP_aes_128_cbc(); break;
+            case 24: cipher = EVP_aes_192_cbc(); break;
+            case 32: cipher = EVP_aes_256_cbc(); break;
+            default: return CKR_KEY_SIZE_RANGE;
+        }
+
+        size_t length = 0;
+        CMAC_CTX *ctx = CMAC_CTX_new();
+        CK_RV rv = CKR_FUNCTION_FAILED;
+        if (ctx && 1 == CMAC_Init(ctx, key->value, key->value_length, cipher, NULL)
+            && 1 == CMAC_Update(ctx, data, data_length) && 1 == CMAC_Final(ctx, out, &length)) {
+            *out_length = (CK_ULONG) length;
+            rv = CKR_OK;
+        }
+        CMAC_CTX_free(ctx);
+        return rv;
+    }
+
+    const EVP_MD *md = soft_md_from_mechanism(prf);
+    unsigned int length = 0;
+    if (!md) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (!HMAC(md, key->value, (int) key->value_length, data, data_length, out, &length)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    *out_length = length;
+    return CKR_OK;
+}
+
+/**
+ * Build the fixed input for one iteration of the SP 800-108 counter mode KDF.
+ *
+ * The CloudHSM mechanism takes an ordered list of byte arrays, the iteration
+ * counter and the DKM length. The older mechanism takes the counter and DKM
+ * formats, a label and a context, and always lays them out as
+ * [i] || Label || 0x00 || Context || [L].
+ */
+static CK_RV soft_kdf_input(CK_MECHANISM_TYPE mechanism, CK_SP800_108_KDF_PARAMS *params,
+                            CK_ULONG counter, CK_ULONG length_bits,
+                            CK_BYTE_PTR input, CK_ULONG capacity, CK_ULONG_PTR input_length) {
+    CK_BYTE field[8];
+    CK_ULONG field_length = 0;
+    CK_ULONG counter_width = 32;
+    CK_ULONG dkm_width = 32;
+    CK_PRF_DATA_PARAM *label = NULL;
+    CK_PRF_DATA_PARAM *context = NULL;
+    CK_ULONG used = 0;
+    CK_RV rv = CKR_OK;
+
+#define SOFT_KDF_APPEND(data, length) \
+    do { \
+        if (used + (length) > capacity) { return CKR_MECHANISM_PARAM_INVALID; } \
+        memcpy(input + used, (data), (length)); \
+        used += (length); \
+    } while (0)
+
+    for (CK_ULONG i = 0; i < params->ulNumberOfDataParams; i++) {
+        CK_PRF_DATA_PARAM *param = &params->pDataParams[i];
+        if (!param->pValue && param->ulValueLen) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+
+        if (CKM_CLOUDHSM_SP800_108_COUNTER_KDF == mechanism) {
+            if (CK_SP800_108_BYTE_ARRAY == param->type) {
+                SOFT_KDF_APPEND(param->pValue, param->ulValueLen);
+            } else if (CK_SP800_108_ITERATION_VARIABLE == param->type
+                       && sizeof(CK_SP800_108_COUNTER_FORMAT) == param->ulValueLen) {
+                CK_SP800_108_COUNTER_FORMAT *format = param->pValue;
+                rv = soft_encode_width(counter, format->ulWidthInBits, field, &field_length);
+                if (CKR_OK != rv || format->ulWidthInBits > 32) {
+                    return CKR_MECHANISM_PARAM_INVALID;
+                }
+                SOFT_KDF_APPEND(field, field_length);
+            } else if (CK_SP800_108_DKM_LENGTH == param->type
+                       && sizeof(CK_SP800_108_DKM_LENGTH_FORMAT) == param->ulValueLen) {
+                CK_SP800_108_DKM_LENGTH_FORMAT *format = param->pValue;
+                if (SP800_108_DKM_LENGTH_SUM_OF_KEYS != format->dkmLengthMethod
+                    || CKR_OK != soft_encode_width(length_bits, format->ulWidthInBits, field, &field_length)) {
+                    return CKR_MECHANISM_PARAM_INVALID;
+                }
+                SOFT_KDF_APPEND(field, field_length);
+            } else {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+        } else {
+            if (SP800_108_COUNTER_FORMAT == param->type
+                && sizeof(CK_SP800_108_COUNTER_FORMAT) == param->ulValueLen) {
+                counter_width = ((CK_SP800_108_COUNTER_FORMAT *) param->pValue)->ulWidthInBits;
+            } else if (SP800_108_DKM_FORMAT == param->type
+                       && sizeof(CK_SP800_108_DKM_LENGTH_FORMAT) == param->ulValueLen) {
+                dkm_width = ((CK_SP800_108_DKM_LENGTH_FORMAT *) param->pValue)->ulWidthInBits;
+            } else if (SP800_108_PRF_LABEL == param->type) {
+                label = param;
+            } else if (SP800_108_PRF_CONTEXT == param->type) {
+                context = param;
+            } else {
+                return CKR_MECHANISM_PARAM_INVALID;
+            }
+        }
+    }
+
+    if (CKM_CLOUDHSM_SP800_108_COUNTER_KDF != mechanism) {
+        CK_BYTE separator = 0;
+
+        rv = soft_encode_width(counter, counter_width, field, &field_length);
+        if (CKR_OK != rv || counter_width > 32) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+        SOFT_KDF_APPEND(field, field_length);
+        if (label) {
+            SOFT_KDF_APPEND(label->pValue, label->ulValueLen);
+        }
+        SOFT_KDF_APPEND(&separator, 1);
+        if (context) {
+            SOFT_KDF_APPEND(context->pValue, context->ulValueLen);
+        }
+        rv = soft_encode_width(length_bits, dkm_width, field, &field_length);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+        SOFT_KDF_APPEND(field, field_length);
+    }
+
+#undef SOFT_KDF_APPEND
+
+    *input_length = used;
+    return CKR_OK;
+}
+
+/**
+ * SP 800-108 counter mode KDF: K(i) = PRF(KI, input(i)) for i = 1..n,
+ * and the new key is the leftmost bytes of K(1) || K(2) || ...
+ */
+static CK_RV soft_derive_sp800_108(struct soft_key *base_key, CK_MECHANISM_PTR mechanism,
+                                   CK_BYTE_PTR value, CK_ULONG length) {
+    CK_SP800_108_KDF_PARAMS *params = mechanism->pParameter;
+    CK_BYTE block[EVP_MAX_MD_SIZE];
+    CK_ULONG block_length = 0;
+    CK_ULONG produced = 0;
+
+    if (!params || sizeof(CK_SP800_108_KDF_PARAMS) != mechanism->ulParameterLen
+        || (!params->pDataParams && params->ulNumberOfDataParams)) {
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+    if (CKO_SECRET_KEY != base_key->key_class) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    CK_ULONG capacity = 16;
+    for (CK_ULONG i = 0; i < params->ulNumberOfDataParams; i++) {
+        capacity += params->pDataParams[i].ulValueLen + 8;
+    }
+    CK_BYTE_PTR input = malloc(capacity);
+    if (!input) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_OK;
+    for (CK_ULONG counter = 1; CKR_OK == rv && produced < length; counter++) {
+        CK_ULONG input_length = 0;
+        rv = soft_kdf_input(mechanism->mechanism, params, counter, length * 8, input, capacity, &input_length);
+        if (CKR_OK == rv) {
+            rv = soft_kdf_prf(params->prftype, base_key, input, input_length, block, &block_length);
+        }
+        if (CKR_OK == rv) {
+            CK_ULONG take = (length - produced) < block_length ? (length - produced) : block_length;
+            memcpy(value + produced, block, take);
+            produced += take;
+        }
+    }
+
+    OPENSSL_cleanse(block, sizeof(block));
+    free(input);
+    return rv;
+}
+
+CK_RV C_DeriveKey(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey,
+                  CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey) {
+    struct soft_key base_key;
+    CK_BYTE value[SOFT_MAX_SECRET_KEY_LENGTH];
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_KEY_TYPE key_type;
+    CK_ULONG length = 0;
+
+    CK_RV rv = soft_key_call_begin(hSession, pMechanism, CKF_DERIVE);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!pTemplate && ulAttributeCount) || !phKey) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (CKR_TEMPLATE_INCOMPLETE != soft_template_get_ulong(pTemplate, ulAttributeCount, CKA_CLASS, &key_class)
+        && CKO_SECRET_KEY != key_class) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+    rv = soft_template_get_ulong(pTemplate, ulAttributeCount, CKA_KEY_TYPE, &key_type);
+    if (CKR_OK == rv) {
+        rv = soft_template_get_ulong(pTemplate, ulAttributeCount, CKA_VALUE_LEN, &length);
+        if (CKR_TEMPLATE_INCOMPLETE == rv && CKK_DES3 == key_type) {
+            length = 24;
+            rv = CKR_OK;
+        }
+    }
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!soft_secret_key_length_valid(key_type, length)) {
+        return CKR_KEY_SIZE_RANGE;
+    }
+
+    rv = soft_object_get_key(hBaseKey, CKA_DERIVE, &base_key);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (CKM_ECDH1_DERIVE == pMechanism->mechanism) {
+        rv = soft_derive_ecdh(&base_key, pMechanism, value, length);
+    } else {
+        rv = soft_derive_sp800_108(&base_key, pMechanism, value, length);
+    }
+    soft_key_release(&base_key);
+
+    if (CKR_OK == rv) {
+        if (CKK_DES3 == key_type) {
+            soft_des_set_parity(value, length);
+        }
+        rv = soft_object_create_secret_key(hSession, pTemplate, ulAttributeCount, key_type, value, length,
+                                           pMechanism->mechanism, phKey);
+    }
+
+    OPENSSL_cleanse(value, sizeof(value));
+    return rv;
+}
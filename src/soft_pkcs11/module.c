@@ -0,0 +1,737 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <openssl/rand.h>
+
+#include "soft_pkcs11.h"
+
+/*
+ * Environment variables read by C_Initialize.
+ * SOFT_PKCS11_LATENCY_US adds a fixed delay to every call which would be a
+ * round trip to the HSM, so client side pipelining can be measured locally.
+ * SOFT_PKCS11_PIN, when set, is the only PIN C_Login accepts.
+ * SOFT_PKCS11_STRAGGLER_EVERY and SOFT_PKCS11_STRAGGLER_US make every Nth
+ * round trip take that much longer, like a request served by a slow HSM.
+ */
+#define SOFT_LATENCY_ENV "SOFT_PKCS11_LATENCY_US"
+#define SOFT_PIN_ENV "SOFT_PKCS11_PIN"
+#define SOFT_STRAGGLER_EVERY_ENV "SOFT_PKCS11_STRAGGLER_EVERY"
+#define SOFT_STRAGGLER_ENV "SOFT_PKCS11_STRAGGLER_US"
+
+#define SOFT_SIGN_FLAGS (CKF_SIGN | CKF_VERIFY)
+#define SOFT_CIPHER_FLAGS (CKF_ENCRYPT | CKF_DECRYPT)
+#define SOFT_WRAP_FLAGS (CKF_WRAP | CKF_UNWRAP)
+
+static const struct soft_mechanism soft_mechanisms[] = {
+        { CKM_AES_KEY_GEN,                     16,   32,    CKF_HW | CKF_GENERATE },
+        { CKM_DES3_KEY_GEN,                    24,   24,    CKF_HW | CKF_GENERATE },
+        { CKM_GENERIC_SECRET_KEY_GEN,          1,    SOFT_MAX_SECRET_KEY_LENGTH, CKF_HW | CKF_GENERATE },
+        { CKM_RSA_PKCS_KEY_PAIR_GEN,           2048, 4096,  CKF_HW | CKF_GENERATE_KEY_PAIR },
+        { CKM_RSA_X9_31_KEY_PAIR_GEN,          2048, 4096,  CKF_HW | CKF_GENERATE_KEY_PAIR },
+        { CKM_EC_KEY_PAIR_GEN,                 256,  521,   CKF_HW | CKF_GENERATE_KEY_PAIR },
+        { CKM_AES_ECB,                         16,   32,    CKF_HW | SOFT_CIPHER_FLAGS },
+        { CKM_AES_CBC,                         16,   32,    CKF_HW | SOFT_CIPHER_FLAGS },
+        { CKM_AES_CBC_PAD,                     16,   32,    CKF_HW | SOFT_CIPHER_FLAGS },
+        { CKM_AES_CTR,                         16,   32,    CKF_HW | SOFT_CIPHER_FLAGS },
+        { CKM_AES_GCM,                         16,   32,    CKF_HW | SOFT_CIPHER_FLAGS | SOFT_WRAP_FLAGS },
+        { CKM_DES3_ECB,                        24,   24,    CKF_HW | SOFT_CIPHER_FLAGS },
+        { CKM_AES_KEY_WRAP,                    16,   32,    CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_AES_KEY_WRAP_PAD,                16,   32,    CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_CLOUDHSM_AES_KEY_WRAP_NO_PAD,    16,   32,    CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD, 16,   32,    CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_CLOUDHSM_AES_KEY_WRAP_ZERO_PAD,  16,   32,    CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_RSA_PKCS,                        2048, 4096,  CKF_HW | SOFT_CIPHER_FLAGS | SOFT_SIGN_FLAGS | SOFT_WRAP_FLAGS },
+        { CKM_RSA_PKCS_OAEP,                   2048, 4096,  CKF_HW | SOFT_CIPHER_FLAGS | SOFT_WRAP_FLAGS },
+        { CKM_RSA_AES_KEY_WRAP,                2048, 4096,  CKF_HW | SOFT_WRAP_FLAGS },
+        { CKM_RSA_PKCS_PSS,                    2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA1_RSA_PKCS,                   2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA224_RSA_PKCS,                 2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA256_RSA_PKCS,                 2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA384_RSA_PKCS,                 2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA512_RSA_PKCS,                 2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA1_RSA_PKCS_PSS,               2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA224_RSA_PKCS_PSS,             2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA256_RSA_PKCS_PSS,             2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA384_RSA_PKCS_PSS,             2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_SHA512_RSA_PKCS_PSS,             2048, 4096,  CKF_HW | SOFT_SIGN_FLAGS },
+        { CKM_ECDSA,                           256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_ECDSA_SHA1,                      256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_ECDSA_SHA224,                    256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_ECDSA_SHA256,                    256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_ECDSA_SHA384,                    256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_ECDSA_SHA512,                    256,  521,   CKF_HW | SOFT_SIGN_FLAGS | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_SHA_1,                           0,    0,     CKF_HW | CKF_DIGEST },
+        { CKM_SHA224,                          0,    0,     CKF_HW | CKF_DIGEST },
+        { CKM_SHA256,                          0,    0,     CKF_HW | CKF_DIGEST },
+        { CKM_SHA384,                          0,    0,     CKF_HW | CKF_DIGEST },
+        { CKM_SHA512,                          0,    0,     CKF_HW | CKF_DIGEST },
+        { CKM_ECDH1_DERIVE,                    256,  521,   CKF_HW | CKF_DERIVE | CKF_EC_F_P | CKF_EC_NAMEDCURVE | CKF_EC_UNCOMPRESS },
+        { CKM_SP800_108_COUNTER_KDF,           16,   SOFT_MAX_SECRET_KEY_LENGTH, CKF_HW | CKF_DERIVE },
+        { CKM_CLOUDHSM_SP800_108_COUNTER_KDF,  16,   SOFT_MAX_SECRET_KEY_LENGTH, CKF_HW | CKF_DERIVE },
+};
+
+static const size_t soft_mechanisms_len = (sizeof(soft_mechanisms)/sizeof(soft_mechanisms[0]));
+
+/*
+ * Module wide state. The lock guards the session table and the login state;
+ * objects are guarded separately in object.c.
+ */
+static pthread_mutex_t soft_lock = PTHREAD_MUTEX_INITIALIZER;
+static CK_BBOOL soft_initialized = CK_FALSE;
+static CK_BBOOL soft_logged_in = CK_FALSE;
+static struct soft_session **soft_sessions = NULL;
+static CK_ULONG soft_session_capacity = 0;
+static CK_ULONG soft_session_count = 0;
+static unsigned long soft_latency_us = 0;
+static unsigned long soft_straggler_every = 0;
+static unsigned long soft_straggler_us = 0;
+static atomic_ulong soft_round_trips;
+static char *soft_pin = NULL;
+
+static CK_FUNCTION_LIST soft_function_list;
+
+/**
+ * Copy a string into a blank padded, non terminated PKCS#11 field.
+ * @param field
+ * @param field_length
+ * @param value
+ */
+static void soft_pad(CK_UTF8CHAR *field, size_t field_length, const char *value) {
+    size_t length = strlen(value);
+
+    memset(field, ' ', field_length);
+    memcpy(field, value, length < field_length ? length : field_length);
+}
+
+CK_BBOOL soft_is_initialized(void) {
+    pthread_mutex_lock(&soft_lock);
+    CK_BBOOL initialized = soft_initialized;
+    pthread_mutex_unlock(&soft_lock);
+    return initialized;
+}
+
+CK_BBOOL soft_is_logged_in(void) {
+    pthread_mutex_lock(&soft_lock);
+    CK_BBOOL logged_in = soft_logged_in;
+    pthread_mutex_unlock(&soft_lock);
+    return logged_in;
+}
+
+/**
+ * Emulate the network round trip to the HSM. Called outside of every lock so
+ * concurrent callers overlap their waits, as they would against a cluster.
+ */
+void soft_round_trip(void) {
+    unsigned long delay_us = soft_latency_us;
+
+    if (soft_straggler_every && 0 == atomic_fetch_add(&soft_round_trips, 1) % soft_straggler_every) {
+        delay_us += soft_straggler_us;
+    }
+    if (0 == delay_us) {
+        return;
+    }
+
+    struct timespec delay = {
+            (time_t) (delay_us / 1000000),
+            (long) (delay_us % 1000000) * 1000
+    };
+    while (0 != nanosleep(&delay, &delay)) {
+    }
+}
+
+/**
+ * Look up an open session.
+ * @param handle
+ * @param session
+ * @return CKR_OK, CKR_CRYPTOKI_NOT_INITIALIZED or CKR_SESSION_HANDLE_INVALID
+ */
+CK_RV soft_session_get(CK_SESSION_HANDLE handle, struct soft_session **session) {
+    CK_RV rv = CKR_OK;
+
+    pthread_mutex_lock(&soft_lock);
+    if (!soft_initialized) {
+        rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+    } else if (CK_INVALID_HANDLE == handle || handle > soft_session_capacity || NULL == soft_sessions[handle - 1]) {
+        rv = CKR_SESSION_HANDLE_INVALID;
+    } else {
+        *session = soft_sessions[handle - 1];
+    }
+    pthread_mutex_unlock(&soft_lock);
+
+    return rv;
+}
+
+const struct soft_mechanism *soft_mechanism_find(CK_MECHANISM_TYPE type) {
+    for (size_t i = 0; i < soft_mechanisms_len; i++) {
+        if (soft_mechanisms[i].type == type) {
+            return &soft_mechanisms[i];
+        }
+    }
+    return NULL;
+}
+
+static void soft_session_free(struct soft_session *session) {
+    soft_operation_reset(&session->encrypt);
+    soft_operation_reset(&session->decrypt);
+    soft_operation_reset(&session->digest);
+    soft_operation_reset(&session->sign);
+    soft_operation_reset(&session->verify);
+    free(session->found);
+    free(session);
+}
+
+CK_RV C_Initialize(CK_VOID_PTR pInitArgs) {
+    CK_C_INITIALIZE_ARGS_PTR args = pInitArgs;
+
+    if (args && args->pReserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&soft_lock);
+    if (soft_initialized) {
+        pthread_mutex_unlock(&soft_lock);
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+
+    CK_RV rv = soft_objects_initialize();
+    if (CKR_OK != rv) {
+        pthread_mutex_unlock(&soft_lock);
+        return rv;
+    }
+
+    const char *latency = getenv(SOFT_LATENCY_ENV);
+    soft_latency_us = latency ? strtoul(latency, NULL, 0) : 0;
+
+    const char *straggler_every = getenv(SOFT_STRAGGLER_EVERY_ENV);
+    const char *straggler = getenv(SOFT_STRAGGLER_ENV);
+    soft_straggler_every = straggler_every ? strtoul(straggler_every, NULL, 0) : 0;
+    soft_straggler_us = straggler ? strtoul(straggler, NULL, 0) : 0;
+    atomic_store(&soft_round_trips, 1);
+
+    const char *pin = getenv(SOFT_PIN_ENV);
+    soft_pin = pin ? strdup(pin) : NULL;
+
+    soft_logged_in = CK_FALSE;
+    soft_initialized = CK_TRUE;
+    pthread_mutex_unlock(&soft_lock);
+
+    return CKR_OK;
+}
+
+CK_RV C_Finalize(CK_VOID_PTR pReserved) {
+    if (pReserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    pthread_mutex_lock(&soft_lock);
+    if (!soft_initialized) {
+        pthread_mutex_unlock(&soft_lock);
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+
+    for (CK_ULONG i = 0; i < soft_session_capacity; i++) {
+        if (soft_sessions[i]) {
+            soft_session_free(soft_sessions[i]);
+        }
+    }
+    free(soft_sessions);
+    soft_sessions = NULL;
+    soft_session_capacity = 0;
+    soft_session_count = 0;
+
+    free(soft_pin);
+    soft_pin = NULL;
+
+    soft_objects_finalize();
+    soft_logged_in = CK_FALSE;
+    soft_initialized = CK_FALSE;
+    pthread_mutex_unlock(&soft_lock);
+
+    return CKR_OK;
+}
+
+CK_RV C_GetInfo(CK_INFO_PTR pInfo) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(pInfo, 0, sizeof(*pInfo));
+    pInfo->cryptokiVersion.major = CRYPTOKI_VERSION_MAJOR;
+    pInfo->cryptokiVersion.minor = CRYPTOKI_VERSION_MINOR;
+    soft_pad(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "aws-cloudhsm-pkcs11-examples");
+    soft_pad(pInfo->libraryDescription, sizeof(pInfo->libraryDescription), "Software PKCS#11 module");
+    pInfo->libraryVersion.major = 1;
+    pInfo->libraryVersion.minor = 0;
+
+    return CKR_OK;
+}
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) __attribute__((visibility("default")));
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList) {
+    if (!ppFunctionList) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *ppFunctionList = &soft_function_list;
+    return CKR_OK;
+}
+
+CK_RV C_GetSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (!pulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!pSlotList) {
+        *pulCount = 1;
+        return CKR_OK;
+    }
+
+    if (*pulCount < 1) {
+        *pulCount = 1;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    pSlotList[0] = SOFT_SLOT_ID;
+    *pulCount = 1;
+    return CKR_OK;
+}
+
+CK_RV C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(pInfo, 0, sizeof(*pInfo));
+    soft_pad(pInfo->slotDescription, sizeof(pInfo->slotDescription), "Software slot");
+    soft_pad(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "aws-cloudhsm-pkcs11-examples");
+    pInfo->flags = CKF_TOKEN_PRESENT;
+    pInfo->hardwareVersion.major = 1;
+    pInfo->firmwareVersion.major = 1;
+
+    return CKR_OK;
+}
+
+CK_RV C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    memset(pInfo, 0, sizeof(*pInfo));
+    soft_pad(pInfo->label, sizeof(pInfo->label), "soft_pkcs11");
+    soft_pad(pInfo->manufacturerID, sizeof(pInfo->manufacturerID), "aws-cloudhsm-pkcs11-examples");
+    soft_pad(pInfo->model, sizeof(pInfo->model), "Software");
+    soft_pad(pInfo->serialNumber, sizeof(pInfo->serialNumber), "1");
+    soft_pad(pInfo->utcTime, sizeof(pInfo->utcTime), "");
+    pInfo->flags = CKF_RNG | CKF_LOGIN_REQUIRED | CKF_USER_PIN_INITIALIZED | CKF_TOKEN_INITIALIZED;
+    pInfo->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+    pInfo->ulMaxRwSessionCount = CK_EFFECTIVELY_INFINITE;
+    pInfo->ulMaxPinLen = 256;
+    pInfo->ulMinPinLen = 1;
+    pInfo->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+    pInfo->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+    pInfo->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+    pInfo->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+    pInfo->hardwareVersion.major = 1;
+    pInfo->firmwareVersion.major = 1;
+
+    pthread_mutex_lock(&soft_lock);
+    pInfo->ulSessionCount = soft_session_count;
+    pInfo->ulRwSessionCount = soft_session_count;
+    pthread_mutex_unlock(&soft_lock);
+
+    return CKR_OK;
+}
+
+CK_RV C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!pulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    // The KDF entries share a value when the vendor header aliases them.
+    CK_ULONG count = 0;
+    for (size_t i = 0; i < soft_mechanisms_len; i++) {
+        if (soft_mechanism_find(soft_mechanisms[i].type) != &soft_mechanisms[i]) {
+            continue;
+        }
+        if (pMechanismList && count < *pulCount) {
+            pMechanismList[count] = soft_mechanisms[i].type;
+        }
+        count++;
+    }
+
+    CK_RV rv = CKR_OK;
+    if (pMechanismList && *pulCount < count) {
+        rv = CKR_BUFFER_TOO_SMALL;
+    }
+    *pulCount = count;
+    return rv;
+}
+
+CK_RV C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    const struct soft_mechanism *mechanism = soft_mechanism_find(type);
+    if (!mechanism) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    pInfo->ulMinKeySize = mechanism->min_key_size;
+    pInfo->ulMaxKeySize = mechanism->max_key_size;
+    pInfo->flags = mechanism->flags;
+    return CKR_OK;
+}
+
+CK_RV C_InitToken(CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_InitPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SetPIN(CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen,
+               CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
+                    CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+    if (!(flags & CKF_SERIAL_SESSION)) {
+        return CKR_SESSION_PARALLEL_NOT_SUPPORTED;
+    }
+    if (!phSession) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    struct soft_session *session = calloc(1, sizeof(struct soft_session));
+    if (!session) {
+        return CKR_HOST_MEMORY;
+    }
+    session->flags = flags;
+
+    pthread_mutex_lock(&soft_lock);
+    CK_ULONG slot = 0;
+    while (slot < soft_session_capacity && soft_sessions[slot]) {
+        slot++;
+    }
+
+    if (slot == soft_session_capacity) {
+        CK_ULONG capacity = soft_session_capacity ? soft_session_capacity * 2 : 16;
+        struct soft_session **sessions = realloc(soft_sessions, capacity * sizeof(struct soft_session *));
+        if (!sessions) {
+            pthread_mutex_unlock(&soft_lock);
+            free(session);
+            return CKR_HOST_MEMORY;
+        }
+        memset(sessions + soft_session_capacity, 0,
+               (capacity - soft_session_capacity) * sizeof(struct soft_session *));
+        soft_sessions = sessions;
+        soft_session_capacity = capacity;
+    }
+
+    session->handle = slot + 1;
+    soft_sessions[slot] = session;
+    soft_session_count++;
+    pthread_mutex_unlock(&soft_lock);
+
+    *phSession = session->handle;
+    return CKR_OK;
+}
+
+CK_RV C_CloseSession(CK_SESSION_HANDLE hSession) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    pthread_mutex_lock(&soft_lock);
+    if (soft_sessions[hSession - 1] != session) {
+        pthread_mutex_unlock(&soft_lock);
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    soft_sessions[hSession - 1] = NULL;
+    soft_session_count--;
+
+    // Closing the last session logs the application out of the token.
+    if (0 == soft_session_count) {
+        soft_logged_in = CK_FALSE;
+    }
+    pthread_mutex_unlock(&soft_lock);
+
+    soft_objects_destroy_session(hSession);
+    soft_session_free(session);
+    return CKR_OK;
+}
+
+CK_RV C_CloseAllSessions(CK_SLOT_ID slotID) {
+    if (!soft_is_initialized()) {
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+    if (SOFT_SLOT_ID != slotID) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    CK_ULONG capacity;
+    pthread_mutex_lock(&soft_lock);
+    capacity = soft_session_capacity;
+    pthread_mutex_unlock(&soft_lock);
+
+    for (CK_ULONG handle = 1; handle <= capacity; handle++) {
+        C_CloseSession(handle);
+    }
+    return CKR_OK;
+}
+
+CK_RV C_GetSessionInfo(CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pInfo) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_BBOOL rw = (session->flags & CKF_RW_SESSION) ? CK_TRUE : CK_FALSE;
+    pInfo->slotID = SOFT_SLOT_ID;
+    pInfo->flags = session->flags;
+    pInfo->ulDeviceError = 0;
+    if (soft_is_logged_in()) {
+        pInfo->state = rw ? CKS_RW_USER_FUNCTIONS : CKS_RO_USER_FUNCTIONS;
+    } else {
+        pInfo->state = rw ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV C_GetOperationState(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+                          CK_ULONG_PTR pulOperationStateLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SetOperationState(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState,
+                          CK_ULONG ulOperationStateLen, CK_OBJECT_HANDLE hEncryptionKey,
+                          CK_OBJECT_HANDLE hAuthenticationKey) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (CKU_USER != userType && CKU_SO != userType) {
+        return CKR_USER_TYPE_INVALID;
+    }
+    if (!pPin) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    pthread_mutex_lock(&soft_lock);
+    if (soft_logged_in) {
+        rv = CKR_USER_ALREADY_LOGGED_IN;
+    } else if (0 == ulPinLen) {
+        rv = CKR_PIN_INCORRECT;
+    } else if (soft_pin && (strlen(soft_pin) != ulPinLen || 0 != memcmp(soft_pin, pPin, ulPinLen))) {
+        rv = CKR_PIN_INCORRECT;
+    } else {
+        soft_logged_in = CK_TRUE;
+    }
+    pthread_mutex_unlock(&soft_lock);
+
+    return rv;
+}
+
+CK_RV C_Logout(CK_SESSION_HANDLE hSession) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    pthread_mutex_lock(&soft_lock);
+    if (!soft_logged_in) {
+        rv = CKR_USER_NOT_LOGGED_IN;
+    }
+    soft_logged_in = CK_FALSE;
+    pthread_mutex_unlock(&soft_lock);
+
+    return rv;
+}
+
+CK_RV C_SeedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pSeed && ulSeedLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+    RAND_seed(pSeed, (int) ulSeedLen);
+    return CKR_OK;
+}
+
+CK_RV C_GenerateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!RandomData && ulRandomLen) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+    if (1 != RAND_bytes(RandomData, (int) ulRandomLen)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE hSession) {
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_CancelFunction(CK_SESSION_HANDLE hSession) {
+    return CKR_FUNCTION_NOT_PARALLEL;
+}
+
+CK_RV C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestKey(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+                    CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_VerifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen,
+                      CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                            CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+                            CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+                          CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen,
+                            CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen) {
+    return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/*
+ * The function list is built from pkcs11f.h, so the entries are always in
+ * the order the CK_FUNCTION_LIST structure expects.
+ */
+#undef CK_NEED_ARG_LIST
+#define CK_PKCS11_FUNCTION_INFO(name) name,
+
+static CK_FUNCTION_LIST soft_function_list = {
+        { CRYPTOKI_VERSION_MAJOR, CRYPTOKI_VERSION_MINOR },
+#include "pkcs11f.h"
+};
+
+#undef CK_PKCS11_FUNCTION_INFO
@@ -0,0 +1,1191 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+
+#include "soft_pkcs11.h"
+
+struct soft_object {
+    CK_OBJECT_HANDLE handle;
+    // The session which created a session object, or CK_INVALID_HANDLE for token objects.
+    CK_SESSION_HANDLE owner;
+    struct soft_attribute_list attributes;
+    EVP_PKEY *pkey;
+};
+
+/*
+ * The object table is indexed by handle - 1. Destroyed slots are kept on a
+ * free stack and reused, so the table stays dense under key churn.
+ */
+static pthread_rwlock_t soft_objects_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct soft_object **soft_objects = NULL;
+static CK_ULONG soft_objects_capacity = 0;
+static CK_ULONG *soft_free_slots = NULL;
+static CK_ULONG soft_free_count = 0;
+
+static const CK_ATTRIBUTE_TYPE soft_bool_attributes[] = {
+        CKA_TOKEN, CKA_PRIVATE, CKA_MODIFIABLE, CKA_COPYABLE, CKA_DESTROYABLE,
+        CKA_SENSITIVE, CKA_EXTRACTABLE, CKA_ENCRYPT, CKA_DECRYPT, CKA_SIGN, CKA_VERIFY,
+        CKA_WRAP, CKA_UNWRAP, CKA_DERIVE, CKA_TRUSTED, CKA_WRAP_WITH_TRUSTED,
+        CKA_LOCAL, CKA_ALWAYS_SENSITIVE, CKA_NEVER_EXTRACTABLE,
+};
+
+static const CK_ATTRIBUTE_TYPE soft_ulong_attributes[] = {
+        CKA_CLASS, CKA_KEY_TYPE, CKA_VALUE_LEN, CKA_MODULUS_BITS, CKA_KEY_GEN_MECHANISM,
+};
+
+// Attributes only the module sets; a template may not supply them.
+static const CK_ATTRIBUTE_TYPE soft_computed_attributes[] = {
+        CKA_LOCAL, CKA_ALWAYS_SENSITIVE, CKA_NEVER_EXTRACTABLE, CKA_KEY_GEN_MECHANISM,
+};
+
+// Attributes which can not change once the object exists.
+static const CK_ATTRIBUTE_TYPE soft_fixed_attributes[] = {
+        CKA_CLASS, CKA_KEY_TYPE, CKA_TOKEN, CKA_PRIVATE, CKA_VALUE, CKA_VALUE_LEN,
+        CKA_MODULUS, CKA_MODULUS_BITS, CKA_PUBLIC_EXPONENT, CKA_EC_PARAMS, CKA_EC_POINT,
+        CKA_LOCAL, CKA_ALWAYS_SENSITIVE, CKA_NEVER_EXTRACTABLE, CKA_KEY_GEN_MECHANISM,
+        CKA_MODIFIABLE, CKA_COPYABLE, CKA_DESTROYABLE, CKA_WRAP_TEMPLATE, CKA_UNWRAP_TEMPLATE,
+};
+
+// Private key components, which are never revealed.
+static const CK_ATTRIBUTE_TYPE soft_private_components[] = {
+        CKA_PRIVATE_EXPONENT, CKA_PRIME_1, CKA_PRIME_2, CKA_EXPONENT_1, CKA_EXPONENT_2,
+        CKA_COEFFICIENT, CKA_VALUE,
+};
+
+#define SOFT_CONTAINS(list, type) soft_contains(list, sizeof(list) / sizeof(list[0]), type)
+
+static CK_BBOOL soft_contains(const CK_ATTRIBUTE_TYPE *list, size_t length, CK_ATTRIBUTE_TYPE type) {
+    for (size_t i = 0; i < length; i++) {
+        if (list[i] == type) {
+            return CK_TRUE;
+        }
+    }
+    return CK_FALSE;
+}
+
+/**
+ * Deep copy an array attribute (a nested template) into one allocation:
+ * the CK_ATTRIBUTE array followed by every value.
+ */
+static CK_VOID_PTR soft_template_dup(CK_ATTRIBUTE_PTR template, CK_ULONG length) {
+    CK_ULONG count = length / sizeof(CK_ATTRIBUTE);
+    size_t size = count * sizeof(CK_ATTRIBUTE);
+
+    for (CK_ULONG i = 0; i < count; i++) {
+        size += template[i].ulValueLen;
+    }
+
+    CK_ATTRIBUTE_PTR copy = malloc(size ? size : 1);
+    if (!copy) {
+        return NULL;
+    }
+
+    CK_BYTE_PTR values = (CK_BYTE_PTR) (copy + count);
+    for (CK_ULONG i = 0; i < count; i++) {
+        copy[i].type = template[i].type;
+        copy[i].ulValueLen = template[i].ulValueLen;
+        copy[i].pValue = values;
+        if (template[i].ulValueLen) {
+            memcpy(values, template[i].pValue, template[i].ulValueLen);
+        }
+        values += template[i].ulValueLen;
+    }
+
+    return copy;
+}
+
+CK_RV soft_attributes_set(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type,
+                          CK_VOID_PTR value, CK_ULONG length) {
+    CK_VOID_PTR copy;
+
+    if (type & CKF_ARRAY_ATTRIBUTE) {
+        copy = soft_template_dup(value, length);
+    } else {
+        copy = malloc(length ? length : 1);
+        if (copy && length) {
+            memcpy(copy, value, length);
+        }
+    }
+    if (!copy) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (CK_ULONG i = 0; i < list->count; i++) {
+        if (list->attributes[i].type == type) {
+            OPENSSL_clear_free(list->attributes[i].pValue, list->attributes[i].ulValueLen);
+            list->attributes[i].pValue = copy;
+            list->attributes[i].ulValueLen = length;
+            return CKR_OK;
+        }
+    }
+
+    if (list->count == list->capacity) {
+        CK_ULONG capacity = list->capacity ? list->capacity * 2 : 32;
+        CK_ATTRIBUTE_PTR attributes = realloc(list->attributes, capacity * sizeof(CK_ATTRIBUTE));
+        if (!attributes) {
+            free(copy);
+            return CKR_HOST_MEMORY;
+        }
+        list->attributes = attributes;
+        list->capacity = capacity;
+    }
+
+    list->attributes[list->count].type = type;
+    list->attributes[list->count].pValue = copy;
+    list->attributes[list->count].ulValueLen = length;
+    list->count++;
+    return CKR_OK;
+}
+
+void soft_attributes_free(struct soft_attribute_list *list) {
+    for (CK_ULONG i = 0; i < list->count; i++) {
+        OPENSSL_clear_free(list->attributes[i].pValue, list->attributes[i].ulValueLen);
+    }
+    free(list->attributes);
+    memset(list, 0, sizeof(*list));
+}
+
+static CK_RV soft_attributes_set_ulong(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type, CK_ULONG value) {
+    return soft_attributes_set(list, type, &value, sizeof(value));
+}
+
+static CK_RV soft_attributes_set_bool(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type, CK_BBOOL value) {
+    return soft_attributes_set(list, type, &value, sizeof(value));
+}
+
+CK_ATTRIBUTE_PTR soft_template_find(CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_ATTRIBUTE_TYPE type) {
+    for (CK_ULONG i = 0; template && i < count; i++) {
+        if (template[i].type == type) {
+            return &template[i];
+        }
+    }
+    return NULL;
+}
+
+CK_RV soft_template_get_ulong(CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_ATTRIBUTE_TYPE type,
+                              CK_ULONG_PTR value) {
+    CK_ATTRIBUTE_PTR attribute = soft_template_find(template, count, type);
+    if (!attribute) {
+        return CKR_TEMPLATE_INCOMPLETE;
+    }
+    if (sizeof(CK_ULONG) != attribute->ulValueLen || !attribute->pValue) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+
+    memcpy(value, attribute->pValue, sizeof(CK_ULONG));
+    return CKR_OK;
+}
+
+static CK_BBOOL soft_list_bool(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type) {
+    CK_ATTRIBUTE_PTR attribute = soft_template_find(list->attributes, list->count, type);
+    if (!attribute || sizeof(CK_BBOOL) != attribute->ulValueLen) {
+        return CK_FALSE;
+    }
+    return *(CK_BBOOL *) attribute->pValue ? CK_TRUE : CK_FALSE;
+}
+
+static CK_ULONG soft_list_ulong(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type) {
+    CK_ULONG value = CK_UNAVAILABLE_INFORMATION;
+    soft_template_get_ulong(list->attributes, list->count, type, &value);
+    return value;
+}
+
+/**
+ * Check the basic shape of a caller supplied attribute.
+ * @param attribute
+ * @return CKR_OK or CKR_ATTRIBUTE_VALUE_INVALID
+ */
+static CK_RV soft_attribute_validate(CK_ATTRIBUTE_PTR attribute) {
+    if (!attribute->pValue && attribute->ulValueLen) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    if (SOFT_CONTAINS(soft_bool_attributes, attribute->type) && sizeof(CK_BBOOL) != attribute->ulValueLen) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    if (SOFT_CONTAINS(soft_ulong_attributes, attribute->type) && sizeof(CK_ULONG) != attribute->ulValueLen) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    if ((attribute->type & CKF_ARRAY_ATTRIBUTE) && 0 != attribute->ulValueLen % sizeof(CK_ATTRIBUTE)) {
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    return CKR_OK;
+}
+
+/**
+ * Apply a caller template on top of the defaults for a new object.
+ * @param list
+ * @param template
+ * @param count
+ * @return
+ */
+static CK_RV soft_attributes_apply(struct soft_attribute_list *list, CK_ATTRIBUTE_PTR template, CK_ULONG count) {
+    for (CK_ULONG i = 0; template && i < count; i++) {
+        CK_RV rv = soft_attribute_validate(&template[i]);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+        if (SOFT_CONTAINS(soft_computed_attributes, template[i].type)) {
+            return CKR_ATTRIBUTE_READ_ONLY;
+        }
+
+        rv = soft_attributes_set(list, template[i].type, template[i].pValue, template[i].ulValueLen);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+    }
+    return CKR_OK;
+}
+
+/**
+ * Set the attributes every key has, before the caller template is applied.
+ */
+static CK_RV soft_key_defaults(struct soft_attribute_list *list, CK_OBJECT_CLASS key_class, CK_KEY_TYPE key_type) {
+    CK_RV rv = CKR_OK;
+    CK_BBOOL secret = (CKO_PUBLIC_KEY != key_class) ? CK_TRUE : CK_FALSE;
+
+    rv |= soft_attributes_set_ulong(list, CKA_CLASS, key_class);
+    rv |= soft_attributes_set_ulong(list, CKA_KEY_TYPE, key_type);
+    rv |= soft_attributes_set_bool(list, CKA_TOKEN, CK_FALSE);
+    rv |= soft_attributes_set_bool(list, CKA_PRIVATE, secret);
+    rv |= soft_attributes_set_bool(list, CKA_MODIFIABLE, CK_TRUE);
+    rv |= soft_attributes_set_bool(list, CKA_COPYABLE, CK_TRUE);
+    rv |= soft_attributes_set_bool(list, CKA_DESTROYABLE, CK_TRUE);
+    rv |= soft_attributes_set(list, CKA_LABEL, NULL, 0);
+    rv |= soft_attributes_set(list, CKA_ID, NULL, 0);
+    rv |= soft_attributes_set_bool(list, CKA_DERIVE, CK_FALSE);
+
+    if (CKO_PRIVATE_KEY != key_class) {
+        rv |= soft_attributes_set_bool(list, CKA_ENCRYPT, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_VERIFY, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_WRAP, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_TRUSTED, CK_FALSE);
+    }
+
+    if (CKO_PUBLIC_KEY != key_class) {
+        rv |= soft_attributes_set_bool(list, CKA_DECRYPT, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_SIGN, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_UNWRAP, CK_FALSE);
+        rv |= soft_attributes_set_bool(list, CKA_SENSITIVE, CK_TRUE);
+        rv |= soft_attributes_set_bool(list, CKA_EXTRACTABLE, CK_TRUE);
+        rv |= soft_attributes_set_bool(list, CKA_WRAP_WITH_TRUSTED, CK_FALSE);
+    }
+
+    return CKR_OK == rv ? CKR_OK : CKR_HOST_MEMORY;
+}
+
+/**
+ * Set the attributes which describe how the key came to exist. These are
+ * applied after the template, so they always win.
+ * @param mechanism The generation mechanism, or CK_UNAVAILABLE_INFORMATION for imported keys.
+ */
+static CK_RV soft_key_provenance(struct soft_attribute_list *list, CK_OBJECT_CLASS key_class,
+                                 CK_MECHANISM_TYPE mechanism) {
+    CK_RV rv = CKR_OK;
+    CK_BBOOL local = (CK_UNAVAILABLE_INFORMATION != mechanism) ? CK_TRUE : CK_FALSE;
+
+    rv |= soft_attributes_set_bool(list, CKA_LOCAL, local);
+    rv |= soft_attributes_set_ulong(list, CKA_KEY_GEN_MECHANISM, mechanism);
+
+    if (CKO_PUBLIC_KEY != key_class) {
+        rv |= soft_attributes_set_bool(list, CKA_ALWAYS_SENSITIVE,
+                                       local && soft_list_bool(list, CKA_SENSITIVE));
+        rv |= soft_attributes_set_bool(list, CKA_NEVER_EXTRACTABLE,
+                                       local && !soft_list_bool(list, CKA_EXTRACTABLE));
+    }
+
+    return CKR_OK == rv ? CKR_OK : CKR_HOST_MEMORY;
+}
+
+static void soft_object_free(struct soft_object *object) {
+    if (!object) {
+        return;
+    }
+    soft_attributes_free(&object->attributes);
+    EVP_PKEY_free(object->pkey);
+    free(object);
+}
+
+/**
+ * Check the class and key type survived the template, then add the object to the store.
+ * Session objects are owned by the session which created them.
+ */
+static CK_RV soft_object_insert(CK_SESSION_HANDLE session, struct soft_object *object,
+                                CK_OBJECT_CLASS key_class, CK_KEY_TYPE key_type) {
+    if (soft_list_ulong(&object->attributes, CKA_CLASS) != key_class
+        || (CK_UNAVAILABLE_INFORMATION != key_type && soft_list_ulong(&object->attributes, CKA_KEY_TYPE) != key_type)) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    object->owner = soft_list_bool(&object->attributes, CKA_TOKEN) ? CK_INVALID_HANDLE : session;
+
+    pthread_rwlock_wrlock(&soft_objects_lock);
+    CK_ULONG slot;
+    if (soft_free_count > 0) {
+        slot = soft_free_slots[--soft_free_count];
+    } else {
+        CK_ULONG capacity = soft_objects_capacity ? soft_objects_capacity * 2 : 256;
+        struct soft_object **objects = realloc(soft_objects, capacity * sizeof(struct soft_object *));
+        CK_ULONG *free_slots = objects ? realloc(soft_free_slots, capacity * sizeof(CK_ULONG)) : NULL;
+        if (objects) {
+            soft_objects = objects;
+        }
+        if (!free_slots) {
+            pthread_rwlock_unlock(&soft_objects_lock);
+            return CKR_HOST_MEMORY;
+        }
+        soft_free_slots = free_slots;
+
+        // Hand out the lowest new handles first.
+        for (CK_ULONG i = capacity; i > soft_objects_capacity + 1; i--) {
+            soft_objects[i - 1] = NULL;
+            soft_free_slots[soft_free_count++] = i - 1;
+        }
+        slot = soft_objects_capacity;
+        soft_objects_capacity = capacity;
+    }
+
+    object->handle = slot + 1;
+    soft_objects[slot] = object;
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return CKR_OK;
+}
+
+/**
+ * Find a visible object. The caller holds the store lock.
+ * Private objects are hidden until the application logs in.
+ */
+static struct soft_object *soft_object_lookup(CK_OBJECT_HANDLE handle, CK_BBOOL logged_in) {
+    if (CK_INVALID_HANDLE == handle || handle > soft_objects_capacity) {
+        return NULL;
+    }
+
+    struct soft_object *object = soft_objects[handle - 1];
+    if (object && !logged_in && soft_list_bool(&object->attributes, CKA_PRIVATE)) {
+        return NULL;
+    }
+    return object;
+}
+
+static void soft_object_remove(CK_OBJECT_HANDLE handle) {
+    soft_object_free(soft_objects[handle - 1]);
+    soft_objects[handle - 1] = NULL;
+    soft_free_slots[soft_free_count++] = handle - 1;
+}
+
+CK_RV soft_objects_initialize(void) {
+    return CKR_OK;
+}
+
+void soft_objects_finalize(void) {
+    pthread_rwlock_wrlock(&soft_objects_lock);
+    for (CK_ULONG i = 0; i < soft_objects_capacity; i++) {
+        soft_object_free(soft_objects[i]);
+    }
+    free(soft_objects);
+    free(soft_free_slots);
+    soft_objects = NULL;
+    soft_free_slots = NULL;
+    soft_objects_capacity = 0;
+    soft_free_count = 0;
+    pthread_rwlock_unlock(&soft_objects_lock);
+}
+
+void soft_objects_destroy_session(CK_SESSION_HANDLE session) {
+    pthread_rwlock_wrlock(&soft_objects_lock);
+    for (CK_ULONG i = 0; i < soft_objects_capacity; i++) {
+        if (soft_objects[i] && soft_objects[i]->owner == session) {
+            soft_object_remove(i + 1);
+        }
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+}
+
+CK_RV soft_object_create_secret_key(CK_SESSION_HANDLE session,
+                                    CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                    CK_KEY_TYPE key_type,
+                                    CK_BYTE_PTR value, CK_ULONG value_length,
+                                    CK_MECHANISM_TYPE mechanism,
+                                    CK_OBJECT_HANDLE_PTR handle) {
+    struct soft_object *object = calloc(1, sizeof(struct soft_object));
+    if (!object) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = soft_key_defaults(&object->attributes, CKO_SECRET_KEY, key_type);
+    if (CKR_OK == rv) {
+        rv = soft_attributes_apply(&object->attributes, template, count);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_attributes_set(&object->attributes, CKA_VALUE, value, value_length);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_attributes_set_ulong(&object->attributes, CKA_VALUE_LEN, value_length);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_key_provenance(&object->attributes, CKO_SECRET_KEY, mechanism);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_object_insert(session, object, CKO_SECRET_KEY, key_type);
+    }
+
+    if (CKR_OK != rv) {
+        soft_object_free(object);
+        return rv;
+    }
+
+    *handle = object->handle;
+    return CKR_OK;
+}
+
+/**
+ * Build a public or private key object around an OpenSSL key.
+ * The object takes its own reference on pkey.
+ */
+static CK_RV soft_object_new_asymmetric(CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                        CK_OBJECT_CLASS key_class, EVP_PKEY *pkey,
+                                        CK_MECHANISM_TYPE mechanism, struct soft_object **result) {
+    struct soft_object *object = calloc(1, sizeof(struct soft_object));
+    if (!object) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = soft_key_defaults(&object->attributes, key_class, soft_pkey_key_type(pkey));
+    if (CKR_OK == rv) {
+        rv = soft_attributes_apply(&object->attributes, template, count);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_pkey_attributes(pkey, key_class, &object->attributes);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_key_provenance(&object->attributes, key_class, mechanism);
+    }
+
+    if (CKR_OK != rv) {
+        soft_object_free(object);
+        return rv;
+    }
+
+    EVP_PKEY_up_ref(pkey);
+    object->pkey = pkey;
+    *result = object;
+    return CKR_OK;
+}
+
+CK_RV soft_object_create_key_pair(CK_SESSION_HANDLE session,
+                                  CK_ATTRIBUTE_PTR public_template, CK_ULONG public_count,
+                                  CK_ATTRIBUTE_PTR private_template, CK_ULONG private_count,
+                                  EVP_PKEY *pkey, CK_MECHANISM_TYPE mechanism,
+                                  CK_OBJECT_HANDLE_PTR public_key, CK_OBJECT_HANDLE_PTR private_key) {
+    struct soft_object *public_object = NULL;
+    struct soft_object *private_object = NULL;
+    CK_KEY_TYPE key_type = soft_pkey_key_type(pkey);
+
+    CK_RV rv = soft_object_new_asymmetric(public_template, public_count, CKO_PUBLIC_KEY,
+                                          pkey, mechanism, &public_object);
+    if (CKR_OK == rv) {
+        rv = soft_object_new_asymmetric(private_template, private_count, CKO_PRIVATE_KEY,
+                                        pkey, mechanism, &private_object);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_object_insert(session, public_object, CKO_PUBLIC_KEY, key_type);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_object_insert(session, private_object, CKO_PRIVATE_KEY, key_type);
+        if (CKR_OK != rv) {
+            pthread_rwlock_wrlock(&soft_objects_lock);
+            soft_object_remove(public_object->handle);
+            pthread_rwlock_unlock(&soft_objects_lock);
+            soft_object_free(private_object);
+            return rv;
+        }
+    }
+
+    if (CKR_OK != rv) {
+        soft_object_free(public_object);
+        soft_object_free(private_object);
+        return rv;
+    }
+
+    *public_key = public_object->handle;
+    *private_key = private_object->handle;
+    return CKR_OK;
+}
+
+CK_RV soft_object_create_private_key(CK_SESSION_HANDLE session,
+                                     CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                     EVP_PKEY *pkey, CK_OBJECT_HANDLE_PTR handle) {
+    struct soft_object *object = NULL;
+
+    CK_RV rv = soft_object_new_asymmetric(template, count, CKO_PRIVATE_KEY, pkey,
+                                          CK_UNAVAILABLE_INFORMATION, &object);
+    if (CKR_OK == rv) {
+        rv = soft_object_insert(session, object, CKO_PRIVATE_KEY, soft_pkey_key_type(pkey));
+        if (CKR_OK != rv) {
+            soft_object_free(object);
+        }
+    }
+    if (CKR_OK == rv) {
+        *handle = object->handle;
+    }
+    return rv;
+}
+
+/**
+ * Copy key material out of the store for an operation.
+ * @param handle
+ * @param usage The attribute which must be true, such as CKA_ENCRYPT.
+ * @param key
+ * @return
+ */
+static CK_RV soft_object_copy_key(struct soft_object *object, struct soft_key *key) {
+    memset(key, 0, sizeof(*key));
+    key->key_class = soft_list_ulong(&object->attributes, CKA_CLASS);
+    key->key_type = soft_list_ulong(&object->attributes, CKA_KEY_TYPE);
+
+    if (CKO_SECRET_KEY == key->key_class) {
+        CK_ATTRIBUTE_PTR value = soft_template_find(object->attributes.attributes, object->attributes.count, CKA_VALUE);
+        if (!value || value->ulValueLen > sizeof(key->value)) {
+            return CKR_KEY_TYPE_INCONSISTENT;
+        }
+        memcpy(key->value, value->pValue, value->ulValueLen);
+        key->value_length = value->ulValueLen;
+    } else if (object->pkey) {
+        EVP_PKEY_up_ref(object->pkey);
+        key->pkey = object->pkey;
+    } else {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV soft_object_get_key(CK_OBJECT_HANDLE handle, CK_ATTRIBUTE_TYPE usage, struct soft_key *key) {
+    CK_BBOOL logged_in = soft_is_logged_in();
+    CK_RV rv;
+
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(handle, logged_in);
+    if (!object) {
+        rv = CKR_KEY_HANDLE_INVALID;
+    } else if (!soft_list_bool(&object->attributes, usage)) {
+        rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+    } else {
+        rv = soft_object_copy_key(object, key);
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+/**
+ * Check every attribute in a nested template against an object.
+ */
+static CK_BBOOL soft_object_matches(struct soft_object *object, CK_ATTRIBUTE_PTR template, CK_ULONG count) {
+    for (CK_ULONG i = 0; i < count; i++) {
+        CK_ATTRIBUTE_PTR attribute = soft_template_find(object->attributes.attributes, object->attributes.count,
+                                                        template[i].type);
+        if (!attribute || attribute->ulValueLen != template[i].ulValueLen
+            || (template[i].ulValueLen && 0 != memcmp(attribute->pValue, template[i].pValue, template[i].ulValueLen))) {
+            return CK_FALSE;
+        }
+    }
+    return CK_TRUE;
+}
+
+CK_RV soft_object_get_wrappable_key(CK_OBJECT_HANDLE wrapping_key, CK_OBJECT_HANDLE handle, struct soft_key *key) {
+    CK_BBOOL logged_in = soft_is_logged_in();
+    CK_RV rv = CKR_OK;
+
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *wrapper = soft_object_lookup(wrapping_key, logged_in);
+    struct soft_object *object = soft_object_lookup(handle, logged_in);
+
+    if (!wrapper) {
+        rv = CKR_WRAPPING_KEY_HANDLE_INVALID;
+    } else if (!object) {
+        rv = CKR_KEY_HANDLE_INVALID;
+    } else if (!soft_list_bool(&object->attributes, CKA_EXTRACTABLE)) {
+        rv = CKR_KEY_UNEXTRACTABLE;
+    } else if (soft_list_bool(&object->attributes, CKA_WRAP_WITH_TRUSTED)
+               && !soft_list_bool(&wrapper->attributes, CKA_TRUSTED)) {
+        rv = CKR_KEY_NOT_WRAPPABLE;
+    } else {
+        CK_ATTRIBUTE_PTR wrap_template = soft_template_find(wrapper->attributes.attributes, wrapper->attributes.count,
+                                                            CKA_WRAP_TEMPLATE);
+        if (wrap_template && !soft_object_matches(object, wrap_template->pValue,
+                                                  wrap_template->ulValueLen / sizeof(CK_ATTRIBUTE))) {
+            rv = CKR_KEY_NOT_WRAPPABLE;
+        }
+    }
+
+    if (CKR_OK == rv) {
+        rv = soft_object_copy_key(object, key);
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+CK_RV soft_object_unwrap_template(CK_OBJECT_HANDLE unwrapping_key,
+                                  CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                  CK_ATTRIBUTE_PTR *merged, CK_ULONG_PTR merged_count) {
+    CK_BBOOL logged_in = soft_is_logged_in();
+    CK_ATTRIBUTE_PTR unwrap_template = NULL;
+    CK_ULONG unwrap_count = 0;
+    CK_RV rv = CKR_OK;
+
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *unwrapper = soft_object_lookup(unwrapping_key, logged_in);
+    if (!unwrapper) {
+        pthread_rwlock_unlock(&soft_objects_lock);
+        return CKR_UNWRAPPING_KEY_HANDLE_INVALID;
+    }
+
+    CK_ATTRIBUTE_PTR attribute = soft_template_find(unwrapper->attributes.attributes, unwrapper->attributes.count,
+                                                    CKA_UNWRAP_TEMPLATE);
+    if (attribute) {
+        unwrap_count = attribute->ulValueLen / sizeof(CK_ATTRIBUTE);
+        unwrap_template = soft_template_dup(attribute->pValue, attribute->ulValueLen);
+        if (!unwrap_template) {
+            rv = CKR_HOST_MEMORY;
+        }
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    // The caller template may repeat, but never contradict, the unwrap template.
+    for (CK_ULONG i = 0; CKR_OK == rv && i < unwrap_count; i++) {
+        CK_ATTRIBUTE_PTR requested = soft_template_find(template, count, unwrap_template[i].type);
+        if (requested && (requested->ulValueLen != unwrap_template[i].ulValueLen
+                          || 0 != memcmp(requested->pValue, unwrap_template[i].pValue, requested->ulValueLen))) {
+            rv = CKR_TEMPLATE_INCONSISTENT;
+        }
+    }
+
+    /*
+     * The merged template is one allocation: the attribute array, then the
+     * unwrap template values. Caller attributes still point at caller memory.
+     */
+    size_t values_size = 0;
+    for (CK_ULONG i = 0; i < unwrap_count; i++) {
+        values_size += unwrap_template[i].ulValueLen;
+    }
+
+    CK_ATTRIBUTE_PTR result = NULL;
+    if (CKR_OK == rv) {
+        result = malloc((count + unwrap_count + 1) * sizeof(CK_ATTRIBUTE) + values_size);
+        if (!result) {
+            rv = CKR_HOST_MEMORY;
+        }
+    }
+
+    if (CKR_OK == rv) {
+        CK_BYTE_PTR values = (CK_BYTE_PTR) (result + count + unwrap_count + 1);
+        if (count) {
+            memcpy(result, template, count * sizeof(CK_ATTRIBUTE));
+        }
+        for (CK_ULONG i = 0; i < unwrap_count; i++) {
+            result[count + i] = unwrap_template[i];
+            result[count + i].pValue = values;
+            if (unwrap_template[i].ulValueLen) {
+                memcpy(values, unwrap_template[i].pValue, unwrap_template[i].ulValueLen);
+            }
+            values += unwrap_template[i].ulValueLen;
+        }
+        *merged = result;
+        *merged_count = count + unwrap_count;
+    }
+
+    free(unwrap_template);
+    return rv;
+}
+
+void soft_key_release(struct soft_key *key) {
+    EVP_PKEY_free(key->pkey);
+    OPENSSL_cleanse(key, sizeof(*key));
+}
+
+CK_RV C_CreateObject(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount,
+                     CK_OBJECT_HANDLE_PTR phObject) {
+    struct soft_session *session = NULL;
+    CK_OBJECT_CLASS object_class;
+    CK_KEY_TYPE key_type = CK_UNAVAILABLE_INFORMATION;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pTemplate || !phObject) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!soft_is_logged_in()) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    rv = soft_template_get_ulong(pTemplate, ulCount, CKA_CLASS, &object_class);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    if (CKO_SECRET_KEY == object_class) {
+        CK_ATTRIBUTE_PTR value = soft_template_find(pTemplate, ulCount, CKA_VALUE);
+        rv = soft_template_get_ulong(pTemplate, ulCount, CKA_KEY_TYPE, &key_type);
+        if (CKR_OK != rv) {
+            return rv;
+        }
+        if (!value || !value->pValue || 0 == value->ulValueLen) {
+            return CKR_TEMPLATE_INCOMPLETE;
+        }
+        if (value->ulValueLen > SOFT_MAX_SECRET_KEY_LENGTH) {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+
+        CK_BYTE key_value[SOFT_MAX_SECRET_KEY_LENGTH];
+        CK_ULONG key_length = value->ulValueLen;
+        memcpy(key_value, value->pValue, key_length);
+        rv = soft_object_create_secret_key(hSession, pTemplate, ulCount, key_type, key_value, key_length,
+                                           CK_UNAVAILABLE_INFORMATION, phObject);
+        OPENSSL_cleanse(key_value, sizeof(key_value));
+        return rv;
+    }
+
+    if (CKO_PUBLIC_KEY == object_class) {
+        EVP_PKEY *pkey = NULL;
+        struct soft_object *object = NULL;
+
+        rv = soft_template_get_ulong(pTemplate, ulCount, CKA_KEY_TYPE, &key_type);
+        if (CKR_OK == rv) {
+            rv = soft_public_key_from_template(key_type, pTemplate, ulCount, &pkey);
+        }
+        if (CKR_OK == rv) {
+            rv = soft_object_new_asymmetric(pTemplate, ulCount, CKO_PUBLIC_KEY, pkey,
+                                            CK_UNAVAILABLE_INFORMATION, &object);
+        }
+        EVP_PKEY_free(pkey);
+        if (CKR_OK == rv) {
+            rv = soft_object_insert(hSession, object, CKO_PUBLIC_KEY, key_type);
+            if (CKR_OK != rv) {
+                soft_object_free(object);
+            }
+        }
+        if (CKR_OK == rv) {
+            *phObject = object->handle;
+        }
+        return rv;
+    }
+
+    if (CKO_DATA == object_class) {
+        struct soft_object *object = calloc(1, sizeof(struct soft_object));
+        if (!object) {
+            return CKR_HOST_MEMORY;
+        }
+
+        rv = soft_attributes_set_bool(&object->attributes, CKA_TOKEN, CK_FALSE);
+        if (CKR_OK == rv) {
+            rv = soft_attributes_set_bool(&object->attributes, CKA_PRIVATE, CK_FALSE);
+        }
+        if (CKR_OK == rv) {
+            rv = soft_attributes_set_bool(&object->attributes, CKA_MODIFIABLE, CK_TRUE);
+        }
+        if (CKR_OK == rv) {
+            rv = soft_attributes_set_bool(&object->attributes, CKA_DESTROYABLE, CK_TRUE);
+        }
+        if (CKR_OK == rv) {
+            rv = soft_attributes_apply(&object->attributes, pTemplate, ulCount);
+        }
+        if (CKR_OK == rv) {
+            rv = soft_object_insert(hSession, object, CKO_DATA, CK_UNAVAILABLE_INFORMATION);
+        }
+        if (CKR_OK != rv) {
+            soft_object_free(object);
+            return rv;
+        }
+
+        *phObject = object->handle;
+        return CKR_OK;
+    }
+
+    // Private keys only enter the module through C_UnwrapKey.
+    return CKR_TEMPLATE_INCONSISTENT;
+}
+
+/**
+ * Check a caller may change an attribute on an existing object.
+ */
+static CK_RV soft_attribute_check_change(struct soft_object *object, CK_ATTRIBUTE_PTR attribute) {
+    CK_RV rv = soft_attribute_validate(attribute);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (SOFT_CONTAINS(soft_fixed_attributes, attribute->type)) {
+        return CKR_ATTRIBUTE_READ_ONLY;
+    }
+
+    // Keys may become more protected, never less.
+    CK_BBOOL value = (sizeof(CK_BBOOL) == attribute->ulValueLen) ? *(CK_BBOOL *) attribute->pValue : CK_FALSE;
+    if (CKA_SENSITIVE == attribute->type && !value && soft_list_bool(&object->attributes, CKA_SENSITIVE)) {
+        return CKR_ATTRIBUTE_READ_ONLY;
+    }
+    if (CKA_EXTRACTABLE == attribute->type && value && !soft_list_bool(&object->attributes, CKA_EXTRACTABLE)) {
+        return CKR_ATTRIBUTE_READ_ONLY;
+    }
+    if (CKA_WRAP_WITH_TRUSTED == attribute->type && !value
+        && soft_list_bool(&object->attributes, CKA_WRAP_WITH_TRUSTED)) {
+        return CKR_ATTRIBUTE_READ_ONLY;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV C_CopyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+                   CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phNewObject) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!pTemplate && ulCount) || !phNewObject) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    struct soft_object *copy = calloc(1, sizeof(struct soft_object));
+    if (!copy) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(hObject, logged_in);
+    if (!object) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else if (!soft_list_bool(&object->attributes, CKA_COPYABLE)) {
+        rv = CKR_ACTION_PROHIBITED;
+    }
+    for (CK_ULONG i = 0; CKR_OK == rv && i < object->attributes.count; i++) {
+        CK_ATTRIBUTE_PTR attribute = &object->attributes.attributes[i];
+        rv = soft_attributes_set(&copy->attributes, attribute->type, attribute->pValue, attribute->ulValueLen);
+    }
+    for (CK_ULONG i = 0; CKR_OK == rv && i < ulCount; i++) {
+        // CKA_TOKEN and CKA_PRIVATE may be chosen for the copy.
+        if (CKA_TOKEN != pTemplate[i].type && CKA_PRIVATE != pTemplate[i].type) {
+            rv = soft_attribute_check_change(object, &pTemplate[i]);
+        } else {
+            rv = soft_attribute_validate(&pTemplate[i]);
+        }
+    }
+    if (CKR_OK == rv && object->pkey) {
+        EVP_PKEY_up_ref(object->pkey);
+        copy->pkey = object->pkey;
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    for (CK_ULONG i = 0; CKR_OK == rv && i < ulCount; i++) {
+        rv = soft_attributes_set(&copy->attributes, pTemplate[i].type, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+    }
+    if (CKR_OK == rv) {
+        rv = soft_object_insert(hSession, copy, soft_list_ulong(&copy->attributes, CKA_CLASS),
+                                CK_UNAVAILABLE_INFORMATION);
+    }
+
+    if (CKR_OK != rv) {
+        soft_object_free(copy);
+        return rv;
+    }
+
+    *phNewObject = copy->handle;
+    return CKR_OK;
+}
+
+CK_RV C_DestroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_wrlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(hObject, logged_in);
+    if (!object) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else if (!soft_list_bool(&object->attributes, CKA_DESTROYABLE)) {
+        rv = CKR_ACTION_PROHIBITED;
+    } else {
+        soft_object_remove(hObject);
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+CK_RV C_GetObjectSize(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulSize) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(hObject, logged_in);
+    if (!object) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else {
+        *pulSize = 0;
+        for (CK_ULONG i = 0; i < object->attributes.count; i++) {
+            *pulSize += object->attributes.attributes[i].ulValueLen;
+        }
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+/**
+ * Copy one attribute out to the caller, following the C_GetAttributeValue rules:
+ * a NULL pValue asks for the length, and each failure is reported in ulValueLen.
+ */
+static CK_RV soft_attribute_get(struct soft_object *object, CK_ATTRIBUTE_PTR request) {
+    CK_ATTRIBUTE_PTR attribute = soft_template_find(object->attributes.attributes, object->attributes.count,
+                                                    request->type);
+    CK_OBJECT_CLASS object_class = soft_list_ulong(&object->attributes, CKA_CLASS);
+
+    CK_BBOOL hidden = soft_list_bool(&object->attributes, CKA_SENSITIVE)
+                      || !soft_list_bool(&object->attributes, CKA_EXTRACTABLE);
+    if ((CKO_SECRET_KEY == object_class && CKA_VALUE == request->type && hidden)
+        || (CKO_PRIVATE_KEY == object_class && SOFT_CONTAINS(soft_private_components, request->type))) {
+        request->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+        return CKR_ATTRIBUTE_SENSITIVE;
+    }
+
+    if (!attribute) {
+        request->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+        return CKR_ATTRIBUTE_TYPE_INVALID;
+    }
+
+    if (!request->pValue) {
+        request->ulValueLen = attribute->ulValueLen;
+        return CKR_OK;
+    }
+
+    if (request->ulValueLen < attribute->ulValueLen) {
+        request->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    if (request->type & CKF_ARRAY_ATTRIBUTE) {
+        // Nested templates are returned into the caller's own attribute array.
+        CK_ATTRIBUTE_PTR nested = attribute->pValue;
+        CK_ATTRIBUTE_PTR out = request->pValue;
+        CK_RV rv = CKR_OK;
+        for (CK_ULONG i = 0; i < attribute->ulValueLen / sizeof(CK_ATTRIBUTE); i++) {
+            out[i].type = nested[i].type;
+            if (out[i].pValue && out[i].ulValueLen >= nested[i].ulValueLen) {
+                memcpy(out[i].pValue, nested[i].pValue, nested[i].ulValueLen);
+            } else if (out[i].pValue) {
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            out[i].ulValueLen = nested[i].ulValueLen;
+        }
+        request->ulValueLen = attribute->ulValueLen;
+        return rv;
+    }
+
+    if (attribute->ulValueLen) {
+        memcpy(request->pValue, attribute->pValue, attribute->ulValueLen);
+    }
+    request->ulValueLen = attribute->ulValueLen;
+    return CKR_OK;
+}
+
+CK_RV C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+                          CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pTemplate && ulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(hObject, logged_in);
+    if (!object) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    // Every attribute is processed; the last failure is the one reported.
+    for (CK_ULONG i = 0; object && i < ulCount; i++) {
+        CK_RV attribute_rv = soft_attribute_get(object, &pTemplate[i]);
+        if (CKR_OK != attribute_rv) {
+            rv = attribute_rv;
+        }
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+CK_RV C_SetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
+                          CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pTemplate && ulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_wrlock(&soft_objects_lock);
+    struct soft_object *object = soft_object_lookup(hObject, logged_in);
+    if (!object) {
+        rv = CKR_OBJECT_HANDLE_INVALID;
+    } else if (!soft_list_bool(&object->attributes, CKA_MODIFIABLE)) {
+        rv = CKR_ACTION_PROHIBITED;
+    }
+
+    // Validate the whole template first so a failure changes nothing.
+    for (CK_ULONG i = 0; CKR_OK == rv && i < ulCount; i++) {
+        rv = soft_attribute_check_change(object, &pTemplate[i]);
+    }
+    for (CK_ULONG i = 0; CKR_OK == rv && i < ulCount; i++) {
+        rv = soft_attributes_set(&object->attributes, pTemplate[i].type, pTemplate[i].pValue, pTemplate[i].ulValueLen);
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    return rv;
+}
+
+CK_RV C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pTemplate && ulCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (session->find_active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    soft_round_trip();
+
+    // Matches are captured now, so objects created during the search are not returned.
+    CK_BBOOL logged_in = soft_is_logged_in();
+    pthread_rwlock_rdlock(&soft_objects_lock);
+    CK_OBJECT_HANDLE_PTR found = malloc((soft_objects_capacity ? soft_objects_capacity : 1) * sizeof(CK_OBJECT_HANDLE));
+    CK_ULONG found_count = 0;
+    for (CK_ULONG i = 0; found && i < soft_objects_capacity; i++) {
+        struct soft_object *object = soft_object_lookup(i + 1, logged_in);
+        if (object && soft_object_matches(object, pTemplate, ulCount)) {
+            found[found_count++] = object->handle;
+        }
+    }
+    pthread_rwlock_unlock(&soft_objects_lock);
+
+    if (!found) {
+        return CKR_HOST_MEMORY;
+    }
+
+    free(session->found);
+    session->found = found;
+    session->found_count = found_count;
+    session->found_position = 0;
+    session->find_active = CK_TRUE;
+    return CKR_OK;
+}
+
+CK_RV C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+                    CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulObjectCount) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!session->find_active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    soft_round_trip();
+
+    CK_ULONG remaining = session->found_count - session->found_position;
+    CK_ULONG count = remaining < ulMaxObjectCount ? remaining : ulMaxObjectCount;
+
+    // Like the CloudHSM library, a NULL handle array counts matches without consuming them.
+    if (phObject) {
+        memcpy(phObject, session->found + session->found_position, count * sizeof(CK_OBJECT_HANDLE));
+        session->found_position += count;
+    }
+    *pulObjectCount = count;
+    return CKR_OK;
+}
+
+CK_RV C_FindObjectsFinal(CK_SESSION_HANDLE hSession) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!session->find_active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    soft_round_trip();
+
+    free(session->found);
+    session->found = NULL;
+    session->found_count = 0;
+    session->found_position = 0;
+    session->find_active = CK_FALSE;
+    return CKR_OK;
+}
@@ -0,0 +1,539 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/rsa.h>
+
+#include "soft_pkcs11.h"
+
+/**
+ * Fetch the active digest, sign or verify operation of a session.
+ */
+static CK_RV soft_operation_get(CK_SESSION_HANDLE hSession, size_t offset, struct soft_operation **op) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    *op = (struct soft_operation *) ((char *) session + offset);
+    if (!(*op)->active) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+    return CKR_OK;
+}
+
+#define SOFT_DIGEST_OP offsetof(struct soft_session, digest)
+#define SOFT_SIGN_OP offsetof(struct soft_session, sign)
+#define SOFT_VERIFY_OP offsetof(struct soft_session, verify)
+
+CK_RV C_DigestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pMechanism) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (session->digest.active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    const struct soft_mechanism *mechanism = soft_mechanism_find(pMechanism->mechanism);
+    if (!mechanism || !(mechanism->flags & CKF_DIGEST)) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    soft_round_trip();
+
+    struct soft_operation *op = &session->digest;
+    op->md = EVP_MD_CTX_new();
+    if (!op->md || 1 != EVP_DigestInit_ex(op->md, soft_md_from_mechanism(pMechanism->mechanism), NULL)) {
+        soft_operation_reset(op);
+        return CKR_HOST_MEMORY;
+    }
+
+    op->mechanism = pMechanism->mechanism;
+    op->active = CK_TRUE;
+    return CKR_OK;
+}
+
+/**
+ * Finish a digest into the caller's buffer. A length query or a short buffer
+ * leaves the operation active.
+ */
+static CK_RV soft_digest_final(struct soft_operation *op, CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    CK_ULONG length = (CK_ULONG) EVP_MD_CTX_size(op->md);
+    unsigned int produced = 0;
+
+    if (!out) {
+        *out_length = length;
+        return CKR_OK;
+    }
+    if (*out_length < length) {
+        *out_length = length;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    CK_RV rv = (1 == EVP_DigestFinal_ex(op->md, out, &produced)) ? CKR_OK : CKR_FUNCTION_FAILED;
+    *out_length = produced;
+    soft_operation_reset(op);
+    return rv;
+}
+
+CK_RV C_Digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+               CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_DIGEST_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if ((!pData && ulDataLen) || !pulDigestLen) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    if (!pDigest || *pulDigestLen < (CK_ULONG) EVP_MD_CTX_size(op->md)) {
+        return soft_digest_final(op, pDigest, pulDigestLen);
+    }
+    if (1 != EVP_DigestUpdate(op->md, pData, ulDataLen)) {
+        soft_operation_reset(op);
+        return CKR_FUNCTION_FAILED;
+    }
+    return soft_digest_final(op, pDigest, pulDigestLen);
+}
+
+CK_RV C_DigestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_DIGEST_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pPart && ulPartLen) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    if (1 != EVP_DigestUpdate(op->md, pPart, ulPartLen)) {
+        soft_operation_reset(op);
+        return CKR_FUNCTION_FAILED;
+    }
+    return CKR_OK;
+}
+
+CK_RV C_DigestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_DIGEST_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulDigestLen) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+    return soft_digest_final(op, pDigest, pulDigestLen);
+}
+
+/**
+ * Start a sign or verify operation.
+ *
+ * Mechanisms which hash inside the module keep a digest context. CKM_RSA_PKCS,
+ * CKM_RSA_PKCS_PSS and CKM_ECDSA sign caller supplied data as is, so their
+ * input is collected until the final call.
+ */
+static CK_RV soft_sign_init(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey,
+                            CK_BBOOL sign) {
+    struct soft_session *session = NULL;
+
+    CK_RV rv = soft_session_get(hSession, &session);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pMechanism) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (!soft_is_logged_in()) {
+        return CKR_USER_NOT_LOGGED_IN;
+    }
+
+    struct soft_operation *op = sign ? &session->sign : &session->verify;
+    if (op->active) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    const struct soft_mechanism *mechanism = soft_mechanism_find(pMechanism->mechanism);
+    if (!mechanism || !(mechanism->flags & (sign ? CKF_SIGN : CKF_VERIFY))) {
+        return CKR_MECHANISM_INVALID;
+    }
+
+    soft_round_trip();
+
+    rv = soft_object_get_key(hKey, sign ? CKA_SIGN : CKA_VERIFY, &op->key);
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+        return rv;
+    }
+
+    op->mechanism = pMechanism->mechanism;
+    CK_BBOOL ecdsa = (mechanism->flags & CKF_EC_F_P) ? CK_TRUE : CK_FALSE;
+    if (!op->key.pkey || (ecdsa ? CKK_EC : CKK_RSA) != op->key.key_type) {
+        soft_operation_reset(op);
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+
+    if (ecdsa) {
+        op->pkey_md = soft_md_from_mechanism(pMechanism->mechanism);
+    } else {
+        rv = soft_rsa_pkcs_params(op, pMechanism);
+        if (CKR_OK != rv) {
+            soft_operation_reset(op);
+            return rv;
+        }
+    }
+
+    if (op->pkey_md && CKM_RSA_PKCS_PSS != pMechanism->mechanism) {
+        op->md = EVP_MD_CTX_new();
+        if (!op->md || 1 != EVP_DigestInit_ex(op->md, op->pkey_md, NULL)) {
+            soft_operation_reset(op);
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    op->active = CK_TRUE;
+    return CKR_OK;
+}
+
+static CK_RV soft_sign_update(struct soft_operation *op, CK_BYTE_PTR data, CK_ULONG data_length) {
+    if (!data && data_length) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (op->md) {
+        return (1 == EVP_DigestUpdate(op->md, data, data_length)) ? CKR_OK : CKR_FUNCTION_FAILED;
+    }
+    return soft_data_append(op, data, data_length);
+}
+
+/**
+ * Signatures are the RSA modulus length, or r || s for ECDSA.
+ */
+static CK_ULONG soft_signature_length(struct soft_operation *op) {
+    if (CKK_EC == op->key.key_type) {
+        const EC_GROUP *group = EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(op->key.pkey));
+        return 2 * (CK_ULONG) ((EC_GROUP_order_bits(group) + 7) / 8);
+    }
+    return (CK_ULONG) EVP_PKEY_size(op->key.pkey);
+}
+
+/**
+ * The bytes the key operation covers: the digest for hashing mechanisms,
+ * otherwise the collected input.
+ */
+static CK_RV soft_sign_input(struct soft_operation *op, CK_BYTE_PTR digest, CK_BYTE_PTR *input, size_t *input_length) {
+    if (!op->md) {
+        *input = op->data;
+        *input_length = op->data_length;
+        if (CKM_RSA_PKCS_PSS == op->mechanism && *input_length != (size_t) EVP_MD_size(op->pkey_md)) {
+            return CKR_DATA_LEN_RANGE;
+        }
+        return CKR_OK;
+    }
+
+    unsigned int length = 0;
+    if (1 != EVP_DigestFinal_ex(op->md, digest, &length)) {
+        return CKR_FUNCTION_FAILED;
+    }
+    *input = digest;
+    *input_length = length;
+    return CKR_OK;
+}
+
+/**
+ * Create an OpenSSL context for the key operation with the padding and digest
+ * of the mechanism.
+ */
+static EVP_PKEY_CTX *soft_sign_ctx(struct soft_operation *op, CK_BBOOL sign) {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(op->key.pkey, NULL);
+    if (!ctx) {
+        return NULL;
+    }
+
+    int ok = sign ? EVP_PKEY_sign_init(ctx) : EVP_PKEY_verify_init(ctx);
+    if (1 == ok && op->pkey_md) {
+        ok = EVP_PKEY_CTX_set_signature_md(ctx, op->pkey_md);
+    }
+    if (1 == ok && CKK_RSA == op->key.key_type) {
+        ok = EVP_PKEY_CTX_set_rsa_padding(ctx, op->padding);
+        if (1 == ok && RSA_PKCS1_PSS_PADDING == op->padding) {
+            ok = EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, op->mgf1_md);
+            if (1 == ok) {
+                ok = EVP_PKEY_CTX_set_rsa_pss_saltlen(ctx, op->salt_length);
+            }
+        }
+    }
+
+    if (1 != ok) {
+        EVP_PKEY_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * Sign the collected input. A length query or a short buffer leaves the operation active.
+ */
+static CK_RV soft_sign_final(struct soft_operation *op, CK_BYTE_PTR out, CK_ULONG_PTR out_length) {
+    CK_ULONG length = soft_signature_length(op);
+    CK_BYTE digest[EVP_MAX_MD_SIZE];
+    CK_BYTE_PTR input = NULL;
+    size_t input_length = 0;
+    unsigned char *der = NULL;
+    size_t der_length = 0;
+    ECDSA_SIG *signature = NULL;
+
+    if (!out) {
+        *out_length = length;
+        return CKR_OK;
+    }
+    if (*out_length < length) {
+        *out_length = length;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    CK_RV rv = soft_sign_input(op, digest, &input, &input_length);
+    EVP_PKEY_CTX *ctx = (CKR_OK == rv) ? soft_sign_ctx(op, CK_TRUE) : NULL;
+    if (CKR_OK == rv && !ctx) {
+        rv = CKR_FUNCTION_FAILED;
+    }
+
+    if (CKR_OK == rv && CKK_RSA == op->key.key_type) {
+        size_t produced = length;
+        rv = (1 == EVP_PKEY_sign(ctx, out, &produced, input, input_length)) ? CKR_OK : CKR_DATA_LEN_RANGE;
+        *out_length = (CK_ULONG) produced;
+    } else if (CKR_OK == rv) {
+        // OpenSSL produces a DER ECDSA-Sig-Value; PKCS#11 wants r || s.
+        rv = CKR_FUNCTION_FAILED;
+        if (1 == EVP_PKEY_sign(ctx, NULL, &der_length, input, input_length)
+            && (der = OPENSSL_malloc(der_length))
+            && 1 == EVP_PKEY_sign(ctx, der, &der_length, input, input_length)) {
+            const unsigned char *p = der;
+            signature = d2i_ECDSA_SIG(NULL, &p, (long) der_length);
+        }
+        if (signature) {
+            const BIGNUM *r = NULL;
+            const BIGNUM *s = NULL;
+            ECDSA_SIG_get0(signature, &r, &s);
+            if (BN_bn2binpad(r, out, (int) length / 2) > 0 && BN_bn2binpad(s, out + length / 2, (int) length / 2) > 0) {
+                *out_length = length;
+                rv = CKR_OK;
+            }
+        }
+    }
+
+    ECDSA_SIG_free(signature);
+    OPENSSL_free(der);
+    EVP_PKEY_CTX_free(ctx);
+    soft_operation_reset(op);
+    return rv;
+}
+
+static CK_RV soft_verify_final(struct soft_operation *op, CK_BYTE_PTR signature, CK_ULONG signature_length) {
+    CK_ULONG length = soft_signature_length(op);
+    CK_BYTE digest[EVP_MAX_MD_SIZE];
+    CK_BYTE_PTR input = NULL;
+    size_t input_length = 0;
+    unsigned char *der = NULL;
+    int der_length = 0;
+
+    if (!signature) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (signature_length != length) {
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    CK_RV rv = soft_sign_input(op, digest, &input, &input_length);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    if (CKK_EC == op->key.key_type) {
+        ECDSA_SIG *value = ECDSA_SIG_new();
+        BIGNUM *r = BN_bin2bn(signature, (int) length / 2, NULL);
+        BIGNUM *s = BN_bin2bn(signature + length / 2, (int) length / 2, NULL);
+        if (!value || !r || !s || 1 != ECDSA_SIG_set0(value, r, s)) {
+            BN_free(r);
+            BN_free(s);
+            ECDSA_SIG_free(value);
+            return CKR_HOST_MEMORY;
+        }
+        der_length = i2d_ECDSA_SIG(value, &der);
+        ECDSA_SIG_free(value);
+        if (der_length <= 0) {
+            return CKR_FUNCTION_FAILED;
+        }
+        signature = der;
+        signature_length = (CK_ULONG) der_length;
+    }
+
+    EVP_PKEY_CTX *ctx = soft_sign_ctx(op, CK_FALSE);
+    if (!ctx) {
+        rv = CKR_FUNCTION_FAILED;
+    } else if (1 != EVP_PKEY_verify(ctx, signature, signature_length, input, input_length)) {
+        rv = CKR_SIGNATURE_INVALID;
+    }
+
+    OPENSSL_free(der);
+    EVP_PKEY_CTX_free(ctx);
+    return rv;
+}
+
+CK_RV C_SignInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return soft_sign_init(hSession, pMechanism, hKey, CK_TRUE);
+}
+
+CK_RV C_Sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+             CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_SIGN_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulSignatureLen) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+
+    // Only consume the data once the signature can be returned.
+    if (!pSignature || *pulSignatureLen < soft_signature_length(op)) {
+        return soft_sign_final(op, pSignature, pulSignatureLen);
+    }
+
+    rv = soft_sign_update(op, pData, ulDataLen);
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+        return rv;
+    }
+    return soft_sign_final(op, pSignature, pulSignatureLen);
+}
+
+CK_RV C_SignUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_SIGN_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    rv = soft_sign_update(op, pPart, ulPartLen);
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+    }
+    return rv;
+}
+
+CK_RV C_SignFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_SIGN_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+    if (!pulSignatureLen) {
+        soft_operation_reset(op);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    soft_round_trip();
+    return soft_sign_final(op, pSignature, pulSignatureLen);
+}
+
+CK_RV C_VerifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey) {
+    return soft_sign_init(hSession, pMechanism, hKey, CK_FALSE);
+}
+
+CK_RV C_Verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+               CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_VERIFY_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    rv = soft_sign_update(op, pData, ulDataLen);
+    if (CKR_OK == rv) {
+        rv = soft_verify_final(op, pSignature, ulSignatureLen);
+    }
+    soft_operation_reset(op);
+    return rv;
+}
+
+CK_RV C_VerifyUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_VERIFY_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    rv = soft_sign_update(op, pPart, ulPartLen);
+    if (CKR_OK != rv) {
+        soft_operation_reset(op);
+    }
+    return rv;
+}
+
+CK_RV C_VerifyFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen) {
+    struct soft_operation *op = NULL;
+
+    CK_RV rv = soft_operation_get(hSession, SOFT_VERIFY_OP, &op);
+    if (CKR_OK != rv) {
+        return rv;
+    }
+
+    soft_round_trip();
+
+    rv = soft_verify_final(op, pSignature, ulSignatureLen);
+    soft_operation_reset(op);
+    return rv;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2024 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this
+ * software and associated documentation files (the "Software"), to deal in the Software
+ * without restriction, including without limitation the rights to use, copy, modify,
+ * merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __SOFT_PKCS11_H__
+#define __SOFT_PKCS11_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <cryptoki.h>
+#include <cloudhsm_pkcs11_vendor_defs.h>
+
+#include <openssl/evp.h>
+
+/*
+ * Internal interface of the software PKCS#11 module.
+ *
+ * The module keeps every object in process memory and implements the
+ * mechanisms with OpenSSL. Only C_GetFunctionList is exported; everything
+ * else is reached through the function list, exactly like the CloudHSM library.
+ */
+
+#define SOFT_SLOT_ID 1
+#define SOFT_MAX_SECRET_KEY_LENGTH 64
+
+/*
+ * Key material copied out of the object store when an operation starts,
+ * so the operation never holds the store lock while it runs.
+ */
+struct soft_key {
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+    CK_BYTE value[SOFT_MAX_SECRET_KEY_LENGTH];
+    CK_ULONG value_length;
+    EVP_PKEY *pkey;
+};
+
+/*
+ * State of one cryptographic operation on a session.
+ * Multi-part state lives in the OpenSSL contexts; mechanisms which OpenSSL
+ * only exposes as single-part calls accumulate their input in data.
+ */
+struct soft_operation {
+    CK_BBOOL active;
+    CK_MECHANISM_TYPE mechanism;
+    struct soft_key key;
+
+    EVP_CIPHER_CTX *cipher;
+    EVP_MD_CTX *md;
+    const EVP_MD *pkey_md;
+    const EVP_MD *mgf1_md;
+    int padding;
+    int salt_length;
+    CK_BYTE_PTR oaep_label;
+    CK_ULONG oaep_label_length;
+
+    CK_BBOOL encrypt;
+    CK_ULONG block_size;
+    CK_ULONG pending;
+    CK_ULONG tag_length;
+
+    CK_BYTE_PTR data;
+    CK_ULONG data_length;
+    CK_ULONG data_capacity;
+};
+
+struct soft_session {
+    CK_SESSION_HANDLE handle;
+    CK_FLAGS flags;
+
+    struct soft_operation encrypt;
+    struct soft_operation decrypt;
+    struct soft_operation digest;
+    struct soft_operation sign;
+    struct soft_operation verify;
+
+    CK_BBOOL find_active;
+    CK_OBJECT_HANDLE_PTR found;
+    CK_ULONG found_count;
+    CK_ULONG found_position;
+};
+
+struct soft_mechanism {
+    CK_MECHANISM_TYPE type;
+    CK_ULONG min_key_size;
+    CK_ULONG max_key_size;
+    CK_FLAGS flags;
+};
+
+/* module.c */
+CK_BBOOL soft_is_initialized(void);
+CK_BBOOL soft_is_logged_in(void);
+void soft_round_trip(void);
+CK_RV soft_session_get(CK_SESSION_HANDLE handle, struct soft_session **session);
+const struct soft_mechanism *soft_mechanism_find(CK_MECHANISM_TYPE type);
+
+/*
+ * A growable list of attributes which owns its values. Array attributes
+ * such as CKA_WRAP_TEMPLATE are deep copied into a single allocation.
+ */
+struct soft_attribute_list {
+    CK_ATTRIBUTE_PTR attributes;
+    CK_ULONG count;
+    CK_ULONG capacity;
+};
+
+/* object.c */
+CK_RV soft_objects_initialize(void);
+void soft_objects_finalize(void);
+void soft_objects_destroy_session(CK_SESSION_HANDLE session);
+
+CK_RV soft_attributes_set(struct soft_attribute_list *list, CK_ATTRIBUTE_TYPE type,
+                          CK_VOID_PTR value, CK_ULONG length);
+void soft_attributes_free(struct soft_attribute_list *list);
+
+CK_ATTRIBUTE_PTR soft_template_find(CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_ATTRIBUTE_TYPE type);
+CK_RV soft_template_get_ulong(CK_ATTRIBUTE_PTR template, CK_ULONG count, CK_ATTRIBUTE_TYPE type,
+                              CK_ULONG_PTR value);
+
+CK_RV soft_object_create_secret_key(CK_SESSION_HANDLE session,
+                                    CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                    CK_KEY_TYPE key_type,
+                                    CK_BYTE_PTR value, CK_ULONG value_length,
+                                    CK_MECHANISM_TYPE mechanism,
+                                    CK_OBJECT_HANDLE_PTR handle);
+CK_RV soft_object_create_key_pair(CK_SESSION_HANDLE session,
+                                  CK_ATTRIBUTE_PTR public_template, CK_ULONG public_count,
+                                  CK_ATTRIBUTE_PTR private_template, CK_ULONG private_count,
+                                  EVP_PKEY *pkey, CK_MECHANISM_TYPE mechanism,
+                                  CK_OBJECT_HANDLE_PTR public_key, CK_OBJECT_HANDLE_PTR private_key);
+CK_RV soft_object_create_private_key(CK_SESSION_HANDLE session,
+                                     CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                     EVP_PKEY *pkey, CK_OBJECT_HANDLE_PTR handle);
+
+CK_RV soft_object_get_key(CK_OBJECT_HANDLE handle, CK_ATTRIBUTE_TYPE usage, struct soft_key *key);
+CK_RV soft_object_get_wrappable_key(CK_OBJECT_HANDLE wrapping_key, CK_OBJECT_HANDLE handle,
+                                    struct soft_key *key);
+/* The merged template is a single allocation which the caller frees. */
+CK_RV soft_object_unwrap_template(CK_OBJECT_HANDLE unwrapping_key,
+                                  CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                  CK_ATTRIBUTE_PTR *merged, CK_ULONG_PTR merged_count);
+void soft_key_release(struct soft_key *key);
+
+/* keys.c */
+CK_KEY_TYPE soft_pkey_key_type(EVP_PKEY *pkey);
+CK_RV soft_pkey_attributes(EVP_PKEY *pkey, CK_OBJECT_CLASS key_class, struct soft_attribute_list *list);
+CK_RV soft_public_key_from_template(CK_KEY_TYPE key_type, CK_ATTRIBUTE_PTR template, CK_ULONG count,
+                                    EVP_PKEY **pkey);
+
+/* cipher.c */
+CK_RV soft_cipher_init(struct soft_operation *op, CK_MECHANISM_PTR mechanism, CK_BBOOL encrypt);
+CK_RV soft_cipher_single(struct soft_operation *op,
+                         CK_BYTE_PTR in, CK_ULONG in_length,
+                         CK_BYTE_PTR out, CK_ULONG_PTR out_length);
+CK_RV soft_rsa_pkcs_params(struct soft_operation *op, CK_MECHANISM_PTR mechanism);
+const EVP_MD *soft_md_from_mechanism(CK_MECHANISM_TYPE type);
+const EVP_MD *soft_md_from_mgf(CK_RSA_PKCS_MGF_TYPE mgf);
+CK_RV soft_aes_key_wrap(CK_BYTE_PTR kek, CK_ULONG kek_length, CK_BBOOL pad,
+                        CK_BYTE_PTR in, CK_ULONG in_length,
+                        CK_BYTE_PTR out, CK_ULONG_PTR out_length);
+CK_RV soft_aes_key_unwrap(CK_BYTE_PTR kek, CK_ULONG kek_length, CK_BBOOL pad,
+                          CK_BYTE_PTR in, CK_ULONG in_length,
+                          CK_BYTE_PTR out, CK_ULONG_PTR out_length);
+CK_RV soft_data_append(struct soft_operation *op, CK_BYTE_PTR data, CK_ULONG data_length);
+void soft_operation_reset(struct soft_operation *op);
+
+#endif
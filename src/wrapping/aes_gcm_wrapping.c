@@ -49,22 +49,10 @@ CK_RV aes_gcm_wrapping(CK_SESSION_HANDLE session) {
     CK_GCM_PARAMS gcm_params = { wrapped_key_iv, wrapped_key_iv_len, 0, NULL, 0, 128 };
     CK_MECHANISM mech = { CKM_AES_GCM, &gcm_params, sizeof(gcm_params) };
 
-    // Determine how much space needs to be allocated for the wrapped key.
-    CK_ULONG wrapped_len = 0;
-    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, NULL, &wrapped_len);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Could not determine size of wrapped key: %lu\n", rv);
-        goto done;
-    }
-
-    wrapped_key = malloc(wrapped_len);
-    if (NULL == wrapped_key) {
-        fprintf(stderr, "Could not allocate memory to hold wrapped key\n");
-        goto done;
-    }
-
     // Wrap the key with AES-GCM mechanism
-    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, wrapped_key, &wrapped_len);
+    CK_ULONG wrapped_capacity = 0;
+    CK_ULONG wrapped_len = 0;
+    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, &wrapped_key, &wrapped_capacity, &wrapped_len);
     if (rv != CKR_OK) {
         fprintf(stderr, "Could not wrap key: %lu\n", rv);
         goto done;
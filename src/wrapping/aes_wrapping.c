@@ -48,22 +48,10 @@ CK_RV aes_pkcs5_padding_wrapping(CK_SESSION_HANDLE session) {
     //  * CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD
     CK_MECHANISM mech = { CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD, NULL, 0 };
 
-    // Determine how much space needs to be allocated for the wrapped key.
-    CK_ULONG wrapped_len = 0;
-    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, NULL, &wrapped_len);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Could not determine size of wrapped key: %lu\n", rv);
-        goto done;
-    }
-
-    wrapped_key = malloc(wrapped_len);
-    if (NULL == wrapped_key) {
-        fprintf(stderr, "Could not allocate memory to hold wrapped key\n");
-        goto done;
-    }
-
     // Wrap the key with PKCS #5 Padding.
-    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, wrapped_key, &wrapped_len);
+    CK_ULONG wrapped_capacity = 0;
+    CK_ULONG wrapped_len = 0;
+    rv = aes_wrap_key(session, &mech, wrapping_key, rsa_private_key, &wrapped_key, &wrapped_capacity, &wrapped_len);
     if (rv != CKR_OK) {
         fprintf(stderr, "Could not wrap key: %lu\n", rv);
         goto done;
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <common.h>
+#include <output_length.h>
 
 /**
  * Generate an AES key that can be used to wrap and unwrap other keys.
@@ -30,7 +31,7 @@ CK_RV generate_aes_token_key_for_wrapping(CK_SESSION_HANDLE session,
             {CKA_VALUE_LEN, &key_length_bytes,  sizeof(key_length_bytes)}
     };
 
-    rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
+    rv = pkcs11_generate_key(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
     return rv;
 }
 
@@ -56,7 +57,7 @@ CK_RV generate_aes_session_key(CK_SESSION_HANDLE session,
             {CKA_VALUE_LEN, &key_length_bytes,  sizeof(key_length_bytes)}
     };
 
-    rv = funcs->C_GenerateKey(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
+    rv = pkcs11_generate_key(session, &mech, template, sizeof(template) / sizeof(CK_ATTRIBUTE), key);
     return rv;
 }
 
@@ -89,7 +90,7 @@ CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
             {CKA_EXTRACTABLE, &true_val,  sizeof(CK_BBOOL)}
     };
 
-    rv = funcs->C_GenerateKeyPair(session,
+    rv = pkcs11_generate_key_pair(session,
                                   &mech,
                                   public_key_template, sizeof(public_key_template) / sizeof(CK_ATTRIBUTE),
                                   private_key_template, sizeof(private_key_template) / sizeof(CK_ATTRIBUTE),
@@ -101,11 +102,14 @@ CK_RV generate_rsa_keypair(CK_SESSION_HANDLE session,
 /**
  * Wrap a key using the wrapping_key handle with given mechanism.
  * The key being wrapped must have the CKA_EXTRACTABLE flag set to true.
+ * The buffer is sized from the mechanism, so the key is wrapped with a single call.
  * @param session
  * @param mech
  * @param wrapping_key
  * @param key_to_wrap
- * @param wrapped_bytes
+ * @param wrapped_bytes Buffer from malloc, or NULL to allocate one sized from the
+ * mechanism. The caller frees it.
+ * @param wrapped_bytes_capacity Size of *wrapped_bytes. Updated when the buffer grows.
  * @param wrapped_bytes_len
  * @return
  */
@@ -113,15 +117,17 @@ CK_RV aes_wrap_key(CK_SESSION_HANDLE session,
                    CK_MECHANISM_PTR mech,
                    CK_OBJECT_HANDLE wrapping_key,
                    CK_OBJECT_HANDLE key_to_wrap,
-                   CK_BYTE_PTR wrapped_bytes,
+                   CK_BYTE_PTR *wrapped_bytes,
+                   CK_ULONG_PTR wrapped_bytes_capacity,
                    CK_ULONG_PTR wrapped_bytes_len) {
-    return funcs->C_WrapKey(
-            session,
-            mech,
-            wrapping_key,
-            key_to_wrap,
-            wrapped_bytes,
-            wrapped_bytes_len);
+    if (!wrapped_bytes || !wrapped_bytes_capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (NULL == *wrapped_bytes) {
+        *wrapped_bytes_capacity = pkcs11_max_output_length(PKCS11_OPERATION_WRAP, mech, 0, 0);
+    }
+    return pkcs11_wrap_key(session, mech, wrapping_key, key_to_wrap, wrapped_bytes, wrapped_bytes_capacity,
+                           wrapped_bytes_len);
 }
 
 /**
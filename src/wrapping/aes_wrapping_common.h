@@ -18,7 +18,8 @@ CK_RV aes_wrap_key(CK_SESSION_HANDLE session,
                    CK_MECHANISM_PTR mech,
                    CK_OBJECT_HANDLE wrapping_key,
                    CK_OBJECT_HANDLE key_to_wrap,
-                   CK_BYTE_PTR wrapped_bytes,
+                   CK_BYTE_PTR *wrapped_bytes,
+                   CK_ULONG_PTR wrapped_bytes_capacity,
                    CK_ULONG_PTR wrapped_bytes_len);
 
 CK_RV aes_unwrap_key(CK_SESSION_HANDLE session,
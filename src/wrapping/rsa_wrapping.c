@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <common.h>
+#include <output_length.h>
 
 /**
  * Generate an AES key that can be wrapped by an RSA key.
@@ -91,7 +92,9 @@ CK_RV generate_wrapping_keypair(CK_SESSION_HANDLE session,
  * @param session
  * @param wrapping_key
  * @param key_to_wrap
- * @param wrapped_bytes
+ * @param wrapped_bytes Buffer from malloc, or NULL to allocate one sized from the
+ * mechanism. The caller frees it.
+ * @param wrapped_bytes_capacity Size of *wrapped_bytes. Updated when the buffer grows.
  * @param wrapped_bytes_len
  * @return
  */
@@ -99,20 +102,21 @@ CK_RV rsa_oaep_wrap_key(
         CK_SESSION_HANDLE session,
         CK_OBJECT_HANDLE wrapping_key,
         CK_OBJECT_HANDLE key_to_wrap,
-        CK_BYTE_PTR wrapped_bytes,
+        CK_BYTE_PTR *wrapped_bytes,
+        CK_ULONG_PTR wrapped_bytes_capacity,
         CK_ULONG_PTR wrapped_bytes_len) {
 
-
     CK_RSA_PKCS_OAEP_PARAMS params = { CKM_SHA256, CKG_MGF1_SHA256  };
     CK_MECHANISM oaep_mech = {CKM_RSA_PKCS_OAEP, &params, sizeof(params)};
 
-    // First, get the just the length of wrapped key
-    return funcs->C_WrapKey(session,
-                            &oaep_mech,
-                            wrapping_key,
-                            key_to_wrap,
-                            wrapped_bytes,
-                            wrapped_bytes_len);
+    if (!wrapped_bytes || !wrapped_bytes_capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (NULL == *wrapped_bytes) {
+        *wrapped_bytes_capacity = pkcs11_max_output_length(PKCS11_OPERATION_WRAP, &oaep_mech, 0, 0);
+    }
+    return pkcs11_wrap_key(session, &oaep_mech, wrapping_key, key_to_wrap, wrapped_bytes, wrapped_bytes_capacity,
+                           wrapped_bytes_len);
 }
 
 /**
@@ -192,7 +196,9 @@ CK_RV rsa_oaep_unwrap_key(
  * @param session
  * @param wrapping_key
  * @param key_to_wrap
- * @param wrapped_bytes
+ * @param wrapped_bytes Buffer from malloc, or NULL to allocate one sized from the
+ * mechanism. The caller frees it.
+ * @param wrapped_bytes_capacity Size of *wrapped_bytes. Updated when the buffer grows.
  * @param wrapped_bytes_len
  * @return
  */
@@ -200,7 +206,8 @@ CK_RV rsa_aes_wrap_key(
         CK_SESSION_HANDLE session,
         CK_OBJECT_HANDLE wrapping_key,
         CK_OBJECT_HANDLE key_to_wrap,
-        CK_BYTE_PTR wrapped_bytes,
+        CK_BYTE_PTR *wrapped_bytes,
+        CK_ULONG_PTR wrapped_bytes_capacity,
         CK_ULONG_PTR wrapped_bytes_len) {
 
     CK_ULONG aes_key_bits = 256;
@@ -208,13 +215,14 @@ CK_RV rsa_aes_wrap_key(
     CK_RSA_AES_KEY_WRAP_PARAMS params = { aes_key_bits, &oaep_params };
     CK_MECHANISM mech = { CKM_RSA_AES_KEY_WRAP, &params, sizeof(params) };
 
-    // First, get the just the length of wrapped key
-    return funcs->C_WrapKey(session,
-                            &mech,
-                            wrapping_key,
-                            key_to_wrap,
-                            wrapped_bytes,
-                            wrapped_bytes_len);
+    if (!wrapped_bytes || !wrapped_bytes_capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (NULL == *wrapped_bytes) {
+        *wrapped_bytes_capacity = pkcs11_max_output_length(PKCS11_OPERATION_WRAP, &mech, 0, 0);
+    }
+    return pkcs11_wrap_key(session, &mech, wrapping_key, key_to_wrap, wrapped_bytes, wrapped_bytes_capacity,
+                           wrapped_bytes_len);
 }
 
 /**
@@ -314,22 +322,10 @@ CK_RV rsa_oaep_wrap(CK_SESSION_HANDLE session) {
         goto done;
     }
 
-    // Determine how much space needs to be allocated for the wrapped key.
-    CK_ULONG wrapped_len = 0;
-    rv = rsa_oaep_wrap_key(session, rsa_public_key, aes_key, NULL, &wrapped_len);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Could not determine size of wrapped key: %lu\n", rv);
-        goto done;
-    }
-
-    wrapped_key = malloc(wrapped_len);
-    if (NULL == wrapped_key) {
-        fprintf(stderr, "Could not allocate memory to hold wrapped key\n");
-        goto done;
-    }
-
     // Wrap the key and display the hex string.
-    rv = rsa_oaep_wrap_key(session, rsa_public_key, aes_key, wrapped_key, &wrapped_len);
+    CK_ULONG wrapped_capacity = 0;
+    CK_ULONG wrapped_len = 0;
+    rv = rsa_oaep_wrap_key(session, rsa_public_key, aes_key, &wrapped_key, &wrapped_capacity, &wrapped_len);
     if (rv != CKR_OK) {
         fprintf(stderr, "Could not wrap key: %lu\n", rv);
         goto done;
@@ -400,22 +396,10 @@ CK_RV rsa_aes_wrap(CK_SESSION_HANDLE session) {
         goto done;
     }
 
-    // Determine how much space needs to be allocated for the wrapped key.
-    CK_ULONG wrapped_len = 0;
-    rv = rsa_aes_wrap_key(session, rsa_public_key, aes_key, NULL, &wrapped_len);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Could not determine size of wrapped key: %lu\n", rv);
-        goto done;
-    }
-
-    wrapped_key = malloc(wrapped_len);
-    if (NULL == wrapped_key) {
-        fprintf(stderr, "Could not allocate memory to hold wrapped key\n");
-        goto done;
-    }
-
     // Wrap the key and display the hex string.
-    rv = rsa_aes_wrap_key(session, rsa_public_key, aes_key, wrapped_key, &wrapped_len);
+    CK_ULONG wrapped_capacity = 0;
+    CK_ULONG wrapped_len = 0;
+    rv = rsa_aes_wrap_key(session, rsa_public_key, aes_key, &wrapped_key, &wrapped_capacity, &wrapped_len);
     if (rv != CKR_OK) {
         fprintf(stderr, "Could not wrap key: %lu\n", rv);
         goto done;
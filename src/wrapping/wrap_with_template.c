@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <common.h>
+#include <output_length.h>
 
 /**
  * Generate an AES key that can be used to wrap and unwrap other keys.
@@ -117,7 +118,9 @@ CK_RV get_attribute(
  * @param session
  * @param wrapping_key
  * @param key_to_wrap
- * @param wrapped_bytes
+ * @param wrapped_bytes Buffer from malloc, or NULL to allocate one sized from the
+ * mechanism. The caller frees it.
+ * @param wrapped_bytes_capacity Size of *wrapped_bytes. Updated when the buffer grows.
  * @param wrapped_bytes_len
  * @return
  */
@@ -125,18 +128,20 @@ CK_RV aes_wrap_key(
         CK_SESSION_HANDLE session,
         CK_OBJECT_HANDLE wrapping_key,
         CK_OBJECT_HANDLE key_to_wrap,
-        CK_BYTE_PTR wrapped_bytes,
+        CK_BYTE_PTR *wrapped_bytes,
+        CK_ULONG_PTR wrapped_bytes_capacity,
         CK_ULONG_PTR wrapped_bytes_len) {
 
     CK_MECHANISM mech = {CKM_CLOUDHSM_AES_KEY_WRAP_PKCS5_PAD, NULL, 0};
 
-    return funcs->C_WrapKey(
-            session,
-            &mech,
-            wrapping_key,
-            key_to_wrap,
-            wrapped_bytes,
-            wrapped_bytes_len);
+    if (!wrapped_bytes || !wrapped_bytes_capacity) {
+        return CKR_ARGUMENTS_BAD;
+    }
+    if (NULL == *wrapped_bytes) {
+        *wrapped_bytes_capacity = pkcs11_max_output_length(PKCS11_OPERATION_WRAP, &mech, 0, 0);
+    }
+    return pkcs11_wrap_key(session, &mech, wrapping_key, key_to_wrap, wrapped_bytes, wrapped_bytes_capacity,
+                           wrapped_bytes_len);
 }
 
 /**
@@ -163,23 +168,10 @@ CK_RV wrap_key_with_template(
         goto done;
     }
 
-    // Determine how much space needs to be allocated for the wrapped key.
-    CK_ULONG wrapped_len = 0;
-    rv = aes_wrap_key(session, wrapping_key, key_to_wrap, NULL, &wrapped_len);
-    if (rv != CKR_OK) {
-        fprintf(stderr, "Could not determine size of wrapped key: %lu\n", rv);
-        goto done;
-    }
-
-    wrapped_key = malloc(wrapped_len);
-    if (NULL == wrapped_key) {
-        rv = CKR_FUNCTION_FAILED;
-        fprintf(stderr, "Could not allocate memory to hold wrapped key\n");
-        goto done;
-    }
-
     // Wrap the key
-    rv = aes_wrap_key(session, wrapping_key, key_to_wrap, wrapped_key, &wrapped_len);
+    CK_ULONG wrapped_capacity = 0;
+    CK_ULONG wrapped_len = 0;
+    rv = aes_wrap_key(session, wrapping_key, key_to_wrap, &wrapped_key, &wrapped_capacity, &wrapped_len);
     if (rv != CKR_OK) {
         fprintf(stderr, "Could not wrap key: %lu\n", rv);
         goto done;